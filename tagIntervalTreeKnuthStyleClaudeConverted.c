@@ -2,11 +2,36 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <math.h>
+#include <stdint.h>
+
+// Position type. Positions are doubles by default; define TAG_TREE_FIXED_POINT for
+// 32.32 fixed point in an int64_t, which keeps fractional positions (e.g. media
+// timestamps) with exact integer compares. Use POS_INT and POS_FRACTION to build
+// positions so code works in both modes.
+#ifdef TAG_TREE_FIXED_POINT
+typedef int64_t Position;
+#define POSITION_FRACTION_BITS 32
+#define POS_INT(n) ((Position)(n) * ((Position)1 << POSITION_FRACTION_BITS))
+#define POS_FRACTION(num, den) (POS_INT(num) / (den))
+#define POSITION_FLOOR(p) ((int)((p) >> POSITION_FRACTION_BITS))
+#else
+typedef double Position;
+#define POS_INT(n) ((Position)(n))
+#define POS_FRACTION(num, den) ((Position)(num) / (den))
+#define POSITION_FLOOR(p) ((int)(p))
+#endif
+
+static inline Position position_max(Position a, Position b) {
+    return a > b ? a : b;
+}
+
+static inline Position position_min(Position a, Position b) {
+    return a < b ? a : b;
+}
 
 // Structure for interval node
 typedef struct IntervalNode {
-    double interval[2];             // [a_v, b_v] where a_v < b_v
+    Position interval[2];           // [a_v, b_v] where a_v < b_v
     char* tag;                      // tag from set α or NULL
     struct IntervalNode** children; // Dynamic array of children
     int children_count;             // Number of children
@@ -17,7 +42,7 @@ typedef struct IntervalNode {
 typedef struct {
     bool removed;
     char* state;
-    double remaining_interval[2];
+    Position remaining_interval[2];
     IntervalNode** rehook_node_list;
     int rehook_count;
     int rehook_capacity;
@@ -26,29 +51,28 @@ typedef struct {
 // Structure for insertion points
 typedef struct {
     int index;
-    double start;
-    double end;
+    Position start;
+    Position end;
 } InsertionPoint;
 
 // Function prototypes
-IntervalNode* create_interval_node(double a, double b, char* tag);
+IntervalNode* create_interval_node(Position a, Position b, char* tag);
 void free_interval_node(IntervalNode* node);
-int find_insertion_point(IntervalNode** children, int count, double value);
-void add_tag_dfs(IntervalNode* node, char* tag, double a, double b);
-bool try_merge_with_neighbors(IntervalNode* node, double a, double b, char* tag);
-RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, double a, double b);
-bool check_tag_dfs(IntervalNode* node, char* tag, double a, double b);
+int find_insertion_point(IntervalNode** children, int count, Position value);
+void add_tag_dfs(IntervalNode* node, char* tag, Position a, Position b);
+bool try_merge_with_neighbors(IntervalNode* node, Position a, Position b, char* tag);
+RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, Position a, Position b);
+bool check_tag_dfs(IntervalNode* node, char* tag, Position a, Position b);
 char* format_text_with_tags(IntervalNode* root, const char* text);
-void collect_markers(IntervalNode* node, void* markers_array, char** parent_tags, int parent_tag_count);
 void add_child(IntervalNode* parent, IntervalNode* child);
 
 // T1. Initialize tree
-IntervalNode* initialize_tree(double a, double b) {
+IntervalNode* initialize_tree(Position a, Position b) {
     return create_interval_node(a, b, NULL);
 }
 
 // Create interval node helper
-IntervalNode* create_interval_node(double a, double b, char* tag) {
+IntervalNode* create_interval_node(Position a, Position b, char* tag) {
     IntervalNode* node = (IntervalNode*)malloc(sizeof(IntervalNode));
     if (!node) {
         fprintf(stderr, "Memory allocation failed\n");
@@ -159,7 +183,7 @@ void remove_node_at_position(IntervalNode* parent, int position) {
 }
 
 // T2. Binary search for insertion point
-int find_insertion_point(IntervalNode** children, int count, double value) {
+int find_insertion_point(IntervalNode** children, int count, Position value) {
     if (count == 0) {
         return 0;
     }
@@ -185,15 +209,15 @@ int find_insertion_point(IntervalNode** children, int count, double value) {
 }
 
 // T3. Add tag
-void add_tag(IntervalNode* root, char* tag, double a, double b) {
+void add_tag(IntervalNode* root, char* tag, Position a, Position b) {
     add_tag_dfs(root, tag, a, b);
 }
 
 // Add tag DFS helper
-void add_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
+void add_tag_dfs(IntervalNode* node, char* tag, Position a, Position b) {
     // Constrain to node boundaries
-    double a_prime = fmax(a, node->interval[0]);
-    double b_prime = fmin(b, node->interval[1]);
+    Position a_prime = position_max(a, node->interval[0]);
+    Position b_prime = position_min(b, node->interval[1]);
     
     // Check if there's overlap
     if (a_prime >= b_prime) {
@@ -228,7 +252,7 @@ void add_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
         exit(EXIT_FAILURE);
     }
     
-    double current = a_prime;
+    Position current = a_prime;
     
     // Find first relevant child
     int i = find_insertion_point(node->children, node->children_count, current);
@@ -250,10 +274,10 @@ void add_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
         
         insertion_points[insertions_count].index = i;
         insertion_points[insertions_count].start = current;
-        insertion_points[insertions_count].end = fmin(b_prime, node->children[i]->interval[0]);
+        insertion_points[insertions_count].end = position_min(b_prime, node->children[i]->interval[0]);
         insertions_count++;
         
-        current = fmin(b_prime, node->children[i]->interval[0]);
+        current = position_min(b_prime, node->children[i]->interval[0]);
     }
     
     // Process overlapping children
@@ -280,10 +304,10 @@ void add_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
                 
                 insertion_points[insertions_count].index = i + 1;
                 insertion_points[insertions_count].start = current;
-                insertion_points[insertions_count].end = fmin(b_prime, next->interval[0]);
+                insertion_points[insertions_count].end = position_min(b_prime, next->interval[0]);
                 insertions_count++;
                 
-                current = fmin(b_prime, next->interval[0]);
+                current = position_min(b_prime, next->interval[0]);
             }
         }
         
@@ -321,7 +345,7 @@ void add_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
 }
 
 // T4. Try merge with neighbors
-bool try_merge_with_neighbors(IntervalNode* node, double a, double b, char* tag) {
+bool try_merge_with_neighbors(IntervalNode* node, Position a, Position b, char* tag) {
     if (node->children_count == 0) {
         return false;
     }
@@ -334,14 +358,14 @@ bool try_merge_with_neighbors(IntervalNode* node, double a, double b, char* tag)
         IntervalNode* left = node->children[i - 1];
         if (left->tag && strcmp(left->tag, tag) == 0 && left->interval[1] >= a) {
             // Merge with left
-            left->interval[1] = fmax(left->interval[1], b);
+            left->interval[1] = position_max(left->interval[1], b);
             
             // Check right neighbor for possible merge
             if (i < node->children_count) {
                 IntervalNode* right = node->children[i];
                 if (right->tag && strcmp(right->tag, tag) == 0 && left->interval[1] >= right->interval[0]) {
                     // Merge left and right
-                    left->interval[1] = fmax(left->interval[1], right->interval[1]);
+                    left->interval[1] = position_max(left->interval[1], right->interval[1]);
                     
                     // Append right children to left
                     for (int j = 0; j < right->children_count; j++) {
@@ -364,7 +388,7 @@ bool try_merge_with_neighbors(IntervalNode* node, double a, double b, char* tag)
     if (i < node->children_count) {
         IntervalNode* right = node->children[i];
         if (right->tag && strcmp(right->tag, tag) == 0 && b >= right->interval[0]) {
-            right->interval[0] = fmin(right->interval[0], a);
+            right->interval[0] = position_min(right->interval[0], a);
             return true;
         }
     }
@@ -373,7 +397,7 @@ bool try_merge_with_neighbors(IntervalNode* node, double a, double b, char* tag)
 }
 
 // Initialize RemoveTagResult
-RemoveTagResult create_remove_tag_result(bool removed, const char* state, double a, double b) {
+RemoveTagResult create_remove_tag_result(bool removed, const char* state, Position a, Position b) {
     RemoveTagResult result;
     result.removed = removed;
     result.state = strdup(state);
@@ -427,7 +451,7 @@ void add_rehook_list(RemoveTagResult* dest, RemoveTagResult* src) {
 }
 
 // T5. Remove tag
-bool remove_tag(IntervalNode* root, char* tag, double a, double b) {
+bool remove_tag(IntervalNode* root, char* tag, Position a, Position b) {
     RemoveTagResult result = remove_tag_dfs(root, tag, a, b);
     bool removed = result.removed;
     free_remove_tag_result(&result);
@@ -435,10 +459,10 @@ bool remove_tag(IntervalNode* root, char* tag, double a, double b) {
 }
 
 // Remove tag DFS helper
-RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
+RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, Position a, Position b) {
     // Adjust interval to node boundaries
-    double a_prime = fmax(a, node->interval[0]);
-    double b_prime = fmin(b, node->interval[1]);
+    Position a_prime = position_max(a, node->interval[0]);
+    Position b_prime = position_min(b, node->interval[1]);
     
     // Check if there's overlap
     if (a_prime >= b_prime) {
@@ -447,8 +471,8 @@ RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, double a, double b
     
     // If node has the tag to remove
     if (node->tag && strcmp(node->tag, tag) == 0) {
-        double a_v = node->interval[0];
-        double b_v = node->interval[1];
+        Position a_v = node->interval[0];
+        Position b_v = node->interval[1];
         RemoveTagResult result = create_remove_tag_result(true, "", b, b); // Will set state later
         
         // Case 1: Remove interval is inside node
@@ -670,8 +694,7 @@ RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, double a, double b
     }
     
     // Node doesn't have tag to remove, process children
-    bool removed = false;
-    RemoveTagResult result = create_remove_tag_result(false, "PROCESSED_CHILDREN", fmax(b_prime, a), b);
+    RemoveTagResult result = create_remove_tag_result(false, "PROCESSED_CHILDREN", position_max(b_prime, a), b);
     
     // Find children that might overlap
     int start_idx = find_insertion_point(node->children, node->children_count, a_prime);
@@ -692,7 +715,6 @@ RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, double a, double b
         RemoveTagResult child_result = remove_tag_dfs(child, tag, a, b);
         
         if (child_result.removed) {
-            removed = true;
             result.removed = true;
             
             if (strcmp(child_result.state, "REMOVE-ENTIRE-NODE") == 0 || 
@@ -729,7 +751,6 @@ RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, double a, double b
                                                                 child_result.remaining_interval[0], 
                                                                 child_result.remaining_interval[1]);
                 if (remaining_result.removed) {
-                    removed = true;
                     result.removed = true;
                 }
                 free_remove_tag_result(&remaining_result);
@@ -744,20 +765,20 @@ RemoveTagResult remove_tag_dfs(IntervalNode* node, char* tag, double a, double b
     // Ensure child intervals are properly nested
     for (int i = 0; i < node->children_count; i++) {
         IntervalNode* child = node->children[i];
-        child->interval[0] = fmax(child->interval[0], node->interval[0]);
-        child->interval[1] = fmin(child->interval[1], node->interval[1]);
+        child->interval[0] = position_max(child->interval[0], node->interval[0]);
+        child->interval[1] = position_min(child->interval[1], node->interval[1]);
     }
     
     return result;
 }
 
 // T6. Check for tag
-bool check_tag(IntervalNode* root, char* tag, double a, double b) {
+bool check_tag(IntervalNode* root, char* tag, Position a, Position b) {
     return check_tag_dfs(root, tag, a, b);
 }
 
 // Check tag DFS helper
-bool check_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
+bool check_tag_dfs(IntervalNode* node, char* tag, Position a, Position b) {
     // If node has the tag and covers the entire interval
     if (node->tag && strcmp(node->tag, tag) == 0 && 
         node->interval[0] <= a && node->interval[1] >= b) {
@@ -792,11 +813,14 @@ bool check_tag_dfs(IntervalNode* node, char* tag, double a, double b) {
 
 // Structure for tag markers in formatted text
 typedef struct {
-    double position;
+    Position position;
     char* tag;
     bool is_opening;
 } TagMarker;
 
+void collect_markers(IntervalNode* node, TagMarker** markers, char** parent_tags, int parent_count,
+                   int* markers_count, int* capacity);
+
 // Compare function for tag markers
 int compare_markers(const void* a, const void* b) {
     TagMarker* marker_a = (TagMarker*)a;
@@ -831,7 +855,7 @@ char* format_text_with_tags(IntervalNode* root, const char* text) {
     int parent_count = 0;
     
     // Collect markers from tree
-    collect_markers(root, markers, parent_tags, parent_count, &markers_count, &capacity);
+    collect_markers(root, &markers, parent_tags, parent_count, &markers_count, &capacity);
     
     // Sort markers by position
     qsort(markers, markers_count, sizeof(TagMarker), compare_markers);
@@ -859,12 +883,12 @@ char* format_text_with_tags(IntervalNode* root, const char* text) {
         TagMarker marker = markers[i];
         
         // Add text segment
-        int segment_len = (int)(marker.position) - pos;
+        int segment_len = POSITION_FLOOR(marker.position) - pos;
         if (segment_len > 0) {
             strncpy(result + result_pos, text + pos, segment_len);
             result_pos += segment_len;
         }
-        pos = (int)(marker.position);
+        pos = POSITION_FLOOR(marker.position);
         
         // Add tag
         if (marker.is_opening) {
@@ -894,30 +918,30 @@ char* format_text_with_tags(IntervalNode* root, const char* text) {
 }
 
 // Helper for collecting markers
-void collect_markers(IntervalNode* node, TagMarker* markers, char** parent_tags, int parent_count,
+void collect_markers(IntervalNode* node, TagMarker** markers, char** parent_tags, int parent_count,
                    int* markers_count, int* capacity) {
     // Add marker for current node if it has a tag
     if (node->tag) {
         // Check if we need to resize markers array
         if (*markers_count + 2 > *capacity) {
             *capacity *= 2;
-            markers = (TagMarker*)realloc(markers, *capacity * sizeof(TagMarker));
-            if (!markers) {
+            *markers = (TagMarker*)realloc(*markers, *capacity * sizeof(TagMarker));
+            if (!*markers) {
                 fprintf(stderr, "Memory reallocation failed\n");
                 exit(EXIT_FAILURE);
             }
         }
         
         // Add opening marker
-        markers[*markers_count].position = node->interval[0];
-        markers[*markers_count].tag = strdup(node->tag);
-        markers[*markers_count].is_opening = true;
+        (*markers)[*markers_count].position = node->interval[0];
+        (*markers)[*markers_count].tag = strdup(node->tag);
+        (*markers)[*markers_count].is_opening = true;
         (*markers_count)++;
         
         // Add closing marker
-        markers[*markers_count].position = node->interval[1];
-        markers[*markers_count].tag = strdup(node->tag);
-        markers[*markers_count].is_opening = false;
+        (*markers)[*markers_count].position = node->interval[1];
+        (*markers)[*markers_count].tag = strdup(node->tag);
+        (*markers)[*markers_count].is_opening = false;
         (*markers_count)++;
     }
     
@@ -955,23 +979,30 @@ void collect_markers(IntervalNode* node, TagMarker* markers, char** parent_tags,
 // Main function to demonstrate usage
 int main() {
     // Initialize tree with range [0, 100]
-    IntervalNode* root = initialize_tree(0, 100);
+    IntervalNode* root = initialize_tree(POS_INT(0), POS_INT(100));
     
     // Add some tags
-    add_tag(root, "bold", 10, 20);
-    add_tag(root, "italic", 15, 25);
-    add_tag(root, "underline", 30, 40);
+    add_tag(root, "bold", POS_INT(10), POS_INT(20));
+    add_tag(root, "italic", POS_INT(15), POS_INT(25));
+    add_tag(root, "underline", POS_INT(30), POS_INT(40));
     
     // Check tags
-    printf("Tag 'bold' in [12, 18]: %s\n", check_tag(root, "bold", 12, 18) ? "true" : "false");
-    printf("Tag 'italic' in [5, 10]: %s\n", check_tag(root, "italic", 5, 10) ? "true" : "false");
+    printf("Tag 'bold' in [12, 18]: %s\n", check_tag(root, "bold", POS_INT(12), POS_INT(18)) ? "true" : "false");
+    printf("Tag 'italic' in [5, 10]: %s\n", check_tag(root, "italic", POS_INT(5), POS_INT(10)) ? "true" : "false");
     
     // Remove a tag
-    remove_tag(root, "bold", 12, 18);
+    remove_tag(root, "bold", POS_INT(12), POS_INT(18));
     printf("After removal - Tag 'bold' in [12, 18]: %s\n", 
-           check_tag(root, "bold", 12, 18) ? "true" : "false");
+           check_tag(root, "bold", POS_INT(12), POS_INT(18)) ? "true" : "false");
     printf("After removal - Tag 'bold' in [10, 12]: %s\n", 
-           check_tag(root, "bold", 10, 12) ? "true" : "false");
+           check_tag(root, "bold", POS_INT(10), POS_INT(12)) ? "true" : "false");
+    
+    // Fractional positions, e.g. a caption from 45.5s to 47.25s of a media track
+    add_tag(root, "caption", POS_FRACTION(91, 2), POS_FRACTION(189, 4));
+    printf("Tag 'caption' in [46, 47]: %s\n", 
+           check_tag(root, "caption", POS_INT(46), POS_INT(47)) ? "true" : "false");
+    printf("Tag 'caption' in [45, 46]: %s\n", 
+           check_tag(root, "caption", POS_INT(45), POS_INT(46)) ? "true" : "false");
     
     // Format text with tags
     const char* text = "This is a sample text for interval tag demonstration.";
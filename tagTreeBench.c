@@ -0,0 +1,807 @@
+    // Tag tree microbenchmarks: build a document with many tags and time the core
+    // operations. Build it once per position width to compare the two:
+    //
+    //   gcc -O2 -o tagTreeBench tagTreeBench.c
+    //   gcc -O2 -DTAG_TREE_POSITION_64 -o tagTreeBench64 tagTreeBench.c
+    //   ./tagTreeBench [tags] [words] [malloc|arena|huge|numa]
+    //
+    // The run starts by checking findInsertionPoint against the original binary
+    // search and that formatted text parses back into the tags it came from, then
+    // times both searches at several fanouts. The last phase builds a tree of
+    // words, paragraphs and sections larger than the last level cache; build with
+    // -DTAG_TREE_NO_PREFETCH as well to see what the prefetches are worth. The last
+    // argument picks where nodes live: the heap, the node arena, the arena on
+    // transparent huge pages, or huge pages bound to the local NUMA node. Styling
+    // the whole large tree is then timed deferred, in one call and in budgeted
+    // steps, formatting and hibernating it are timed the same way, and it is
+    // dumped in each format; the run fails if a budgeted step of an operation or a
+    // task takes more than BENCH_STEP_SLACK budgets of CPU time. Last, threads
+    // churn through small documents of their own to show how node allocation
+    // scales with the thread count. Built with -DTAG_TREE_LATENCY_STATS, the run
+    // ends with the latency histograms of the operations it timed and the cost of
+    // recording one.
+
+    #define TAG_TREE_NO_MAIN
+    #define TAG_TREE_QUIET
+    #include "tagTreeInterval.c"
+
+    #include <time.h>
+
+    #define BENCH_DOCUMENT_LENGTH (1 << 24)
+    #define CHURN_DOCUMENT_LENGTH 4096
+    #define CHURN_TAGS 256
+    #define BENCH_STEP_SLACK 4  // budgets of CPU time a budgeted step may take
+
+    // Function prototypes
+    uint64_t nowNanoseconds(void);
+    uint64_t threadCpuNanoseconds(void);
+    uint32_t nextBenchRandom(uint32_t* state);
+    void reportBench(const char* name, int operations, uint64_t begin, uint64_t end);
+    int findInsertionPointReference(IntervalNode** children, int numChildren, TreePosition start);
+    IntervalNode** createBenchChildren(int numChildren, uint32_t* state, bool distinct);
+    void freeBenchChildren(IntervalNode** children, int numChildren);
+    int checkChildSearch(void);
+    int checkFormatRoundTrip(void);
+    int checkDeferredQueries(void);
+    void benchChildSearch(int searches);
+    void benchTagOperations(int numTags);
+    TaggedIntervalTree* buildWordTree(int numWords);
+    void benchLargeTree(int numWords, int numQueries);
+    void benchDeferred(int numWords, int numQueries);
+    int benchIncremental(int numWords);
+    int reportSteps(const char* name, TreeContinuation continuation, WorkBudget budget, uint64_t firstStep, 
+                    uint64_t firstStepCpu);
+    int benchTasks(int numWords);
+    int reportTaskSteps(const char* name, TreeTask* task, WorkBudget budget);
+    void benchDump(int numWords);
+    void countDumpBytes(const char* data, size_t length, void* context);
+    void* churnDocuments(void* arg);
+    void benchChurn(int maxThreads, int documents);
+    #ifdef TAG_TREE_LATENCY_STATS
+    void benchLatency(int timings);
+    #endif
+
+    // Get a monotonic timestamp in nanoseconds
+    uint64_t nowNanoseconds(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    }
+
+    // Get the CPU time of the calling thread in nanoseconds, which time slices given
+    // to other processes do not count towards
+    uint64_t threadCpuNanoseconds(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+        return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    }
+
+    // Small xorshift generator, so both builds see the same workload
+    uint32_t nextBenchRandom(uint32_t* state) {
+        uint32_t x = *state;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        *state = x;
+        return x;
+    }
+
+    // Print the throughput of one timed phase
+    void reportBench(const char* name, int operations, uint64_t begin, uint64_t end) {
+        double seconds = (end - begin) / 1e9;
+        printf("%-12s %9d ops %10.0f ops/s %8.1f ns/op\n", name, operations,
+               operations / seconds, (end - begin) / (double)operations);
+    }
+
+    // The original branchy binary search: returns the index of a child starting
+    // exactly at start, or the insertion point if there is none
+    int findInsertionPointReference(IntervalNode** children, int numChildren, TreePosition start) {
+        if (numChildren == 0) return 0;
+
+        int left = 0;
+        int right = numChildren - 1;
+
+        while (left <= right) {
+            int mid = (left + right) / 2;
+            if (children[mid]->interval[0] == start) {
+                return mid;
+            } else if (children[mid]->interval[0] < start) {
+                left = mid + 1;
+            } else {
+                right = mid - 1;
+            }
+        }
+
+        return left;
+    }
+
+    // Make separately allocated children with sorted starts; without distinct,
+    // runs of equal starts are common
+    IntervalNode** createBenchChildren(int numChildren, uint32_t* state, bool distinct) {
+        IntervalNode** children = (IntervalNode**)malloc((numChildren + 1) * sizeof(IntervalNode*));
+        if (!children) {
+            perror("Failed to allocate memory for benchmark children");
+            exit(EXIT_FAILURE);
+        }
+
+        TreePosition start = 0;
+        for (int i = 0; i < numChildren; i++) {
+            children[i] = createIntervalNode(start, start + 1, NULL);
+            start += distinct ? 1 + nextBenchRandom(state) % 8 : nextBenchRandom(state) % 2;
+        }
+        return children;
+    }
+
+    // Free children made by createBenchChildren
+    void freeBenchChildren(IntervalNode** children, int numChildren) {
+        for (int i = 0; i < numChildren; i++) {
+            freeIntervalNode(children[i]);
+        }
+        free(children);
+    }
+
+    // Compare findInsertionPoint with the reference at every fanout up to a few
+    // hundred and for every key in range. With distinct starts the results must be
+    // equal; with repeated starts either may pick any child of a run, so the new
+    // one must return the first. Returns the number of mismatches.
+    int checkChildSearch(void) {
+        uint32_t state = 88675123u;
+        int mismatches = 0;
+        long searches = 0;
+
+        for (int numChildren = 0; numChildren <= 300; numChildren++) {
+            for (int distinct = 0; distinct < 2; distinct++) {
+                IntervalNode** children = createBenchChildren(numChildren, &state, distinct);
+                TreePosition last = numChildren > 0 ? children[numChildren - 1]->interval[0] : 0;
+
+                for (TreePosition key = -1; key <= last + 1; key++) {
+                    int expected = findInsertionPointReference(children, numChildren, key);
+                    int found = findInsertionPoint(children, numChildren, key);
+                    if (!distinct) {
+                        while (expected > 0 && children[expected - 1]->interval[0] == key) {
+                            expected--;
+                        }
+                    }
+                    if (found != expected) {
+                        mismatches++;
+                    }
+                    searches++;
+                }
+
+                freeBenchChildren(children, numChildren);
+            }
+        }
+
+        printf("findInsertionPoint: %ld searches, %d mismatches against the reference\n",
+               searches, mismatches);
+        return mismatches;
+    }
+
+    // Format random trees, parse the markup back and compare the tags covering each
+    // position. The first tree has spans that open and close together at several
+    // depths, where tags used to come out in the wrong order.
+    int checkFormatRoundTrip(void) {
+        static const char* tags[] = {"b", "i", "u"};
+        uint32_t state = 362436069u;
+        int mismatches = 0;
+        int rounds = 2000;
+        char text[256];
+
+        for (int round = 0; round < rounds; round++) {
+            TreePosition length = 120 + nextBenchRandom(&state) % 120;
+            for (TreePosition i = 0; i < length; i++) {
+                text[i] = 'a' + i % 26;
+            }
+            text[length] = '\0';
+
+            TaggedIntervalTree* tree = createTaggedIntervalTree(0, length);
+            if (round == 0) {
+                addTag(tree, "u", 63, 86);
+                addTag(tree, "i", 63, 83);
+                addTag(tree, "i", 86, 119);
+                addTag(tree, "u", 86, 92);
+            } else {
+                int numTags = 1 + nextBenchRandom(&state) % 16;
+                for (int t = 0; t < numTags; t++) {
+                    TreePosition start = nextBenchRandom(&state) % length;
+                    TreePosition end = start + 1 + nextBenchRandom(&state) % 60;
+                    addTag(tree, tags[nextBenchRandom(&state) % 3], start, end < length ? end : length);
+                }
+            }
+
+            char* formatted = getFormattedText(tree, text);
+            TaggedIntervalTree* parsed = NULL;
+            char* plain = NULL;
+            parseTaggedText(formatted, strlen(formatted), &parsed, &plain);
+
+            bool same = strcmp(plain, text) == 0;
+            for (TreePosition pos = 0; same && pos < length; pos++) {
+                for (int t = 0; t < 3; t++) {
+                    if (hasTag(tree, tags[t], pos, pos + 1) != hasTag(parsed, tags[t], pos, pos + 1)) {
+                        same = false;
+                    }
+                }
+            }
+            if (!same) {
+                mismatches++;
+            }
+
+            free(formatted);
+            free(plain);
+            freeTaggedIntervalTree(parsed);
+            freeTaggedIntervalTree(tree);
+        }
+
+        printf("getFormattedText: %d trees, %d mismatches after parsing back\n", rounds, mismatches);
+        return mismatches;
+    }
+
+    // Ask hasTag over random ranges of random trees while their long adds and
+    // removes are still deferred and an incremental add or remove is in progress,
+    // with edits in between, one query at a time and batched. Then settle the
+    // trees and ask again: the answers must not change. In the first trees an add
+    // meets a span of another tag, and ranges reaching across the span's ends used
+    // to be answered as covered. Returns the number of changed answers.
+    int checkDeferredQueries(void) {
+        static const char* tags[] = {"b", "i", "u"};
+        uint32_t state = 521288629u;
+        int mismatches = 0;
+        int rounds = 300;
+        TagQuery queries[256];
+        bool answers[256];
+        bool batched[256];
+        WorkBudget budget = {1, 0};
+        TreeContinuation continuation;
+
+        for (int round = 0; round < rounds; round++) {
+            TaggedIntervalTree* tree = createTaggedIntervalTree(0, 20000);
+            if (round == 0) {
+                addTag(tree, "i", 100, 200);
+                addTag(tree, "b", 0, 10000);
+            } else if (round == 1) {
+                addTag(tree, "i", 1000, 1200);
+                addTagIncremental(tree, "b", 0, 3000, budget, &continuation);
+            } else {
+                int numChanges = 1 + nextBenchRandom(&state) % 40;
+                for (int c = 0; c < numChanges; c++) {
+                    TreePosition size = tree->root->interval[1];
+                    TreePosition start = nextBenchRandom(&state) % size;
+                    TreePosition end = start + 1 + (nextBenchRandom(&state) % 4 == 0 ? 
+                                       DEFERRED_TAG_MIN_LENGTH + nextBenchRandom(&state) % 8000 : 
+                                       nextBenchRandom(&state) % 300);
+                    end = end < size ? end : size;
+                    TreePosition len = 1 + nextBenchRandom(&state) % 50;
+                    const char* tag = tags[nextBenchRandom(&state) % 3];
+                    switch (nextBenchRandom(&state) % 8) {
+                        case 0: insertText(tree, start, len); break;
+                        case 1: deleteText(tree, start, len < size - start ? len : size - start); break;
+                        case 2: removeTag(tree, tag, start, end); break;
+                        default: addTag(tree, tag, start, end); break;
+                    }
+                }
+                
+                // Leave an add or remove in progress over some of the queries
+                TreePosition size = tree->root->interval[1];
+                TreePosition start = nextBenchRandom(&state) % size;
+                TreePosition end = start + 1 + nextBenchRandom(&state) % 2000;
+                const char* tag = tags[nextBenchRandom(&state) % 3];
+                switch (nextBenchRandom(&state) % 3) {
+                    case 0: addTagIncremental(tree, tag, start, end < size ? end : size, budget, &continuation); break;
+                    case 1: removeTagIncremental(tree, tag, start, end < size ? end : size, budget); break;
+                    default: break;
+                }
+            }
+
+            TreePosition size = tree->root->interval[1];
+            for (int q = 0; q < 256; q++) {
+                TreePosition start = nextBenchRandom(&state) % size;
+                TreePosition end = start + 1 + nextBenchRandom(&state) % 300;
+                queries[q].tag = tags[nextBenchRandom(&state) % 3];
+                queries[q].start = start;
+                queries[q].end = end < size ? end : size;
+            }
+            if (round == 0) {
+                queries[0] = (TagQuery){"b", 99, 101};
+                queries[1] = (TagQuery){"b", 50, 150};
+            } else if (round == 1) {
+                queries[0] = (TagQuery){"b", 999, 1001};
+            }
+
+            for (int q = 0; q < 256; q++) {
+                answers[q] = hasTag(tree, queries[q].tag, queries[q].start, queries[q].end);
+            }
+            hasTagBatch(tree, queries, 256, batched);
+            settleTree(tree);
+            for (int q = 0; q < 256; q++) {
+                bool settled = hasTag(tree, queries[q].tag, queries[q].start, queries[q].end);
+                if (answers[q] != settled || batched[q] != settled) {
+                    mismatches++;
+                }
+            }
+            freeTaggedIntervalTree(tree);
+        }
+
+        printf("hasTag: %d trees with deferred tags, %d answers changed by settling\n", rounds, mismatches);
+        return mismatches;
+    }
+
+    // Time the reference and the current child search at typical fanouts
+    void benchChildSearch(int searches) {
+        int fanouts[] = {8, 32, 64, 256, 4096};
+        uint32_t state = 521288629u;
+
+        for (size_t f = 0; f < sizeof(fanouts) / sizeof(fanouts[0]); f++) {
+            int numChildren = fanouts[f];
+            IntervalNode** children = createBenchChildren(numChildren, &state, true);
+            TreePosition last = children[numChildren - 1]->interval[0];
+            TreePosition* keys = (TreePosition*)malloc(searches * sizeof(TreePosition));
+            if (!keys) {
+                perror("Failed to allocate memory for benchmark keys");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < searches; i++) {
+                keys[i] = nextBenchRandom(&state) % (last + 2);
+            }
+
+            char name[32];
+            long sum = 0;
+            uint64_t begin = nowNanoseconds();
+            for (int i = 0; i < searches; i++) {
+                sum += findInsertionPointReference(children, numChildren, keys[i]);
+            }
+            snprintf(name, sizeof(name), "ref/%d", numChildren);
+            reportBench(name, searches, begin, nowNanoseconds());
+
+            begin = nowNanoseconds();
+            for (int i = 0; i < searches; i++) {
+                sum -= findInsertionPoint(children, numChildren, keys[i]);
+            }
+            snprintf(name, sizeof(name), "search/%d", numChildren);
+            reportBench(name, searches, begin, nowNanoseconds());
+
+            if (sum != 0) {
+                printf("search/%d disagrees with the reference\n", numChildren);
+            }
+            free(keys);
+            freeBenchChildren(children, numChildren);
+        }
+    }
+
+    // Time the core operations on a document with numTags scattered tags
+    void benchTagOperations(int numTags) {
+        const char* tags[] = {"b", "i", "u", "em"};
+        TreePosition length = BENCH_DOCUMENT_LENGTH;
+        TaggedIntervalTree* tree = createTaggedIntervalTree(0, length);
+
+        printf("Positions: %zu-bit, IntervalNode: %zu bytes, TrackedPosition: %zu bytes\n",
+               sizeof(TreePosition) * 8, sizeof(IntervalNode), sizeof(TrackedPosition));
+
+        // Tag spans scattered over the document
+        uint32_t state = 2463534242u;
+        uint64_t begin = nowNanoseconds();
+        for (int i = 0; i < numTags; i++) {
+            TreePosition start = nextBenchRandom(&state) % (length - 64);
+            TreePosition end = start + 1 + nextBenchRandom(&state) % 64;
+            addTag(tree, tags[i % 4], start, end);
+        }
+        reportBench("addTag", numTags, begin, nowNanoseconds());
+
+        size_t usage = getTreeMemoryUsage(tree);
+        printf("Tree uses %zu bytes, %.1f bytes per tag\n", usage, (double)usage / numTags);
+
+        // Point and short range queries
+        int hits = 0;
+        begin = nowNanoseconds();
+        for (int i = 0; i < numTags; i++) {
+            TreePosition start = nextBenchRandom(&state) % (length - 64);
+            hits += hasTag(tree, tags[i % 4], start, start + 1 + i % 8);
+        }
+        reportBench("hasTag", numTags, begin, nowNanoseconds());
+
+        // Edits shift every span after them
+        int numEdits = numTags / 10 + 1;
+        begin = nowNanoseconds();
+        for (int i = 0; i < numEdits; i++) {
+            TreePosition pos = nextBenchRandom(&state) % length;
+            insertText(tree, pos, 1 + i % 16);
+        }
+        reportBench("insertText", numEdits, begin, nowNanoseconds());
+
+        begin = nowNanoseconds();
+        for (int i = 0; i < numEdits; i++) {
+            TreePosition pos = nextBenchRandom(&state) % length;
+            deleteText(tree, pos, 1 + i % 16);
+        }
+        reportBench("deleteText", numEdits, begin, nowNanoseconds());
+
+        // Hibernation varints are the same width in both builds
+        hibernateTree(tree);
+        printf("Hibernated blob: %zu bytes (%d hits)\n", tree->blobSize, hits);
+
+        freeTaggedIntervalTree(tree);
+    }
+
+    // Build a document of numWords words in paragraphs and sections
+    TaggedIntervalTree* buildWordTree(int numWords) {
+        TreeBuilder* builder = beginTreeBuilder(0);
+        for (int w = 0; w < numWords; w++) {
+            TreePosition pos = (TreePosition)w * 8;
+            if (w % 1024 == 0) openBuilderSpan(builder, "sec", pos);
+            if (w % 16 == 0) openBuilderSpan(builder, "p", pos);
+            openBuilderSpan(builder, "w", pos);
+            closeBuilderSpan(builder, "w", pos + 5);
+            if (w % 16 == 15 || w == numWords - 1) closeBuilderSpan(builder, "p", pos + 7);
+            if (w % 1024 == 1023 || w == numWords - 1) closeBuilderSpan(builder, "sec", pos + 7);
+        }
+        return finishTreeBuilder(builder, (TreePosition)numWords * 8);
+    }
+
+    // Time point queries on a large document made one at a time and in batches
+    void benchLargeTree(int numWords, int numQueries) {
+        TaggedIntervalTree* tree = buildWordTree(numWords);
+        printf("Large tree: %d words, %zu bytes, %zu bytes of arena\n", numWords,
+               getTreeMemoryUsage(tree), getNodeArenaBytes());
+
+        // Hits at every depth, and misses that descend all the way
+        const char* tags[] = {"w", "p", "sec", "em"};
+        TagQuery* queries = (TagQuery*)malloc(numQueries * sizeof(TagQuery));
+        bool* results = (bool*)malloc(numQueries * sizeof(bool));
+        if (!queries || !results) {
+            perror("Failed to allocate memory for benchmark queries");
+            exit(EXIT_FAILURE);
+        }
+        uint32_t state = 3141592653u;
+        for (int i = 0; i < numQueries; i++) {
+            queries[i].tag = tags[i % 4];
+            queries[i].start = (TreePosition)(nextBenchRandom(&state) % numWords) * 8 + i % 5;
+            queries[i].end = queries[i].start + 1;
+        }
+
+        int hits = 0;
+        uint64_t begin = nowNanoseconds();
+        for (int i = 0; i < numQueries; i++) {
+            hits += hasTag(tree, queries[i].tag, queries[i].start, queries[i].end);
+        }
+        reportBench("hasTag", numQueries, begin, nowNanoseconds());
+
+        begin = nowNanoseconds();
+        hasTagBatch(tree, queries, numQueries, results);
+        reportBench("hasTagBatch", numQueries, begin, nowNanoseconds());
+
+        for (int i = 0; i < numQueries; i++) {
+            hits -= results[i];
+        }
+        if (hits != 0) {
+            printf("hasTagBatch disagrees with hasTag on %d queries\n", hits);
+        }
+
+        // Tags at random positions, then at a run of neighbouring ones
+        TreePosition* positions = (TreePosition*)malloc(numQueries * sizeof(TreePosition));
+        TagsAtAnswers answers = {{NULL, 0, 0}, NULL, NULL, 0};
+        if (!positions) {
+            perror("Failed to allocate memory for benchmark positions");
+            exit(EXIT_FAILURE);
+        }
+        for (int run = 0; run < 2; run++) {
+            TreePosition first = (TreePosition)(nextBenchRandom(&state) % (numWords / 2)) * 8;
+            for (int i = 0; i < numQueries; i++) {
+                positions[i] = run == 0 ? queries[i].start : first + i;
+            }
+
+            TagsAt single = {NULL, 0, 0};
+            long total = 0;
+            begin = nowNanoseconds();
+            for (int i = 0; i < numQueries; i++) {
+                tagsAt(tree, positions[i], &single);
+                total += single.count;
+            }
+            reportBench(run == 0 ? "tagsAt" : "tagsAt/run", numQueries, begin, nowNanoseconds());
+
+            begin = nowNanoseconds();
+            tagsAtBatch(tree, positions, numQueries, &answers);
+            reportBench(run == 0 ? "tagsAtBatch" : "batch/run", numQueries, begin, nowNanoseconds());
+
+            if (total != answers.tags.count) {
+                printf("tagsAtBatch disagrees with tagsAt\n");
+            }
+            freeTagsAt(&single);
+        }
+
+        freeTagsAtAnswers(&answers);
+        free(positions);
+        free(queries);
+        free(results);
+        freeTaggedIntervalTree(tree);
+    }
+
+    // Style a whole large document, which is deferred, then time the queries that
+    // apply it along their paths and the compaction that applies the rest
+    void benchDeferred(int numWords, int numQueries) {
+        TaggedIntervalTree* tree = buildWordTree(numWords);
+        TreePosition length = (TreePosition)numWords * 8;
+
+        uint64_t begin = nowNanoseconds();
+        addTag(tree, "em", 0, length);
+        printf("%-12s %10.3f ms deferred\n", "addTag", (nowNanoseconds() - begin) / 1e6);
+
+        uint32_t state = 2718281828u;
+        for (int run = 0; run < 2; run++) {
+            int hits = 0;
+            begin = nowNanoseconds();
+            for (int i = 0; i < numQueries; i++) {
+                TreePosition pos = (TreePosition)(nextBenchRandom(&state) % numWords) * 8 + 4;
+                hits += hasTag(tree, "em", pos, pos + 1);
+            }
+            reportBench(run == 0 ? "hasTag/first" : "hasTag/again", numQueries, begin, nowNanoseconds());
+            if (hits != numQueries) {
+                printf("hasTag missed the deferred tag %d times\n", numQueries - hits);
+            }
+        }
+
+        begin = nowNanoseconds();
+        compactTree(tree);
+        printf("%-12s %10.3f ms, %zu bytes\n", "compactTree", (nowNanoseconds() - begin) / 1e6, 
+               getTreeMemoryUsage(tree));
+        freeTaggedIntervalTree(tree);
+    }
+
+    // Add and remove a tag over a whole large document in one call, then in steps
+    // of at most a millisecond, and compact what the removal leaves. Returns the
+    // number of operations with a step over the slack.
+    int benchIncremental(int numWords) {
+        TaggedIntervalTree* tree = buildWordTree(numWords);
+        TreePosition length = (TreePosition)numWords * 8;
+
+        uint64_t begin = nowNanoseconds();
+        addTag(tree, "em", 4, length - 4);
+        printf("%-12s %10.3f ms in one call\n", "addTag", (nowNanoseconds() - begin) / 1e6);
+        begin = nowNanoseconds();
+        removeTag(tree, "em", 4, length - 4);
+        printf("%-12s %10.3f ms in one call\n", "removeTag", (nowNanoseconds() - begin) / 1e6);
+
+        WorkBudget budget = {0, 1000000};
+        TreeContinuation continuation;
+        int failures = 0;
+        begin = nowNanoseconds();
+        uint64_t cpuBegin = threadCpuNanoseconds();
+        addTagIncremental(tree, "em", 4, length - 4, budget, &continuation);
+        failures += reportSteps("addTag", continuation, budget, nowNanoseconds() - begin, 
+                                threadCpuNanoseconds() - cpuBegin);
+        begin = nowNanoseconds();
+        cpuBegin = threadCpuNanoseconds();
+        continuation = removeTagIncremental(tree, "em", 4, length - 4, budget);
+        failures += reportSteps("removeTag", continuation, budget, nowNanoseconds() - begin, 
+                                threadCpuNanoseconds() - cpuBegin);
+        begin = nowNanoseconds();
+        cpuBegin = threadCpuNanoseconds();
+        continuation = compactTreeIncremental(tree, budget);
+        failures += reportSteps("compactTree", continuation, budget, nowNanoseconds() - begin, 
+                                threadCpuNanoseconds() - cpuBegin);
+
+        freeTaggedIntervalTree(tree);
+        return failures;
+    }
+
+    // Resume an incremental operation until it is done, and print the number of
+    // steps, the longest one and the total time. Returns 1 if a step took more
+    // than BENCH_STEP_SLACK budgets of CPU time; wall time also counts the time
+    // slices of other processes, so it is only printed.
+    int reportSteps(const char* name, TreeContinuation continuation, WorkBudget budget, uint64_t firstStep, 
+                    uint64_t firstStepCpu) {
+        int steps = 1;
+        uint64_t longest = firstStep;
+        uint64_t longestCpu = firstStepCpu;
+        uint64_t total = firstStep;
+        while (isTreeOperationPending(continuation)) {
+            uint64_t begin = nowNanoseconds();
+            uint64_t cpuBegin = threadCpuNanoseconds();
+            resumeTreeOperation(&continuation, budget);
+            uint64_t step = nowNanoseconds() - begin;
+            uint64_t stepCpu = threadCpuNanoseconds() - cpuBegin;
+            longest = step > longest ? step : longest;
+            longestCpu = stepCpu > longestCpu ? stepCpu : longestCpu;
+            total += step;
+            steps++;
+        }
+        printf("%-12s %10.3f ms in %d steps, longest %.3f ms, %.3f ms of CPU\n", name, total / 1e6, steps, 
+               longest / 1e6, longestCpu / 1e6);
+        if (longestCpu > BENCH_STEP_SLACK * budget.maxNanoseconds) {
+            printf("%s took a step of %.3f ms of CPU against a budget of %.3f ms\n", name, longestCpu / 1e6, 
+                   budget.maxNanoseconds / 1e6);
+            return 1;
+        }
+        return 0;
+    }
+
+    // Time formatting and hibernating the large tree in one call and as tasks run
+    // in budgeted steps. Returns the number of tasks with a step over the slack.
+    int benchTasks(int numWords) {
+        TaggedIntervalTree* tree = buildWordTree(numWords);
+        TreePosition length = (TreePosition)numWords * 8;
+        char* text = (char*)malloc(length + 1);
+        if (!text) {
+            perror("Failed to allocate memory for benchmark text");
+            exit(EXIT_FAILURE);
+        }
+        memset(text, 'x', length);
+        text[length] = '\0';
+
+        uint64_t begin = nowNanoseconds();
+        char* formatted = getFormattedText(tree, text);
+        printf("%-12s %10.3f ms in one call\n", "format", (nowNanoseconds() - begin) / 1e6);
+        free(formatted);
+
+        WorkBudget budget = {0, 1000000};
+        int failures = reportTaskSteps("format", startFormatTask(tree, text, &formatted), budget);
+        free(formatted);
+
+        begin = nowNanoseconds();
+        hibernateTree(tree);
+        printf("%-12s %10.3f ms in one call\n", "hibernate", (nowNanoseconds() - begin) / 1e6);
+        touchTree(tree, NULL);
+        failures += reportTaskSteps("hibernate", startHibernateTask(tree), budget);
+
+        free(text);
+        freeTaggedIntervalTree(tree);
+        return failures;
+    }
+
+    // Run a task until it is done and free it. Print the number of steps, the
+    // longest one and the total time; returns 1 if a step took more than
+    // BENCH_STEP_SLACK budgets of CPU time, as reportSteps does.
+    int reportTaskSteps(const char* name, TreeTask* task, WorkBudget budget) {
+        int steps = 0;
+        uint64_t longest = 0;
+        uint64_t longestCpu = 0;
+        uint64_t total = 0;
+        bool done = false;
+        while (!done) {
+            uint64_t begin = nowNanoseconds();
+            uint64_t cpuBegin = threadCpuNanoseconds();
+            done = runTreeTask(task, budget);
+            uint64_t step = nowNanoseconds() - begin;
+            uint64_t stepCpu = threadCpuNanoseconds() - cpuBegin;
+            longest = step > longest ? step : longest;
+            longestCpu = stepCpu > longestCpu ? stepCpu : longestCpu;
+            total += step;
+            steps++;
+        }
+        freeTreeTask(task);
+        printf("%-12s %10.3f ms in %d steps, longest %.3f ms, %.3f ms of CPU\n", name, total / 1e6, steps, 
+               longest / 1e6, longestCpu / 1e6);
+        if (longestCpu > BENCH_STEP_SLACK * budget.maxNanoseconds) {
+            printf("%s took a step of %.3f ms of CPU against a budget of %.3f ms\n", name, longestCpu / 1e6, 
+                   budget.maxNanoseconds / 1e6);
+            return 1;
+        }
+        return 0;
+    }
+
+    // Time dumping the large tree in each format, counting the bytes instead of
+    // keeping them
+    void benchDump(int numWords) {
+        TaggedIntervalTree* tree = buildWordTree(numWords);
+        const char* names[] = {"dump/text", "dump/json", "dump/dot"};
+        DumpFormat formats[] = {DUMP_TEXT, DUMP_JSON, DUMP_DOT};
+        for (int i = 0; i < 3; i++) {
+            size_t bytes = 0;
+            uint64_t begin = nowNanoseconds();
+            dumpTree(tree, formats[i], countDumpBytes, &bytes);
+            uint64_t elapsed = nowNanoseconds() - begin;
+            printf("%-12s %10.3f ms, %zu bytes, %.0f MB/s\n", names[i], elapsed / 1e6, bytes, bytes / (elapsed / 1e3));
+        }
+        freeTaggedIntervalTree(tree);
+    }
+
+    // Dump callback that only counts the bytes
+    void countDumpBytes(const char* data, size_t length, void* context) {
+        (void)data;
+        *(size_t*)context += length;
+    }
+
+    // Thread body for benchChurn: create, tag, edit and free documents, and
+    // return the number of operations done
+    void* churnDocuments(void* arg) {
+        int documents = *(int*)arg;
+        const char* tags[] = {"b", "i", "u", "em"};
+        uint32_t state = 2463534242u ^ (uint32_t)(uintptr_t)&documents;
+        uintptr_t operations = 0;
+        for (int d = 0; d < documents; d++) {
+            TaggedIntervalTree* tree = createTaggedIntervalTree(0, CHURN_DOCUMENT_LENGTH);
+            for (int i = 0; i < CHURN_TAGS; i++) {
+                TreePosition start = nextBenchRandom(&state) % (CHURN_DOCUMENT_LENGTH - 64);
+                addTag(tree, tags[i % 4], start, start + 1 + nextBenchRandom(&state) % 64);
+            }
+            for (int i = 0; i < CHURN_TAGS / 4; i++) {
+                TreePosition pos = nextBenchRandom(&state) % CHURN_DOCUMENT_LENGTH;
+                if (i % 2) {
+                    insertText(tree, pos, 1 + i % 16);
+                } else {
+                    deleteText(tree, pos, 1 + i % 16);
+                }
+            }
+            freeTaggedIntervalTree(tree);
+            operations += CHURN_TAGS + CHURN_TAGS / 4 + 2;
+        }
+        return (void*)operations;
+    }
+
+    // Run churnDocuments on 1, 2, 4, ... maxThreads threads at once and report
+    // the combined throughput
+    void benchChurn(int maxThreads, int documents) {
+        for (int numThreads = 1; ; numThreads = numThreads * 2 < maxThreads ? numThreads * 2 : maxThreads) {
+            pthread_t threads[256];
+            uint64_t begin = nowNanoseconds();
+            for (int i = 0; i < numThreads; i++) {
+                if (pthread_create(&threads[i], NULL, churnDocuments, &documents) != 0) {
+                    perror("Failed to create churn thread");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            uintptr_t operations = 0;
+            for (int i = 0; i < numThreads; i++) {
+                void* done;
+                pthread_join(threads[i], &done);
+                operations += (uintptr_t)done;
+            }
+
+            char name[32];
+            snprintf(name, sizeof(name), "churn x%d", numThreads);
+            reportBench(name, (int)operations, begin, nowNanoseconds());
+            if (numThreads == maxThreads) break;
+        }
+    }
+
+    #ifdef TAG_TREE_LATENCY_STATS
+    // Print the latency histograms of everything the run did, then time what
+    // recording one latency costs
+    void benchLatency(int timings) {
+        LatencyHistogram histograms[NUM_LATENCY_OPERATIONS];
+        collectLatencyStats(histograms);
+        dumpLatencyStats(histograms, DUMP_TEXT, writeDumpToFile, stdout);
+
+        uint64_t begin = nowNanoseconds();
+        for (int i = 0; i < timings; i++) {
+            LatencyTimer timer = {LATENCY_HAS_TAG, LATENCY_TICKS()};
+            recordLatency(&timer);
+        }
+        reportBench("recordLatency", timings, begin, nowNanoseconds());
+    }
+    #endif
+
+    int main(int argc, char** argv) {
+        int numTags = argc > 1 ? atoi(argv[1]) : 100000;
+        int numWords = argc > 2 ? atoi(argv[2]) : 1 << 22;
+        const char* nodeMemory = argc > 3 ? argv[3] : "malloc";
+        int arenaFlags = -1;
+        if (strcmp(nodeMemory, "arena") == 0) arenaFlags = 0;
+        if (strcmp(nodeMemory, "huge") == 0) arenaFlags = ARENA_HUGE_PAGES;
+        if (strcmp(nodeMemory, "numa") == 0) arenaFlags = ARENA_HUGE_PAGES | ARENA_NUMA_LOCAL;
+        if (numTags <= 0 || numWords <= 0 || (arenaFlags < 0 && strcmp(nodeMemory, "malloc") != 0)) {
+            fprintf(stderr, "usage: %s [tags] [words] [malloc|arena|huge|numa]\n", argv[0]);
+            return 1;
+        }
+        if (arenaFlags >= 0) {
+            enableNodeArena(arenaFlags);
+        }
+        printf("Nodes from: %s\n", nodeMemory);
+
+        if (checkChildSearch() != 0 || checkFormatRoundTrip() != 0 || checkDeferredQueries() != 0) {
+            return 1;
+        }
+        benchChildSearch(1000000);
+        benchTagOperations(numTags);
+        benchLargeTree(numWords, 1 << 20);
+        benchDeferred(numWords, 1 << 16);
+        if (benchIncremental(numWords) != 0 || benchTasks(numWords) != 0) {
+            return 1;
+        }
+        benchDump(numWords);
+
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        benchChurn(cpus < 1 ? 1 : cpus > 256 ? 256 : (int)cpus, 2000);
+        #ifdef TAG_TREE_LATENCY_STATS
+        benchLatency(10000000);
+        #endif
+        return 0;
+    }
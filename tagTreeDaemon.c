@@ -0,0 +1,780 @@
+    // Tag tree daemon: owns a set of documents and serves them over a Unix socket.
+    //
+    //   tagTreeDaemon serve <socket>
+    //   tagTreeDaemon bench <socket> [requests] [pipeline depth]
+    //   tagTreeDaemon replicate [mutations] [followers]
+    //
+    // Every message is a fixed header followed by a little-endian body. Clients may
+    // pipeline any number of requests; the server answers all complete requests in
+    // a read with one write, in order. Positions on the wire are 32-bit even when the
+    // trees are built with TAG_TREE_POSITION_64.
+
+    #define _GNU_SOURCE
+    #define TAG_TREE_NO_MAIN
+    #define TAG_TREE_QUIET
+    #include "tagTreeInterval.c"
+
+    #include <errno.h>
+    #include <time.h>
+    #include <sys/epoll.h>
+    #include <sys/socket.h>
+    #include <sys/un.h>
+
+    #define MAX_EVENTS 64
+    #define READ_CHUNK 65536
+    #define OUTPUT_HIGH_WATER (4 * 1024 * 1024)
+    #define REPLICATION_BATCH 256
+
+    // Request opcodes
+    typedef enum {
+        OP_CREATE = 1,      // body: start, end
+        OP_ADD_TAG = 2,     // body: start, end, tag length, tag
+        OP_REMOVE_TAG = 3,  // body: start, end, tag length, tag
+        OP_HAS_TAG = 4,     // body: start, end, tag length, tag; reply: one byte
+        OP_QUERY = 5,       // body: start, end; reply: count, then (start, end, tag length, tag)
+        OP_FORMAT = 6,      // body: text; reply: formatted text
+        OP_INSERT_TEXT = 7, // body: pos, len
+        OP_DELETE_TEXT = 8  // body: pos, len
+    } DaemonOpcode;
+
+    // Reply statuses
+    typedef enum {
+        REPLY_OK = 0,
+        REPLY_BAD_REQUEST = 1,
+        REPLY_NO_DOCUMENT = 2,
+        REPLY_MEMORY_LIMIT = 3
+    } DaemonStatus;
+
+    // Header of a request; length counts the body bytes that follow
+    typedef struct {
+        uint32_t length;
+        uint32_t id;
+        uint16_t opcode;
+        uint16_t document;
+    } RequestHeader;
+
+    // Header of a reply; id echoes the request
+    typedef struct {
+        uint32_t length;
+        uint32_t id;
+        uint16_t status;
+        uint16_t reserved;
+    } ReplyHeader;
+
+    // Structure for a growing byte buffer with a consumed prefix
+    typedef struct {
+        unsigned char* data;
+        size_t start;           // first unconsumed byte
+        size_t size;            // end of the valid bytes
+        size_t capacity;
+    } ByteBuffer;
+
+    // Structure for a client connection
+    typedef struct {
+        int fd;
+        ByteBuffer input;
+        ByteBuffer output;
+        uint32_t events;        // epoll events the connection is registered for
+        bool peerClosed;        // the peer will send nothing more
+    } Connection;
+
+    // Structure for the deferred tags above a query's node, in the root's frame:
+    // each hides the spans of its tag below it
+    typedef struct {
+        const char** tags;
+        TreePosition* ranges;   // start and end of each mask
+        int count;
+        int capacity;
+    } QueryMasks;
+
+    // Documents served by the daemon, indexed by the request's document number
+    static TaggedIntervalTree* documents[65536];
+
+    // Function prototypes
+    void reserveBytes(ByteBuffer* buffer, size_t bytes);
+    void appendBytes(ByteBuffer* buffer, const void* bytes, size_t length);
+    void compactBuffer(ByteBuffer* buffer);
+    bool readTagArgs(const unsigned char* body, uint32_t length, int* start, int* end, char* tag);
+    bool isTextEditInRange(TaggedIntervalTree* tree, int32_t pos, int32_t len);
+    void appendReply(ByteBuffer* output, uint32_t id, DaemonStatus status, const void* body,
+                     size_t length);
+    void appendQuerySpan(ByteBuffer* reply, uint32_t* count, TreePosition start, TreePosition end, const char* tag);
+    void pushQueryMask(QueryMasks* masks, const char* tag, TreePosition start, TreePosition end);
+    void queryUnmaskedSpans(const QueryMasks* masks, int numMasks, const char* tag, TreePosition start,
+                            TreePosition end, ByteBuffer* reply, uint32_t* count);
+    void queryTagsDFS(IntervalNode* node, TreePosition shift, TreePosition start, TreePosition end,
+                      QueryMasks* masks, ByteBuffer* reply, uint32_t* count);
+    void handleRequest(const RequestHeader* header, const unsigned char* body, ByteBuffer* output);
+    bool processInput(Connection* conn);
+    bool flushOutput(Connection* conn);
+    void closeConnection(int epollFd, Connection* conn);
+    int serve(const char* path);
+    int compareLatencies(const void* a, const void* b);
+    uint64_t nowNanoseconds(void);
+    int bench(const char* path, int requests, int depth);
+    void applyBenchMutation(TaggedIntervalTree* tree, int i);
+    void transferBytes(int fd, void* data, size_t size, bool sending);
+    int replicate(int mutations, int numFollowers);
+
+    // Make room for bytes more at the end of a buffer
+    void reserveBytes(ByteBuffer* buffer, size_t bytes) {
+        if (buffer->size + bytes <= buffer->capacity) return;
+
+        size_t newCapacity = buffer->capacity == 0 ? 4096 : buffer->capacity;
+        while (newCapacity < buffer->size + bytes) newCapacity *= 2;
+
+        unsigned char* newData = (unsigned char*)realloc(buffer->data, newCapacity);
+        if (!newData) {
+            perror("Failed to allocate memory for buffer");
+            exit(EXIT_FAILURE);
+        }
+
+        buffer->data = newData;
+        buffer->capacity = newCapacity;
+    }
+
+    // Append bytes to a buffer
+    void appendBytes(ByteBuffer* buffer, const void* bytes, size_t length) {
+        reserveBytes(buffer, length);
+        memcpy(buffer->data + buffer->size, bytes, length);
+        buffer->size += length;
+    }
+
+    // Drop the consumed prefix of a buffer
+    void compactBuffer(ByteBuffer* buffer) {
+        if (buffer->start == 0) return;
+
+        memmove(buffer->data, buffer->data + buffer->start, buffer->size - buffer->start);
+        buffer->size -= buffer->start;
+        buffer->start = 0;
+    }
+
+    // Parse the start, end, tag body shared by the tag requests
+    bool readTagArgs(const unsigned char* body, uint32_t length, int* start, int* end, char* tag) {
+        if (length < 9) return false;
+
+        int32_t range[2];
+        memcpy(range, body, sizeof(range));
+        uint8_t tagLength = body[8];
+        if (tagLength == 0 || tagLength >= MAX_TAG_LENGTH || length != 9u + tagLength) return false;
+
+        *start = range[0];
+        *end = range[1];
+        memcpy(tag, body + 9, tagLength);
+        tag[tagLength] = '\0';
+        return true;
+    }
+
+    // Check that a text edit starts inside a document and keeps it within the 32-bit wire range
+    bool isTextEditInRange(TaggedIntervalTree* tree, int32_t pos, int32_t len) {
+        touchTree(tree, NULL);
+        TreePosition start = tree->root->interval[0];
+        TreePosition end = tree->root->interval[1];
+        return len >= 0 && pos >= start && pos <= end && len <= INT32_MAX - end;
+    }
+
+    // Append a reply to a connection's output
+    void appendReply(ByteBuffer* output, uint32_t id, DaemonStatus status, const void* body,
+                     size_t length) {
+        ReplyHeader header = {(uint32_t)length, id, (uint16_t)status, 0};
+        appendBytes(output, &header, sizeof(header));
+        if (length > 0) {
+            appendBytes(output, body, length);
+        }
+    }
+
+    // Append one tagged span to a query reply
+    void appendQuerySpan(ByteBuffer* reply, uint32_t* count, TreePosition start, TreePosition end, const char* tag) {
+        int32_t range[2] = {(int32_t)start, (int32_t)end};
+        uint8_t tagLength = (uint8_t)strlen(tag);
+        appendBytes(reply, range, sizeof(range));
+        appendBytes(reply, &tagLength, 1);
+        appendBytes(reply, tag, tagLength);
+        (*count)++;
+    }
+
+    // Add a mask on top of a query's mask stack
+    void pushQueryMask(QueryMasks* masks, const char* tag, TreePosition start, TreePosition end) {
+        if (masks->count >= masks->capacity) {
+            int newCapacity = masks->capacity == 0 ? 16 : masks->capacity * 2;
+            const char** newTags = (const char**)realloc(masks->tags, newCapacity * sizeof(const char*));
+            TreePosition* newRanges = (TreePosition*)realloc(masks->ranges, 2 * newCapacity * sizeof(TreePosition));
+            if (!newTags || !newRanges) {
+                perror("Failed to allocate memory for query masks");
+                exit(EXIT_FAILURE);
+            }
+            masks->tags = newTags;
+            masks->ranges = newRanges;
+            masks->capacity = newCapacity;
+        }
+
+        masks->tags[masks->count] = tag;
+        masks->ranges[2 * masks->count] = start;
+        masks->ranges[2 * masks->count + 1] = end;
+        masks->count++;
+    }
+
+    // Append the parts of a span that none of the first numMasks masks of its tag hide
+    void queryUnmaskedSpans(const QueryMasks* masks, int numMasks, const char* tag, TreePosition start,
+                            TreePosition end, ByteBuffer* reply, uint32_t* count) {
+        for (int k = numMasks - 1; k >= 0; k--) {
+            TreePosition maskStart = masks->ranges[2 * k];
+            TreePosition maskEnd = masks->ranges[2 * k + 1];
+            if (maskStart >= end || start >= maskEnd || strcmp(masks->tags[k], tag) != 0) continue;
+
+            if (start < maskStart) {
+                queryUnmaskedSpans(masks, k, tag, start, maskStart, reply, count);
+            }
+            if (end > maskEnd) {
+                queryUnmaskedSpans(masks, k, tag, maskEnd, end, reply, count);
+            }
+            return;
+        }
+        appendQuerySpan(reply, count, start, end, tag);
+    }
+
+    // Collect the tagged spans overlapping [start,end) into a query reply without
+    // settling the tree: shift adds up the pending shifts above node, and deferred
+    // tags are reported as spans of their own that hide the older spans of their
+    // tag below them, deepest nodes being the oldest
+    void queryTagsDFS(IntervalNode* node, TreePosition shift, TreePosition start, TreePosition end,
+                      QueryMasks* masks, ByteBuffer* reply, uint32_t* count) {
+        if (node->tag) {
+            queryUnmaskedSpans(masks, masks->count, node->tag, node->interval[0] + shift,
+                               node->interval[1] + shift, reply, count);
+        }
+
+        shift += node->pendingShift;
+        int numMasks = masks->count;
+        for (int k = node->deferred ? node->deferred->count - 1 : -1; k >= 0; k--) {
+            DeferredTag* entry = &node->deferred->entries[k];
+            if (entry->add && entry->start + shift < end && entry->end + shift > start) {
+                queryUnmaskedSpans(masks, masks->count, entry->tag, entry->start + shift,
+                                   entry->end + shift, reply, count);
+            }
+            pushQueryMask(masks, entry->tag, entry->start + shift, entry->end + shift);
+        }
+
+        int i = findInsertionPoint(node->children, node->numChildren, start - shift);
+        if (i > 0 && node->children[i - 1]->interval[1] > start - shift) {
+            i--;
+        }
+
+        for (; i < node->numChildren && node->children[i]->interval[0] < end - shift; i++) {
+            if (node->children[i]->interval[1] > start - shift) {
+                queryTagsDFS(node->children[i], shift, start, end, masks, reply, count);
+            }
+        }
+        masks->count = numMasks;
+    }
+
+    // Execute one request and append its reply
+    void handleRequest(const RequestHeader* header, const unsigned char* body, ByteBuffer* output) {
+        TaggedIntervalTree* tree = documents[header->document];
+        int32_t args[2];
+        int start, end;
+        char tag[MAX_TAG_LENGTH];
+
+        if (header->opcode != OP_CREATE && !tree) {
+            appendReply(output, header->id, REPLY_NO_DOCUMENT, NULL, 0);
+            return;
+        }
+
+        switch (header->opcode) {
+            case OP_CREATE:
+            case OP_INSERT_TEXT:
+            case OP_DELETE_TEXT:
+                if (header->length != sizeof(args)) break;
+                memcpy(args, body, sizeof(args));
+
+                if (header->opcode == OP_CREATE) {
+                    if (args[0] < 0 || args[0] > args[1]) break;
+                    freeTaggedIntervalTree(tree);
+                    documents[header->document] = createTaggedIntervalTree(args[0], args[1]);
+                } else if (!isTextEditInRange(tree, args[0], args[1])) {
+                    break;
+                } else if (header->opcode == OP_INSERT_TEXT) {
+                    insertText(tree, args[0], args[1]);
+                } else {
+                    deleteText(tree, args[0], args[1]);
+                }
+                appendReply(output, header->id, REPLY_OK, NULL, 0);
+                return;
+
+            case OP_ADD_TAG:
+                if (!readTagArgs(body, header->length, &start, &end, tag)) break;
+                appendReply(output, header->id, addTag(tree, tag, start, end) == TREE_OK ?
+                            REPLY_OK : REPLY_MEMORY_LIMIT, NULL, 0);
+                return;
+
+            case OP_REMOVE_TAG:
+                if (!readTagArgs(body, header->length, &start, &end, tag)) break;
+                removeTag(tree, tag, start, end);
+                appendReply(output, header->id, REPLY_OK, NULL, 0);
+                return;
+
+            case OP_HAS_TAG: {
+                if (!readTagArgs(body, header->length, &start, &end, tag)) break;
+                uint8_t found = hasTag(tree, tag, start, end);
+                appendReply(output, header->id, REPLY_OK, &found, 1);
+                return;
+            }
+
+            case OP_QUERY: {
+                if (header->length != sizeof(args)) break;
+                memcpy(args, body, sizeof(args));
+
+                // Build the reply in place: header, count, then the spans
+                size_t replyStart = output->size;
+                ReplyHeader reply = {0, header->id, REPLY_OK, 0};
+                uint32_t count = 0;
+                appendBytes(output, &reply, sizeof(reply));
+                appendBytes(output, &count, sizeof(count));
+
+                QueryMasks masks = {NULL, NULL, 0, 0};
+                touchTree(tree, NULL);
+                queryTagsDFS(tree->root, 0, args[0], args[1], &masks, output, &count);
+                free(masks.tags);
+                free(masks.ranges);
+
+                reply.length = (uint32_t)(output->size - replyStart - sizeof(reply));
+                memcpy(output->data + replyStart, &reply, sizeof(reply));
+                memcpy(output->data + replyStart + sizeof(reply), &count, sizeof(count));
+                return;
+            }
+
+            case OP_FORMAT: {
+                char* text = (char*)malloc(header->length + 1);
+                if (!text) {
+                    perror("Failed to allocate memory for text");
+                    exit(EXIT_FAILURE);
+                }
+                memcpy(text, body, header->length);
+                text[header->length] = '\0';
+
+                char* formatted = getFormattedText(tree, text);
+                appendReply(output, header->id, REPLY_OK, formatted, strlen(formatted));
+                free(formatted);
+                free(text);
+                return;
+            }
+        }
+
+        appendReply(output, header->id, REPLY_BAD_REQUEST, NULL, 0);
+    }
+
+    // Handle the complete requests in a connection's input until the socket stops taking
+    // replies past the high-water mark; false on a protocol error or if the peer is gone
+    bool processInput(Connection* conn) {
+        ByteBuffer* input = &conn->input;
+
+        while (input->size - input->start >= sizeof(RequestHeader)) {
+            if (conn->output.size > OUTPUT_HIGH_WATER) {
+                if (!flushOutput(conn)) return false;
+                if (conn->output.size > OUTPUT_HIGH_WATER) break;
+            }
+
+            RequestHeader header;
+            memcpy(&header, input->data + input->start, sizeof(header));
+            if (header.length > 16 * 1024 * 1024) return false;
+
+            size_t frameSize = sizeof(header) + header.length;
+            if (input->size - input->start < frameSize) break;
+
+            handleRequest(&header, input->data + input->start + sizeof(header), &conn->output);
+            input->start += frameSize;
+        }
+
+        compactBuffer(input);
+        return true;
+    }
+
+    // Write as much pending output as the socket takes; false if the peer is gone
+    bool flushOutput(Connection* conn) {
+        ByteBuffer* output = &conn->output;
+
+        while (output->start < output->size) {
+            ssize_t written = send(conn->fd, output->data + output->start,
+                                   output->size - output->start, MSG_NOSIGNAL);
+            if (written < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (errno == EINTR) continue;
+                return false;
+            }
+            output->start += written;
+        }
+
+        compactBuffer(output);
+        return true;
+    }
+
+    // Close a connection and free its buffers
+    void closeConnection(int epollFd, Connection* conn) {
+        epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+        close(conn->fd);
+        free(conn->input.data);
+        free(conn->output.data);
+        free(conn);
+    }
+
+    // Run the event loop on a Unix socket
+    int serve(const char* path) {
+        int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (listenFd < 0) {
+            perror("Failed to create socket");
+            return EXIT_FAILURE;
+        }
+
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+        unlink(path);
+
+        if (bind(listenFd, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+            listen(listenFd, 128) != 0) {
+            perror("Failed to listen on socket");
+            close(listenFd);
+            return EXIT_FAILURE;
+        }
+
+        int epollFd = epoll_create1(0);
+        if (epollFd < 0) {
+            perror("Failed to create epoll instance");
+            close(listenFd);
+            return EXIT_FAILURE;
+        }
+
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &event);
+        printf("Serving tag trees on %s\n", path);
+
+        struct epoll_event events[MAX_EVENTS];
+        while (true) {
+            int ready = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+            if (ready < 0) {
+                if (errno == EINTR) continue;
+                perror("epoll_wait failed");
+                break;
+            }
+
+            for (int i = 0; i < ready; i++) {
+                Connection* conn = (Connection*)events[i].data.ptr;
+
+                // The listening socket carries no connection
+                if (!conn) {
+                    int fd;
+                    while ((fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK)) >= 0) {
+                        conn = (Connection*)calloc(1, sizeof(Connection));
+                        if (!conn) {
+                            perror("Failed to allocate memory for Connection");
+                            exit(EXIT_FAILURE);
+                        }
+                        conn->fd = fd;
+                        conn->events = EPOLLIN;
+
+                        struct epoll_event connEvent = {.events = EPOLLIN, .data.ptr = conn};
+                        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &connEvent);
+                    }
+                    continue;
+                }
+
+                // Answer what is already buffered, then read and answer more until the
+                // socket is drained or the replies back up past the high-water mark
+                bool alive = processInput(conn) && flushOutput(conn);
+                while (alive && !conn->peerClosed && conn->output.size <= OUTPUT_HIGH_WATER) {
+                    reserveBytes(&conn->input, READ_CHUNK);
+                    ssize_t received = read(conn->fd, conn->input.data + conn->input.size,
+                                            READ_CHUNK);
+                    if (received > 0) {
+                        conn->input.size += received;
+                        alive = processInput(conn);
+                    } else if (received == 0) {
+                        conn->peerClosed = true;
+                    } else if (errno != EINTR) {
+                        alive = errno == EAGAIN || errno == EWOULDBLOCK;
+                        break;
+                    }
+                }
+
+                // A peer that stopped sending is closed once its replies are written
+                alive = alive && flushOutput(conn);
+                if (!alive || (conn->peerClosed && conn->output.size == 0)) {
+                    closeConnection(epollFd, conn);
+                    continue;
+                }
+
+                // Read only while replies are below the high-water mark, and wait for
+                // EPOLLOUT only while they are backed up
+                uint32_t wanted = (conn->peerClosed || conn->output.size > OUTPUT_HIGH_WATER ? 0 : EPOLLIN) |
+                                  (conn->output.size > 0 ? EPOLLOUT : 0);
+                if (wanted != conn->events) {
+                    struct epoll_event connEvent = {.events = wanted, .data.ptr = conn};
+                    epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &connEvent);
+                    conn->events = wanted;
+                }
+            }
+        }
+
+        close(epollFd);
+        close(listenFd);
+        return EXIT_FAILURE;
+    }
+
+    // Compare function for sorting latencies
+    int compareLatencies(const void* a, const void* b) {
+        uint64_t latencyA = *(const uint64_t*)a;
+        uint64_t latencyB = *(const uint64_t*)b;
+        return latencyA < latencyB ? -1 : latencyA > latencyB;
+    }
+
+    // Get a monotonic timestamp in nanoseconds
+    uint64_t nowNanoseconds(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    }
+
+    // Benchmark client: keeps depth requests in flight, mixing adds and queries,
+    // and reports throughput and latency percentiles
+    int bench(const char* path, int requests, int depth) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+
+        if (fd < 0 || connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+            perror("Failed to connect");
+            return EXIT_FAILURE;
+        }
+
+        uint64_t* sentAt = (uint64_t*)malloc((requests + 1) * sizeof(uint64_t));
+        uint64_t* latencies = (uint64_t*)malloc((requests + 1) * sizeof(uint64_t));
+        if (!sentAt || !latencies) {
+            perror("Failed to allocate memory for latencies");
+            exit(EXIT_FAILURE);
+        }
+
+        ByteBuffer output = {NULL, 0, 0, 0};
+        ByteBuffer input = {NULL, 0, 0, 0};
+
+        // Request 0 creates the document
+        RequestHeader create = {8, 0, OP_CREATE, 0};
+        int32_t range[2] = {0, 1 << 20};
+        appendBytes(&output, &create, sizeof(create));
+        appendBytes(&output, range, sizeof(range));
+        sentAt[0] = nowNanoseconds();
+
+        const char* tags[] = {"b", "i", "u", "em"};
+        int sent = 1;
+        int received = 0;
+        uint64_t begin = nowNanoseconds();
+
+        while (received <= requests) {
+            // Top up the pipeline
+            while (sent <= requests && sent - received < depth) {
+                const char* tag = tags[sent % 4];
+                int32_t start = (int32_t)((sent * 7919u) % (1 << 20));
+                int32_t span[2] = {start, start + 1 + (sent % 64)};
+                uint8_t tagLength = (uint8_t)strlen(tag);
+                RequestHeader header = {9u + tagLength, (uint32_t)sent,
+                                        sent % 2 ? OP_ADD_TAG : OP_HAS_TAG, 0};
+
+                appendBytes(&output, &header, sizeof(header));
+                appendBytes(&output, span, sizeof(span));
+                appendBytes(&output, &tagLength, 1);
+                appendBytes(&output, tag, tagLength);
+                sentAt[sent++] = nowNanoseconds();
+            }
+
+            // Send the batch
+            while (output.start < output.size) {
+                ssize_t written = write(fd, output.data + output.start, output.size - output.start);
+                if (written <= 0) {
+                    perror("Failed to send requests");
+                    return EXIT_FAILURE;
+                }
+                output.start += written;
+            }
+            compactBuffer(&output);
+
+            // Collect whatever replies are ready
+            reserveBytes(&input, READ_CHUNK);
+            ssize_t got = read(fd, input.data + input.size, READ_CHUNK);
+            if (got <= 0) {
+                perror("Failed to receive replies");
+                return EXIT_FAILURE;
+            }
+            input.size += got;
+
+            uint64_t now = nowNanoseconds();
+            while (input.size - input.start >= sizeof(ReplyHeader)) {
+                ReplyHeader reply;
+                memcpy(&reply, input.data + input.start, sizeof(reply));
+                if (input.size - input.start < sizeof(reply) + reply.length) break;
+
+                latencies[received++] = now - sentAt[reply.id];
+                input.start += sizeof(reply) + reply.length;
+            }
+            compactBuffer(&input);
+        }
+
+        double seconds = (nowNanoseconds() - begin) / 1e9;
+        qsort(latencies, received, sizeof(uint64_t), compareLatencies);
+
+        printf("%d requests, pipeline depth %d: %.0f requests/s\n", requests, depth,
+               requests / seconds);
+        printf("latency p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n",
+               latencies[received / 2] / 1e3, latencies[received * 99 / 100] / 1e3,
+               latencies[received * 999 / 1000] / 1e3, latencies[received - 1] / 1e3);
+
+        free(sentAt);
+        free(latencies);
+        free(output.data);
+        free(input.data);
+        close(fd);
+        return EXIT_SUCCESS;
+    }
+
+    // Apply the i-th mutation of the replication benchmark: mostly tag edits, with
+    // balanced text inserts and deletes
+    void applyBenchMutation(TaggedIntervalTree* tree, int i) {
+        static const char* tags[] = {"b", "i", "u", "em"};
+        int start = (int)((i * 7919u) % (1 << 20));
+
+        switch (i % 8) {
+            case 5:
+                removeTag(tree, tags[i % 4], start, start + 16);
+                break;
+            case 6:
+                insertText(tree, start, 4);
+                break;
+            case 7:
+                deleteText(tree, start, 4);
+                break;
+            default:
+                addTag(tree, tags[i % 4], start, start + 1 + (i % 64));
+                break;
+        }
+    }
+
+    // Send or receive exactly size bytes
+    void transferBytes(int fd, void* data, size_t size, bool sending) {
+        unsigned char* bytes = (unsigned char*)data;
+        while (size > 0) {
+            ssize_t done = sending ? write(fd, bytes, size) : read(fd, bytes, size);
+            if (done <= 0) {
+                if (done < 0 && errno == EINTR) continue;
+                perror("Failed to transfer replication batch");
+                exit(EXIT_FAILURE);
+            }
+            bytes += done;
+            size -= done;
+        }
+    }
+
+    // Replication benchmark: the same mutations on a single tree, then on a logged
+    // leader whose followers catch up every REPLICATION_BATCH mutations. One extra
+    // follower is fed encoded batches over a socket pair.
+    int replicate(int mutations, int numFollowers) {
+        TaggedIntervalTree* baseline = createTaggedIntervalTree(0, 1 << 20);
+        uint64_t begin = nowNanoseconds();
+        for (int i = 0; i < mutations; i++) {
+            applyBenchMutation(baseline, i);
+        }
+        double baselineSeconds = (nowNanoseconds() - begin) / 1e9;
+
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets) != 0) {
+            perror("Failed to create socket pair");
+            return EXIT_FAILURE;
+        }
+
+        TaggedIntervalTree* leader = createTaggedIntervalTree(0, 1 << 20);
+        ReplicationLog* log = startReplicationLog(leader);
+        ReplicaFollower** followers = (ReplicaFollower**)malloc(numFollowers * sizeof(ReplicaFollower*));
+        if (!followers) {
+            perror("Failed to allocate memory for followers");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < numFollowers; i++) {
+            followers[i] = createFollower(log);
+        }
+        ReplicaFollower* remote = createDetachedFollower(0, 1 << 20, getLogSequence(log));
+
+        uint64_t leaderNanoseconds = 0, followerNanoseconds = 0, remoteNanoseconds = 0;
+        for (int done = 0; done < mutations; ) {
+            uint64_t start = nowNanoseconds();
+            for (int i = 0; i < REPLICATION_BATCH && done < mutations; i++, done++) {
+                applyBenchMutation(leader, done);
+            }
+            uint64_t leaderDone = nowNanoseconds();
+
+            for (int i = 0; i < numFollowers; i++) {
+                readFollower(followers[i], 0);
+            }
+            uint64_t followersDone = nowNanoseconds();
+
+            // Ship the new entries as a length-prefixed batch
+            size_t size;
+            unsigned char* batch = encodeLogBatch(log, remote->nextSequence, REPLICATION_BATCH, &size);
+            uint32_t length = (uint32_t)size;
+            transferBytes(sockets[0], &length, sizeof(length), true);
+            transferBytes(sockets[0], batch, size, true);
+
+            transferBytes(sockets[1], &length, sizeof(length), false);
+            transferBytes(sockets[1], batch, length, false);
+            if (applyEncodedBatch(remote, batch, length) < 0) {
+                fprintf(stderr, "Replication batch rejected\n");
+                return EXIT_FAILURE;
+            }
+            free(batch);
+            trimReplicationLog(log, remote->nextSequence);
+
+            leaderNanoseconds += leaderDone - start;
+            followerNanoseconds += followersDone - leaderDone;
+            remoteNanoseconds += nowNanoseconds() - followersDone;
+        }
+
+        printf("%d mutations, batches of %d\n", mutations, REPLICATION_BATCH);
+        printf("single tree:       %.0f mutations/s\n", mutations / baselineSeconds);
+        printf("logged leader:     %.0f mutations/s\n", mutations / (leaderNanoseconds / 1e9));
+        if (numFollowers > 0) {
+            printf("in-process follower: %.0f mutations/s each (%d followers)\n", 
+                   mutations / (followerNanoseconds / 1e9 / numFollowers), numFollowers);
+        }
+        printf("socket follower:   %.0f mutations/s, lag %llu\n", mutations / (remoteNanoseconds / 1e9), 
+               (unsigned long long)getFollowerLag(remote));
+
+        for (int i = 0; i < numFollowers; i++) {
+            freeFollower(followers[i]);
+        }
+        free(followers);
+        freeFollower(remote);
+        freeTaggedIntervalTree(leader);
+        freeTaggedIntervalTree(baseline);
+        close(sockets[0]);
+        close(sockets[1]);
+        return EXIT_SUCCESS;
+    }
+
+    int main(int argc, char** argv) {
+        if (argc >= 3 && strcmp(argv[1], "serve") == 0) {
+            return serve(argv[2]);
+        }
+        if (argc >= 3 && strcmp(argv[1], "bench") == 0) {
+            int requests = argc >= 4 ? atoi(argv[3]) : 100000;
+            int depth = argc >= 5 ? atoi(argv[4]) : 32;
+            return bench(argv[2], requests > 0 ? requests : 1, depth > 0 ? depth : 1);
+        }
+        if (argc >= 2 && strcmp(argv[1], "replicate") == 0) {
+            int mutations = argc >= 3 ? atoi(argv[2]) : 100000;
+            int numFollowers = argc >= 4 ? atoi(argv[3]) : 2;
+            return replicate(mutations > 0 ? mutations : 1, numFollowers > 0 ? numFollowers : 0);
+        }
+
+        fprintf(stderr, "usage: %s serve <socket>\n       %s bench <socket> [requests] [depth]\n"
+                "       %s replicate [mutations] [followers]\n", argv[0], argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
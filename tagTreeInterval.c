@@ -3,9 +3,93 @@
     #include <stdlib.h>
     #include <string.h>
     #include <stdbool.h>
+    #include <stdatomic.h>
+    #include <stdint.h>
+    #include <inttypes.h>
     #include <math.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <pthread.h>
+    #include <time.h>
+    #include <stdarg.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <sys/syscall.h>
+    #ifdef __SSE2__
+    #include <emmintrin.h>
+    #endif
+    #if defined(TAG_TREE_LATENCY_STATS) && (defined(__x86_64__) || defined(__i386__))
+    #include <x86intrin.h>
+    #endif
     
     #define MAX_TAG_LENGTH 32
+    #define TEXT_INDEX_CHUNK 1024     // bytes between text index checkpoints
+    #define CHILD_SCAN_LIMIT 4        // nodes up to this fanout are searched by a linear scan
+    #define TAG_QUERY_GROUP 16        // descents interleaved by batched queries
+    #define DUMP_BUFFER_SIZE 4096     // bytes of a dump staged before its callback sees them
+    #define LATENCY_SUB_BUCKET_BITS 5 // latency buckets split each power of two 32 ways
+    #define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+    #define LATENCY_MAX_BITS 44       // longer latencies share the last bucket
+    #define NUM_LATENCY_BUCKETS ((LATENCY_MAX_BITS - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS)
+    #define NODE_ARENA_CHUNK (2u << 20)  // node arena chunk, one transparent huge page
+    #define MAX_NUMA_NODES 64
+    #define NODE_CACHE_BATCH 64         // blocks a thread cache trades with its depot at once
+    #define NUM_BLOCK_CLASSES 6         // nodes, then children arrays of 4, 8, 16, 32 and 64 slots
+    #define OPERATION_PIECE_NODES 256   // nodes an incremental operation aims to visit per piece
+    #define DEFERRED_TAG_MIN_LENGTH 4096  // adds and removes over shorter ranges are applied at once
+    #define DEFERRED_APPLY_CHILDREN 256 // children a node's deferred tags are applied to at a time
+    #define TASK_CLOCK_INTERVAL 64      // nodes or tags a task handles between reads of the clock
+    #define FORMAT_TEXT_CHUNK 4096      // bytes of text a format task measures or copies as one unit of work
+    #define FORMAT_RELEASE_BYTES (1 << 20)  // written markers a format task gives back to the system at a time
+    #define FORMAT_MARKER_CHUNK 4096    // markers a format task collects per chunk
+    #define FORMAT_TAG_BLOCK 4096       // bytes of tag copies per block of a format task
+    #define HIBERNATE_CHUNK 65536       // bytes of encoded nodes a hibernate task writes per chunk
+    #define MAX_NODE_RECORD 32          // bytes of the longest encoded node
+    
+    // Trace lines printed by the tree operations; define TAG_TREE_QUIET to drop them
+    #ifdef TAG_TREE_QUIET
+    #define TREE_TRACE(...) ((void)0)
+    #else
+    #define TREE_TRACE(...) printf(__VA_ARGS__)
+    #endif
+    
+    // Latency histograms of addTag, removeTag, hasTag and getFormattedText; define
+    // TAG_TREE_LATENCY_STATS to record them. LATENCY_SCOPE times the rest of the
+    // enclosing function, whichever way it returns. Ticks are cycles where the
+    // time stamp counter can be read, nanoseconds elsewhere.
+    #ifdef TAG_TREE_LATENCY_STATS
+    #define LATENCY_SCOPE(operation) \
+        LatencyTimer latencyTimer __attribute__((cleanup(recordLatency))) = {operation, LATENCY_TICKS()}
+    #if defined(__x86_64__) || defined(__i386__)
+    #define LATENCY_TICKS() __rdtsc()
+    #define LATENCY_TICKS_ARE_CYCLES 1
+    #else
+    #define LATENCY_TICKS() monotonicNanoseconds()
+    #define LATENCY_TICKS_ARE_CYCLES 0
+    #endif
+    #else
+    #define LATENCY_SCOPE(operation) ((void)0)
+    #endif
+    
+    // Hint that a descent is about to read a node or array; define TAG_TREE_NO_PREFETCH
+    // to compare against plain loads
+    #ifdef TAG_TREE_NO_PREFETCH
+    #define PREFETCH(address) ((void)sizeof(address))
+    #else
+    #define PREFETCH(address) __builtin_prefetch(address)
+    #endif
+    
+    // Text positions and lengths. Define TAG_TREE_POSITION_64 for documents and
+    // logs beyond 2 GB; the default keeps nodes compact for ordinary documents.
+    #ifdef TAG_TREE_POSITION_64
+    typedef int64_t TreePosition;
+    #define PRIpos PRId64
+    #define SHARED_TREE_MAGIC 0x34364754u  // "TG64"
+    #else
+    typedef int32_t TreePosition;
+    #define PRIpos PRId32
+    #define SHARED_TREE_MAGIC 0x54475452u  // "TGTR"
+    #endif
     
     // Result state enum for removal operations
     typedef enum {
@@ -17,15 +101,95 @@
         PROCESSED_CHILDREN
     } RemoveState;
     
+    // Which side a tracked position sticks to when text is inserted exactly at it
+    typedef enum {
+        GRAVITY_LEFT,
+        GRAVITY_RIGHT
+    } PositionGravity;
+    
     // Structure for an interval node
     typedef struct IntervalNode {
-        int interval[2];        // [start, end]
+        TreePosition interval[2];  // [start, end]
         char* tag;              // tag name, NULL if no tag
         struct IntervalNode** children;  // array of child nodes
         int numChildren;        // number of children
         int childrenCapacity;   // capacity of children array
+        TreePosition pendingShift;  // shift not yet applied to the descendants
+        struct IntervalNode* parent;     // parent node, NULL for the root
+        struct TrackedPosition* positions[2];  // treaps of tracked positions by gravity, NULL if none
+        struct DeferredTags* deferred;   // tags still to be applied below this node, NULL if none
     } IntervalNode;
     
+    // Structure for a position that follows edits. The position is stored in the
+    // same frame as the owner's children, so lazy shifts move it for free. Each node
+    // keeps its positions in a treap per gravity ordered by position, with lazy
+    // shifts of its own, so an edit moves the positions after it in O(log n).
+    typedef struct TrackedPosition {
+        TreePosition position;  // position relative to the owner's and treap parents' pending shifts
+        PositionGravity gravity;
+        IntervalNode* owner;    // node holding the position, NULL once the tree is freed
+        struct TrackedPosition* left;   // treap child with earlier positions
+        struct TrackedPosition* right;  // treap child with later positions
+        struct TrackedPosition* up;     // treap parent, NULL at the root
+        TreePosition pendingShift;      // shift not yet applied to the treap children
+        uint32_t priority;      // treap priority, higher nearer the root
+        bool isAnchor;          // true for anchors, false for span handle endpoints
+        void* data;             // caller data for anchors
+    } TrackedPosition;
+    
+    // A zero-width anchor (cursor, bookmark, search hit) that follows edits
+    typedef TrackedPosition Anchor;
+    
+    // One question of a batched hasTag: does tag cover [start,end)?
+    typedef struct {
+        const char* tag;
+        TreePosition start;
+        TreePosition end;
+    } TagQuery;
+    
+    // The tags covering a position, outermost first. The strings belong to the tree
+    // and stay valid until it is next modified.
+    typedef struct {
+        const char** tags;
+        int count;
+        int capacity;
+    } TagsAt;
+    
+    // Answers of a tagsAtBatch call: the tags covering positions[i] are
+    // tags.tags[first[i]] to tags.tags[first[i] + count[i] - 1], outermost first.
+    // Start it zeroed; later calls reuse its buffers.
+    typedef struct {
+        TagsAt tags;            // the tags of every answer
+        int* first;
+        int* count;
+        int capacity;           // positions first and count have room for
+    } TagsAtAnswers;
+    
+    // A position of a tagsAtBatch call and where its answer goes
+    typedef struct {
+        TreePosition position;
+        int index;
+    } PositionSlot;
+    
+    // One lane of a tagsAtBatch call: a run of sorted positions answered one after
+    // another, keeping the path of nodes that contain the current position
+    typedef struct {
+        int next;               // slot being answered
+        int last;               // end of the lane's run of slots
+        IntervalNode** path;    // nodes containing the position, root first
+        TreePosition* shifts;   // pending shifts above each path node, added up
+        int depth;
+        int capacity;
+        bool fetched;           // whether the deepest node's children were prefetched
+    } TagsAtLane;
+    
+    // Structure for a stable reference to a tagged span
+    typedef struct {
+        char* tag;
+        TrackedPosition* start;
+        TrackedPosition* end;
+    } SpanHandle;
+    
     // Structure for rehook nodes list
     typedef struct {
         IntervalNode** nodes;    // array of nodes to rehook
@@ -37,48 +201,953 @@
     typedef struct {
         bool removed;
         RemoveState state;
-        int remainingInterval[2];
+        TreePosition remainingInterval[2];
         RehookNodeList rehookNodeList;
     } RemoveResult;
     
     // Structure for insertion points
     typedef struct {
         int index;
-        int start;
-        int end;
+        TreePosition start;
+        TreePosition end;
     } InsertPoint;
     
-    // Structure for the tree
+    // Kind of change reported to subscribers
+    typedef enum {
+        CHANGE_TAG_ADDED,
+        CHANGE_TAG_REMOVED,
+        CHANGE_TAGS_MERGED,
+        CHANGE_TEXT_INSERTED,
+        CHANGE_TEXT_DELETED
+    } ChangeKind;
+    
+    // Structure for a change record. Text edits have an empty tag; deleted ranges
+    // are given in the positions before the deletion.
+    typedef struct {
+        ChangeKind kind;
+        char tag[MAX_TAG_LENGTH];
+        TreePosition start;
+        TreePosition end;
+    } ChangeRecord;
+    
+    // Structure for a change subscriber: a single-producer single-consumer ring.
+    // The thread editing the tree writes, one consumer thread drains.
+    typedef struct ChangeSubscriber {
+        ChangeRecord* records;  // ring of records
+        size_t capacity;        // ring size, a power of two
+        _Atomic size_t head;    // next record to drain, written by the consumer
+        _Atomic size_t tail;    // next free slot, written by the producer
+        atomic_bool overflowed; // records were dropped since the last drain
+        struct ChangeSubscriber* next;  // next subscriber of the same tree
+    } ChangeSubscriber;
+    
+    // Status of tree operations that can be refused
+    typedef enum {
+        TREE_OK,
+        TREE_MEMORY_LIMIT_EXCEEDED,
+        TREE_SHARED_SEGMENT_FULL,
+        TREE_SHARED_SEGMENT_READ_ONLY,
+        TREE_REPLICATION_LOG_ACTIVE
+    } TreeStatus;
+    
+    // Structure for the memory charged to a document; trees split from it share it
+    typedef struct {
+        size_t bytesUsed;       // bytes held by nodes, tags and their arrays
+        size_t peakBytes;       // highest bytesUsed seen
+        size_t limit;           // operations that would grow past it are refused, 0 for none
+        size_t bytesReserved;   // growth admitted for incremental operations and deferred adds
+                                // but not applied yet
+        int refCount;           // number of trees sharing the account
+    } TreeMemoryAccount;
+    
+    // A tag add or remove waiting to be applied below a node
     typedef struct {
+        bool add;
+        char* tag;
+        TreePosition start;     // in the same frame as the node's children
+        TreePosition end;
+        size_t reservedBytes;   // growth reserved for applying it at its node
+    } DeferredTag;
+    
+    // Tags a node has yet to apply to its children, oldest first. They are
+    // applied when an edit next reaches the node's children; queries lay them
+    // over the children instead.
+    typedef struct DeferredTags {
+        DeferredTag* entries;
+        int count;
+        int capacity;
+        TreeMemoryAccount* account;  // account charged for applying them
+    } DeferredTags;
+    
+    // Options for enableNodeArena
+    typedef enum {
+        ARENA_HUGE_PAGES = 1,   // ask for transparent huge pages with madvise
+        ARENA_NUMA_LOCAL = 2    // bind each chunk to the NUMA node of the thread that maps it
+    } NodeArenaFlags;
+    
+    // Node memory carved from aligned NODE_ARENA_CHUNK chunks instead of the heap.
+    // Freed nodes go to the block caches, so chunks are never unmapped.
+    typedef struct {
+        bool enabled;
+        int flags;
+        pthread_mutex_t lock;
+        char* unused[MAX_NUMA_NODES];             // start of the unused part of the newest chunk
+        char* unusedEnd[MAX_NUMA_NODES];
+        size_t bytesMapped;
+    } NodeArena;
+    
+    // Free blocks of one size, linked through their first word
+    typedef struct {
+        void* first;
+        int count;
+    } BlockList;
+    
+    // Free nodes and children arrays kept by one thread, so a thread's edits
+    // recycle them without locks or atomics
+    typedef struct {
+        BlockList lists[NUM_BLOCK_CLASSES];
+        bool registered;        // whether the thread exit handler will flush the cache
+    } BlockCache;
+    
+    // Batches of NODE_CACHE_BATCH free blocks traded between thread caches.
+    // There is one depot per NUMA node when the arena is NUMA local.
+    typedef struct {
+        pthread_mutex_t lock;
+        BlockList* batches[NUM_BLOCK_CLASSES];
+        int numBatches[NUM_BLOCK_CLASSES];
+        int capacity[NUM_BLOCK_CLASSES];
+    } BlockDepot;
+    
+    // Limits for one step of an incremental operation; 0 leaves a limit off
+    typedef struct {
+        int maxNodes;               // nodes the step may visit
+        uint64_t maxNanoseconds;    // time the step may take
+    } WorkBudget;
+    
+    // Kind of incremental operation
+    typedef enum {
+        OPERATION_ADD_TAG,
+        OPERATION_REMOVE_TAG,
+        OPERATION_COMPACT
+    } OperationKind;
+    
+    // An add, remove or compaction applied a piece of [cursor,end) at a time.
+    // Until it is done, hasTag and tagsAt overlay the part not yet applied, and
+    // insertText and deleteText move the range along with the text.
+    typedef struct {
+        OperationKind kind;
+        uint64_t id;
+        char* tag;                  // NULL for compaction
+        TreePosition start;         // where the operation began
+        TreePosition cursor;        // everything before cursor has been applied
+        TreePosition end;
+        TreePosition pieceLength;   // positions the next piece covers
+        size_t reservedBytes;       // admitted growth the pieces have not taken yet
+    } TreeOperation;
+    
+    // Structure for the tree
+    typedef struct TaggedIntervalTree {
         IntervalNode* root;
+        ChangeSubscriber* subscribers;  // change subscribers, NULL if none
+        TreeMemoryAccount* account;     // memory charged to this tree
+        unsigned char* blob;            // encoded nodes while hibernated, NULL when resident
+        size_t blobSize;                // size of the blob in bytes
+        struct TaggedIntervalTree* lruPrev;  // more recently used resident tree
+        struct TaggedIntervalTree* lruNext;  // less recently used resident tree
+        pthread_t lruThread;            // thread that used the tree last
+        struct ReplicationLog* log;     // log of the mutations for followers, NULL if none
+        TreeOperation* pending;         // incremental operation in progress, NULL if none
+        uint64_t operationCount;        // incremental operations started, for their ids
+        bool hasDeferredTags;           // whether nodes may hold deferred tags
+        struct TreeTask* task;          // task working on the tree, NULL if none
     } TaggedIntervalTree;
     
+    // Handle for resuming an incremental operation. It goes stale once the
+    // operation is done, whether a step finished it or another call settled it.
+    typedef struct {
+        TaggedIntervalTree* tree;
+        uint64_t operation;         // 0 once there is nothing left to do
+    } TreeContinuation;
+    
+    // Kind of mutation recorded in a replication log
+    typedef enum {
+        LOG_ADD_TAG,
+        LOG_REMOVE_TAG,
+        LOG_INSERT_TEXT,
+        LOG_DELETE_TEXT
+    } LogEntryKind;
+    
+    // Structure for a logged mutation. Text edits have an empty tag and give the
+    // range [start,end) that was inserted or deleted.
+    typedef struct {
+        LogEntryKind kind;
+        char tag[MAX_TAG_LENGTH];
+        TreePosition start;
+        TreePosition end;
+    } LogEntry;
+    
+    // Structure for the sequenced mutation log of a leader tree. Entry i has the
+    // sequence firstSequence + i; entries every follower has applied can be trimmed.
+    typedef struct ReplicationLog {
+        TaggedIntervalTree* leader;
+        LogEntry* entries;
+        size_t count;
+        size_t capacity;
+        uint64_t firstSequence;     // sequence of entries[0]
+        struct ReplicaFollower* followers;  // followers reading the log in process
+    } ReplicationLog;
+    
+    // Structure for a follower replica: a copy of the leader and the next entry to apply
+    typedef struct ReplicaFollower {
+        TaggedIntervalTree* tree;
+        ReplicationLog* log;        // log read in process, NULL for a follower fed batches
+        uint64_t nextSequence;      // sequence of the first entry not yet applied
+        uint64_t knownSequence;     // end of the leader's log as last seen by the follower
+        struct ReplicaFollower* next;
+    } ReplicaFollower;
+    
+    // Structure for a node in a shared segment. Nodes are stored breadth first, so
+    // children are contiguous and always follow their parent.
+    typedef struct {
+        TreePosition start;
+        TreePosition end;
+        uint32_t tagOffset;     // offset of the tag in the buffer, 0 for no tag
+        uint32_t firstChild;    // index of the first child
+        uint32_t numChildren;
+    } SharedNode;
+    
+    // Structure for one of the two snapshot buffers of a shared segment
+    typedef struct {
+        _Atomic uint32_t sequence;  // odd while the writer rewrites the buffer
+        uint32_t numNodes;
+        uint64_t offset;            // start of the buffer in the segment
+        uint64_t size;              // bytes used: nodes, then tag strings
+    } SharedBuffer;
+    
+    // Structure at the start of a shared segment. The writer fills the inactive
+    // buffer and then flips activeBuffer; readers validate the buffer's sequence.
+    typedef struct {
+        uint32_t magic;
+        _Atomic uint32_t activeBuffer;
+        uint64_t bufferCapacity;    // bytes available to each buffer
+        SharedBuffer buffers[2];
+    } SharedTreeHeader;
+    
+    // Structure for a process's mapping of a shared segment
+    typedef struct {
+        SharedTreeHeader* header;
+        size_t mappedSize;
+        bool writable;
+    } SharedTree;
+    
+    // Structure for a tagged span read from a shared segment
+    typedef struct {
+        char tag[MAX_TAG_LENGTH];
+        TreePosition start;
+        TreePosition end;
+    } SharedTagSpan;
+    
+    // Structure for an open span of a tree builder
+    typedef struct {
+        char tag[MAX_TAG_LENGTH];
+        IntervalNode* node;     // the span's node, attached to its parent once closed
+        bool transparent;       // repeats the tag of an enclosing span; node is the parent's
+    } BuilderSpan;
+    
+    // Structure for building a tree from well-nested spans given in document order
+    typedef struct {
+        TaggedIntervalTree* tree;
+        BuilderSpan* open;      // open spans, the root at the bottom
+        int depth;
+        int capacity;
+    } TreeBuilder;
+    
+    // Unit of a text position. Tree positions are UTF-8 bytes.
+    typedef enum {
+        UNIT_BYTE,
+        UNIT_UTF16,
+        UNIT_CODE_POINT
+    } PositionUnit;
+    
+    // Structure for the offsets of one character boundary in each unit
+    typedef struct {
+        TreePosition byte;
+        TreePosition utf16;
+        TreePosition codePoint;
+    } TextCheckpoint;
+    
+    // Structure for translating positions in a UTF-8 text: a checkpoint at the first
+    // character boundary at or before every TEXT_INDEX_CHUNK bytes, and one at the end
+    typedef struct {
+        const char* text;       // indexed text, not owned
+        TreePosition length;  // length in bytes
+        TextCheckpoint* checkpoints;
+        int numCheckpoints;
+    } TextIndex;
+    
+    // Structure for the line starts of a tree's text. Line 0 starts at the root's
+    // start; every later line start is a tracked position just after a newline.
+    typedef struct {
+        TaggedIntervalTree* tree;
+        TrackedPosition** lineStarts;   // starts of lines 1 and on, in order
+        int numLines;                   // number of lines, at least 1
+        int capacity;                   // capacity of lineStarts
+    } LineIndex;
+    
+    // Callback for a tagged span on one line; columns are byte offsets in the line
+    typedef void (*LineSpanCallback)(int line, const char* tag, TreePosition startColumn, TreePosition endColumn, 
+                                     void* context);
+    
+    // Structure for a tagged span clipped to a line, while queryLines sorts them
+    typedef struct {
+        int line;
+        int order;              // DFS order, so enclosing spans come first
+        const char* tag;
+        TreePosition start;
+        TreePosition end;
+    } LineSpan;
+    
+    // Structure for a growing byte buffer used to encode hibernated trees
+    typedef struct {
+        unsigned char* data;
+        size_t size;
+        size_t capacity;
+    } BlobWriter;
+    
+    // Structure for reading an encoded tree
+    typedef struct {
+        const unsigned char* data;
+        size_t pos;
+        size_t size;            // reads past it leave pos beyond size
+    } BlobReader;
+    
+    // Chunk of the nodes a hibernate task encodes, linked so they are never copied
+    // to make room
+    typedef struct BlobChunk {
+        struct BlobChunk* next;
+        size_t size;
+        unsigned char bytes[HIBERNATE_CHUNK];
+    } BlobChunk;
+    
+    // Structure for the interned tags of a tree being encoded
+    typedef struct {
+        const char** tags;
+        int count;
+        int capacity;
+    } TagTable;
+    
+    // Structure for tag markers
+    typedef struct {
+        TreePosition position;
+        char* tag;
+        bool isOpening;
+        int order;              // index of the node, lower for a node than for those inside it
+    } TagMarker;
+    
+    // Chunk of the markers a format task collects, linked so they are never copied
+    // to make room
+    typedef struct MarkerChunk {
+        struct MarkerChunk* next;
+        int count;
+        TagMarker markers[FORMAT_MARKER_CHUNK];
+    } MarkerChunk;
+    
+    // Block of the tag copies a format task's markers point into, freed whole
+    typedef struct TagBlock {
+        struct TagBlock* next;
+        size_t size;
+        size_t used;
+        char bytes[];
+    } TagBlock;
+    
+    // Structure for formatted text being written
+    typedef struct {
+        char* data;
+        size_t size;
+        size_t capacity;
+    } FormattedBuffer;
+    
+    // Stage of rendering markers into text
+    typedef enum {
+        RENDER_MEASURE_TEXT,    // finding the end of the text
+        RENDER_PLACE_MARKERS,   // moving markers off UTF-8 continuation bytes
+        RENDER_SORT_MARKERS,    // merge sorting the markers by position
+        RENDER_WRITE_TEXT,      // copying the text and writing the tags
+        RENDER_DONE
+    } RenderStage;
+    
+    // Markers being rendered into text a few at a time. Tags the rendering owns are
+    // freed once written.
+    typedef struct {
+        RenderStage stage;
+        const char* text;
+        TreePosition textLength;    // measured so far, then the whole text
+        TreePosition textPosition;  // text copied so far
+        TagMarker* markers;
+        TagMarker* sorted;          // target of the merge pass under way
+        MarkerChunk* chunks;        // markers not yet gathered into markers
+        int chunkMarker;            // next marker of the first chunk
+        bool ownsTags;              // whether the tags are freed as they are written
+        int markerCount;
+        int nextMarker;             // next marker to place or write
+        int width;                  // length of the sorted runs being merged
+        int mergeStart;             // first marker of the pair of runs being merged
+        int left;                   // next marker of each run, and the next slot to fill
+        int right;
+        int out;
+        int released;               // markers whose pages have been given back
+        TagMarker* tagStack;        // the markers of the open tags, which free owned tags on closing
+        int stackSize;
+        FormattedBuffer buffer;
+    } FormatRender;
+    
+    // Kind of resumable task
+    typedef enum {
+        TASK_FORMAT_TEXT,
+        TASK_PARSE_MARKUP,
+        TASK_HIBERNATE,
+        TASK_COMPACT
+    } TreeTaskKind;
+    
+    // A depth-first walk over a tree that can stop after any node and resume
+    typedef struct {
+        IntervalNode** nodes;   // path from the root
+        int* next;              // index of the next child to visit at each depth
+        int depth;
+        int capacity;
+    } TreeWalk;
+    
+    // A long call run a step at a time by runTreeTask, so an event loop can
+    // interleave it with other work. Results go where the start call was told
+    // once the task is done, and stay NULL if it was cancelled.
+    typedef struct TreeTask {
+        TreeTaskKind kind;
+        TaggedIntervalTree* tree;   // tree the task still reads or changes, NULL once it is through with it
+        bool done;
+        TreeWalk walk;
+        
+        // Formatting: the markers collected so far and the copies of their tags,
+        // then their rendering
+        const char* text;
+        MarkerChunk* chunks;
+        MarkerChunk* lastChunk;
+        int markerCount;
+        TagBlock* tagBlocks;
+        char* lastTag;              // last tag copied, which the next node may share
+        char** formatted;
+        FormatRender render;
+        
+        // Parsing: the input consumed so far and the tree built from it
+        const char* input;
+        size_t length;
+        size_t pos;
+        char* plain;
+        size_t plainLength;
+        TreeBuilder* builder;
+        TaggedIntervalTree** parsed;
+        char** plainText;
+        
+        // Hibernation: the nodes encoded so far, then the blob they are copied into,
+        // then the nodes the blob replaced, held as the children of a node of the
+        // task's own until they are freed
+        BlobWriter nodes;           // the last chunk, which never grows
+        BlobChunk* blobChunks;
+        BlobChunk* lastBlobChunk;
+        size_t encodedSize;
+        BlobWriter blob;
+        TagTable tags;
+        IntervalNode detached;
+        
+        // Compaction
+        TreeContinuation continuation;
+    } TreeTask;
+    
+    // Format of a tree dump
+    typedef enum {
+        DUMP_TEXT,      // one line per node, indented by depth, as treeToString
+        DUMP_JSON,      // nested objects with each node's depth and fanout
+        DUMP_DOT        // Graphviz digraph with nodes labelled by depth and fanout
+    } DumpFormat;
+    
+    // Callback that receives a dump a piece at a time
+    typedef void (*DumpCallback)(const char* data, size_t length, void* context);
+    
+    // Structure for a dump in progress, staged so the callback sees large pieces
+    typedef struct {
+        char data[DUMP_BUFFER_SIZE];
+        size_t length;
+        DumpCallback callback;
+        void* context;
+    } DumpBuffer;
+    
+    #ifdef TAG_TREE_LATENCY_STATS
+    // Operations whose latency is recorded
+    typedef enum {
+        LATENCY_ADD_TAG,
+        LATENCY_REMOVE_TAG,
+        LATENCY_HAS_TAG,
+        LATENCY_FORMAT_TEXT,
+        NUM_LATENCY_OPERATIONS
+    } LatencyOperation;
+    
+    // Structure for a timer that LATENCY_SCOPE records when it goes out of scope
+    typedef struct {
+        LatencyOperation operation;
+        uint64_t begin;         // ticks when the operation started
+    } LatencyTimer;
+    
+    // Structure for one thread's latency counts; only that thread writes them
+    typedef struct ThreadLatency {
+        _Atomic uint64_t counts[NUM_LATENCY_OPERATIONS][NUM_LATENCY_BUCKETS];
+        struct ThreadLatency* next;
+    } ThreadLatency;
+    
+    // Structure for a snapshot of one operation's latencies, merged over threads
+    typedef struct {
+        uint64_t counts[NUM_LATENCY_BUCKETS];
+        uint64_t total;
+        double nanosecondsPerTick;
+    } LatencyHistogram;
+    #endif
+    
+    // Structure for the two halves of a split tree
+    typedef struct {
+        TaggedIntervalTree* left;
+        TaggedIntervalTree* right;
+    } TreeSplitResult;
+    
     // Function prototypes
-    IntervalNode* createIntervalNode(int start, int end, const char* tag);
+    IntervalNode* createIntervalNode(TreePosition start, TreePosition end, const char* tag);
     void freeIntervalNode(IntervalNode* node);
-    TaggedIntervalTree* createTaggedIntervalTree(int start, int end);
+    TaggedIntervalTree* createTaggedIntervalTree(TreePosition start, TreePosition end);
     void freeTaggedIntervalTree(TaggedIntervalTree* tree);
     char* intervalNodeToString(IntervalNode* node, int indent);
     char* treeToString(TaggedIntervalTree* tree);
-    int findInsertionPoint(IntervalNode** children, int numChildren, int start);
-    bool tryMergeWithNeighbors(IntervalNode* node, int newStart, int newEnd, const char* tag);
-    void addTag(TaggedIntervalTree* tree, const char* tag, int start, int end);
-    void addTagDFS(IntervalNode* node, const char* tag, int start, int end);
-    bool removeTag(TaggedIntervalTree* tree, const char* tag, int start, int end);
-    RemoveResult removeTagDFS(IntervalNode* node, const char* tag, int start, int end);
-    bool hasTag(TaggedIntervalTree* tree, const char* tag, int start, int end);
-    bool checkTagDFS(IntervalNode* node, const char* tag, int start, int end);
+    void dumpTree(TaggedIntervalTree* tree, DumpFormat format, DumpCallback callback, void* context);
+    void dumpTreeToFile(TaggedIntervalTree* tree, DumpFormat format, FILE* file);
+    char* dumpTreeToString(TaggedIntervalTree* tree, DumpFormat format);
+    #ifdef TAG_TREE_LATENCY_STATS
+    void collectLatencyStats(LatencyHistogram* histograms);
+    void mergeLatencyHistograms(LatencyHistogram* into, const LatencyHistogram* from);
+    uint64_t getLatencyPercentile(const LatencyHistogram* histogram, double percentile);
+    void dumpLatencyStats(const LatencyHistogram* histograms, DumpFormat format, DumpCallback callback, void* context);
+    const char* latencyOperationName(LatencyOperation operation);
+    #endif
+    int findInsertionPoint(IntervalNode** children, int numChildren, TreePosition start);
+    int countChildrenBefore(IntervalNode** children, int numChildren, TreePosition start);
+    bool tryMergeWithNeighbors(IntervalNode* node, TreePosition newStart, TreePosition newEnd, const char* tag);
+    TreeStatus addTag(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end);
+    void addTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end);
+    size_t measureTagGaps(IntervalNode* node, const char* tag, TreePosition start, TreePosition end, 
+                          TreePosition shift, size_t limit);
+    bool removeTag(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end);
+    RemoveResult removeTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end);
+    bool hasTag(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end);
+    bool checkTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end);
+    bool checkSettledTag(IntervalNode* node, TreeOperation* operation, const char* tag, TreePosition start, 
+                         TreePosition end);
+    IntervalNode* copySettledRange(IntervalNode* node, TreeOperation* operation, TreePosition start, 
+                                   TreePosition end);
+    IntervalNode* copyNodeRange(IntervalNode* node, TreePosition start, TreePosition end);
+    void hasTagBatch(TaggedIntervalTree* tree, const TagQuery* queries, int numQueries, bool* results);
+    IntervalNode* stepTagQuery(IntervalNode* node, const TagQuery* query, TreePosition* shift, bool* found);
+    void tagsAt(TaggedIntervalTree* tree, TreePosition pos, TagsAt* out);
+    void collectTagsAt(IntervalNode* node, TreePosition pos, TagsAt* out);
+    void overlayDeferredTagsAt(DeferredTags* deferred, TreePosition pos, TagsAt* tags, int first);
+    void tagsAtBatch(TaggedIntervalTree* tree, const TreePosition* positions, int numPositions, 
+                     TagsAtAnswers* out);
+    void freeTagsAt(TagsAt* tags);
+    void freeTagsAtAnswers(TagsAtAnswers* answers);
+    IntervalNode* findChildContaining(IntervalNode* node, TreePosition pos);
+    void appendTagsAt(TagsAt* tags, const char* tag);
+    bool startLanePosition(TagsAtLane* lane, IntervalNode* root, const PositionSlot* slots);
+    void pushLaneNode(TagsAtLane* lane, IntervalNode* node, TreePosition shift);
+    int comparePositionSlots(const void* a, const void* b);
     char* getFormattedText(TaggedIntervalTree* tree, const char* text);
+    TaggedIntervalTree* extractSlice(TaggedIntervalTree* tree, TreePosition start, TreePosition end);
+    TreeStatus pasteSlice(TaggedIntervalTree* tree, TreePosition pos, TaggedIntervalTree* slice);
+    TreeSplitResult splitTree(TaggedIntervalTree* tree, TreePosition pos);
+    TreeStatus concatTrees(TaggedIntervalTree* a, TaggedIntervalTree* b);
+    void insertText(TaggedIntervalTree* tree, TreePosition pos, TreePosition len);
+    void deleteText(TaggedIntervalTree* tree, TreePosition pos, TreePosition len);
+    SpanHandle* addTagWithHandle(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end);
+    bool getSpanHandleInterval(SpanHandle* handle, TreePosition* start, TreePosition* end);
+    bool removeTagByHandle(TaggedIntervalTree* tree, SpanHandle* handle);
+    void releaseSpanHandle(SpanHandle* handle);
+    Anchor* createAnchor(TaggedIntervalTree* tree, TreePosition pos, PositionGravity gravity, void* data);
+    bool getAnchorPosition(Anchor* anchor, TreePosition* pos);
+    void* getAnchorData(Anchor* anchor);
+    void moveAnchor(TaggedIntervalTree* tree, Anchor* anchor, TreePosition pos);
+    Anchor** getAnchorsInRange(TaggedIntervalTree* tree, TreePosition start, TreePosition end, int* count);
+    void releaseAnchor(Anchor* anchor);
+    ChangeSubscriber* subscribeChanges(TaggedIntervalTree* tree, int capacity);
+    void unsubscribeChanges(TaggedIntervalTree* tree, ChangeSubscriber* subscriber);
+    int drainChanges(ChangeSubscriber* subscriber, ChangeRecord* records, int maxRecords, 
+                     bool* overflowed);
+    size_t getTreeMemoryUsage(TaggedIntervalTree* tree);
+    size_t getTreePeakMemoryUsage(TaggedIntervalTree* tree);
+    void setTreeMemoryLimit(TaggedIntervalTree* tree, size_t limit);
+    void hibernateTree(TaggedIntervalTree* tree);
+    TreeStatus addTagIncremental(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end, 
+                                 WorkBudget budget, TreeContinuation* continuation);
+    TreeContinuation removeTagIncremental(TaggedIntervalTree* tree, const char* tag, TreePosition start, 
+                                          TreePosition end, WorkBudget budget);
+    TreeContinuation compactTreeIncremental(TaggedIntervalTree* tree, WorkBudget budget);
+    bool resumeTreeOperation(TreeContinuation* continuation, WorkBudget budget);
+    void finishTreeOperation(TreeContinuation* continuation);
+    bool isTreeOperationPending(TreeContinuation continuation);
+    void compactTree(TaggedIntervalTree* tree);
+    TreeTask* startFormatTask(TaggedIntervalTree* tree, const char* text, char** formatted);
+    TreeTask* startParseTask(const char* input, size_t len, TaggedIntervalTree** tree, char** plainText);
+    TreeTask* startHibernateTask(TaggedIntervalTree* tree);
+    TreeTask* startCompactTask(TaggedIntervalTree* tree);
+    bool runTreeTask(TreeTask* task, WorkBudget budget);
+    bool isTreeTaskDetached(TreeTask* task);
+    void cancelTreeTask(TreeTask* task);
+    void freeTreeTask(TreeTask* task);
+    SharedTree* createSharedTree(const char* name, size_t bufferCapacity);
+    SharedTree* openSharedTree(const char* name);
+    void closeSharedTree(SharedTree* shared);
+    void removeSharedTree(const char* name);
+    TreeStatus publishSharedTree(SharedTree* shared, TaggedIntervalTree* tree);
+    bool sharedHasTag(SharedTree* shared, const char* tag, TreePosition start, TreePosition end);
+    int sharedTagsInRange(SharedTree* shared, TreePosition start, TreePosition end, SharedTagSpan* spans, int maxSpans);
+    char* sharedFormattedText(SharedTree* shared, const char* text);
+    bool isTreeHibernated(TaggedIntervalTree* tree);
+    void setResidentBudget(size_t bytes);
+    size_t getResidentBytes(void);
+    bool enableNodeArena(int flags);
+    size_t getNodeArenaBytes(void);
+    ReplicationLog* startReplicationLog(TaggedIntervalTree* tree);
+    void stopReplicationLog(TaggedIntervalTree* tree);
+    uint64_t getLogSequence(ReplicationLog* log);
+    void trimReplicationLog(ReplicationLog* log, uint64_t sequence);
+    ReplicaFollower* createFollower(ReplicationLog* log);
+    ReplicaFollower* createDetachedFollower(TreePosition start, TreePosition end, uint64_t sequence);
+    void freeFollower(ReplicaFollower* follower);
+    int applyLogBatch(ReplicaFollower* follower, int maxEntries);
+    uint64_t getFollowerLag(ReplicaFollower* follower);
+    TaggedIntervalTree* readFollower(ReplicaFollower* follower, uint64_t maxLag);
+    unsigned char* encodeLogBatch(ReplicationLog* log, uint64_t fromSequence, int maxEntries, 
+                                  size_t* size);
+    int applyEncodedBatch(ReplicaFollower* follower, const unsigned char* data, size_t size);
+    TreeBuilder* beginTreeBuilder(TreePosition start);
+    void openBuilderSpan(TreeBuilder* builder, const char* tag, TreePosition pos);
+    void closeBuilderSpan(TreeBuilder* builder, const char* tag, TreePosition pos);
+    TaggedIntervalTree* finishTreeBuilder(TreeBuilder* builder, TreePosition end);
+    TreePosition parseTaggedText(const char* input, size_t len, TaggedIntervalTree** tree, char** plainText);
+    TextIndex* buildTextIndex(const char* text, TreePosition length);
+    void freeTextIndex(TextIndex* index);
+    TreePosition translatePosition(TextIndex* index, TreePosition pos, PositionUnit from, PositionUnit to);
+    TreeStatus addTagInUnit(TaggedIntervalTree* tree, TextIndex* index, const char* tag, TreePosition start, 
+                            TreePosition end, PositionUnit unit);
+    bool removeTagInUnit(TaggedIntervalTree* tree, TextIndex* index, const char* tag, TreePosition start, 
+                         TreePosition end, PositionUnit unit);
+    bool hasTagInUnit(TaggedIntervalTree* tree, TextIndex* index, const char* tag, TreePosition start, 
+                      TreePosition end, PositionUnit unit);
+    LineIndex* createLineIndex(TaggedIntervalTree* tree, const char* text, TreePosition length);
+    void freeLineIndex(LineIndex* index);
+    void insertLineText(LineIndex* index, TreePosition pos, const char* text, TreePosition length);
+    void deleteLineText(LineIndex* index, TreePosition pos, TreePosition length);
+    int getLineCount(LineIndex* index);
+    TreePosition getLineStart(LineIndex* index, int line);
+    int getLineOfPosition(LineIndex* index, TreePosition pos);
+    int queryLines(LineIndex* index, int firstLine, int lastLine, LineSpanCallback callback, 
+                   void* context);
+    
+    // Helper functions for dumps
+    void dumpSubtree(IntervalNode* node, int indent, DumpFormat format, DumpBuffer* buffer);
+    void dumpNode(IntervalNode* node, int depth, size_t id, size_t parentId, int indent, DumpFormat format, 
+                  DumpBuffer* buffer);
+    void writeDump(DumpBuffer* buffer, const char* data, size_t length);
+    void writeDumpf(DumpBuffer* buffer, const char* format, ...);
+    void writeDumpEscaped(DumpBuffer* buffer, const char* text, DumpFormat format);
+    void flushDump(DumpBuffer* buffer);
+    void writeDumpToFile(const char* data, size_t length, void* context);
+    void writeDumpToBlob(const char* data, size_t length, void* context);
+    
+    #ifdef TAG_TREE_LATENCY_STATS
+    // Helper functions for latency histograms
+    void recordLatency(LatencyTimer* timer);
+    int latencyBucket(uint64_t ticks);
+    uint64_t latencyBucketStart(int bucket);
+    ThreadLatency* registerThreadLatency(void);
+    void retireThreadLatency(void* latency);
+    void createLatencyKey(void);
+    #endif
     
     // Helper functions for dynamic arrays
     void addChildToNode(IntervalNode* node, IntervalNode* child);
+    void insertChildAt(IntervalNode* node, int index, IntervalNode* child);
     void addNodeToRehookList(RehookNodeList* list, IntervalNode* node);
     void freeRehookNodeList(RehookNodeList* list);
     RehookNodeList createRehookNodeList();
     
+    // Helper functions for lazy shifting and structural edits
+    void pushDownShift(IntervalNode* node);
+    void settleNode(IntervalNode* node);
+    void settleNodeRange(IntervalNode* node, TreePosition start, TreePosition end);
+    void shiftIntervalNode(IntervalNode* node, TreePosition delta);
+    void freeIntervalNodeShell(IntervalNode* node);
+    IntervalNode* splitIntervalNode(IntervalNode* node, TreePosition pos);
+    void splitChildAt(IntervalNode* node, TreePosition pos);
+    void liftChildren(IntervalNode* node, int index);
+    int spliceChildren(IntervalNode* node, int index, IntervalNode** nodes, int count);
+    int compareNodeStarts(const void* a, const void* b);
+    void concatIntervalNodes(IntervalNode* left, IntervalNode* right);
+    void mergeSeamAt(IntervalNode* node, int index);
+    void settleSeamPath(IntervalNode* node, TreePosition pos);
+    void mergeSeamsAt(IntervalNode* node, TreePosition pos);
+    void copyClippedChildren(IntervalNode* dest, IntervalNode* src, TreePosition start, TreePosition end, TreePosition delta);
+    void insertGapDFS(IntervalNode* node, TreePosition pos, TreePosition len);
+    void deleteRangeDFS(IntervalNode* node, TreePosition start, TreePosition end);
+    TreePosition mapDeletedPosition(TreePosition pos, TreePosition start, TreePosition end);
+    
+    // Helper functions for deferred tags
+    void deferTag(TaggedIntervalTree* tree, bool add, const char* tag, TreePosition start, TreePosition end);
+    void queueDeferredTag(IntervalNode* node, bool add, const char* tag, TreePosition start, TreePosition end);
+    void appendDeferredTag(DeferredTags** list, IntervalNode* node, bool add, const char* tag, 
+                           TreePosition start, TreePosition end);
+    void moveDeferredTags(IntervalNode* from, IntervalNode* to);
+    bool hasDeferredTagsOver(IntervalNode* node, TreePosition start, TreePosition end);
+    void shiftDeferredTags(IntervalNode* node, TreePosition pos, TreePosition len);
+    void clipDeferredTags(IntervalNode* node, TreePosition start, TreePosition end);
+    void applyDeferredTags(IntervalNode* node, TreePosition from, TreePosition to);
+    void applyDeferredTagsDFS(IntervalNode* node);
+    void freeDeferredTags(DeferredTags* deferred);
+    size_t measureDeferredTags(DeferredTags* deferred);
+    size_t measureDeferredAdd(IntervalNode* node, const char* tag, TreePosition start, TreePosition end);
+    size_t estimateDeferredGrowth(IntervalNode* node, const char* tag, TreePosition start, TreePosition end);
+    bool overlapsTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end);
+    bool overlapsTagBelow(IntervalNode* node, int newer, const char* tag, TreePosition start, TreePosition end);
+    
+    // Helper functions for incremental operations
+    TreeContinuation beginTreeOperation(TaggedIntervalTree* tree, OperationKind kind, const char* tag, 
+                                        TreePosition start, TreePosition end, size_t reservedBytes, 
+                                        WorkBudget budget);
+    bool stepTreeOperation(TaggedIntervalTree* tree, WorkBudget budget);
+    void applyOperationPiece(IntervalNode* root, TreeOperation* operation, TreePosition pieceEnd);
+    void endTreeOperation(TaggedIntervalTree* tree);
+    void freeTreeOperation(TreeOperation* operation);
+    void finishPendingOperation(TaggedIntervalTree* tree);
+    void settleTree(TaggedIntervalTree* tree);
+    void shiftPendingOperation(TreeOperation* operation, TreePosition pos, TreePosition len);
+    void clipPendingOperation(TreeOperation* operation, TreePosition start, TreePosition end);
+    bool overlaysPendingTag(TreeOperation* operation, const char* tag, TreePosition start, TreePosition end);
+    void overlayTagsAt(TreeOperation* operation, TreePosition pos, TagsAt* tags, int first);
+    void compactDFS(IntervalNode* node, TreePosition from, TreePosition to);
+    void shrinkChildArray(IntervalNode* node);
+    uint64_t monotonicNanoseconds(void);
+    
+    // Helper functions for resumable tasks
+    TreeTask* createTreeTask(TreeTaskKind kind, TaggedIntervalTree* tree);
+    void attachTreeTask(TreeTask* task, TaggedIntervalTree* tree);
+    void detachTreeTask(TreeTask* task);
+    void settleTreeTask(TaggedIntervalTree* tree);
+    bool stepTreeTask(TreeTask* task, WorkBudget budget);
+    bool isTaskBudgetSpent(WorkBudget budget, size_t count, uint64_t begin);
+    bool stepFormatTask(TreeTask* task, WorkBudget budget, uint64_t begin);
+    void addTaskMarker(TreeTask* task, TreePosition position, char* tag, bool isOpening, int order);
+    char* copyTaskTag(TreeTask* task, const char* tag);
+    bool freeTaskTags(TreeTask* task, WorkBudget budget, uint64_t begin);
+    void freeTaskMarkers(TreeTask* task);
+    char* renderFormattedText(const char* text, TagMarker* markers, int markerCount);
+    void beginFormatRender(FormatRender* render, const char* text, TagMarker* markers, int markerCount);
+    void beginChunkedFormatRender(FormatRender* render, const char* text, MarkerChunk* chunks, int markerCount);
+    bool stepFormatRender(FormatRender* render, WorkBudget budget, uint64_t begin);
+    void writeMarkerRun(FormatRender* render);
+    void releaseWrittenMarkers(FormatRender* render);
+    void releasePages(const void* start, const void* end);
+    void finishFormatRender(FormatRender* render);
+    void freeFormatRender(FormatRender* render);
+    void freeMarkerTag(FormatRender* render, char* tag);
+    void appendFormatted(FormattedBuffer* buffer, const char* bytes, size_t length);
+    void appendFormattedTag(FormattedBuffer* buffer, const char* tag, bool isOpening);
+    bool closesInRun(const TagMarker* markers, int first, int last, int order);
+    bool stepParseTask(TreeTask* task, WorkBudget budget, uint64_t begin);
+    bool stepHibernateTask(TreeTask* task, WorkBudget budget, uint64_t begin);
+    void startBlobChunk(TreeTask* task);
+    void startTaskBlob(TreeTask* task);
+    void finishHibernateTask(TreeTask* task);
+    void freeBlobChunks(TreeTask* task);
+    bool freeHibernatedNodes(TreeTask* task, IntervalNode* root, WorkBudget budget, uint64_t begin, size_t count);
+    void initTreeWalk(TreeWalk* walk, IntervalNode* root);
+    IntervalNode* advanceTreeWalk(TreeWalk* walk);
+    IntervalNode* advanceTreeWalkPostOrder(TreeWalk* walk);
+    void pushTreeWalk(TreeWalk* walk, IntervalNode* node);
+    void freeTreeWalk(TreeWalk* walk);
+    
+    // Helper functions for tracked positions
+    TrackedPosition* trackPosition(TaggedIntervalTree* tree, TreePosition pos, PositionGravity gravity);
+    bool resolveTrackedPosition(TrackedPosition* tp, TreePosition* pos);
+    void releaseTrackedPosition(TrackedPosition* tp);
+    void attachTrackedPosition(IntervalNode* node, TrackedPosition* tp);
+    void appendTrackedPosition(IntervalNode* node, TrackedPosition* tp);
+    void detachTrackedPosition(TrackedPosition* tp);
+    bool ownsTrackedPosition(IntervalNode* node, TrackedPosition* tp);
+    void moveTrackedPositions(IntervalNode* from, IntervalNode* to);
+    void rehomeTrackedPositions(IntervalNode* node);
+    void shiftTrackedPositions(IntervalNode* node, TreePosition pos, TreePosition len);
+    void collapseTrackedPositions(IntervalNode* node, TreePosition start, TreePosition end);
+    void splitPositions(TrackedPosition* root, TreePosition pos, bool inclusive, 
+                        TrackedPosition** before, TrackedPosition** after);
+    TrackedPosition* joinPositions(TrackedPosition* before, TrackedPosition* after);
+    void shiftPositions(TrackedPosition* root, TreePosition delta);
+    void pushDownPositionShift(TrackedPosition* tp);
+    void settlePositionPath(TrackedPosition* tp);
+    void pinPositions(TrackedPosition* root, TreePosition pos);
+    void adoptPositions(TrackedPosition* root, IntervalNode* owner);
+    void scatterPositions(TrackedPosition* root, TreePosition delta, IntervalNode* node, 
+                          void (*place)(IntervalNode* node, TrackedPosition* tp));
+    void sinkParkedPosition(IntervalNode* root, TrackedPosition* tp);
+    uint32_t nextPositionPriority(void);
+    IntervalNode* findSpanNode(TrackedPosition* tp, const char* tag, TreePosition start, TreePosition end);
+    void freeSubtree(IntervalNode* node, IntervalNode* heir, TreePosition delta);
+    void placeTrackedPosition(TaggedIntervalTree* tree, TrackedPosition* tp, TreePosition pos);
+    void collectAnchorsDFS(IntervalNode* node, TreePosition start, TreePosition end, Anchor*** anchors, 
+                           int* count, int* capacity);
+    void collectAnchorsInTreap(TrackedPosition* tp, TreePosition start, TreePosition end, Anchor*** anchors, 
+                               int* count, int* capacity);
+    int compareAnchors(const void* a, const void* b);
+    
+    // Helper functions for change notification
+    void emitChange(TaggedIntervalTree* tree, ChangeKind kind, const char* tag, TreePosition start, TreePosition end);
+    void emitMergeChange(const char* tag, TreePosition start, TreePosition end);
+    bool coalesceChange(ChangeRecord* last, const ChangeRecord* record);
+    void freeChangeSubscribers(TaggedIntervalTree* tree);
+    
+    // Helper functions for memory accounting
+    TaggedIntervalTree* createTreeWithAccount(TreePosition start, TreePosition end, TreeMemoryAccount* account);
+    TreeMemoryAccount* enterTreeAccount(TaggedIntervalTree* tree);
+    void leaveTreeAccount(TreeMemoryAccount* previous);
+    void releaseTreeAccount(TreeMemoryAccount* account);
+    bool admitTreeGrowth(TaggedIntervalTree* tree, size_t bytes);
+    bool admitTagGrowth(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end, 
+                        size_t* growth);
+    void chargeTreeMemory(TreeMemoryAccount* account, size_t bytes);
+    IntervalNode* allocateNodeMemory(void);
+    void releaseNodeMemory(IntervalNode* node);
+    int currentNumaNode(void);
+    void mapArenaChunk(int numaNode);
+    size_t blockClassSize(int blockClass);
+    int childArrayClass(int capacity);
+    int smallBlockClass(size_t size);
+    void* allocateBlockMemory(size_t size);
+    void releaseBlockMemory(void* block, size_t size);
+    char* copyTag(const char* tag);
+    void releaseTag(char* tag);
+    void* takeBlock(int blockClass);
+    void giveBlock(int blockClass, void* block);
+    void refillBlockCache(int blockClass);
+    void flushBlockCache(int blockClass, int count);
+    void flushThreadBlockCache(void* cache);
+    void createBlockCacheKey(void);
+    int currentDepot(void);
+    void* carveBlocks(int blockClass, int count);
+    IntervalNode** allocateChildArray(int capacity);
+    void releaseChildArray(IntervalNode** children, int capacity);
+    void* accountedMalloc(size_t size);
+    void accountedFree(void* ptr, size_t size);
+    size_t measureSubtreeBytes(IntervalNode* node);
+    size_t estimateTagGrowth(const char* tag);
+    
+    // Helper functions for hibernation
+    void touchTree(TaggedIntervalTree* tree, TaggedIntervalTree* other);
+    void markTreeUsed(TaggedIntervalTree* tree);
+    void linkResidentTree(TaggedIntervalTree* tree);
+    void unlinkResidentTree(TaggedIntervalTree* tree);
+    void enforceResidentBudget(TaggedIntervalTree* keep, TaggedIntervalTree* other);
+    void lockResidentTrees(void);
+    void unlockResidentTrees(void);
+    void createLruLock(void);
+    void rehydrateTree(TaggedIntervalTree* tree);
+    void sinkTrackedPosition(IntervalNode* root, TrackedPosition* tp, TreePosition pos);
+    IntervalNode* decodeNode(BlobReader* reader, const char** tags, IntervalNode* parent, TreePosition origin);
+    int internTag(TagTable* tags, const char* tag);
+    void writeBlobByte(BlobWriter* writer, unsigned char byte);
+    void writeBlobBytes(BlobWriter* writer, const void* bytes, size_t length);
+    void writeVarint(BlobWriter* writer, uint64_t value);
+    void writeSignedVarint(BlobWriter* writer, int64_t value);
+    uint64_t readVarint(BlobReader* reader);
+    int64_t readSignedVarint(BlobReader* reader);
+    
+    // Helper functions for replication
+    void appendLogEntry(ReplicationLog* log, LogEntryKind kind, const char* tag, TreePosition start, TreePosition end);
+    void applyLogEntry(TaggedIntervalTree* tree, const LogEntry* entry);
+    void writeSequence(BlobWriter* writer, uint64_t sequence);
+    uint64_t readSequence(BlobReader* reader);
+    
+    // Helper functions for building and parsing
+    void pushBuilderSpan(TreeBuilder* builder, const char* tag, TreePosition pos);
+    void popBuilderSpan(TreeBuilder* builder, TreePosition pos);
+    size_t findMarkupStart(const char* input, size_t pos, size_t len);
+    bool isTagNameChar(char c);
+    
+    // Helper functions for position translation
+    void countTextUnits(const char* text, TreePosition start, TreePosition end, TreePosition* utf16, TreePosition* codePoints);
+    TreePosition checkpointOffset(const TextCheckpoint* checkpoint, PositionUnit unit);
+    
+    // Helper functions for line indexes
+    void addLineStarts(LineIndex* index, int line, TreePosition pos, const char* text, TreePosition length);
+    TreePosition getLineEnd(LineIndex* index, int line);
+    void collectLineSpansDFS(IntervalNode* node, const TreePosition* starts, int firstLine, int numLines, 
+                             LineSpan** spans, int* count, int* capacity);
+    int compareLineSpans(const void* a, const void* b);
+    
+    // Resident trees in least recently used order, and the bytes their nodes hold.
+    // The list is shared by all threads under lruLock, which is recursive since
+    // hibernating a tree unlinks it while the lock is held.
+    static TaggedIntervalTree* lruHead = NULL;
+    static TaggedIntervalTree* lruTail = NULL;
+    static pthread_mutex_t lruLock;
+    static pthread_once_t lruLockOnce = PTHREAD_ONCE_INIT;
+    static _Atomic size_t residentBytes = 0;
+    static _Atomic size_t residentBudget = 0;
+    
+    // Tree whose public operation is running on this thread; merges deep in the
+    // DFS helpers report to it
+    static _Thread_local TaggedIntervalTree* changeSource = NULL;
+    
+    // Node whose deferred tags are being applied on this thread; the DFS helpers
+    // defer the work again when they reach the nodes below it
+    static _Thread_local IntervalNode* deferringBelow = NULL;
+    
+    // Nodes visited on this thread by the DFS helpers that incremental operations budget
+    static _Thread_local size_t nodesVisited = 0;
+    
+    // State of this thread's generator for treap priorities
+    static _Thread_local uint32_t positionPriorityState = 2463534242u;
+    
+    #ifdef TAG_TREE_LATENCY_STATS
+    // Latency counts: this thread's, every live thread's, and those of threads that
+    // exited, with the clock readings that ticks are converted by
+    static _Thread_local ThreadLatency* threadLatency = NULL;
+    static ThreadLatency* latencyThreads = NULL;
+    static uint64_t retiredLatency[NUM_LATENCY_OPERATIONS][NUM_LATENCY_BUCKETS];
+    static pthread_mutex_t latencyLock = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_key_t latencyKey;
+    static pthread_once_t latencyKeyOnce = PTHREAD_ONCE_INIT;
+    static uint64_t latencyEpochTicks;
+    static uint64_t latencyEpochNanoseconds;
+    #endif
+    
+    // Account charged for node allocations by the operation running on this thread
+    static _Thread_local TreeMemoryAccount* currentAccount = NULL;
+    
+    // Where nodes come from; the arena can only be switched on before the first node
+    static NodeArena nodeArena = {false, 0, PTHREAD_MUTEX_INITIALIZER, {NULL}, {NULL}, 0};
+    static atomic_bool nodeMemoryUsed = false;
+    static _Thread_local int threadNumaNode = -1;
+    
+    // Free nodes and children arrays, cached per thread and traded in batches
+    static _Thread_local BlockCache blockCache;
+    static BlockDepot blockDepots[MAX_NUMA_NODES] = {[0 ... MAX_NUMA_NODES - 1] = {PTHREAD_MUTEX_INITIALIZER}};
+    static pthread_key_t blockCacheKey;
+    static pthread_once_t blockCacheKeyOnce = PTHREAD_ONCE_INIT;
+    
     // Create a new interval node
-    IntervalNode* createIntervalNode(int start, int end, const char* tag) {
-        IntervalNode* node = (IntervalNode*)malloc(sizeof(IntervalNode));
+    IntervalNode* createIntervalNode(TreePosition start, TreePosition end, const char* tag) {
+        IntervalNode* node = allocateNodeMemory();
         if (!node) {
             perror("Failed to allocate memory for IntervalNode");
             exit(EXIT_FAILURE);
@@ -88,12 +1157,7 @@
         node->interval[1] = end;
         
         if (tag) {
-            node->tag = strdup(tag);
-            if (!node->tag) {
-                perror("Failed to allocate memory for tag");
-                free(node);
-                exit(EXIT_FAILURE);
-            }
+            node->tag = copyTag(tag);
         } else {
             node->tag = NULL;
         }
@@ -101,42 +1165,93 @@
         node->children = NULL;
         node->numChildren = 0;
         node->childrenCapacity = 0;
+        node->pendingShift = 0;
+        node->parent = NULL;
+        node->positions[GRAVITY_LEFT] = NULL;
+        node->positions[GRAVITY_RIGHT] = NULL;
+        node->deferred = NULL;
         
         return node;
     }
     
-    // Free an interval node and all its children
+    // Free an interval node and all its children. Tracked positions inside the
+    // subtree move up to the parent, or are invalidated when there is none;
+    // callers that shrink the parent afterwards rehome them.
     void freeIntervalNode(IntervalNode* node) {
         if (!node) return;
         
+        freeSubtree(node, node->parent, 0);
+    }
+    
+    // Recursive helper for freeIntervalNode; delta converts the node's frame to the heir's
+    void freeSubtree(IntervalNode* node, IntervalNode* heir, TreePosition delta) {
+        delta += node->pendingShift;
+        
+        // Hand tracked positions over to the heir
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            scatterPositions(node->positions[gravity], delta, heir, heir ? appendTrackedPosition : NULL);
+            node->positions[gravity] = NULL;
+        }
+        
         // Free tag if it exists
         if (node->tag) {
-            free(node->tag);
+            releaseTag(node->tag);
         }
         
         // Free all children
         for (int i = 0; i < node->numChildren; i++) {
-            freeIntervalNode(node->children[i]);
+            freeSubtree(node->children[i], heir, delta);
         }
         
         // Free children array
         if (node->children) {
-            free(node->children);
+            releaseChildArray(node->children, node->childrenCapacity);
         }
+        freeDeferredTags(node->deferred);
         
         // Free the node itself
-        free(node);
+        releaseNodeMemory(node);
+    }
+    
+    // Create a new tagged interval tree with its own memory account
+    TaggedIntervalTree* createTaggedIntervalTree(TreePosition start, TreePosition end) {
+        return createTreeWithAccount(start, end, NULL);
     }
     
-    // Create a new tagged interval tree
-    TaggedIntervalTree* createTaggedIntervalTree(int start, int end) {
+    // Create a tree charged to an existing account, or to a new one when account is NULL
+    TaggedIntervalTree* createTreeWithAccount(TreePosition start, TreePosition end, TreeMemoryAccount* account) {
         TaggedIntervalTree* tree = (TaggedIntervalTree*)malloc(sizeof(TaggedIntervalTree));
         if (!tree) {
             perror("Failed to allocate memory for TaggedIntervalTree");
             exit(EXIT_FAILURE);
         }
         
+        if (!account) {
+            account = (TreeMemoryAccount*)calloc(1, sizeof(TreeMemoryAccount));
+            if (!account) {
+                perror("Failed to allocate memory for TreeMemoryAccount");
+                free(tree);
+                exit(EXIT_FAILURE);
+            }
+        }
+        account->refCount++;
+        tree->account = account;
+        tree->subscribers = NULL;
+        tree->blob = NULL;
+        tree->blobSize = 0;
+        tree->lruPrev = NULL;
+        tree->lruNext = NULL;
+        tree->log = NULL;
+        tree->pending = NULL;
+        tree->operationCount = 0;
+        tree->hasDeferredTags = false;
+        tree->task = NULL;
+        linkResidentTree(tree);
+        
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        chargeTreeMemory(account, sizeof(TaggedIntervalTree));
         tree->root = createIntervalNode(start, end, NULL);
+        leaveTreeAccount(previousAccount);
         
         return tree;
     }
@@ -145,59 +1260,237 @@
     void freeTaggedIntervalTree(TaggedIntervalTree* tree) {
         if (!tree) return;
         
+        if (tree->task) {
+            cancelTreeTask(tree->task);
+        }
+        if (tree->blob) {
+            tree->account->bytesUsed -= tree->blobSize;
+            free(tree->blob);
+        } else {
+            unlinkResidentTree(tree);
+        }
+        
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
         freeIntervalNode(tree->root);
+        leaveTreeAccount(previousAccount);
+        
+        endTreeOperation(tree);
+        tree->account->bytesUsed -= sizeof(TaggedIntervalTree);
+        releaseTreeAccount(tree->account);
+        freeChangeSubscribers(tree);
+        stopReplicationLog(tree);
         free(tree);
     }
     
-    // Create a string representation of an interval node
+    // Create a string representation of an interval node, indented by indent spaces
     char* intervalNodeToString(IntervalNode* node, int indent) {
         if (!node) return strdup("");
         
-        // Calculate buffer size
-        int bufferSize = 256;  // Starting size
-        for (int i = 0; i < node->numChildren; i++) {
-            bufferSize += 256;  // Add space for each child
-        }
+        BlobWriter output = {NULL, 0, 0};
+        DumpBuffer buffer = {.length = 0, .callback = writeDumpToBlob, .context = &output};
+        dumpSubtree(node, indent, DUMP_TEXT, &buffer);
+        flushDump(&buffer);
+        writeBlobByte(&output, '\0');
+        return (char*)output.data;
+    }
+    
+    // Get string representation of the tree
+    char* treeToString(TaggedIntervalTree* tree) {
+        if (!tree || !tree->root) return strdup("");
+        return dumpTreeToString(tree, DUMP_TEXT);
+    }
+    
+    // Dump a tree in one pass, handing the output to callback a piece at a time.
+    // Memory use grows with the depth of the tree, not its size.
+    void dumpTree(TaggedIntervalTree* tree, DumpFormat format, DumpCallback callback, void* context) {
+        touchTree(tree, NULL);
+        settleTree(tree);
         
-        char* result = (char*)malloc(bufferSize);
-        if (!result) {
-            perror("Failed to allocate memory for string representation");
+        DumpBuffer buffer = {.length = 0, .callback = callback, .context = context};
+        dumpSubtree(tree->root, 0, format, &buffer);
+        flushDump(&buffer);
+    }
+    
+    // Dump a tree to a file
+    void dumpTreeToFile(TaggedIntervalTree* tree, DumpFormat format, FILE* file) {
+        dumpTree(tree, format, writeDumpToFile, file);
+    }
+    
+    // Dump a tree into a malloc'd, null terminated string
+    char* dumpTreeToString(TaggedIntervalTree* tree, DumpFormat format) {
+        BlobWriter output = {NULL, 0, 0};
+        dumpTree(tree, format, writeDumpToBlob, &output);
+        writeBlobByte(&output, '\0');
+        return (char*)output.data;
+    }
+    
+    // Dump a node and everything below it in pre-order. JSON objects are closed,
+    // and DOT edges drawn, from the path the walk keeps.
+    void dumpSubtree(IntervalNode* node, int indent, DumpFormat format, DumpBuffer* buffer) {
+        TreeWalk walk;
+        initTreeWalk(&walk, node);
+        int idCapacity = walk.capacity;
+        size_t* ids = (size_t*)malloc(idCapacity * sizeof(size_t));
+        if (!ids) {
+            perror("Failed to allocate memory for dump ids");
             exit(EXIT_FAILURE);
         }
         
-        char indentStr[128];
-        for (int i = 0; i < indent; i++) {
-            indentStr[i] = ' ';
+        if (format == DUMP_DOT) {
+            writeDumpf(buffer, "digraph tagTree {\n  node [shape=box];\n");
+        }
+        ids[0] = 0;
+        size_t nextId = 1;
+        dumpNode(node, 0, ids[0], 0, indent, format, buffer);
+        
+        int previousDepth = 0;
+        IntervalNode* child;
+        while ((child = advanceTreeWalk(&walk))) {
+            int depth = walk.depth - 1;
+            if (walk.capacity > idCapacity) {
+                idCapacity = walk.capacity;
+                ids = (size_t*)realloc(ids, idCapacity * sizeof(size_t));
+                if (!ids) {
+                    perror("Failed to allocate memory for dump ids");
+                    exit(EXIT_FAILURE);
+                }
+            }
+            
+            if (format == DUMP_JSON) {
+                for (int d = previousDepth; d >= depth; d--) {
+                    writeDumpf(buffer, "]}");
+                }
+                writeDumpf(buffer, walk.next[depth - 1] > 1 ? ",\n" : "\n");
+            }
+            ids[depth] = nextId++;
+            dumpNode(child, depth, ids[depth], ids[depth - 1], indent, format, buffer);
+            previousDepth = depth;
         }
-        indentStr[indent] = '\0';
         
-        int offset = 0;
+        if (format == DUMP_JSON) {
+            for (int d = previousDepth; d >= 0; d--) {
+                writeDumpf(buffer, "]}");
+            }
+            writeDumpf(buffer, "\n");
+        } else if (format == DUMP_DOT) {
+            writeDumpf(buffer, "}\n");
+        }
+        free(ids);
+        freeTreeWalk(&walk);
+    }
+    
+    // Dump one node at depth below the dumped subtree. A JSON node is left open for
+    // its children; a DOT node below the top gets an edge from its parent.
+    void dumpNode(IntervalNode* node, int depth, size_t id, size_t parentId, int indent, DumpFormat format, 
+                  DumpBuffer* buffer) {
+        switch (format) {
+            case DUMP_TEXT:
+                writeDumpf(buffer, "%*s[%" PRIpos ",%" PRIpos "]", indent + 2 * depth, "", 
+                           node->interval[0], node->interval[1]);
+                if (node->tag) {
+                    writeDumpf(buffer, " tag: ");
+                    writeDump(buffer, node->tag, strlen(node->tag));
+                }
+                writeDumpf(buffer, "\n");
+                break;
+            case DUMP_JSON:
+                writeDumpf(buffer, "{\"start\":%" PRIpos ",\"end\":%" PRIpos ",\"tag\":", 
+                           node->interval[0], node->interval[1]);
+                if (node->tag) {
+                    writeDumpf(buffer, "\"");
+                    writeDumpEscaped(buffer, node->tag, format);
+                    writeDumpf(buffer, "\"");
+                } else {
+                    writeDumpf(buffer, "null");
+                }
+                writeDumpf(buffer, ",\"depth\":%d,\"fanout\":%d,\"children\":[", depth, node->numChildren);
+                break;
+            case DUMP_DOT:
+                writeDumpf(buffer, "  n%zu [label=\"[%" PRIpos ",%" PRIpos "]", id, node->interval[0], node->interval[1]);
+                if (node->tag) {
+                    writeDumpf(buffer, " ");
+                    writeDumpEscaped(buffer, node->tag, format);
+                }
+                writeDumpf(buffer, "\\ndepth %d, fanout %d\"];\n", depth, node->numChildren);
+                if (depth > 0) {
+                    writeDumpf(buffer, "  n%zu -> n%zu;\n", parentId, id);
+                }
+                break;
+        }
+    }
+    
+    // Append bytes to a dump, handing full buffers to its callback
+    void writeDump(DumpBuffer* buffer, const char* data, size_t length) {
+        if (buffer->length + length > DUMP_BUFFER_SIZE) {
+            flushDump(buffer);
+            if (length > DUMP_BUFFER_SIZE) {
+                buffer->callback(data, length, buffer->context);
+                return;
+            }
+        }
         
-        // Add this node
-        if (node->tag) {
-            offset += snprintf(result + offset, bufferSize - offset, 
-                              "%s[%d,%d] tag: %s\n", 
-                              indentStr, node->interval[0], node->interval[1], node->tag);
-        } else {
-            offset += snprintf(result + offset, bufferSize - offset, 
-                              "%s[%d,%d]\n", 
-                              indentStr, node->interval[0], node->interval[1]);
+        memcpy(buffer->data + buffer->length, data, length);
+        buffer->length += length;
+    }
+    
+    // Append formatted text to a dump
+    void writeDumpf(DumpBuffer* buffer, const char* format, ...) {
+        va_list args;
+        va_start(args, format);
+        size_t room = DUMP_BUFFER_SIZE - buffer->length;
+        int length = vsnprintf(buffer->data + buffer->length, room, format, args);
+        va_end(args);
+        if (length < 0 || (size_t)length < room) {
+            buffer->length += length > 0 ? length : 0;
+            return;
         }
         
-        // Add children
-        for (int i = 0; i < node->numChildren; i++) {
-            char* childStr = intervalNodeToString(node->children[i], indent + 2);
-            offset += snprintf(result + offset, bufferSize - offset, "%s", childStr);
-            free(childStr);
+        // Too long for what is left of the buffer; long indents can exceed all of it
+        char* text = (char*)malloc((size_t)length + 1);
+        if (!text) {
+            perror("Failed to allocate memory for dump text");
+            exit(EXIT_FAILURE);
+        }
+        va_start(args, format);
+        vsnprintf(text, (size_t)length + 1, format, args);
+        va_end(args);
+        writeDump(buffer, text, length);
+        free(text);
+    }
+    
+    // Append a tag to a JSON or DOT dump, escaping quotes, backslashes and control characters
+    void writeDumpEscaped(DumpBuffer* buffer, const char* text, DumpFormat format) {
+        for (const char* c = text; *c; c++) {
+            unsigned char byte = (unsigned char)*c;
+            if (byte == '"' || byte == '\\') {
+                char escaped[2] = {'\\', (char)byte};
+                writeDump(buffer, escaped, 2);
+            } else if (byte < 0x20 && format == DUMP_JSON) {
+                writeDumpf(buffer, "\\u%04x", byte);
+            } else if (byte < 0x20) {
+                writeDumpf(buffer, " ");
+            } else {
+                writeDump(buffer, c, 1);
+            }
         }
+    }
+    
+    // Hand the staged part of a dump to its callback
+    void flushDump(DumpBuffer* buffer) {
+        if (buffer->length == 0) return;
         
-        return result;
+        buffer->callback(buffer->data, buffer->length, buffer->context);
+        buffer->length = 0;
     }
     
-    // Get string representation of the tree
-    char* treeToString(TaggedIntervalTree* tree) {
-        if (!tree || !tree->root) return strdup("");
-        return intervalNodeToString(tree->root, 0);
+    // Dump callback that writes to a FILE*
+    void writeDumpToFile(const char* data, size_t length, void* context) {
+        fwrite(data, 1, length, (FILE*)context);
+    }
+    
+    // Dump callback that appends to a BlobWriter
+    void writeDumpToBlob(const char* data, size_t length, void* context) {
+        writeBlobBytes((BlobWriter*)context, data, length);
     }
     
     // Add a child to a node
@@ -205,12 +1498,11 @@
         // Expand capacity if needed
         if (node->numChildren >= node->childrenCapacity) {
             int newCapacity = node->childrenCapacity == 0 ? 4 : node->childrenCapacity * 2;
-            IntervalNode** newChildren = (IntervalNode**)realloc(node->children, 
-                                        newCapacity * sizeof(IntervalNode*));
-            if (!newChildren) {
-                perror("Failed to allocate memory for children");
-                exit(EXIT_FAILURE);
+            IntervalNode** newChildren = allocateChildArray(newCapacity);
+            if (node->numChildren > 0) {
+                memcpy(newChildren, node->children, node->numChildren * sizeof(IntervalNode*));
             }
+            releaseChildArray(node->children, node->childrenCapacity);
             
             node->children = newChildren;
             node->childrenCapacity = newCapacity;
@@ -218,27 +1510,53 @@
         
         // Add child
         node->children[node->numChildren++] = child;
+        child->parent = node;
     }
     
-    // Binary search to find insertion point
-    int findInsertionPoint(IntervalNode** children, int numChildren, int start) {
-        if (numChildren == 0) return 0;
+    // Insert a child at a given index
+    void insertChildAt(IntervalNode* node, int index, IntervalNode* child) {
+        addChildToNode(node, child);
         
-        int left = 0;
-        int right = numChildren - 1;
+        // Shift elements to make room for insertion
+        for (int j = node->numChildren - 1; j > index; j--) {
+            node->children[j] = node->children[j - 1];
+        }
         
-        while (left <= right) {
-            int mid = (left + right) / 2;
-            if (children[mid]->interval[0] == start) {
-                return mid;
-            } else if (children[mid]->interval[0] < start) {
-                left = mid + 1;
-            } else {
-                right = mid - 1;
-            }
+        node->children[index] = child;
+    }
+    
+    // Find the first child starting at or after start, which is the insertion point
+    // for a new child and the match when one starts exactly at start. Tiny nodes are
+    // scanned; otherwise a binary search halves the range with conditional moves, so
+    // the random keys of real edits cost no mispredicted branches.
+    int findInsertionPoint(IntervalNode** children, int numChildren, TreePosition start) {
+        if (numChildren <= CHILD_SCAN_LIMIT) {
+            return countChildrenBefore(children, numChildren, start);
         }
         
-        return left;
+        // Both possible probes of the next round are fetched while this one is read
+        IntervalNode** base = children;
+        int remaining = numChildren;
+        while (remaining > 1) {
+            int half = remaining / 2;
+            int nextHalf = (remaining - half) / 2;
+            PREFETCH(base[nextHalf]);
+            PREFETCH(base[half + nextHalf]);
+            base = base[half]->interval[0] < start ? base + half : base;
+            remaining -= half;
+        }
+        
+        return (int)(base - children) + (base[0]->interval[0] < start);
+    }
+    
+    // Count the children starting before start. Children are sorted by start, so
+    // the count is the lower bound; the loads are independent and need no branch.
+    int countChildrenBefore(IntervalNode** children, int numChildren, TreePosition start) {
+        int count = 0;
+        for (int i = 0; i < numChildren; i++) {
+            count += children[i]->interval[0] < start;
+        }
+        return count;
     }
     
     // Create a new rehook node list
@@ -281,7 +1599,7 @@
     }
     
     // Try to merge a new interval with existing children
-    bool tryMergeWithNeighbors(IntervalNode* node, int newStart, int newEnd, const char* tag) {
+    bool tryMergeWithNeighbors(IntervalNode* node, TreePosition newStart, TreePosition newEnd, const char* tag) {
         if (node->numChildren == 0) return false;
         
         // Find potential neighbors using binary search
@@ -290,29 +1608,50 @@
         // Check left neighbor if exists
         if (index > 0) {
             IntervalNode* leftNeighbor = node->children[index - 1];
+            
+            // The extended span must stop before the next sibling it cannot merge with
+            int limitIndex = index;
+            if (index < node->numChildren && node->children[index]->tag && tag && 
+                strcmp(node->children[index]->tag, tag) == 0) {
+                limitIndex++;
+            }
+            bool fits = limitIndex >= node->numChildren || 
+                        newEnd <= node->children[limitIndex]->interval[0];
+            
+            // Spans of the tag that already touch stay apart, as they do when the
+            // interval is added a gap at a time, so the result does not depend on
+            // where the interval was cut
+            bool touching = limitIndex > index && 
+                            leftNeighbor->interval[1] >= node->children[index]->interval[0];
+            
             if (leftNeighbor->tag && tag && strcmp(leftNeighbor->tag, tag) == 0 && 
-                leftNeighbor->interval[1] >= newStart) {
+                leftNeighbor->interval[1] >= newStart && fits && 
+                !(touching && newEnd > leftNeighbor->interval[1])) {
                 // Can merge with left neighbor
+                TreePosition leftEnd = leftNeighbor->interval[1];
                 leftNeighbor->interval[1] = leftNeighbor->interval[1] > newEnd ? 
                                            leftNeighbor->interval[1] : newEnd;
                 
-                // Check if we can also merge with right neighbor
+                // Check if we can also merge with right neighbor across the gap
                 if (index < node->numChildren) {
                     IntervalNode* rightNeighbor = node->children[index];
                     if (rightNeighbor->tag && tag && strcmp(rightNeighbor->tag, tag) == 0 && 
+                        leftEnd < rightNeighbor->interval[0] && 
                         leftNeighbor->interval[1] >= rightNeighbor->interval[0]) {
                         leftNeighbor->interval[1] = leftNeighbor->interval[1] > rightNeighbor->interval[1] ? 
                                                    leftNeighbor->interval[1] : rightNeighbor->interval[1];
                         
-                        // Move right neighbor's children to left neighbor
+                        // Move right neighbor's children and deferred tags to left neighbor
+                        pushDownShift(leftNeighbor);
+                        pushDownShift(rightNeighbor);
                         for (int i = 0; i < rightNeighbor->numChildren; i++) {
                             addChildToNode(leftNeighbor, rightNeighbor->children[i]);
                         }
+                        moveDeferredTags(rightNeighbor, leftNeighbor);
                         
                         // Free right neighbor's resources except children
-                        if (rightNeighbor->tag) free(rightNeighbor->tag);
-                        if (rightNeighbor->children) free(rightNeighbor->children);
-                        free(rightNeighbor);
+                        moveTrackedPositions(rightNeighbor, leftNeighbor);
+                        freeIntervalNodeShell(rightNeighbor);
                         
                         // Remove right neighbor from node's children
                         for (int i = index; i < node->numChildren - 1; i++) {
@@ -321,6 +1660,7 @@
                         node->numChildren--;
                     }
                 }
+                emitMergeChange(tag, leftNeighbor->interval[0], leftNeighbor->interval[1]);
                 return true;
             }
         }
@@ -329,10 +1669,12 @@
         if (index < node->numChildren) {
             IntervalNode* rightNeighbor = node->children[index];
             if (rightNeighbor->tag && tag && strcmp(rightNeighbor->tag, tag) == 0 && 
-                newEnd >= rightNeighbor->interval[0]) {
+                newEnd >= rightNeighbor->interval[0] && newEnd <= rightNeighbor->interval[1] && 
+                (index == 0 || node->children[index - 1]->interval[1] <= newStart)) {
                 // Can merge with right neighbor
                 rightNeighbor->interval[0] = rightNeighbor->interval[0] < newStart ? 
                                             rightNeighbor->interval[0] : newStart;
+                emitMergeChange(tag, rightNeighbor->interval[0], rightNeighbor->interval[1]);
                 return true;
             }
         }
@@ -340,16 +1682,43 @@
         return false;
     }
     
-    // Add a tag to an interval
-    void addTag(TaggedIntervalTree* tree, const char* tag, int start, int end) {
-        if (start >= end) return; // Invalid interval
+    // Add a tag to an interval; refused when the nodes it needs would not fit in the
+    // tree's memory limit
+    TreeStatus addTag(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end) {
+        LATENCY_SCOPE(LATENCY_ADD_TAG);
+        if (start >= end) return TREE_OK; // Invalid interval
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        
+        // A long add is deferred, so only the node it is queued at is measured
+        bool deferred = end - start >= DEFERRED_TAG_MIN_LENGTH;
+        bool admitted = deferred ? tree->account->limit == 0 || 
+                                   admitTreeGrowth(tree, measureDeferredAdd(tree->root, tag, start, end)) :
+                                   admitTagGrowth(tree, tag, start, end, NULL);
+        if (!admitted) return TREE_MEMORY_LIMIT_EXCEEDED;
+        
+        TREE_TRACE("Adding tag %s to interval [%" PRIpos ",%" PRIpos "]\n", tag, start, end);
+        emitChange(tree, CHANGE_TAG_ADDED, tag, start, end);
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        changeSource = tree;
+        if (deferred) {
+            deferTag(tree, true, tag, start, end);
+        } else {
+            addTagDFS(tree->root, tag, start, end);
+        }
+        changeSource = NULL;
+        leaveTreeAccount(previousAccount);
+        
+        if (tree->log) {
+            appendLogEntry(tree->log, LOG_ADD_TAG, tag, start, end);
+        }
+        return TREE_OK;
+    }
+    
+    // DFS helper for adding tags
+    void addTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end) {
+        nodesVisited++;
         
-        printf("Adding tag %s to interval [%d,%d]\n", tag, start, end);
-        addTagDFS(tree->root, tag, start, end);
-    }
-    
-    // DFS helper for adding tags
-    void addTagDFS(IntervalNode* node, const char* tag, int start, int end) {
         // Make sure we're working within the node's interval
         start = start > node->interval[0] ? start : node->interval[0];
         end = end < node->interval[1] ? end : node->interval[1];
@@ -359,6 +1728,14 @@
         // If this node has the same tag, we don't need to add it again
         if (node->tag && strcmp(node->tag, tag) == 0) return;
         
+        // Below a node applying its deferred tags, the add is deferred again
+        if (deferringBelow && node != deferringBelow && node->numChildren > 0) {
+            queueDeferredTag(node, true, tag, start, end);
+            return;
+        }
+        
+        settleNodeRange(node, start, end);
+        
         // If no children, create a new child with this tag
         if (node->numChildren == 0) {
             IntervalNode* newNode = createIntervalNode(start, end, tag);
@@ -374,15 +1751,15 @@
         // We need to find where to insert the new tag
         typedef struct {
             int index;
-            int start;
-            int end;
+            TreePosition start;
+            TreePosition end;
         } InsertPoint;
         
         InsertPoint* insertPoints = NULL;
         int numInsertPoints = 0;
         int insertPointsCapacity = 0;
         
-        int currentPos = start;
+        TreePosition currentPos = start;
         
         // Use binary search to find the first child that might overlap
         int i = findInsertionPoint(node->children, node->numChildren, currentPos);
@@ -420,7 +1797,8 @@
             
             // If current position overlaps with this child
             if (currentPos < child->interval[1]) {
-                // Recursively add tag to this child
+                // Recursively add tag to this child, fetching the next sibling meanwhile
+                if (i + 1 < node->numChildren) PREFETCH(node->children[i + 1]);
                 addTagDFS(child, tag, currentPos, end);
                 currentPos = child->interval[1];
             }
@@ -480,29 +1858,7 @@
             // Try to merge with neighbors first
             if (!tryMergeWithNeighbors(node, point.start, point.end, tag)) {
                 IntervalNode* newNode = createIntervalNode(point.start, point.end, tag);
-                
-                // Make space in children array
-                if (node->numChildren >= node->childrenCapacity) {
-                    int newCapacity = node->childrenCapacity == 0 ? 4 : node->childrenCapacity * 2;
-                    IntervalNode** newChildren = (IntervalNode**)realloc(node->children, 
-                                                newCapacity * sizeof(IntervalNode*));
-                    if (!newChildren) {
-                        perror("Failed to allocate memory for children");
-                        exit(EXIT_FAILURE);
-                    }
-                    
-                    node->children = newChildren;
-                    node->childrenCapacity = newCapacity;
-                }
-                
-                // Shift elements to make room for insertion
-                for (int j = node->numChildren; j > point.index; j--) {
-                    node->children[j] = node->children[j - 1];
-                }
-                
-                // Insert the new node
-                node->children[point.index] = newNode;
-                node->numChildren++;
+                insertChildAt(node, point.index, newNode);
             }
         }
         
@@ -512,21 +1868,102 @@
         }
     }
     
+    // Measure the bytes addTagDFS would allocate to fill the gaps of [start,end) below
+    // node: a node and its tag per gap, and the growth of the children arrays they
+    // join. The tree is not changed: shift is the pending shift of the ancestors,
+    // added on the way down instead of pushed. Below a node with deferred tags the
+    // children are not final, so only that level is estimated. Measuring stops once
+    // it passes limit.
+    size_t measureTagGaps(IntervalNode* node, const char* tag, TreePosition start, TreePosition end, 
+                          TreePosition shift, size_t limit) {
+        TreePosition nodeStart = node->interval[0] + shift;
+        TreePosition nodeEnd = node->interval[1] + shift;
+        start = start > nodeStart ? start : nodeStart;
+        end = end < nodeEnd ? end : nodeEnd;
+        
+        if (start >= end) return 0;
+        if (node->tag && strcmp(node->tag, tag) == 0) return 0;
+        
+        // The children are in the frame of the node's own pending shift
+        shift += node->pendingShift;
+        if (node->deferred) return estimateDeferredGrowth(node, tag, start - shift, end - shift);
+        size_t bytes = 0;
+        int gaps = 0;
+        TreePosition currentPos = start;
+        int i = findInsertionPoint(node->children, node->numChildren, currentPos - shift);
+        if (i > 0 && node->children[i - 1]->interval[1] + shift > currentPos) {
+            i--;
+        }
+        
+        for (; i < node->numChildren && currentPos < end && bytes <= limit; i++) {
+            IntervalNode* child = node->children[i];
+            TreePosition childStart = child->interval[0] + shift;
+            TreePosition childEnd = child->interval[1] + shift;
+            if (childStart >= end) break;
+            
+            // A gap before this child, then whatever the child itself needs
+            if (currentPos < childStart) {
+                gaps++;
+                currentPos = childStart;
+            }
+            bytes += measureTagGaps(child, tag, currentPos, end, shift, limit - bytes);
+            currentPos = childEnd > currentPos ? childEnd : currentPos;
+        }
+        if (currentPos < end) gaps++;
+        if (gaps == 0) return bytes;
+        
+        // The children array doubles as addChildToNode grows it
+        int capacity = node->childrenCapacity;
+        while (capacity < node->numChildren + gaps) {
+            capacity = capacity == 0 ? 4 : capacity * 2;
+        }
+        return bytes + gaps * (sizeof(IntervalNode) + strlen(tag) + 1) + 
+               (capacity - node->childrenCapacity) * sizeof(IntervalNode*);
+    }
+    
     // Remove a tag from an interval
-    bool removeTag(TaggedIntervalTree* tree, const char* tag, int start, int end) {
+    bool removeTag(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end) {
+        LATENCY_SCOPE(LATENCY_REMOVE_TAG);
         if (start >= end) return false; // Invalid interval
         
-        printf("Removing tag %s from interval [%d,%d]\n", tag, start, end);
-        RemoveResult result = removeTagDFS(tree->root, tag, start, end);
-        freeRehookNodeList(&result.rehookNodeList);
-        return result.removed;
+        TREE_TRACE("Removing tag %s from interval [%" PRIpos ",%" PRIpos "]\n", tag, start, end);
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        
+        // Removal is never refused: it is how a tree over its limit sheds memory
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        bool removed;
+        if (end - start >= DEFERRED_TAG_MIN_LENGTH) {
+            // A long removal is deferred once a span of the tag shows it removes something
+            removed = overlapsTagDFS(tree->root, tag, start, end);
+            if (removed) {
+                deferTag(tree, false, tag, start, end);
+            }
+        } else {
+            RemoveResult result = removeTagDFS(tree->root, tag, start, end);
+            freeRehookNodeList(&result.rehookNodeList);
+            removed = result.removed;
+        }
+        leaveTreeAccount(previousAccount);
+        
+        if (removed) {
+            emitChange(tree, CHANGE_TAG_REMOVED, tag, start, end);
+        }
+        
+        // Logged even when nothing was reported removed, so followers replay the same steps
+        if (tree->log) {
+            appendLogEntry(tree->log, LOG_REMOVE_TAG, tag, start, end);
+        }
+        return removed;
     }
     
     // DFS helper for removing tags
-    RemoveResult removeTagDFS(IntervalNode* node, const char* tag, int start, int end) {
+    RemoveResult removeTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end) {
+        nodesVisited++;
+        
         // Adjust interval to node boundaries
-        int effectiveStart = start > node->interval[0] ? start : node->interval[0];
-        int effectiveEnd = end < node->interval[1] ? end : node->interval[1];
+        TreePosition effectiveStart = start > node->interval[0] ? start : node->interval[0];
+        TreePosition effectiveEnd = end < node->interval[1] ? end : node->interval[1];
         
         RemoveResult result;
         result.removed = false;
@@ -539,13 +1976,36 @@
             return result;
         }
         
+        // Below a node applying its deferred tags, the removal is deferred again,
+        // unless this node's own span has to be cut
+        if (deferringBelow && node != deferringBelow && node->numChildren > 0 && 
+            !(node->tag && strcmp(node->tag, tag) == 0)) {
+            queueDeferredTag(node, false, tag, effectiveStart, effectiveEnd);
+            result.state = PROCESSED_CHILDREN;
+            return result;
+        }
+        
+        // Cutting this node's own span reads all its children; otherwise only the range
+        bool tagged = node->tag && strcmp(node->tag, tag) == 0;
+        if (tagged) {
+            settleNode(node);
+        } else {
+            settleNodeRange(node, effectiveStart, effectiveEnd);
+        }
+        
         // Check if this node has the tag to remove
-        if (node->tag && strcmp(node->tag, tag) == 0) {
-            int originalStart = node->interval[0];
-            int originalEnd = node->interval[1];
+        if (tagged) {
+            TreePosition originalStart = node->interval[0];
+            TreePosition originalEnd = node->interval[1];
             
-            // Case 1: Remove-interval is inside a tag (not touching start and end position)
-            if (effectiveStart > originalStart && effectiveEnd < originalEnd) {
+            // Case 1: Remove-interval leaves part of the tag; the parts that stay
+            // become new nodes, and the children of the removed part are rehooked
+            if (effectiveStart > originalStart || effectiveEnd < originalEnd) {
+                // Split the children straddling the ends of the removed part, so that
+                // each child lies before, inside or after it
+                if (effectiveStart > originalStart) splitChildAt(node, effectiveStart);
+                if (effectiveEnd < originalEnd) splitChildAt(node, effectiveEnd);
+                
                 // Create separate collections for children
                 IntervalNode** beforeNodes = NULL;
                 int numBeforeNodes = 0;
@@ -596,6 +2056,8 @@
                         if (childResult.removed && 
                             (childResult.state == REMOVE_ENTIRE_NODE || childResult.state == REMOVE_INTERVAL_INSIDE)) {
                             // If child is completely removed or split, add its rehook nodes
+                            moveTrackedPositions(child, node);
+                            freeIntervalNodeShell(child);
                             for (int j = 0; j < childResult.rehookNodeList.count; j++) {
                                 addNodeToRehookList(&result.rehookNodeList, childResult.rehookNodeList.nodes[j]);
                             }
@@ -673,213 +2135,7 @@
                 return result;
             }
             
-            // Case 2: Remove-interval starts at or before tag start but ends within tag
-            if (effectiveStart <= originalStart && effectiveEnd < originalEnd) {
-                // Adjust this node's interval to start at the end of the removal
-                node->interval[0] = effectiveEnd;
-                
-                // Process any children that might be affected
-                int* childrenToRemove = NULL;
-                int numChildrenToRemove = 0;
-                int childrenToRemoveCapacity = 0;
-                
-                for (int i = 0; i < node->numChildren; i++) {
-                    IntervalNode* child = node->children[i];
-                    
-                    if (child->interval[1] <= effectiveEnd) {
-                        // This child is entirely removed
-                        if (numChildrenToRemove >= childrenToRemoveCapacity) {
-                            childrenToRemoveCapacity = childrenToRemoveCapacity == 0 ? 4 : childrenToRemoveCapacity * 2;
-                            int* newArray = (int*)realloc(childrenToRemove, 
-                                           childrenToRemoveCapacity * sizeof(int));
-                            if (!newArray) {
-                                perror("Failed to allocate memory for childrenToRemove");
-                                exit(EXIT_FAILURE);
-                            }
-                            childrenToRemove = newArray;
-                        }
-                        childrenToRemove[numChildrenToRemove++] = i;
-                        freeIntervalNode(child);
-                    } else if (child->interval[0] < effectiveEnd) {
-                        // This child is partially affected
-                        RemoveResult childResult = removeTagDFS(child, tag, effectiveStart, effectiveEnd);
-                        
-                        if (childResult.removed && childResult.state == REMOVE_ENTIRE_NODE) {
-                            // Mark for removal
-                            if (numChildrenToRemove >= childrenToRemoveCapacity) {
-                                childrenToRemoveCapacity = childrenToRemoveCapacity == 0 ? 4 : childrenToRemoveCapacity * 2;
-                                int* newArray = (int*)realloc(childrenToRemove, 
-                                               childrenToRemoveCapacity * sizeof(int));
-                                if (!newArray) {
-                                    perror("Failed to allocate memory for childrenToRemove");
-                                    exit(EXIT_FAILURE);
-                                }
-                                childrenToRemove = newArray;
-                            }
-                            childrenToRemove[numChildrenToRemove++] = i;
-                            
-                            // Add any rehook nodes back to the node's children
-                            for (int j = 0; j < childResult.rehookNodeList.count; j++) {
-                                IntervalNode* rehookNode = childResult.rehookNodeList.nodes[j];
-                                if (rehookNode->interval[0] >= effectiveEnd) {
-    int insertPos = findInsertionPoint(node->children, node->numChildren, 
-                                                 rehookNode->interval[0]);
-                                    
-                                    // Make space for new node
-                                    if (node->numChildren >= node->childrenCapacity) {
-                                        int newCapacity = node->childrenCapacity == 0 ? 4 : node->childrenCapacity * 2;
-                                        IntervalNode** newChildren = (IntervalNode**)realloc(node->children, 
-                                                                    newCapacity * sizeof(IntervalNode*));
-                                        if (!newChildren) {
-                                            perror("Failed to allocate memory for children");
-                                            exit(EXIT_FAILURE);
-                                        }
-                                        node->children = newChildren;
-                                        node->childrenCapacity = newCapacity;
-                                    }
-                                    
-                                    // Shift elements to make room
-                                    for (int k = node->numChildren; k > insertPos; k--) {
-                                        node->children[k] = node->children[k - 1];
-                                    }
-                                    
-                                    node->children[insertPos] = rehookNode;
-                                    node->numChildren++;
-                                }
-                            }
-                        }
-                        
-                        // Free the rehook list structure but not its nodes
-                        free(childResult.rehookNodeList.nodes);
-                    }
-                }
-                
-                // Remove affected children (in reverse order to not mess up indices)
-                for (int i = numChildrenToRemove - 1; i >= 0; i--) {
-                    int index = childrenToRemove[i];
-                    
-                    // Shift elements to remove the node
-                    for (int j = index; j < node->numChildren - 1; j++) {
-                        node->children[j] = node->children[j + 1];
-                    }
-                    node->numChildren--;
-                }
-                
-                // Free temporary array
-                if (childrenToRemove) free(childrenToRemove);
-                
-                result.removed = true;
-                result.state = REMOVE_INTERVAL_LEFT;
-                result.remainingInterval[0] = effectiveEnd;
-                result.remainingInterval[1] = end;
-                
-                return result;
-            }
-            
-            // Case 3: Remove-interval starts within tag but extends to or beyond tag end
-            if (effectiveStart > originalStart && effectiveEnd >= originalEnd) {
-                // Adjust this node's interval to end at the start of the removal
-                node->interval[1] = effectiveStart;
-                
-                // Process any children that might be affected
-                int* childrenToRemove = NULL;
-                int numChildrenToRemove = 0;
-                int childrenToRemoveCapacity = 0;
-                
-                for (int i = 0; i < node->numChildren; i++) {
-                    IntervalNode* child = node->children[i];
-                    
-                    if (child->interval[0] >= effectiveStart) {
-                        // This child is entirely removed
-                        if (numChildrenToRemove >= childrenToRemoveCapacity) {
-                            childrenToRemoveCapacity = childrenToRemoveCapacity == 0 ? 4 : childrenToRemoveCapacity * 2;
-                            int* newArray = (int*)realloc(childrenToRemove, 
-                                           childrenToRemoveCapacity * sizeof(int));
-                            if (!newArray) {
-                                perror("Failed to allocate memory for childrenToRemove");
-                                exit(EXIT_FAILURE);
-                            }
-                            childrenToRemove = newArray;
-                        }
-                        childrenToRemove[numChildrenToRemove++] = i;
-                        freeIntervalNode(child);
-                    } else if (child->interval[1] > effectiveStart) {
-                        // This child is partially affected
-                        RemoveResult childResult = removeTagDFS(child, tag, effectiveStart, child->interval[1]);
-                        
-                        if (childResult.removed && childResult.state == REMOVE_ENTIRE_NODE) {
-                            // Mark for removal
-                            if (numChildrenToRemove >= childrenToRemoveCapacity) {
-                                childrenToRemoveCapacity = childrenToRemoveCapacity == 0 ? 4 : childrenToRemoveCapacity * 2;
-                                int* newArray = (int*)realloc(childrenToRemove, 
-                                               childrenToRemoveCapacity * sizeof(int));
-                                if (!newArray) {
-                                    perror("Failed to allocate memory for childrenToRemove");
-                                    exit(EXIT_FAILURE);
-                                }
-                                childrenToRemove = newArray;
-                            }
-                            childrenToRemove[numChildrenToRemove++] = i;
-                            
-                            // Add any rehook nodes back to the node's children
-                            for (int j = 0; j < childResult.rehookNodeList.count; j++) {
-                                IntervalNode* rehookNode = childResult.rehookNodeList.nodes[j];
-                                if (rehookNode->interval[1] <= effectiveStart) {
-                                    int insertPos = findInsertionPoint(node->children, node->numChildren, 
-                                                 rehookNode->interval[0]);
-                                    
-                                    // Make space for new node
-                                    if (node->numChildren >= node->childrenCapacity) {
-                                        int newCapacity = node->childrenCapacity == 0 ? 4 : node->childrenCapacity * 2;
-                                        IntervalNode** newChildren = (IntervalNode**)realloc(node->children, 
-                                                                    newCapacity * sizeof(IntervalNode*));
-                                        if (!newChildren) {
-                                            perror("Failed to allocate memory for children");
-                                            exit(EXIT_FAILURE);
-                                        }
-                                        node->children = newChildren;
-                                        node->childrenCapacity = newCapacity;
-                                    }
-                                    
-                                    // Shift elements to make room
-                                    for (int k = node->numChildren; k > insertPos; k--) {
-                                        node->children[k] = node->children[k - 1];
-                                    }
-                                    
-                                    node->children[insertPos] = rehookNode;
-                                    node->numChildren++;
-                                }
-                            }
-                        }
-                        
-                        // Free the rehook list structure but not its nodes
-                        free(childResult.rehookNodeList.nodes);
-                    }
-                }
-                
-                // Remove affected children (in reverse order to not mess up indices)
-                for (int i = numChildrenToRemove - 1; i >= 0; i--) {
-                    int index = childrenToRemove[i];
-                    
-                    // Shift elements to remove the node
-                    for (int j = index; j < node->numChildren - 1; j++) {
-                        node->children[j] = node->children[j + 1];
-                    }
-                    node->numChildren--;
-                }
-                
-                // Free temporary array
-                if (childrenToRemove) free(childrenToRemove);
-                
-                result.removed = true;
-                result.state = REMOVE_INTERVAL_RIGHT;
-                result.remainingInterval[0] = start;
-                result.remainingInterval[1] = effectiveStart;
-                
-                return result;
-            }
-            
-            // Case 4: Remove-interval completely covers tag
+            // Case 2: Remove-interval completely covers tag
             if (effectiveStart <= originalStart && effectiveEnd >= originalEnd) {
                 // Process children to see if any need tag removal too
                 for (int i = 0; i < node->numChildren; i++) {
@@ -889,8 +2145,11 @@
                     if (child->interval[0] < effectiveEnd && child->interval[1] > effectiveStart) {
                         RemoveResult childResult = removeTagDFS(child, tag, effectiveStart, effectiveEnd);
                         
-                        if (childResult.removed) {
+                        if (childResult.removed && 
+                            (childResult.state == REMOVE_ENTIRE_NODE || childResult.state == REMOVE_INTERVAL_INSIDE)) {
                             // Add rehook nodes from child
+                            moveTrackedPositions(child, node);
+                            freeIntervalNodeShell(child);
                             for (int j = 0; j < childResult.rehookNodeList.count; j++) {
                                 addNodeToRehookList(&result.rehookNodeList, childResult.rehookNodeList.nodes[j]);
                             }
@@ -934,8 +2193,11 @@
         while (i < node->numChildren) {
             IntervalNode* child = node->children[i];
             
+            // Children are sorted by start, so none after this one overlap
+            if (effectiveEnd <= child->interval[0]) break;
+            
             // Skip if no overlap
-            if (effectiveEnd <= child->interval[0] || effectiveStart >= child->interval[1]) {
+            if (effectiveStart >= child->interval[1]) {
                 i++;
                 continue;
             }
@@ -947,66 +2209,19 @@
                 
                 if (childResult.state == REMOVE_ENTIRE_NODE || 
                     childResult.state == REMOVE_INTERVAL_INSIDE) {
-                    // Remove this child
-                    for (int j = i; j < node->numChildren - 1; j++) {
-                        node->children[j] = node->children[j + 1];
-                    }
-                    node->numChildren--;
-                    
-                    // Insert rehook nodes at the right positions
-                    for (int j = 0; j < childResult.rehookNodeList.count; j++) {
-                        IntervalNode* rehookNode = childResult.rehookNodeList.nodes[j];
-                        int insertPos = findInsertionPoint(node->children, node->numChildren, rehookNode->interval[0]);
-                        
-                        // Make space for new node
-                        if (node->numChildren >= node->childrenCapacity) {
-                            int newCapacity = node->childrenCapacity == 0 ? 4 : node->childrenCapacity * 2;
-                            IntervalNode** newChildren = (IntervalNode**)realloc(node->children, 
-                                                        newCapacity * sizeof(IntervalNode*));
-                            if (!newChildren) {
-                                perror("Failed to allocate memory for children");
-                                exit(EXIT_FAILURE);
-                            }
-                            node->children = newChildren;
-                            node->childrenCapacity = newCapacity;
-                        }
-                        
-                        // Shift elements to make room
-                        for (int k = node->numChildren; k > insertPos; k--) {
-                            node->children[k] = node->children[k - 1];
-                        }
-                        
-                        node->children[insertPos] = rehookNode;
-                        node->numChildren++;
-                    }
-                    
-                    // Update position for next iteration
-                    i = findInsertionPoint(node->children, node->numChildren, effectiveStart);
-                    if (i > 0 && node->children[i - 1]->interval[1] > effectiveStart) {
-                        i--;
+                    // Put the rehook nodes in this child's place. They lie inside it and
+                    // were processed with it, so the scan goes on after them.
+                    moveTrackedPositions(child, node);
+                    freeIntervalNodeShell(child);
+                    if (childResult.rehookNodeList.count > 1) {
+                        qsort(childResult.rehookNodeList.nodes, childResult.rehookNodeList.count, 
+                              sizeof(IntervalNode*), compareNodeStarts);
                     }
+                    i = spliceChildren(node, i, childResult.rehookNodeList.nodes, childResult.rehookNodeList.count);
                 } else {
                     // For LEFT and RIGHT states, the child was adjusted, so keep it
                     i++;
                 }
-                
-                // Continue with remaining interval if any
-                if (childResult.remainingInterval[0] < childResult.remainingInterval[1]) {
-                    // Call recursively with remaining interval
-                    RemoveResult remainingResult = removeTagDFS(
-                        node, 
-                        tag, 
-                        childResult.remainingInterval[0], 
-                        childResult.remainingInterval[1]
-                    );
-                    
-                    if (remainingResult.removed) {
-                        removed = true;
-                    }
-                    
-                    // Free the rehook list structure
-                    free(remainingResult.rehookNodeList.nodes);
-                }
             } else {
                 i++;
             }
@@ -1015,13 +2230,19 @@
             free(childResult.rehookNodeList.nodes);
         }
         
-        // Ensure child intervals are properly nested within parent
-        for (int i = 0; i < node->numChildren; i++) {
-            if (node->children[i]->interval[0] < node->interval[0]) {
-                node->children[i]->interval[0] = node->interval[0];
+        // Ensure the children the removal went through are properly nested within parent
+        for (int j = startIdx; j < i; j++) {
+            bool clamped = false;
+            if (node->children[j]->interval[0] < node->interval[0]) {
+                node->children[j]->interval[0] = node->interval[0];
+                clamped = true;
             }
-            if (node->children[i]->interval[1] > node->interval[1]) {
-                node->children[i]->interval[1] = node->interval[1];
+            if (node->children[j]->interval[1] > node->interval[1]) {
+                node->children[j]->interval[1] = node->interval[1];
+                clamped = true;
+            }
+            if (clamped) {
+                rehomeTrackedPositions(node->children[j]);
             }
         }
         
@@ -1034,31 +2255,45 @@
     }
     
     // Check if an interval has a specific tag
-    bool hasTag(TaggedIntervalTree* tree, const char* tag, int start, int end) {
+    bool hasTag(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end) {
+        LATENCY_SCOPE(LATENCY_HAS_TAG);
+        touchTree(tree, NULL);
+        if (overlaysPendingTag(tree->pending, tag, start, end)) {
+            return checkSettledTag(tree->root, tree->pending, tag, start, end);
+        }
         return checkTagDFS(tree->root, tag, start, end);
     }
     
     // DFS helper for checking tags
-    bool checkTagDFS(IntervalNode* node, const char* tag, int start, int end) {
-        // If this node has the tag and fully contains the interval
-        if (node->tag && strcmp(node->tag, tag) == 0 && 
-            node->interval[0] <= start && 
-            node->interval[1] >= end) {
+    bool checkTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end) {
+        // If this node fully contains the interval and has the tag; the tag string
+        // is a separate allocation, so it is only read for containing nodes
+        if (node->interval[0] <= start && node->interval[1] >= end && 
+            node->tag && strcmp(node->tag, tag) == 0) {
             return true;
         }
         
+        // Queries leave the node's shift and deferred tags where they are
+        if (hasDeferredTagsOver(node, start, end)) {
+            return checkSettledTag(node, NULL, tag, start, end);
+        }
+        start -= node->pendingShift;
+        end -= node->pendingShift;
+        
         // Use binary search to find children that might overlap
         int i = findInsertionPoint(node->children, node->numChildren, start);
         if (i > 0 && node->children[i - 1]->interval[1] > start) {
             i--;
         }
         
-        // Check relevant children
+        // Check relevant children; they are sorted by start, so the first one
+        // starting at or after end ends the search
         while (i < node->numChildren) {
             IntervalNode* child = node->children[i];
+            if (end <= child->interval[0]) break;
             
             // Skip if no overlap
-            if (end <= child->interval[0] || start >= child->interval[1]) {
+            if (start >= child->interval[1]) {
                 i++;
                 continue;
             }
@@ -1073,237 +2308,5504 @@
         return false;
     }
     
-    // Structure for tag markers
-    typedef struct {
-        int position;
-        char* tag;
-        bool isOpening;
-    } TagMarker;
-    
-    // Compare function for sorting markers
-    int compareMarkers(const void* a, const void* b) {
-        const TagMarker* markerA = (const TagMarker*)a;
-        const TagMarker* markerB = (const TagMarker*)b;
+    // Check the descendants of node for a span containing [start,end), given in
+    // node's frame, as they will be once the deferred tags over the range are
+    // applied, and then operation if it is not NULL; node is then the root.
+    // Whether a span contains the range depends on where applying them cuts and
+    // merges the spans, deferred tags of other tags included, so they are applied
+    // to a copy of the nodes over the range and the copy is read.
+    bool checkSettledTag(IntervalNode* node, TreeOperation* operation, const char* tag, TreePosition start, 
+                         TreePosition end) {
+        TreeMemoryAccount scratch = {0, 0, 0, 0, 1};
+        TreeMemoryAccount* previousAccount = currentAccount;
+        TaggedIntervalTree* previousSource = changeSource;
+        size_t visitedBefore = nodesVisited;
+        currentAccount = &scratch;
+        changeSource = NULL;
         
-        if (markerA->position == markerB->position) {
-            return markerA->isOpening ? 1 : -1;
-        }
-        return markerA->position - markerB->position;
+        IntervalNode* copy = copySettledRange(node, operation, start, end);
+        bool found = checkTagDFS(copy, tag, start, end);
+        freeIntervalNode(copy);
+        
+        currentAccount = previousAccount;
+        changeSource = previousSource;
+        nodesVisited = visitedBefore;
+        return found;
     }
     
-// Get formatted text with tags - completely fixed version
-char* getFormattedText(TaggedIntervalTree* tree, const char* text) {
-    if (!tree || !text) return NULL;
-    
-    // Count maximum possible markers (2 per node)
-    int maxMarkers = 0;
+    // Copy the descendants of node over [start,end) with the deferred tags over the
+    // range applied, and then operation if it is not NULL; node is then the root.
+    // The copy is charged to the current account and must not report changes, so
+    // callers run it under a scratch account with no change source.
+    IntervalNode* copySettledRange(IntervalNode* node, TreeOperation* operation, TreePosition start, 
+                                   TreePosition end) {
+        IntervalNode* copy = copyNodeRange(node, start, end);
+        TreePosition from = operation && operation->cursor > start ? operation->cursor : start;
+        TreePosition to = operation && operation->end < end ? operation->end : end;
+        if (operation && from < to) {
+            if (operation->kind == OPERATION_ADD_TAG) {
+                addTagDFS(copy, operation->tag, from, to);
+            } else if (operation->kind == OPERATION_REMOVE_TAG) {
+                RemoveResult result = removeTagDFS(copy, operation->tag, from, to);
+                freeRehookNodeList(&result.rehookNodeList);
+                if (from == operation->cursor && operation->cursor > operation->start) {
+                    mergeSeamsAt(copy, from);
+                }
+            }
+        }
+        applyDeferredTagsDFS(copy);
+        return copy;
+    }
     
-    void countNodes(IntervalNode* node) {
-        if (node->tag) {
-            maxMarkers += 2;  // Opening and closing tag
+    // Copy node with the descendants and deferred tags overlapping [start,end),
+    // given in node's frame, the deferred tags cut to the range. Applying them
+    // outside the range does not change which spans contain it.
+    IntervalNode* copyNodeRange(IntervalNode* node, TreePosition start, TreePosition end) {
+        IntervalNode* copy = createIntervalNode(node->interval[0], node->interval[1], node->tag);
+        copy->pendingShift = node->pendingShift;
+        start -= node->pendingShift;
+        end -= node->pendingShift;
+        
+        for (int k = 0; node->deferred && k < node->deferred->count; k++) {
+            DeferredTag* entry = &node->deferred->entries[k];
+            TreePosition entryStart = entry->start > start ? entry->start : start;
+            TreePosition entryEnd = entry->end < end ? entry->end : end;
+            if (entryStart < entryEnd) {
+                appendDeferredTag(&copy->deferred, copy, entry->add, entry->tag, entryStart, entryEnd);
+            }
         }
         
-        for (int i = 0; i < node->numChildren; i++) {
-            countNodes(node->children[i]);
+        int i = findInsertionPoint(node->children, node->numChildren, start);
+        if (i > 0 && node->children[i - 1]->interval[1] > start) {
+            i--;
         }
+        for (; i < node->numChildren && node->children[i]->interval[0] < end; i++) {
+            if (node->children[i]->interval[1] > start) {
+                addChildToNode(copy, copyNodeRange(node->children[i], start, end));
+            }
+        }
+        return copy;
     }
     
-    countNodes(tree->root);
-    
-    // Allocate markers array
-    TagMarker* markers = (TagMarker*)malloc(maxMarkers * sizeof(TagMarker));
-    if (!markers) {
-        perror("Failed to allocate memory for markers");
-        return NULL;
-    }
-    
-    int markerCount = 0;
-    
-    // Collect markers
-    void collectMarkers(IntervalNode* node) {
-        if (node->tag) {
-            // Add opening tag
-            markers[markerCount].position = node->interval[0];
-            markers[markerCount].tag = strdup(node->tag);
-            markers[markerCount].isOpening = true;
-            markerCount++;
+    // Answer many hasTag questions at once. Descents run in groups of
+    // TAG_QUERY_GROUP: every visit to a node first prefetches what the next step
+    // reads and moves on to the next query, so the cache misses of a group overlap
+    // instead of following one another.
+    void hasTagBatch(TaggedIntervalTree* tree, const TagQuery* queries, int numQueries, bool* results) {
+        touchTree(tree, NULL);
+        
+        for (int first = 0; first < numQueries; first += TAG_QUERY_GROUP) {
+            int count = numQueries - first < TAG_QUERY_GROUP ? numQueries - first : TAG_QUERY_GROUP;
+            IntervalNode* nodes[TAG_QUERY_GROUP];
+            TreePosition shifts[TAG_QUERY_GROUP];
+            bool fetched[TAG_QUERY_GROUP];
+            int active = count;
             
-            // Add closing tag
-            markers[markerCount].position = node->interval[1];
-            markers[markerCount].tag = strdup(node->tag);
-            markers[markerCount].isOpening = false;
-            markerCount++;
+            for (int q = 0; q < count; q++) {
+                nodes[q] = tree->root;
+                shifts[q] = 0;
+                fetched[q] = false;
+                results[first + q] = false;
+            }
+            
+            while (active > 0) {
+                for (int q = 0; q < count; q++) {
+                    IntervalNode* node = nodes[q];
+                    if (!node) continue;
+                    
+                    if (!fetched[q]) {
+                        // The node has arrived; request its tag and children
+                        if (node->tag) PREFETCH(node->tag);
+                        if (node->numChildren > 0) {
+                            PREFETCH(node->children);
+                            PREFETCH(node->children[node->numChildren / 2]);
+                        }
+                        fetched[q] = true;
+                        continue;
+                    }
+                    
+                    nodes[q] = stepTagQuery(node, &queries[first + q], &shifts[q], &results[first + q]);
+                    fetched[q] = false;
+                    if (nodes[q]) {
+                        PREFETCH(nodes[q]);
+                    } else {
+                        active--;
+                    }
+                }
+            }
         }
         
-        for (int i = 0; i < node->numChildren; i++) {
-            collectMarkers(node->children[i]);
+        // Answers touching a pending add or remove see it as done
+        if (tree->pending) {
+            for (int q = 0; q < numQueries; q++) {
+                const TagQuery* query = &queries[q];
+                if (overlaysPendingTag(tree->pending, query->tag, query->start, query->end)) {
+                    results[q] = checkSettledTag(tree->root, tree->pending, query->tag, query->start, query->end);
+                }
+            }
         }
     }
     
-    collectMarkers(tree->root);
-    
-    // First sort markers by position
-    qsort(markers, markerCount, sizeof(TagMarker), compareMarkers);
-    
-    // Calculate result size
-    int textLen = strlen(text);
-    int resultSize = textLen + 1;  // Start with text length + null terminator
-    
-    for (int i = 0; i < markerCount; i++) {
-        // Add space for <tag> or </tag>
-        resultSize += strlen(markers[i].tag) + (markers[i].isOpening ? 2 : 3);
-    }
-    
-    // Account for potential extra closing/opening tags when fixing nesting
-    resultSize *= 2;
-    
-    // Allocate result buffer
-    char* result = (char*)malloc(resultSize * sizeof(char));
-    if (!result) {
-        perror("Failed to allocate memory for formatted text");
+    // Advance a batched query by one level: report a node that answers it, or
+    // return the only child that can, NULL when the descent is over. Children lie
+    // inside their parent and do not overlap, so the path matches checkTagDFS.
+    // shift holds the pending shifts above node, added up. At deferred tags over the
+    // range the query is finished by checkSettledTag.
+    IntervalNode* stepTagQuery(IntervalNode* node, const TagQuery* query, TreePosition* shift, bool* found) {
+        TreePosition start = query->start - *shift;
+        TreePosition end = query->end - *shift;
+        if (node->interval[0] <= start && node->interval[1] >= end && 
+            node->tag && strcmp(node->tag, query->tag) == 0) {
+            *found = true;
+            return NULL;
+        }
         
-        // Free markers
-        for (int i = 0; i < markerCount; i++) {
-            free(markers[i].tag);
+        if (hasDeferredTagsOver(node, start, end)) {
+            *found = checkSettledTag(node, NULL, query->tag, start, end);
+            return NULL;
         }
-        free(markers);
+        start -= node->pendingShift;
+        end -= node->pendingShift;
         
-        return NULL;
+        int i = findInsertionPoint(node->children, node->numChildren, start + 1) - 1;
+        if (i < 0) return NULL;
+        
+        IntervalNode* child = node->children[i];
+        if (end <= child->interval[0] || start >= child->interval[1] || child->interval[1] < end) {
+            return NULL;
+        }
+        *shift += node->pendingShift;
+        return child;
     }
     
-    // Define stack entry to properly track ownership of tag strings
-    typedef struct {
-        char* tag;
-        int position;
-    } StackEntry;
-    
-    // Stack to track open tags - using a more robust structure
-    StackEntry* tagStack = (StackEntry*)malloc(maxMarkers * sizeof(StackEntry));
-    if (!tagStack) {
-        perror("Failed to allocate memory for tag stack");
-        free(result);
-        for (int i = 0; i < markerCount; i++) {
-            free(markers[i].tag);
-        }
-        free(markers);
-        return NULL;
+    // Collect the tags covering pos into out, replacing what it held
+    void tagsAt(TaggedIntervalTree* tree, TreePosition pos, TagsAt* out) {
+        touchTree(tree, NULL);
+        out->count = 0;
+        
+        IntervalNode* root = tree->root;
+        if (pos < root->interval[0] || pos >= root->interval[1]) return;
+        
+        collectTagsAt(root, pos, out);
+        overlayTagsAt(tree->pending, pos, out, 0);
     }
-    int stackSize = 0;
     
-    // Insert tags into text
-    int resultPos = 0;
-    int lastPosition = 0;
-    
-    // Process text position by position
-    int textPosition = 0;
-    int maxPosition = 0;
+    // Collect the tags of node and its descendants covering pos, root first, and lay
+    // the deferred tags of each node over what its descendants hold, deepest first:
+    // deferred tags above are always the newer ones
+    void collectTagsAt(IntervalNode* node, TreePosition pos, TagsAt* out) {
+        if (node->tag) appendTagsAt(out, node->tag);
+        int first = out->count;
+        
+        pos -= node->pendingShift;
+        IntervalNode* child = findChildContaining(node, pos);
+        if (child) {
+            collectTagsAt(child, pos, out);
+        }
+        if (node->deferred) {
+            overlayDeferredTagsAt(node->deferred, pos, out, first);
+        }
+    }
     
-    // Find the maximum position
-    for (int i = 0; i < markerCount; i++) {
-        if (markers[i].position > maxPosition) {
-            maxPosition = markers[i].position;
+    // Make the tags collected at pos, in the children's frame, from index first on
+    // show the deferred tags covering pos, in the order they were queued
+    void overlayDeferredTagsAt(DeferredTags* deferred, TreePosition pos, TagsAt* tags, int first) {
+        for (int k = 0; k < deferred->count; k++) {
+            DeferredTag* entry = &deferred->entries[k];
+            if (pos < entry->start || pos >= entry->end) continue;
+            
+            int kept = first;
+            for (int i = first; i < tags->count; i++) {
+                if (strcmp(tags->tags[i], entry->tag) != 0) {
+                    tags->tags[kept++] = tags->tags[i];
+                }
+            }
+            tags->count = kept;
+            if (entry->add) {
+                appendTagsAt(tags, entry->tag);
+            }
         }
     }
     
-    // Process character by character
-    while (textPosition <= maxPosition && text[textPosition] != '\0') {
-        // Check if there are any tags at this position
-        bool hasTagsAtPosition = false;
-        for (int i = 0; i < markerCount; i++) {
-            if (markers[i].position == textPosition) {
-                hasTagsAtPosition = true;
-                break;
+    // Collect the tags covering each of positions into out, replacing what it held.
+    // Positions are answered in sorted order, so neighbours share the top of their
+    // paths, in TAG_QUERY_GROUP lanes whose descents interleave like hasTagBatch's.
+    void tagsAtBatch(TaggedIntervalTree* tree, const TreePosition* positions, int numPositions, 
+                     TagsAtAnswers* out) {
+        touchTree(tree, NULL);
+        out->tags.count = 0;
+        if (numPositions <= 0) return;
+        
+        if (numPositions > out->capacity) {
+            int* newFirst = (int*)realloc(out->first, numPositions * sizeof(int));
+            int* newCount = (int*)realloc(out->count, numPositions * sizeof(int));
+            if (!newFirst || !newCount) {
+                perror("Failed to allocate memory for tag answers");
+                exit(EXIT_FAILURE);
             }
+            out->first = newFirst;
+            out->count = newCount;
+            out->capacity = numPositions;
         }
         
-        if (hasTagsAtPosition) {
-            // Process all opening and closing tags at this position
-            
-            // First process all closing tags
-            for (int i = 0; i < markerCount; i++) {
-                if (markers[i].position == textPosition && !markers[i].isOpening) {
-                    // Find this tag in the stack
-                    int j = stackSize - 1;
-                    while (j >= 0 && strcmp(tagStack[j].tag, markers[i].tag) != 0) {
-                        j--;
-                    }
-                    
-                    if (j >= 0) {
-                        // Close all tags up to and including this one
-                        for (int k = stackSize - 1; k >= j; k--) {
-                            result[resultPos++] = '<';
-                            result[resultPos++] = '/';
-                            strcpy(result + resultPos, tagStack[k].tag);
-                            resultPos += strlen(tagStack[k].tag);
-                            result[resultPos++] = '>';
-                            
-                            // Free tag if it was allocated for stack
-                            free(tagStack[k].tag);
-                            stackSize--;
-                        }
+        PositionSlot* slots = (PositionSlot*)malloc(numPositions * sizeof(PositionSlot));
+        if (!slots) {
+            perror("Failed to allocate memory for position slots");
+            exit(EXIT_FAILURE);
+        }
+        
+        bool sorted = true;
+        for (int i = 0; i < numPositions; i++) {
+            slots[i].position = positions[i];
+            slots[i].index = i;
+            out->first[i] = 0;
+            out->count[i] = 0;
+            if (i > 0 && positions[i] < positions[i - 1]) sorted = false;
+        }
+        if (!sorted) {
+            qsort(slots, numPositions, sizeof(PositionSlot), comparePositionSlots);
+        }
+        
+        // Split the sorted positions into contiguous runs, one per lane
+        int numLanes = numPositions < TAG_QUERY_GROUP ? numPositions : TAG_QUERY_GROUP;
+        TagsAtLane lanes[TAG_QUERY_GROUP];
+        int active = 0;
+        for (int l = 0; l < numLanes; l++) {
+            TagsAtLane* lane = &lanes[l];
+            lane->next = (int)((long long)numPositions * l / numLanes);
+            lane->last = (int)((long long)numPositions * (l + 1) / numLanes);
+            lane->path = NULL;
+            lane->shifts = NULL;
+            lane->depth = 0;
+            lane->capacity = 0;
+            if (startLanePosition(lane, tree->root, slots)) active++;
+        }
+        
+        while (active > 0) {
+            for (int l = 0; l < numLanes; l++) {
+                TagsAtLane* lane = &lanes[l];
+                if (lane->next >= lane->last) continue;
+                IntervalNode* node = lane->path[lane->depth - 1];
+                
+                if (!lane->fetched) {
+                    // The node has arrived; request its children for the next visit
+                    if (node->numChildren > 0) {
+                        PREFETCH(node->children);
+                        PREFETCH(node->children[node->numChildren / 2]);
                     }
+                    lane->fetched = true;
+                    continue;
                 }
-            }
-            
-            // Then process all opening tags
-            for (int i = 0; i < markerCount; i++) {
-                if (markers[i].position == textPosition && markers[i].isOpening) {
-                    // Add opening tag
-                    result[resultPos++] = '<';
-                    strcpy(result + resultPos, markers[i].tag);
-                    resultPos += strlen(markers[i].tag);
-                    result[resultPos++] = '>';
-                    
-                    // Push tag to stack
-                    tagStack[stackSize].tag = strdup(markers[i].tag);
-                    tagStack[stackSize].position = textPosition;
-                    stackSize++;
+                
+                TreePosition shift = lane->shifts[lane->depth - 1] + node->pendingShift;
+                IntervalNode* child = findChildContaining(node, slots[lane->next].position - shift);
+                if (child) {
+                    pushLaneNode(lane, child, shift);
+                    PREFETCH(child);
+                    continue;
+                }
+                
+                // The path is complete: answer and move to the lane's next position.
+                // Deferred tags are laid over what the nodes below them hold, as in
+                // collectTagsAt.
+                int index = slots[lane->next].index;
+                out->first[index] = out->tags.count;
+                for (int d = 0; d < lane->depth; d++) {
+                    if (lane->path[d]->tag) appendTagsAt(&out->tags, lane->path[d]->tag);
+                }
+                int above = out->tags.count;
+                for (int d = lane->depth - 1; d >= 0; d--) {
+                    IntervalNode* pathNode = lane->path[d];
+                    if (pathNode->deferred) {
+                        overlayDeferredTagsAt(pathNode->deferred, slots[lane->next].position - lane->shifts[d] - 
+                                              pathNode->pendingShift, &out->tags, above);
+                    }
+                    if (pathNode->tag) above--;
                 }
+                overlayTagsAt(tree->pending, slots[lane->next].position, &out->tags, out->first[index]);
+                out->count[index] = out->tags.count - out->first[index];
+                lane->next++;
+                if (!startLanePosition(lane, tree->root, slots)) active--;
             }
         }
         
-        // Add current character
-        if (text[textPosition] != '\0') {
-            result[resultPos++] = text[textPosition];
+        for (int l = 0; l < numLanes; l++) {
+            free(lanes[l].path);
+            free(lanes[l].shifts);
         }
-        
-        textPosition++;
+        free(slots);
     }
     
-    // Add remaining text
-    if (text[textPosition] != '\0') {
-        strcpy(result + resultPos, text + textPosition);
-        resultPos += strlen(text + textPosition);
+    // Free the buffer of a TagsAt
+    void freeTagsAt(TagsAt* tags) {
+        free(tags->tags);
+        tags->tags = NULL;
+        tags->count = 0;
+        tags->capacity = 0;
     }
     
-    // Close any remaining open tags
-    for (int i = stackSize - 1; i >= 0; i--) {
-        result[resultPos++] = '<';
-        result[resultPos++] = '/';
-        strcpy(result + resultPos, tagStack[i].tag);
-        resultPos += strlen(tagStack[i].tag);
-        result[resultPos++] = '>';
-        
-        // Free tag
-        free(tagStack[i].tag);
+    // Free the buffers of a TagsAtAnswers
+    void freeTagsAtAnswers(TagsAtAnswers* answers) {
+        freeTagsAt(&answers->tags);
+        free(answers->first);
+        free(answers->count);
+        answers->first = NULL;
+        answers->count = NULL;
+        answers->capacity = 0;
     }
     
-    // Null terminate
-    result[resultPos] = '\0';
-    
-    // Free stack
-    free(tagStack);
+    // Find the child containing pos, given in the children's frame.
+    // Children do not overlap, so it is the last one starting at or before pos.
+    IntervalNode* findChildContaining(IntervalNode* node, TreePosition pos) {
+        int i = findInsertionPoint(node->children, node->numChildren, pos + 1) - 1;
+        if (i < 0 || pos >= node->children[i]->interval[1]) return NULL;
+        return node->children[i];
+    }
     
-    // Free markers
-    for (int i = 0; i < markerCount; i++) {
-        free(markers[i].tag);
+    // Append a tag to a TagsAt
+    void appendTagsAt(TagsAt* tags, const char* tag) {
+        if (tags->count >= tags->capacity) {
+            int newCapacity = tags->capacity == 0 ? 4 : tags->capacity * 2;
+            const char** newTags = (const char**)realloc(tags->tags, newCapacity * sizeof(char*));
+            if (!newTags) {
+                perror("Failed to allocate memory for tags at position");
+                exit(EXIT_FAILURE);
+            }
+            tags->tags = newTags;
+            tags->capacity = newCapacity;
+        }
+        
+        tags->tags[tags->count++] = tag;
     }
-    free(markers);
     
-    return result;
-}
+    // Prepare a lane for its next position: keep the part of the path that still
+    // contains it, and answer positions outside the tree at once. Returns false
+    // when the lane has no positions left.
+    bool startLanePosition(TagsAtLane* lane, IntervalNode* root, const PositionSlot* slots) {
+        for (; lane->next < lane->last; lane->next++) {
+            TreePosition pos = slots[lane->next].position;
+            while (lane->depth > 0 && 
+                   (pos - lane->shifts[lane->depth - 1] < lane->path[lane->depth - 1]->interval[0] || 
+                    pos - lane->shifts[lane->depth - 1] >= lane->path[lane->depth - 1]->interval[1])) {
+                lane->depth--;
+            }
+            
+            if (lane->depth > 0) {
+                lane->fetched = true;
+                return true;
+            }
+            if (pos >= root->interval[0] && pos < root->interval[1]) {
+                pushLaneNode(lane, root, 0);
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    // Extend a lane's path by a node under pending shifts adding up to shift
+    void pushLaneNode(TagsAtLane* lane, IntervalNode* node, TreePosition shift) {
+        if (lane->depth >= lane->capacity) {
+            int newCapacity = lane->capacity == 0 ? 16 : lane->capacity * 2;
+            IntervalNode** newPath = (IntervalNode**)realloc(lane->path, newCapacity * sizeof(IntervalNode*));
+            TreePosition* newShifts = (TreePosition*)realloc(lane->shifts, newCapacity * sizeof(TreePosition));
+            if (!newPath || !newShifts) {
+                perror("Failed to allocate memory for lane path");
+                exit(EXIT_FAILURE);
+            }
+            lane->path = newPath;
+            lane->shifts = newShifts;
+            lane->capacity = newCapacity;
+        }
+        
+        lane->path[lane->depth] = node;
+        lane->shifts[lane->depth] = shift;
+        lane->depth++;
+        lane->fetched = false;
+    }
+    
+    // Compare position slots by position
+    int comparePositionSlots(const void* a, const void* b) {
+        const PositionSlot* slotA = (const PositionSlot*)a;
+        const PositionSlot* slotB = (const PositionSlot*)b;
+        return (slotA->position > slotB->position) - (slotA->position < slotB->position);
+    }
+    
+    // Apply a node's pending shift to its direct children and its deferred tags. The
+    // deferred tags stay queued; see settleNode.
+    void pushDownShift(IntervalNode* node) {
+        if (node->pendingShift != 0) {
+            for (int i = 0; i < node->numChildren; i++) {
+                IntervalNode* child = node->children[i];
+                child->interval[0] += node->pendingShift;
+                child->interval[1] += node->pendingShift;
+                child->pendingShift += node->pendingShift;
+            }
+            
+            shiftPositions(node->positions[GRAVITY_LEFT], node->pendingShift);
+            shiftPositions(node->positions[GRAVITY_RIGHT], node->pendingShift);
+            
+            if (node->deferred) {
+                for (int i = 0; i < node->deferred->count; i++) {
+                    node->deferred->entries[i].start += node->pendingShift;
+                    node->deferred->entries[i].end += node->pendingShift;
+                }
+            }
+            
+            node->pendingShift = 0;
+        }
+    }
+    
+    // Push down a node's pending shift and apply all its deferred tags, so its
+    // children are final
+    void settleNode(IntervalNode* node) {
+        pushDownShift(node);
+        if (node->deferred) {
+            applyDeferredTags(node, node->interval[0], node->interval[1]);
+        }
+    }
+    
+    // Push down a node's pending shift and apply its deferred tags around [start,end)
+    // only, for edits that touch no children outside it. The cost then follows the
+    // range rather than the node's fanout; see applyDeferredTags.
+    void settleNodeRange(IntervalNode* node, TreePosition start, TreePosition end) {
+        pushDownShift(node);
+        if (hasDeferredTagsOver(node, start, end)) {
+            applyDeferredTags(node, start, end);
+        }
+    }
+    
+    // Shift a node now and its descendants lazily
+    void shiftIntervalNode(IntervalNode* node, TreePosition delta) {
+        node->interval[0] += delta;
+        node->interval[1] += delta;
+        node->pendingShift += delta;
+    }
+    
+    // Free a node whose children and tracked positions have been moved elsewhere
+    void freeIntervalNodeShell(IntervalNode* node) {
+        if (node->tag) releaseTag(node->tag);
+        releaseChildArray(node->children, node->childrenCapacity);
+        freeDeferredTags(node->deferred);
+        releaseNodeMemory(node);
+    }
+    
+    // Split a node at pos: the node keeps [start,pos) and the returned node gets [pos,end).
+    // Only the children straddling pos are split, so the cost is O(depth + fanout),
+    // plus the deferred tags of the nodes split.
+    IntervalNode* splitIntervalNode(IntervalNode* node, TreePosition pos) {
+        pushDownShift(node);
+        
+        IntervalNode* right = createIntervalNode(pos, node->interval[1], node->tag);
+        
+        // Tracked positions after pos go with the right half, and so do those at pos
+        // that stick to the right
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            splitPositions(node->positions[gravity], pos, gravity == GRAVITY_LEFT, 
+                           &node->positions[gravity], &right->positions[gravity]);
+            adoptPositions(right->positions[gravity], right);
+        }
+        
+        int i = findInsertionPoint(node->children, node->numChildren, pos);
+        int keep = i;
+        
+        // A child straddling pos is split as well
+        if (i > 0 && node->children[i - 1]->interval[1] > pos) {
+            addChildToNode(right, splitIntervalNode(node->children[i - 1], pos));
+        }
+        
+        for (; i < node->numChildren; i++) {
+            addChildToNode(right, node->children[i]);
+        }
+        
+        node->numChildren = keep;
+        node->interval[1] = pos;
+        
+        // Deferred tags go with the half they lie in, cut at pos
+        DeferredTags* deferred = node->deferred;
+        if (deferred) {
+            node->deferred = NULL;
+            TreeMemoryAccount* previousAccount = currentAccount;
+            currentAccount = deferred->account;
+            for (int j = 0; j < deferred->count; j++) {
+                DeferredTag* entry = &deferred->entries[j];
+                if (entry->start < pos) {
+                    appendDeferredTag(&node->deferred, node, entry->add, entry->tag, 
+                                      entry->start, entry->end < pos ? entry->end : pos);
+                }
+                if (entry->end > pos) {
+                    appendDeferredTag(&right->deferred, right, entry->add, entry->tag, 
+                                      entry->start > pos ? entry->start : pos, entry->end);
+                }
+            }
+            freeDeferredTags(deferred);
+            currentAccount = previousAccount;
+        }
+        
+        return right;
+    }
+    
+    // Split the child of node straddling pos, if any, into siblings that meet at pos
+    void splitChildAt(IntervalNode* node, TreePosition pos) {
+        int i = findInsertionPoint(node->children, node->numChildren, pos);
+        if (i > 0 && node->children[i - 1]->interval[1] > pos) {
+            insertChildAt(node, i, splitIntervalNode(node->children[i - 1], pos));
+        }
+    }
+    
+    // Replace the child at index with its own children and free it. The children lie
+    // inside the child they replace, so they keep the order; its tracked positions
+    // move up to node.
+    void liftChildren(IntervalNode* node, int index) {
+        IntervalNode* child = node->children[index];
+        for (int i = 0; i < child->numChildren; i++) {
+            shiftIntervalNode(child->children[i], child->pendingShift);
+        }
+        spliceChildren(node, index, child->children, child->numChildren);
+        child->numChildren = 0;
+        
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            scatterPositions(child->positions[gravity], child->pendingShift, node, attachTrackedPosition);
+            child->positions[gravity] = NULL;
+        }
+        
+        freeIntervalNodeShell(child);
+    }
+    
+    // Put count nodes sorted by start in place of the child at index, which they lie
+    // inside, and return the index after them. The child itself is left to the caller.
+    int spliceChildren(IntervalNode* node, int index, IntervalNode** nodes, int count) {
+        int numChildren = node->numChildren - 1 + count;
+        
+        // Expand capacity if needed
+        if (numChildren > node->childrenCapacity) {
+            int newCapacity = node->childrenCapacity;
+            while (newCapacity < numChildren) {
+                newCapacity *= 2;
+            }
+            IntervalNode** newChildren = allocateChildArray(newCapacity);
+            memcpy(newChildren, node->children, node->numChildren * sizeof(IntervalNode*));
+            releaseChildArray(node->children, node->childrenCapacity);
+            
+            node->children = newChildren;
+            node->childrenCapacity = newCapacity;
+        }
+        
+        memmove(&node->children[index + count], &node->children[index + 1], 
+                (node->numChildren - index - 1) * sizeof(IntervalNode*));
+        for (int i = 0; i < count; i++) {
+            nodes[i]->parent = node;
+            node->children[index + i] = nodes[i];
+        }
+        node->numChildren = numChildren;
+        return index + count;
+    }
+    
+    // Order nodes by the start of their interval
+    int compareNodeStarts(const void* a, const void* b) {
+        const IntervalNode* nodeA = *(const IntervalNode* const*)a;
+        const IntervalNode* nodeB = *(const IntervalNode* const*)b;
+        return (nodeA->interval[0] > nodeB->interval[0]) - (nodeA->interval[0] < nodeB->interval[0]);
+    }
+    
+    // Merge children[index - 1] and children[index] if they carry the same tag and touch,
+    // continuing down the seam between their own children
+    void mergeSeamAt(IntervalNode* node, int index) {
+        if (index <= 0 || index >= node->numChildren) return;
+        
+        IntervalNode* left = node->children[index - 1];
+        IntervalNode* right = node->children[index];
+        
+        if (!left->tag || !right->tag || strcmp(left->tag, right->tag) != 0 || 
+            left->interval[1] < right->interval[0]) {
+            return;
+        }
+        
+        pushDownShift(left);
+        pushDownShift(right);
+        
+        int seam = left->numChildren;
+        left->interval[1] = left->interval[1] > right->interval[1] ? 
+                           left->interval[1] : right->interval[1];
+        
+        for (int i = 0; i < right->numChildren; i++) {
+            addChildToNode(left, right->children[i]);
+        }
+        moveDeferredTags(right, left);
+        moveTrackedPositions(right, left);
+        freeIntervalNodeShell(right);
+        
+        // Remove right from node's children
+        for (int i = index; i < node->numChildren - 1; i++) {
+            node->children[i] = node->children[i + 1];
+        }
+        node->numChildren--;
+        
+        emitMergeChange(left->tag, left->interval[0], left->interval[1]);
+        mergeSeamAt(left, seam);
+    }
+    
+    // Apply the deferred tags around pos, given in node's frame, on every level down
+    // to the spans that end or start there, so that cutting or joining the tree at
+    // pos sees them final. The rest of the queues stay where they are.
+    void settleSeamPath(IntervalNode* node, TreePosition pos) {
+        settleNodeRange(node, pos - 1, pos + 1);
+        IntervalNode* left = findChildContaining(node, pos - 1);
+        IntervalNode* right = findChildContaining(node, pos);
+        if (left) settleSeamPath(left, pos);
+        if (right && right != left) settleSeamPath(right, pos);
+    }
+    
+    // Merge the spans of the same tag that meet at pos, given in node's frame, at
+    // the first level below node where siblings meet there
+    void mergeSeamsAt(IntervalNode* node, TreePosition pos) {
+        while (node->numChildren > 0) {
+            // The spans on both sides of pos have to be final
+            settleNodeRange(node, pos - 1, pos + 1);
+            
+            int index = findInsertionPoint(node->children, node->numChildren, pos);
+            if (index > 0 && index < node->numChildren && node->children[index]->interval[0] == pos && 
+                node->children[index - 1]->interval[1] == pos) {
+                mergeSeamAt(node, index);
+                return;
+            }
+            
+            IntervalNode* child = findChildContaining(node, pos);
+            if (!child) return;
+            node = child;
+        }
+    }
+    
+    // Append right's children after left's end, merging the spans at the seam.
+    // Right is shifted lazily, its deferred tags move to left and its shell is freed.
+    void concatIntervalNodes(IntervalNode* left, IntervalNode* right) {
+        pushDownShift(left);
+        shiftIntervalNode(right, left->interval[1] - right->interval[0]);
+        pushDownShift(right);
+        
+        int seam = left->numChildren;
+        for (int i = 0; i < right->numChildren; i++) {
+            addChildToNode(left, right->children[i]);
+        }
+        mergeSeamAt(left, seam);
+        
+        left->interval[1] = right->interval[1];
+        moveDeferredTags(right, left);
+        moveTrackedPositions(right, left);
+        freeIntervalNodeShell(right);
+    }
+    
+    // Copy the children of src clipped to [start,end) into dest, shifted by delta
+    void copyClippedChildren(IntervalNode* dest, IntervalNode* src, TreePosition start, TreePosition end, TreePosition delta) {
+        settleNodeRange(src, start, end);
+        
+        int i = findInsertionPoint(src->children, src->numChildren, start);
+        if (i > 0 && src->children[i - 1]->interval[1] > start) {
+            i--;
+        }
+        
+        for (; i < src->numChildren && src->children[i]->interval[0] < end; i++) {
+            IntervalNode* child = src->children[i];
+            TreePosition childStart = child->interval[0] > start ? child->interval[0] : start;
+            TreePosition childEnd = child->interval[1] < end ? child->interval[1] : end;
+            
+            if (childStart >= childEnd) continue;
+            
+            IntervalNode* copy = createIntervalNode(childStart + delta, childEnd + delta, child->tag);
+            copyClippedChildren(copy, child, start, end, delta);
+            addChildToNode(dest, copy);
+        }
+    }
+    
+    // Extract [start,end) as a standalone tree rebased to 0. The copy applies the
+    // deferred tags over the range on its way down and leaves the rest queued.
+    TaggedIntervalTree* extractSlice(TaggedIntervalTree* tree, TreePosition start, TreePosition end) {
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        IntervalNode* root = tree->root;
+        start = start > root->interval[0] ? start : root->interval[0];
+        end = end < root->interval[1] ? end : root->interval[1];
+        if (end < start) end = start;
+        
+        TaggedIntervalTree* slice = createTaggedIntervalTree(0, end - start);
+        TreeMemoryAccount* previousAccount = enterTreeAccount(slice);
+        copyClippedChildren(slice->root, root, start, end, -start);
+        leaveTreeAccount(previousAccount);
+        
+        return slice;
+    }
+    
+    // Insert a slice at pos, shifting the content after pos and merging spans at both seams.
+    // Refused while the tree is replicated, since followers could not rebuild the same nodes.
+    TreeStatus pasteSlice(TaggedIntervalTree* tree, TreePosition pos, TaggedIntervalTree* slice) {
+        if (tree->log) return TREE_REPLICATION_LOG_ACTIVE;
+        touchTree(tree, slice);
+        finishPendingOperation(tree);
+        finishPendingOperation(slice);
+        IntervalNode* root = tree->root;
+        TreePosition sliceStart = slice->root->interval[0];
+        TreePosition length = slice->root->interval[1] - sliceStart;
+        
+        if (pos < root->interval[0] || pos > root->interval[1] || length <= 0) return TREE_OK;
+        if (!admitTreeGrowth(tree, measureSubtreeBytes(slice->root) + 2 * estimateTagGrowth(NULL))) {
+            return TREE_MEMORY_LIMIT_EXCEEDED;
+        }
+        
+        TREE_TRACE("Pasting slice of length %" PRIpos " at %" PRIpos "\n", length, pos);
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        changeSource = tree;
+        
+        // Detach everything after pos, splitting the spans that straddle it. The
+        // slice's deferred tags are applied as it is copied.
+        settleSeamPath(root, pos);
+        IntervalNode* tail = splitIntervalNode(root, pos);
+        
+        // Graft a copy of the slice into the gap
+        int seam = root->numChildren;
+        copyClippedChildren(root, slice->root, sliceStart, sliceStart + length, pos - sliceStart);
+        mergeSeamAt(root, seam);
+        root->interval[1] = pos + length;
+        
+        // Reattach the tail after the slice
+        concatIntervalNodes(root, tail);
+        changeSource = NULL;
+        leaveTreeAccount(previousAccount);
+        emitChange(tree, CHANGE_TEXT_INSERTED, NULL, pos, pos + length);
+        
+        return TREE_OK;
+    }
+    
+    // Split a tree at pos. The tree keeps [start,pos) and becomes the left half;
+    // the right half is a new tree rebased to 0. A replicated tree is left whole and
+    // the right half is NULL.
+    TreeSplitResult splitTree(TaggedIntervalTree* tree, TreePosition pos) {
+        TreeSplitResult result;
+        result.left = tree;
+        result.right = NULL;
+        if (tree->log) return result;
+        
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        IntervalNode* root = tree->root;
+        pos = pos > root->interval[0] ? pos : root->interval[0];
+        pos = pos < root->interval[1] ? pos : root->interval[1];
+        
+        TREE_TRACE("Splitting tree at %" PRIpos "\n", pos);
+        
+        // Both halves stay charged to the document's account, and the deferred tags
+        // away from pos stay queued in the half they lie in
+        TreePosition oldEnd = root->interval[1];
+        result.right = createTreeWithAccount(0, 0, tree->account);
+        result.right->hasDeferredTags = tree->hasDeferredTags;
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        settleSeamPath(root, pos);
+        concatIntervalNodes(result.right->root, splitIntervalNode(root, pos));
+        leaveTreeAccount(previousAccount);
+        
+        if (pos < oldEnd) {
+            emitChange(tree, CHANGE_TEXT_DELETED, NULL, pos, oldEnd);
+        }
+        return result;
+    }
+    
+    // Append b after the end of a, merging the spans at the seam. b is consumed, unless
+    // either tree is replicated or b's nodes do not fit in a's memory limit, in which
+    // case both are left untouched.
+    TreeStatus concatTrees(TaggedIntervalTree* a, TaggedIntervalTree* b) {
+        if (a->log || b->log) return TREE_REPLICATION_LOG_ACTIVE;
+        touchTree(a, b);
+        finishPendingOperation(a);
+        finishPendingOperation(b);
+        TREE_TRACE("Concatenating tree of length %" PRIpos " after %" PRIpos "\n", 
+               b->root->interval[1] - b->root->interval[0], a->root->interval[1]);
+        
+        // The nodes of b are charged to a from now on. Its deferred tags hold its
+        // account, and the nodes are measured one by one anyway, so they are applied.
+        if (b->account != a->account) {
+            settleTree(b);
+            size_t bytes = measureSubtreeBytes(b->root);
+            if (!admitTreeGrowth(a, bytes + 2 * estimateTagGrowth(NULL))) return TREE_MEMORY_LIMIT_EXCEEDED;
+            b->account->bytesUsed -= bytes;
+            chargeTreeMemory(a->account, bytes);
+        }
+        
+        // The spans meeting at the seam are made final first; the rest of b's
+        // deferred tags move to a
+        TreePosition seam = a->root->interval[1];
+        TreeMemoryAccount* previousAccount = enterTreeAccount(a);
+        settleSeamPath(a->root, seam);
+        settleSeamPath(b->root, b->root->interval[0]);
+        changeSource = a;
+        a->hasDeferredTags = a->hasDeferredTags || b->hasDeferredTags;
+        concatIntervalNodes(a->root, b->root);
+        changeSource = NULL;
+        leaveTreeAccount(previousAccount);
+        
+        if (a->root->interval[1] > seam) {
+            emitChange(a, CHANGE_TEXT_INSERTED, NULL, seam, a->root->interval[1]);
+        }
+        unlinkResidentTree(b);
+        b->account->bytesUsed -= sizeof(TaggedIntervalTree);
+        releaseTreeAccount(b->account);
+        freeChangeSubscribers(b);
+        free(b);
+        return TREE_OK;
+    }
+    
+    // Find the node carrying tag over exactly [start,end) among the owner of a tracked
+    // position and its ancestors, in O(depth). NULL if the span was merged, split or
+    // dropped, or if deferred tags over it are still to be applied.
+    IntervalNode* findSpanNode(TrackedPosition* tp, const char* tag, TreePosition start, TreePosition end) {
+        // Each node's interval is given in the frame of its ancestors' pending shifts
+        TreePosition shift = 0;
+        for (IntervalNode* node = tp->owner; node; node = node->parent) {
+            shift += node->pendingShift;
+        }
+        
+        IntervalNode* span = NULL;
+        for (IntervalNode* node = tp->owner; node; node = node->parent) {
+            shift -= node->pendingShift;
+            if (!span && node->parent && node->tag && strcmp(node->tag, tag) == 0) {
+                if (node->interval[0] + shift != start || node->interval[1] + shift != end) return NULL;
+                span = node;
+            }
+            if (span && hasDeferredTagsOver(node, start - shift, end - shift)) return NULL;
+        }
+        
+        return span;
+    }
+    
+    // Check whether a tracked position may stay attached to a node. A position is owned
+    // by a node that contains it, or sits on the node boundary it sticks to.
+    bool ownsTrackedPosition(IntervalNode* node, TrackedPosition* tp) {
+        if (!node->parent) return true;
+        
+        TreePosition pos = tp->position + node->pendingShift;
+        if (pos > node->interval[0] && pos < node->interval[1]) return true;
+        if (pos == node->interval[0]) return tp->gravity == GRAVITY_RIGHT;
+        if (pos == node->interval[1]) return tp->gravity == GRAVITY_LEFT;
+        return false;
+    }
+    
+    // Attach a tracked position given in node's children frame, climbing to the
+    // nearest ancestor that owns it
+    void attachTrackedPosition(IntervalNode* node, TrackedPosition* tp) {
+        while (!ownsTrackedPosition(node, tp)) {
+            tp->position += node->pendingShift;
+            node = node->parent;
+        }
+        
+        appendTrackedPosition(node, tp);
+    }
+    
+    // Add a tracked position to the treap of its gravity on a node
+    void appendTrackedPosition(IntervalNode* node, TrackedPosition* tp) {
+        TrackedPosition* before;
+        TrackedPosition* after;
+        splitPositions(node->positions[tp->gravity], tp->position, false, &before, &after);
+        
+        tp->owner = node;
+        tp->left = NULL;
+        tp->right = NULL;
+        tp->up = NULL;
+        tp->pendingShift = 0;
+        tp->priority = nextPositionPriority();
+        node->positions[tp->gravity] = joinPositions(joinPositions(before, tp), after);
+    }
+    
+    // Detach a tracked position from its owner; its position is left in the owner's frame
+    void detachTrackedPosition(TrackedPosition* tp) {
+        IntervalNode* owner = tp->owner;
+        if (!owner) return;
+        
+        settlePositionPath(tp);
+        TrackedPosition* rest = joinPositions(tp->left, tp->right);
+        if (rest) rest->up = tp->up;
+        
+        if (!tp->up) {
+            owner->positions[tp->gravity] = rest;
+        } else if (tp->up->left == tp) {
+            tp->up->left = rest;
+        } else {
+            tp->up->right = rest;
+        }
+        
+        tp->left = NULL;
+        tp->right = NULL;
+        tp->up = NULL;
+        tp->owner = NULL;
+    }
+    
+    // Move all tracked positions of a node that is about to be dropped to a node
+    // covering it (its parent or a sibling it is merged into)
+    void moveTrackedPositions(IntervalNode* from, IntervalNode* to) {
+        pushDownShift(to);
+        pushDownShift(from);
+        
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            scatterPositions(from->positions[gravity], 0, to, attachTrackedPosition);
+            from->positions[gravity] = NULL;
+        }
+    }
+    
+    // Re-attach the positions a node no longer owns after its interval shrank. Only
+    // the ends of the treaps outside the interval are visited.
+    void rehomeTrackedPositions(IntervalNode* node) {
+        if (!node->parent) return;
+        
+        // The interval in the frame the positions are stored in
+        TreePosition start = node->interval[0] - node->pendingShift;
+        TreePosition end = node->interval[1] - node->pendingShift;
+        
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            // Left gravity positions stay at the end and leave at the start, right
+            // gravity ones the other way round
+            TrackedPosition* before;
+            TrackedPosition* after;
+            splitPositions(node->positions[gravity], start, gravity == GRAVITY_LEFT, &before, &node->positions[gravity]);
+            splitPositions(node->positions[gravity], end, gravity == GRAVITY_LEFT, &node->positions[gravity], &after);
+            
+            scatterPositions(before, node->pendingShift, node->parent, attachTrackedPosition);
+            scatterPositions(after, node->pendingShift, node->parent, attachTrackedPosition);
+        }
+    }
+    
+    // Shift the tracked positions of a node after pos by len. Right gravity positions
+    // at pos move along, left gravity ones stay.
+    void shiftTrackedPositions(IntervalNode* node, TreePosition pos, TreePosition len) {
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            TrackedPosition* before;
+            TrackedPosition* after;
+            splitPositions(node->positions[gravity], pos, gravity == GRAVITY_LEFT, &before, &after);
+            shiftPositions(after, len);
+            node->positions[gravity] = joinPositions(before, after);
+        }
+    }
+    
+    // Map the tracked positions of a node through the deletion of [start,end). Only the
+    // positions inside the range are visited; those after it are shifted lazily.
+    void collapseTrackedPositions(IntervalNode* node, TreePosition start, TreePosition end) {
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            TrackedPosition* before;
+            TrackedPosition* inside;
+            TrackedPosition* after;
+            splitPositions(node->positions[gravity], start, true, &before, &inside);
+            splitPositions(inside, end, false, &inside, &after);
+            pinPositions(inside, start);
+            shiftPositions(after, start - end);
+            node->positions[gravity] = joinPositions(joinPositions(before, inside), after);
+        }
+    }
+    
+    // Split a treap into the positions before pos (or at it, if inclusive) and the rest
+    void splitPositions(TrackedPosition* root, TreePosition pos, bool inclusive, 
+                        TrackedPosition** before, TrackedPosition** after) {
+        if (!root) {
+            *before = NULL;
+            *after = NULL;
+            return;
+        }
+        
+        pushDownPositionShift(root);
+        root->up = NULL;
+        if (root->position < pos || (inclusive && root->position == pos)) {
+            splitPositions(root->right, pos, inclusive, &root->right, after);
+            if (root->right) root->right->up = root;
+            *before = root;
+        } else {
+            splitPositions(root->left, pos, inclusive, before, &root->left);
+            if (root->left) root->left->up = root;
+            *after = root;
+        }
+    }
+    
+    // Join two treaps in the same frame, every position of before being at or before
+    // those of after. Returns the new root, whose parent link the caller sets.
+    TrackedPosition* joinPositions(TrackedPosition* before, TrackedPosition* after) {
+        if (!before) return after;
+        if (!after) return before;
+        
+        if (before->priority > after->priority) {
+            pushDownPositionShift(before);
+            before->right = joinPositions(before->right, after);
+            before->right->up = before;
+            return before;
+        }
+        
+        pushDownPositionShift(after);
+        after->left = joinPositions(before, after->left);
+        after->left->up = after;
+        return after;
+    }
+    
+    // Shift a treap now at its root and lazily below
+    void shiftPositions(TrackedPosition* root, TreePosition delta) {
+        if (!root) return;
+        
+        root->position += delta;
+        root->pendingShift += delta;
+    }
+    
+    // Apply a treap node's pending shift to its children
+    void pushDownPositionShift(TrackedPosition* tp) {
+        if (tp->pendingShift == 0) return;
+        
+        shiftPositions(tp->left, tp->pendingShift);
+        shiftPositions(tp->right, tp->pendingShift);
+        tp->pendingShift = 0;
+    }
+    
+    // Push the pending shifts down the path from the treap root, so tp's position
+    // and those of its children are exact in the owner's frame
+    void settlePositionPath(TrackedPosition* tp) {
+        if (tp->up) settlePositionPath(tp->up);
+        pushDownPositionShift(tp);
+    }
+    
+    // Move every position of a treap to pos; the order is kept since they are all equal
+    void pinPositions(TrackedPosition* root, TreePosition pos) {
+        if (!root) return;
+        
+        root->position = pos;
+        root->pendingShift = 0;
+        pinPositions(root->left, pos);
+        pinPositions(root->right, pos);
+    }
+    
+    // Make owner the owner of every position of a treap
+    void adoptPositions(TrackedPosition* root, IntervalNode* owner) {
+        if (!root) return;
+        
+        root->owner = owner;
+        adoptPositions(root->left, owner);
+        adoptPositions(root->right, owner);
+    }
+    
+    // Take apart a treap that was taken off its node, adding delta to every position,
+    // and hand each to place with node, or invalidate them if place is NULL
+    void scatterPositions(TrackedPosition* root, TreePosition delta, IntervalNode* node, 
+                          void (*place)(IntervalNode* node, TrackedPosition* tp)) {
+        if (!root) return;
+        
+        TrackedPosition* left = root->left;
+        TrackedPosition* right = root->right;
+        TreePosition childDelta = delta + root->pendingShift;
+        
+        root->position += delta;
+        root->left = NULL;
+        root->right = NULL;
+        root->up = NULL;
+        root->pendingShift = 0;
+        root->owner = NULL;
+        if (place) place(node, root);
+        
+        scatterPositions(left, childDelta, node, place);
+        scatterPositions(right, childDelta, node, place);
+    }
+    
+    // Sink a position parked on the root back to its deepest owner
+    void sinkParkedPosition(IntervalNode* root, TrackedPosition* tp) {
+        sinkTrackedPosition(root, tp, tp->position);
+    }
+    
+    // Get the next treap priority from this thread's xorshift generator
+    uint32_t nextPositionPriority(void) {
+        uint32_t x = positionPriorityState;
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        positionPriorityState = x;
+        return x;
+    }
+    
+    // Start tracking a position, attaching it to the deepest node that owns it
+    TrackedPosition* trackPosition(TaggedIntervalTree* tree, TreePosition pos, PositionGravity gravity) {
+        TrackedPosition* tp = (TrackedPosition*)malloc(sizeof(TrackedPosition));
+        if (!tp) {
+            perror("Failed to allocate memory for TrackedPosition");
+            exit(EXIT_FAILURE);
+        }
+        tp->gravity = gravity;
+        tp->owner = NULL;
+        tp->isAnchor = false;
+        tp->data = NULL;
+        
+        placeTrackedPosition(tree, tp, pos);
+        return tp;
+    }
+    
+    // Attach a detached tracked position at pos in a tree
+    void placeTrackedPosition(TaggedIntervalTree* tree, TrackedPosition* tp, TreePosition pos) {
+        touchTree(tree, NULL);
+        
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        sinkTrackedPosition(tree->root, tp, pos);
+        leaveTreeAccount(previousAccount);
+    }
+    
+    // Attach a detached tracked position at pos, descending to the deepest owning node
+    void sinkTrackedPosition(IntervalNode* root, TrackedPosition* tp, TreePosition pos) {
+        IntervalNode* node = root;
+        pos = pos > node->interval[0] ? pos : node->interval[0];
+        pos = pos < node->interval[1] ? pos : node->interval[1];
+        
+        PositionGravity gravity = tp->gravity;
+        tp->position = pos;
+        
+        while (true) {
+            settleNodeRange(node, pos - 1, pos + 1);
+            
+            int i = findInsertionPoint(node->children, node->numChildren, pos);
+            IntervalNode* next = NULL;
+            
+            if (i < node->numChildren && node->children[i]->interval[0] == pos && 
+                gravity == GRAVITY_RIGHT) {
+                next = node->children[i];
+            } else if (i > 0 && (node->children[i - 1]->interval[1] > pos || 
+                       (node->children[i - 1]->interval[1] == pos && gravity == GRAVITY_LEFT))) {
+                next = node->children[i - 1];
+            }
+            
+            if (!next) break;
+            node = next;
+        }
+        
+        attachTrackedPosition(node, tp);
+    }
+    
+    // Resolve a tracked position to an absolute position in O(depth)
+    bool resolveTrackedPosition(TrackedPosition* tp, TreePosition* pos) {
+        if (!tp->owner) return false;
+        
+        TreePosition result = tp->position;
+        for (TrackedPosition* ancestor = tp->up; ancestor; ancestor = ancestor->up) {
+            result += ancestor->pendingShift;
+        }
+        for (IntervalNode* node = tp->owner; node; node = node->parent) {
+            result += node->pendingShift;
+        }
+        
+        *pos = result;
+        return true;
+    }
+    
+    // Stop tracking a position
+    void releaseTrackedPosition(TrackedPosition* tp) {
+        if (!tp) return;
+        
+        detachTrackedPosition(tp);
+        free(tp);
+    }
+    
+    // Insert len positions at pos, shifting everything after it
+    void insertText(TaggedIntervalTree* tree, TreePosition pos, TreePosition len) {
+        touchTree(tree, NULL);
+        settleTreeTask(tree);
+        IntervalNode* root = tree->root;
+        if (len <= 0 || pos < root->interval[0] || pos > root->interval[1]) return;
+        
+        TREE_TRACE("Inserting %" PRIpos " positions at %" PRIpos "\n", len, pos);
+        insertGapDFS(root, pos, len);
+        if (tree->pending) {
+            shiftPendingOperation(tree->pending, pos, len);
+        }
+        emitChange(tree, CHANGE_TEXT_INSERTED, NULL, pos, pos + len);
+        if (tree->log) {
+            appendLogEntry(tree->log, LOG_INSERT_TEXT, NULL, pos, pos + len);
+        }
+    }
+    
+    // DFS helper for inserting: spans containing pos grow, spans after it are shifted lazily.
+    // Only the deferred tags around pos are applied; the others move with the text.
+    void insertGapDFS(IntervalNode* node, TreePosition pos, TreePosition len) {
+        settleNodeRange(node, pos - 1, pos + 1);
+        shiftDeferredTags(node, pos, len);
+        shiftTrackedPositions(node, pos, len);
+        
+        int i = findInsertionPoint(node->children, node->numChildren, pos);
+        if (i > 0 && node->children[i - 1]->interval[1] > pos) {
+            insertGapDFS(node->children[i - 1], pos, len);
+        }
+        
+        for (; i < node->numChildren; i++) {
+            shiftIntervalNode(node->children[i], len);
+        }
+        
+        node->interval[1] += len;
+    }
+    
+    // Delete len positions at pos, shrinking or dropping the spans inside the range
+    void deleteText(TaggedIntervalTree* tree, TreePosition pos, TreePosition len) {
+        touchTree(tree, NULL);
+        settleTreeTask(tree);
+        IntervalNode* root = tree->root;
+        TreePosition start = pos > root->interval[0] ? pos : root->interval[0];
+        TreePosition end = pos + len < root->interval[1] ? pos + len : root->interval[1];
+        if (start >= end) return;
+        
+        TREE_TRACE("Deleting positions [%" PRIpos ",%" PRIpos ")\n", start, end);
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        changeSource = tree;
+        deleteRangeDFS(root, start, end);
+        changeSource = NULL;
+        leaveTreeAccount(previousAccount);
+        if (tree->pending) {
+            clipPendingOperation(tree->pending, start, end);
+        }
+        emitChange(tree, CHANGE_TEXT_DELETED, NULL, start, end);
+        if (tree->log) {
+            appendLogEntry(tree->log, LOG_DELETE_TEXT, NULL, start, end);
+        }
+    }
+    
+    // Map a position through the deletion of [start,end)
+    TreePosition mapDeletedPosition(TreePosition pos, TreePosition start, TreePosition end) {
+        if (pos <= start) return pos;
+        if (pos >= end) return pos - (end - start);
+        return start;
+    }
+    
+    // DFS helper for deleting [start,end) from a node that overlaps it. Only the
+    // deferred tags over the range and next to it are applied; the others move with
+    // the text.
+    void deleteRangeDFS(IntervalNode* node, TreePosition start, TreePosition end) {
+        settleNodeRange(node, start - 1, end + 1);
+        clipDeferredTags(node, start, end);
+        
+        node->interval[0] = mapDeletedPosition(node->interval[0], start, end);
+        node->interval[1] = mapDeletedPosition(node->interval[1], start, end);
+        
+        int first = findInsertionPoint(node->children, node->numChildren, start);
+        if (first > 0 && node->children[first - 1]->interval[1] > start) {
+            first--;
+        }
+        
+        // Drop the children inside the range; their positions move to this node
+        int kept = first;
+        for (int i = first; i < node->numChildren; i++) {
+            IntervalNode* child = node->children[i];
+            if (child->interval[0] >= start && child->interval[1] <= end) {
+                freeIntervalNode(child);
+            } else {
+                node->children[kept++] = child;
+            }
+        }
+        node->numChildren = kept;
+        
+        collapseTrackedPositions(node, start, end);
+        
+        // Shrink the children overlapping the range and shift the ones after it
+        for (int i = first; i < node->numChildren; i++) {
+            IntervalNode* child = node->children[i];
+            if (child->interval[0] >= end) {
+                shiftIntervalNode(child, start - end);
+            } else {
+                deleteRangeDFS(child, start, end);
+            }
+        }
+        
+        // Spans that now meet at start may merge; spans that met elsewhere already
+        // stay apart, so the result does not depend on which deferred tags were applied
+        int seam = findInsertionPoint(node->children, node->numChildren, start);
+        if (seam > 0 && seam < node->numChildren && node->children[seam - 1]->interval[1] == start) {
+            mergeSeamAt(node, seam);
+        }
+        
+        if (node->parent) {
+            rehomeTrackedPositions(node);
+        }
+    }
+    
+    // Defer an add or remove over [start,end) to the lowest node containing the
+    // range: the levels below apply it as edits next reach them, each deferring it
+    // to the children it reaches, so only the paths that are edited get built. The
+    // descent stops at a node with deferred tags over the range, so they keep their
+    // order.
+    void deferTag(TaggedIntervalTree* tree, bool add, const char* tag, TreePosition start, TreePosition end) {
+        IntervalNode* node = tree->root;
+        start = start > node->interval[0] ? start : node->interval[0];
+        end = end < node->interval[1] ? end : node->interval[1];
+        if (start >= end) return;
+        
+        while (!hasDeferredTagsOver(node, start, end)) {
+            pushDownShift(node);
+            IntervalNode* child = findChildContaining(node, start);
+            if (!child || child->interval[1] < end) break;
+            if (child->tag && strcmp(child->tag, tag) == 0) {
+                // Inside a span of the tag there is nothing to add, and a removal cuts the span
+                if (add) return;
+                break;
+            }
+            node = child;
+        }
+        
+        if (node->numChildren == 0) {
+            if (add) addTagDFS(node, tag, start, end);
+            return;
+        }
+        queueDeferredTag(node, add, tag, start, end);
+        tree->hasDeferredTags = true;
+    }
+    
+    // Queue an add or remove over [start,end) for the levels below node
+    void queueDeferredTag(IntervalNode* node, bool add, const char* tag, TreePosition start, TreePosition end) {
+        appendDeferredTag(&node->deferred, node, add, tag, start - node->pendingShift, end - node->pendingShift);
+    }
+    
+    // Append an add or remove over [start,end), in node's children's frame, to a
+    // deferred tag list of node. Repeating the last entry over part of its range
+    // changes nothing, so it is not appended again.
+    void appendDeferredTag(DeferredTags** list, IntervalNode* node, bool add, const char* tag, 
+                           TreePosition start, TreePosition end) {
+        DeferredTags* deferred = *list;
+        if (deferred) {
+            DeferredTag* last = &deferred->entries[deferred->count - 1];
+            if (last->add == add && last->start <= start && end <= last->end && strcmp(last->tag, tag) == 0) {
+                return;
+            }
+        } else {
+            deferred = (DeferredTags*)allocateBlockMemory(sizeof(DeferredTags));
+            deferred->entries = NULL;
+            deferred->count = 0;
+            deferred->capacity = 0;
+            deferred->account = currentAccount;
+            *list = deferred;
+        }
+        
+        if (deferred->count >= deferred->capacity) {
+            int newCapacity = deferred->capacity == 0 ? 2 : deferred->capacity * 2;
+            DeferredTag* newEntries = (DeferredTag*)allocateBlockMemory(newCapacity * sizeof(DeferredTag));
+            if (deferred->count > 0) {
+                memcpy(newEntries, deferred->entries, deferred->count * sizeof(DeferredTag));
+                releaseBlockMemory(deferred->entries, deferred->capacity * sizeof(DeferredTag));
+            }
+            deferred->entries = newEntries;
+            deferred->capacity = newCapacity;
+        }
+        
+        DeferredTag* entry = &deferred->entries[deferred->count];
+        entry->add = add;
+        entry->tag = copyTag(tag);
+        entry->start = start;
+        entry->end = end;
+        entry->reservedBytes = 0;
+        deferred->count++;
+        
+        // Under a limit, an add holds the growth of applying it here until it is applied
+        if (add && deferred->account && deferred->account->limit != 0) {
+            entry->reservedBytes = estimateDeferredGrowth(node, tag, start, end);
+            deferred->account->bytesReserved += entry->reservedBytes;
+        }
+    }
+    
+    // Check whether a deferred tag of node overlaps [start,end), given in node's frame
+    bool hasDeferredTagsOver(IntervalNode* node, TreePosition start, TreePosition end) {
+        if (!node->deferred) return false;
+        
+        start -= node->pendingShift;
+        end -= node->pendingShift;
+        for (int i = 0; i < node->deferred->count; i++) {
+            DeferredTag* entry = &node->deferred->entries[i];
+            if (entry->start < end && start < entry->end) return true;
+        }
+        return false;
+    }
+    
+    // Move the deferred tags of node, whose shift is pushed down, through the
+    // insertion of len positions at pos, as insertGapDFS moves its children
+    void shiftDeferredTags(IntervalNode* node, TreePosition pos, TreePosition len) {
+        if (!node->deferred) return;
+        
+        for (int i = 0; i < node->deferred->count; i++) {
+            DeferredTag* entry = &node->deferred->entries[i];
+            if (entry->start >= pos) entry->start += len;
+            if (entry->end > pos) entry->end += len;
+        }
+    }
+    
+    // Move the deferred tags of node, whose shift is pushed down, through the
+    // deletion of [start,end). The ones over the range have been applied.
+    void clipDeferredTags(IntervalNode* node, TreePosition start, TreePosition end) {
+        if (!node->deferred) return;
+        
+        for (int i = 0; i < node->deferred->count; i++) {
+            DeferredTag* entry = &node->deferred->entries[i];
+            entry->start = mapDeletedPosition(entry->start, start, end);
+            entry->end = mapDeletedPosition(entry->end, start, end);
+        }
+    }
+    
+    // Move the deferred tags of a node being merged into its left neighbor to that
+    // neighbor. Both have their shifts pushed down and the ranges do not overlap, so
+    // the order of the two lists does not matter.
+    void moveDeferredTags(IntervalNode* from, IntervalNode* to) {
+        DeferredTags* deferred = from->deferred;
+        if (!deferred) return;
+        
+        from->deferred = NULL;
+        TreeMemoryAccount* previousAccount = currentAccount;
+        currentAccount = deferred->account;
+        for (int i = 0; i < deferred->count; i++) {
+            DeferredTag* entry = &deferred->entries[i];
+            appendDeferredTag(&to->deferred, to, entry->add, entry->tag, entry->start, entry->end);
+        }
+        freeDeferredTags(deferred);
+        currentAccount = previousAccount;
+    }
+    
+    // Apply a node's deferred tags to its children over [from,to), in the order they
+    // were queued. The range is widened to whole blocks of DEFERRED_APPLY_CHILDREN
+    // children, and the parts of the entries outside it stay queued, so a helper
+    // that reads a few children does not pay for the node's whole fanout and
+    // scattered reads cut an entry into at most one piece per block. The node's
+    // pending shift has been pushed down already.
+    void applyDeferredTags(IntervalNode* node, TreePosition from, TreePosition to) {
+        DeferredTags* deferred = node->deferred;
+        DeferredTags* rest = NULL;
+        node->deferred = NULL;
+        
+        int first = findInsertionPoint(node->children, node->numChildren, from);
+        if (first > 0 && node->children[first - 1]->interval[1] > from) {
+            first--;
+        }
+        int last = findInsertionPoint(node->children, node->numChildren, to);
+        first -= first % DEFERRED_APPLY_CHILDREN;
+        last += DEFERRED_APPLY_CHILDREN - 1 - (last + DEFERRED_APPLY_CHILDREN - 1) % DEFERRED_APPLY_CHILDREN;
+        from = first > 0 ? node->children[first - 1]->interval[1] : node->interval[0];
+        to = last < node->numChildren ? node->children[last]->interval[0] : node->interval[1];
+        
+        IntervalNode* previousLevel = deferringBelow;
+        TreeMemoryAccount* previousAccount = currentAccount;
+        deferringBelow = node;
+        currentAccount = deferred->account;
+        for (int i = 0; i < deferred->count; i++) {
+            DeferredTag* entry = &deferred->entries[i];
+            TreePosition start = entry->start > from ? entry->start : from;
+            TreePosition end = entry->end < to ? entry->end : to;
+            
+            if (start < end) {
+                if (entry->add) {
+                    addTagDFS(node, entry->tag, start, end);
+                } else {
+                    RemoveResult result = removeTagDFS(node, entry->tag, start, end);
+                    freeRehookNodeList(&result.rehookNodeList);
+                }
+            }
+            
+            // Keep what lies inside the node on either side of the range
+            TreePosition leftStart = entry->start > node->interval[0] ? entry->start : node->interval[0];
+            TreePosition leftEnd = entry->end < from ? entry->end : from;
+            if (leftStart < leftEnd) {
+                appendDeferredTag(&rest, node, entry->add, entry->tag, leftStart, leftEnd);
+            }
+            TreePosition rightStart = entry->start > to ? entry->start : to;
+            TreePosition rightEnd = entry->end < node->interval[1] ? entry->end : node->interval[1];
+            if (rightStart < rightEnd) {
+                appendDeferredTag(&rest, node, entry->add, entry->tag, rightStart, rightEnd);
+            }
+        }
+        freeDeferredTags(deferred);
+        node->deferred = rest;
+        currentAccount = previousAccount;
+        deferringBelow = previousLevel;
+    }
+    
+    // Apply every deferred tag in a subtree
+    void applyDeferredTagsDFS(IntervalNode* node) {
+        settleNode(node);
+        for (int i = 0; i < node->numChildren; i++) {
+            applyDeferredTagsDFS(node->children[i]);
+        }
+    }
+    
+    // Free a node's deferred tags
+    void freeDeferredTags(DeferredTags* deferred) {
+        if (!deferred) return;
+        
+        for (int i = 0; i < deferred->count; i++) {
+            releaseTag(deferred->entries[i].tag);
+            deferred->account->bytesReserved -= deferred->entries[i].reservedBytes;
+        }
+        releaseBlockMemory(deferred->entries, deferred->capacity * sizeof(DeferredTag));
+        releaseBlockMemory(deferred, sizeof(DeferredTags));
+    }
+    
+    // Count the bytes held by a node's deferred tags
+    size_t measureDeferredTags(DeferredTags* deferred) {
+        if (!deferred) return 0;
+        
+        size_t bytes = sizeof(DeferredTags) + deferred->capacity * sizeof(DeferredTag);
+        for (int i = 0; i < deferred->count; i++) {
+            bytes += strlen(deferred->entries[i].tag) + 1;
+        }
+        return bytes;
+    }
+    
+    // Measure what a long add over [start,end) that deferTag queues takes: the
+    // entry and the growth it reserves at the node it is queued at. The tree is not
+    // changed; the descent follows deferTag's, adding the pending shifts on the way.
+    size_t measureDeferredAdd(IntervalNode* node, const char* tag, TreePosition start, TreePosition end) {
+        start = start > node->interval[0] ? start : node->interval[0];
+        end = end < node->interval[1] ? end : node->interval[1];
+        if (start >= end) return 0;
+        
+        while (!hasDeferredTagsOver(node, start, end)) {
+            TreePosition shift = node->pendingShift;
+            int i = findInsertionPoint(node->children, node->numChildren, start - shift + 1) - 1;
+            if (i < 0) break;
+            IntervalNode* child = node->children[i];
+            if (child->interval[1] + shift <= start || child->interval[1] + shift < end) break;
+            if (child->tag && strcmp(child->tag, tag) == 0) return 0;
+            
+            // Enter the child's frame
+            start -= shift;
+            end -= shift;
+            node = child;
+        }
+        
+        if (node->numChildren == 0) return sizeof(IntervalNode) + strlen(tag) + 1 + 4 * sizeof(IntervalNode*);
+        return estimateDeferredGrowth(node, tag, start - node->pendingShift, end - node->pendingShift) +
+               sizeof(DeferredTags) + 2 * sizeof(DeferredTag) + strlen(tag) + 1;
+    }
+    
+    // Estimate the bytes applying an add over [start,end) at node takes, given in the
+    // frame of its children: a node and its tag for each gap between the children it
+    // overlaps, the grown children array, and an entry deferring it to each of them.
+    // Found with two searches, so it costs O(log fanout).
+    size_t estimateDeferredGrowth(IntervalNode* node, const char* tag, TreePosition start, TreePosition end) {
+        int first = findInsertionPoint(node->children, node->numChildren, start);
+        if (first > 0 && node->children[first - 1]->interval[1] > start) {
+            first--;
+        }
+        int overlapped = findInsertionPoint(node->children, node->numChildren, end) - first;
+        if (overlapped < 0) overlapped = 0;
+        
+        int capacity = node->childrenCapacity;
+        while (capacity < node->numChildren + overlapped + 1) {
+            capacity = capacity == 0 ? 4 : capacity * 2;
+        }
+        size_t tagBytes = strlen(tag) + 1;
+        return (overlapped + 1) * (sizeof(IntervalNode) + tagBytes) +
+               (capacity - node->childrenCapacity) * sizeof(IntervalNode*) +
+               overlapped * (sizeof(DeferredTags) + 2 * sizeof(DeferredTag) + tagBytes);
+    }
+    
+    // Check whether a span of tag below node overlaps [start,end)
+    bool overlapsTagDFS(IntervalNode* node, const char* tag, TreePosition start, TreePosition end) {
+        return overlapsTagBelow(node, node->deferred ? node->deferred->count : 0, tag, 
+                                start - node->pendingShift, end - node->pendingShift);
+    }
+    
+    // overlapsTagDFS over the children of node, in their frame, with the first
+    // newer deferred tags of node laid over them. The newest deferred tag of the
+    // tag over a part of the range decides it: an add overlaps, and a removal
+    // leaves the parts outside it to be looked up.
+    bool overlapsTagBelow(IntervalNode* node, int newer, const char* tag, TreePosition start, TreePosition end) {
+        for (int k = newer - 1; k >= 0; k--) {
+            DeferredTag* entry = &node->deferred->entries[k];
+            if (entry->start >= end || start >= entry->end || strcmp(entry->tag, tag) != 0) continue;
+            if (entry->add) return true;
+            
+            return (start < entry->start && overlapsTagBelow(node, k, tag, start, entry->start)) || 
+                   (end > entry->end && overlapsTagBelow(node, k, tag, entry->end, end));
+        }
+        
+        int i = findInsertionPoint(node->children, node->numChildren, start);
+        if (i > 0 && node->children[i - 1]->interval[1] > start) {
+            i--;
+        }
+        
+        for (; i < node->numChildren && node->children[i]->interval[0] < end; i++) {
+            IntervalNode* child = node->children[i];
+            if (child->interval[1] <= start) continue;
+            if (child->tag && strcmp(child->tag, tag) == 0) return true;
+            if (overlapsTagDFS(child, tag, start, end)) return true;
+        }
+        return false;
+    }
+    
+    // Add a tag to an interval a piece at a time: apply pieces within the budget and
+    // hand back a continuation for the rest. Queries see the whole span at once.
+    // Refused like addTag; the growth admitted stays reserved until the pieces take it.
+    TreeStatus addTagIncremental(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end, 
+                                 WorkBudget budget, TreeContinuation* continuation) {
+        continuation->tree = tree;
+        continuation->operation = 0;
+        if (start >= end) return TREE_OK; // Invalid interval
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        size_t growth;
+        if (!admitTagGrowth(tree, tag, start, end, &growth)) return TREE_MEMORY_LIMIT_EXCEEDED;
+        
+        TREE_TRACE("Adding tag %s to interval [%" PRIpos ",%" PRIpos "] incrementally\n", tag, start, end);
+        emitChange(tree, CHANGE_TAG_ADDED, tag, start, end);
+        if (tree->log) {
+            appendLogEntry(tree->log, LOG_ADD_TAG, tag, start, end);
+        }
+        *continuation = beginTreeOperation(tree, OPERATION_ADD_TAG, tag, start, end, growth, budget);
+        return TREE_OK;
+    }
+    
+    // Remove a tag from an interval a piece at a time, like addTagIncremental. The
+    // removal is reported to subscribers up front, before it is known whether the
+    // tag was there.
+    TreeContinuation removeTagIncremental(TaggedIntervalTree* tree, const char* tag, TreePosition start, 
+                                          TreePosition end, WorkBudget budget) {
+        TreeContinuation continuation = {tree, 0};
+        if (start >= end) return continuation; // Invalid interval
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        
+        TREE_TRACE("Removing tag %s from interval [%" PRIpos ",%" PRIpos "] incrementally\n", tag, start, end);
+        emitChange(tree, CHANGE_TAG_REMOVED, tag, start, end);
+        if (tree->log) {
+            appendLogEntry(tree->log, LOG_REMOVE_TAG, tag, start, end);
+        }
+        return beginTreeOperation(tree, OPERATION_REMOVE_TAG, tag, start, end, 0, budget);
+    }
+    
+    // Compact a tree a piece at a time: merge touching siblings that carry the same
+    // tag and trim children arrays. The tagged spans do not change.
+    TreeContinuation compactTreeIncremental(TaggedIntervalTree* tree, WorkBudget budget) {
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        
+        TREE_TRACE("Compacting tree\n");
+        return beginTreeOperation(tree, OPERATION_COMPACT, NULL, tree->root->interval[0], 
+                                  tree->root->interval[1], 0, budget);
+    }
+    
+    // Compact a tree in one go
+    void compactTree(TaggedIntervalTree* tree) {
+        WorkBudget unlimited = {0, 0};
+        compactTreeIncremental(tree, unlimited);
+    }
+    
+    // Apply more pieces of an incremental operation within the budget. Returns true
+    // once the operation is done, and then the continuation is stale.
+    bool resumeTreeOperation(TreeContinuation* continuation, WorkBudget budget) {
+        if (!isTreeOperationPending(*continuation)) {
+            continuation->operation = 0;
+            return true;
+        }
+        
+        touchTree(continuation->tree, NULL);
+        if (stepTreeOperation(continuation->tree, budget)) {
+            continuation->operation = 0;
+        }
+        return continuation->operation == 0;
+    }
+    
+    // Apply the rest of an incremental operation now
+    void finishTreeOperation(TreeContinuation* continuation) {
+        WorkBudget unlimited = {0, 0};
+        resumeTreeOperation(continuation, unlimited);
+    }
+    
+    // Check whether an incremental operation still has pieces to apply
+    bool isTreeOperationPending(TreeContinuation continuation) {
+        return continuation.operation != 0 && continuation.tree->pending && 
+               continuation.tree->pending->id == continuation.operation;
+    }
+    
+    // Start an incremental operation over [start,end) clipped to the tree, reserving
+    // the growth it was admitted with, and take its first step
+    TreeContinuation beginTreeOperation(TaggedIntervalTree* tree, OperationKind kind, const char* tag, 
+                                        TreePosition start, TreePosition end, size_t reservedBytes, 
+                                        WorkBudget budget) {
+        IntervalNode* root = tree->root;
+        TreeContinuation continuation = {tree, 0};
+        if (start < root->interval[0]) start = root->interval[0];
+        if (end > root->interval[1]) end = root->interval[1];
+        if (start >= end) return continuation;
+        
+        TreeOperation* operation = (TreeOperation*)malloc(sizeof(TreeOperation));
+        if (!operation) {
+            perror("Failed to allocate memory for TreeOperation");
+            exit(EXIT_FAILURE);
+        }
+        operation->kind = kind;
+        operation->id = ++tree->operationCount;
+        operation->tag = NULL;
+        if (tag) {
+            operation->tag = strdup(tag);
+            if (!operation->tag) {
+                perror("Failed to allocate memory for operation tag");
+                exit(EXIT_FAILURE);
+            }
+        }
+        operation->start = start;
+        operation->cursor = start;
+        operation->end = end;
+        operation->pieceLength = 64;
+        operation->reservedBytes = reservedBytes;
+        tree->account->bytesReserved += reservedBytes;
+        tree->pending = operation;
+        
+        continuation.operation = operation->id;
+        if (stepTreeOperation(tree, budget)) {
+            continuation.operation = 0;
+        }
+        return continuation;
+    }
+    
+    // Apply pieces of the tree's pending operation until the budget is spent; at
+    // least one piece is applied. Piece lengths adapt so a piece visits about
+    // OPERATION_PIECE_NODES nodes. Returns true and frees the operation once it is done.
+    bool stepTreeOperation(TaggedIntervalTree* tree, WorkBudget budget) {
+        TreeOperation* operation = tree->pending;
+        int pieceNodes = budget.maxNodes > 0 && budget.maxNodes < OPERATION_PIECE_NODES ? 
+                         budget.maxNodes : OPERATION_PIECE_NODES;
+        uint64_t begin = budget.maxNanoseconds > 0 ? monotonicNanoseconds() : 0;
+        size_t visited = 0;
+        
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        changeSource = tree;
+        while (operation->cursor < operation->end) {
+            TreePosition pieceEnd = operation->end - operation->cursor > operation->pieceLength ? 
+                                    operation->cursor + operation->pieceLength : operation->end;
+            size_t visitedBefore = nodesVisited;
+            size_t usedBefore = tree->account->bytesUsed;
+            applyOperationPiece(tree->root, operation, pieceEnd);
+            size_t cost = nodesVisited - visitedBefore;
+            
+            // What the piece took is charged now, so that much less stays reserved
+            size_t used = tree->account->bytesUsed;
+            size_t taken = used > usedBefore ? used - usedBefore : 0;
+            taken = taken < operation->reservedBytes ? taken : operation->reservedBytes;
+            operation->reservedBytes -= taken;
+            tree->account->bytesReserved -= taken;
+            visited += cost;
+            operation->cursor = pieceEnd;
+            
+            if (cost < (size_t)pieceNodes / 2 && operation->pieceLength < operation->end - operation->cursor) {
+                operation->pieceLength *= 2;
+            } else if (cost > (size_t)pieceNodes * 2 && operation->pieceLength > 1) {
+                operation->pieceLength /= 2;
+            }
+            
+            if (budget.maxNodes > 0 && visited >= (size_t)budget.maxNodes) break;
+            if (budget.maxNanoseconds > 0 && monotonicNanoseconds() - begin >= budget.maxNanoseconds) break;
+        }
+        changeSource = NULL;
+        leaveTreeAccount(previousAccount);
+        
+        if (operation->cursor < operation->end) return false;
+        
+        endTreeOperation(tree);
+        return true;
+    }
+    
+    // Apply an operation to [cursor,pieceEnd)
+    void applyOperationPiece(IntervalNode* root, TreeOperation* operation, TreePosition pieceEnd) {
+        switch (operation->kind) {
+            case OPERATION_ADD_TAG:
+                addTagDFS(root, operation->tag, operation->cursor, pieceEnd);
+                break;
+            case OPERATION_REMOVE_TAG: {
+                RemoveResult result = removeTagDFS(root, operation->tag, operation->cursor, pieceEnd);
+                freeRehookNodeList(&result.rehookNodeList);
+                
+                // The previous piece cut the spans inside the ones it removed at cursor,
+                // and this one lifted their other halves next to them; join them again,
+                // so the pieces leave the spans a whole removal would
+                if (operation->cursor > operation->start) {
+                    mergeSeamsAt(root, operation->cursor);
+                }
+                break;
+            }
+            case OPERATION_COMPACT:
+                compactDFS(root, operation->cursor, pieceEnd);
+                break;
+        }
+    }
+    
+    // Drop the tree's pending operation, releasing the growth it still has reserved
+    void endTreeOperation(TaggedIntervalTree* tree) {
+        TreeOperation* operation = tree->pending;
+        if (!operation) return;
+        
+        tree->account->bytesReserved -= operation->reservedBytes;
+        tree->pending = NULL;
+        freeTreeOperation(operation);
+    }
+    
+    // Free an incremental operation
+    void freeTreeOperation(TreeOperation* operation) {
+        if (!operation) return;
+        
+        free(operation->tag);
+        free(operation);
+    }
+    
+    // Finish the tree's pending operation, if any, and let a task reading the tree
+    // get through with it first
+    void finishPendingOperation(TaggedIntervalTree* tree) {
+        settleTreeTask(tree);
+        if (!tree->pending) return;
+        
+        WorkBudget unlimited = {0, 0};
+        stepTreeOperation(tree, unlimited);
+    }
+    
+    // Finish the pending operation and apply every deferred tag, for calls that
+    // read or reshape the whole tree and cannot overlay them
+    void settleTree(TaggedIntervalTree* tree) {
+        finishPendingOperation(tree);
+        if (!tree->hasDeferredTags) return;
+        
+        applyDeferredTagsDFS(tree->root);
+        tree->hasDeferredTags = false;
+    }
+    
+    // Move a pending operation's range through the insertion of len positions at
+    // pos. Text inserted where the operation began stays outside it, as it does
+    // at the start of a span, and compaction grows with the tree.
+    void shiftPendingOperation(TreeOperation* operation, TreePosition pos, TreePosition len) {
+        bool untouched = operation->cursor == operation->start;
+        if (pos <= operation->start) operation->start += len;
+        if (untouched) {
+            operation->cursor = operation->start;
+        } else if (pos < operation->cursor) {
+            operation->cursor += len;
+        }
+        if (pos < operation->end || (pos == operation->end && operation->kind == OPERATION_COMPACT)) {
+            operation->end += len;
+        }
+    }
+    
+    // Move a pending operation's range through the deletion of [start,end)
+    void clipPendingOperation(TreeOperation* operation, TreePosition start, TreePosition end) {
+        operation->start = mapDeletedPosition(operation->start, start, end);
+        operation->cursor = mapDeletedPosition(operation->cursor, start, end);
+        operation->end = mapDeletedPosition(operation->end, start, end);
+    }
+    
+    // Check whether a query about tag over [start,end) meets the part of a
+    // pending add of that tag or of a pending remove that is not applied yet. A
+    // remove of another tag matters too: it cuts the spans inside the ones it cuts.
+    bool overlaysPendingTag(TreeOperation* operation, const char* tag, TreePosition start, TreePosition end) {
+        return operation && operation->tag && start < operation->end && operation->cursor < end && 
+               (operation->kind == OPERATION_REMOVE_TAG || strcmp(operation->tag, tag) == 0);
+    }
+    
+    // Make the tags collected at pos from index first on show a pending add or
+    // remove; a pending tag is listed last
+    void overlayTagsAt(TreeOperation* operation, TreePosition pos, TagsAt* tags, int first) {
+        if (!operation || !operation->tag || pos < operation->cursor || pos >= operation->end) return;
+        
+        int kept = first;
+        bool present = false;
+        for (int i = first; i < tags->count; i++) {
+            if (strcmp(tags->tags[i], operation->tag) == 0) {
+                present = true;
+                if (operation->kind == OPERATION_REMOVE_TAG) continue;
+            }
+            tags->tags[kept++] = tags->tags[i];
+        }
+        tags->count = kept;
+        
+        if (operation->kind == OPERATION_ADD_TAG && !present) {
+            appendTagsAt(tags, operation->tag);
+        }
+    }
+    
+    // DFS helper for compaction: merge each child starting in [from,to) into its
+    // left sibling when they carry the same tag and touch, then trim the node's
+    // children array
+    void compactDFS(IntervalNode* node, TreePosition from, TreePosition to) {
+        nodesVisited++;
+        settleNodeRange(node, from, to);
+        
+        int i = findInsertionPoint(node->children, node->numChildren, from);
+        if (i > 0 && node->children[i - 1]->interval[1] > from) {
+            i--;
+        }
+        
+        while (i < node->numChildren && node->children[i]->interval[0] < to) {
+            IntervalNode* child = node->children[i];
+            compactDFS(child, from, to);
+            
+            // After a merge children[i] is the next sibling, to be tried against the merged span
+            int numChildren = node->numChildren;
+            if (child->interval[0] >= from) {
+                mergeSeamAt(node, i);
+            }
+            if (node->numChildren == numChildren) {
+                i++;
+            }
+        }
+        
+        shrinkChildArray(node);
+    }
+    
+    // Trim a children array to the smallest power of two that holds the children
+    void shrinkChildArray(IntervalNode* node) {
+        int capacity = 0;
+        if (node->numChildren > 0) {
+            capacity = 4;
+            while (capacity < node->numChildren) capacity *= 2;
+        }
+        if (capacity >= node->childrenCapacity) return;
+        
+        IntervalNode** children = NULL;
+        if (capacity > 0) {
+            children = allocateChildArray(capacity);
+            memcpy(children, node->children, node->numChildren * sizeof(IntervalNode*));
+        }
+        releaseChildArray(node->children, node->childrenCapacity);
+        node->children = children;
+        node->childrenCapacity = capacity;
+    }
+    
+    // Get a monotonic timestamp in nanoseconds
+    uint64_t monotonicNanoseconds(void) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+    }
+    
+    #ifdef TAG_TREE_LATENCY_STATS
+    // Get the name of an instrumented operation
+    const char* latencyOperationName(LatencyOperation operation) {
+        static const char* names[NUM_LATENCY_OPERATIONS] = {"addTag", "removeTag", "hasTag", "getFormattedText"};
+        return names[operation];
+    }
+    
+    // Record the time since a timer started in this thread's histogram. Only the
+    // owning thread writes its counts, so a relaxed load and store will do.
+    void recordLatency(LatencyTimer* timer) {
+        uint64_t ticks = LATENCY_TICKS() - timer->begin;
+        ThreadLatency* latency = threadLatency ? threadLatency : registerThreadLatency();
+        _Atomic uint64_t* count = &latency->counts[timer->operation][latencyBucket(ticks)];
+        atomic_store_explicit(count, atomic_load_explicit(count, memory_order_relaxed) + 1, memory_order_relaxed);
+    }
+    
+    // Get the bucket of a value: exact below LATENCY_SUB_BUCKETS, then
+    // LATENCY_SUB_BUCKETS buckets to each power of two
+    int latencyBucket(uint64_t ticks) {
+        if (ticks < LATENCY_SUB_BUCKETS) return (int)ticks;
+        if (ticks >> LATENCY_MAX_BITS) return NUM_LATENCY_BUCKETS - 1;
+        
+        int shift = 63 - __builtin_clzll(ticks) - LATENCY_SUB_BUCKET_BITS;
+        return shift * LATENCY_SUB_BUCKETS + (int)(ticks >> shift);
+    }
+    
+    // Get the smallest value that falls in a bucket
+    uint64_t latencyBucketStart(int bucket) {
+        if (bucket < 2 * LATENCY_SUB_BUCKETS) return (uint64_t)bucket;
+        
+        int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+        return (uint64_t)(bucket % LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKETS) << shift;
+    }
+    
+    // Give this thread a histogram and list it, so collectLatencyStats finds it
+    ThreadLatency* registerThreadLatency(void) {
+        ThreadLatency* latency = (ThreadLatency*)calloc(1, sizeof(ThreadLatency));
+        if (!latency) {
+            perror("Failed to allocate memory for latency histogram");
+            exit(EXIT_FAILURE);
+        }
+        
+        pthread_once(&latencyKeyOnce, createLatencyKey);
+        pthread_mutex_lock(&latencyLock);
+        latency->next = latencyThreads;
+        latencyThreads = latency;
+        pthread_mutex_unlock(&latencyLock);
+        
+        pthread_setspecific(latencyKey, latency);
+        threadLatency = latency;
+        return latency;
+    }
+    
+    // Thread exit handler: fold the thread's counts into the retired ones and free them
+    void retireThreadLatency(void* latency) {
+        pthread_mutex_lock(&latencyLock);
+        ThreadLatency** link = &latencyThreads;
+        while (*link != latency) {
+            link = &(*link)->next;
+        }
+        *link = ((ThreadLatency*)latency)->next;
+        
+        for (int op = 0; op < NUM_LATENCY_OPERATIONS; op++) {
+            for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+                retiredLatency[op][i] += atomic_load_explicit(&((ThreadLatency*)latency)->counts[op][i], 
+                                                              memory_order_relaxed);
+            }
+        }
+        pthread_mutex_unlock(&latencyLock);
+        
+        free(latency);
+        threadLatency = NULL;
+    }
+    
+    // Create the key whose destructor retires a thread's histogram, and take the
+    // first reading of the clocks that later readings convert ticks with
+    void createLatencyKey(void) {
+        if (pthread_key_create(&latencyKey, retireThreadLatency) != 0) {
+            perror("Failed to create latency key");
+            exit(EXIT_FAILURE);
+        }
+        latencyEpochTicks = LATENCY_TICKS();
+        latencyEpochNanoseconds = monotonicNanoseconds();
+    }
+    
+    // Merge the histograms of every thread, live or exited, into one per operation.
+    // Counts are read while their threads keep recording, so a snapshot may miss
+    // the last few samples.
+    void collectLatencyStats(LatencyHistogram* histograms) {
+        memset(histograms, 0, NUM_LATENCY_OPERATIONS * sizeof(LatencyHistogram));
+        pthread_once(&latencyKeyOnce, createLatencyKey);
+        
+        pthread_mutex_lock(&latencyLock);
+        for (int op = 0; op < NUM_LATENCY_OPERATIONS; op++) {
+            for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+                histograms[op].counts[i] = retiredLatency[op][i];
+            }
+        }
+        for (ThreadLatency* latency = latencyThreads; latency; latency = latency->next) {
+            for (int op = 0; op < NUM_LATENCY_OPERATIONS; op++) {
+                for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+                    histograms[op].counts[i] += atomic_load_explicit(&latency->counts[op][i], memory_order_relaxed);
+                }
+            }
+        }
+        pthread_mutex_unlock(&latencyLock);
+        
+        // Ticks are converted with their rate since the first thread registered
+        double nanosecondsPerTick = 1.0;
+        if (LATENCY_TICKS_ARE_CYCLES) {
+            uint64_t ticks = LATENCY_TICKS() - latencyEpochTicks;
+            uint64_t nanoseconds = monotonicNanoseconds() - latencyEpochNanoseconds;
+            nanosecondsPerTick = ticks > 0 ? (double)nanoseconds / ticks : 1.0;
+        }
+        for (int op = 0; op < NUM_LATENCY_OPERATIONS; op++) {
+            histograms[op].nanosecondsPerTick = nanosecondsPerTick;
+            for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+                histograms[op].total += histograms[op].counts[i];
+            }
+        }
+    }
+    
+    // Add the counts of one histogram to another. Both should come from the same
+    // process, so their ticks have the same length.
+    void mergeLatencyHistograms(LatencyHistogram* into, const LatencyHistogram* from) {
+        for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+            into->counts[i] += from->counts[i];
+        }
+        into->total += from->total;
+        if (into->nanosecondsPerTick == 0) {
+            into->nanosecondsPerTick = from->nanosecondsPerTick;
+        }
+    }
+    
+    // Get the latency in nanoseconds that percentile percent of the samples stay
+    // under, to the precision of a bucket; 0 for an empty histogram
+    uint64_t getLatencyPercentile(const LatencyHistogram* histogram, double percentile) {
+        if (histogram->total == 0) return 0;
+        
+        double exactRank = percentile / 100.0 * histogram->total;
+        uint64_t rank = (uint64_t)exactRank;
+        if (rank < exactRank || rank == 0) rank++;
+        uint64_t seen = 0;
+        int bucket = 0;
+        for (; bucket < NUM_LATENCY_BUCKETS - 1; bucket++) {
+            seen += histogram->counts[bucket];
+            if (seen >= rank) break;
+        }
+        return (uint64_t)(latencyBucketStart(bucket + 1) * histogram->nanosecondsPerTick);
+    }
+    
+    // Write a summary line per operation, or in JSON the percentiles and the
+    // nonempty buckets as [start in nanoseconds, count] pairs
+    void dumpLatencyStats(const LatencyHistogram* histograms, DumpFormat format, DumpCallback callback, void* context) {
+        static const double percentiles[] = {50, 90, 99, 99.9, 100};
+        DumpBuffer buffer = {.length = 0, .callback = callback, .context = context};
+        
+        if (format == DUMP_JSON) writeDumpf(&buffer, "{");
+        for (int op = 0; op < NUM_LATENCY_OPERATIONS; op++) {
+            const LatencyHistogram* histogram = &histograms[op];
+            if (format == DUMP_JSON) {
+                writeDumpf(&buffer, "%s\n\"%s\":{\"count\":%" PRIu64, op > 0 ? "," : "", 
+                           latencyOperationName(op), histogram->total);
+                for (int p = 0; p < 5; p++) {
+                    writeDumpf(&buffer, ",\"p%g\":%" PRIu64, percentiles[p], 
+                               getLatencyPercentile(histogram, percentiles[p]));
+                }
+                writeDumpf(&buffer, ",\"buckets\":[");
+                bool first = true;
+                for (int i = 0; i < NUM_LATENCY_BUCKETS; i++) {
+                    if (histogram->counts[i] == 0) continue;
+                    writeDumpf(&buffer, "%s[%" PRIu64 ",%" PRIu64 "]", first ? "" : ",", 
+                               (uint64_t)(latencyBucketStart(i) * histogram->nanosecondsPerTick), histogram->counts[i]);
+                    first = false;
+                }
+                writeDumpf(&buffer, "]}");
+            } else {
+                writeDumpf(&buffer, "%-17s %10" PRIu64 " ops", latencyOperationName(op), histogram->total);
+                for (int p = 0; p < 5; p++) {
+                    writeDumpf(&buffer, "  p%g %" PRIu64 " ns", percentiles[p], 
+                               getLatencyPercentile(histogram, percentiles[p]));
+                }
+                writeDumpf(&buffer, "\n");
+            }
+        }
+        if (format == DUMP_JSON) writeDumpf(&buffer, "\n}\n");
+        flushDump(&buffer);
+    }
+    #endif
+    
+    // Start formatting text with the tree's tags. The task walks the tree for the
+    // markers, then renders them into *formatted in the steps after it no longer
+    // needs the tree.
+    TreeTask* startFormatTask(TaggedIntervalTree* tree, const char* text, char** formatted) {
+        TreeTask* task = createTreeTask(TASK_FORMAT_TEXT, tree);
+        *formatted = NULL;
+        task->text = text;
+        task->formatted = formatted;
+        initTreeWalk(&task->walk, tree->root);
+        return task;
+    }
+    
+    // Start parsing <tag>...</tag> markup as parseTaggedText does, building the
+    // tree a tag at a time. *tree and *plainText are set once the task is done.
+    TreeTask* startParseTask(const char* input, size_t len, TaggedIntervalTree** tree, char** plainText) {
+        TreeBuilder* builder = beginTreeBuilder(0);
+        TreeTask* task = createTreeTask(TASK_PARSE_MARKUP, builder->tree);
+        *tree = NULL;
+        *plainText = NULL;
+        task->input = input;
+        task->length = len;
+        task->builder = builder;
+        task->parsed = tree;
+        task->plainText = plainText;
+        task->plain = (char*)malloc(len + 1);
+        if (!task->plain) {
+            perror("Failed to allocate memory for plain text");
+            exit(EXIT_FAILURE);
+        }
+        
+        return task;
+    }
+    
+    // Start hibernating a tree, encoding its nodes a few at a time. Once they are
+    // all encoded the blob takes their place, and the steps after that free them.
+    // A tree still being built by a parse task stays resident.
+    TreeTask* startHibernateTask(TaggedIntervalTree* tree) {
+        TreeTask* task = createTreeTask(TASK_HIBERNATE, NULL);
+        if (tree->blob || (tree->task && tree->task->kind == TASK_PARSE_MARKUP)) return task;
+        finishPendingOperation(tree);
+        if (tree->blob) return task;
+        
+        attachTreeTask(task, tree);
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        initTreeWalk(&task->walk, tree->root);
+        leaveTreeAccount(previousAccount);
+        startBlobChunk(task);
+        writeVarint(&task->nodes, tree->root->numChildren);
+        return task;
+    }
+    
+    // Start compacting a tree; the task runs compactTreeIncremental and resumes it
+    TreeTask* startCompactTask(TaggedIntervalTree* tree) {
+        touchTree(tree, NULL);
+        finishPendingOperation(tree);
+        TreeTask* task = createTreeTask(TASK_COMPACT, NULL);
+        
+        attachTreeTask(task, tree);
+        return task;
+    }
+    
+    // Run a task until it is done or the budget is spent; at least one node or tag
+    // is handled. Returns true once the task is done, or was cancelled.
+    bool runTreeTask(TreeTask* task, WorkBudget budget) {
+        if (task->done) return true;
+        uint64_t begin = budget.maxNanoseconds > 0 ? monotonicNanoseconds() : 0;
+        if (task->tree && !stepTreeTask(task, budget)) return false;
+        
+        if (task->kind == TASK_FORMAT_TEXT) {
+            if (!stepFormatRender(&task->render, budget, begin)) return false;
+            if (!freeTaskTags(task, budget, begin)) return false;
+            *task->formatted = task->render.buffer.data;
+            task->render.buffer.data = NULL;
+        }
+        task->done = true;
+        return true;
+    }
+    
+    // Check whether a task is through with its tree. The rest of a detached format
+    // task only renders its markers, so it may be run on another thread while the
+    // tree is used again. A hibernate task frees the nodes the blob replaced until
+    // it is done, so it stays with its tree.
+    bool isTreeTaskDetached(TreeTask* task) {
+        return task->tree == NULL;
+    }
+    
+    // Stop a task and drop its partial work. A cancelled hibernation leaves the tree
+    // resident, or frees the rest of the nodes once the blob has replaced them, and
+    // a cancelled compaction leaves the rest of the tree as it was.
+    void cancelTreeTask(TreeTask* task) {
+        if (task->done) return;
+        
+        TaggedIntervalTree* tree = task->tree;
+        detachTreeTask(task);
+        switch (task->kind) {
+            case TASK_FORMAT_TEXT:
+                freeFormatRender(&task->render);
+                freeTaskMarkers(task);
+                break;
+            case TASK_PARSE_MARKUP:
+                freeTaggedIntervalTree(task->builder->tree);
+                free(task->builder->open);
+                free(task->builder);
+                task->builder = NULL;
+                free(task->plain);
+                task->plain = NULL;
+                break;
+            case TASK_HIBERNATE:
+                freeBlobChunks(task);
+                free(task->blob.data);
+                free(task->tags.tags);
+                task->blob.data = NULL;
+                task->tags.tags = NULL;
+                if (task->detached.children) {
+                    WorkBudget unlimited = {0, 0};
+                    TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+                    freeHibernatedNodes(task, tree->root, unlimited, 0, 0);
+                    leaveTreeAccount(previousAccount);
+                }
+                break;
+            case TASK_COMPACT:
+                if (tree && isTreeOperationPending(task->continuation)) {
+                    endTreeOperation(tree);
+                }
+                break;
+        }
+        task->done = true;
+    }
+    
+    // Free a task, cancelling it if it is not done
+    void freeTreeTask(TreeTask* task) {
+        if (!task) return;
+        
+        cancelTreeTask(task);
+        freeTreeWalk(&task->walk);
+        free(task);
+    }
+    
+    // Allocate a task; a tree given here has its pending operation finished and
+    // becomes the task's tree. The task's walk applies deferred tags as it goes.
+    TreeTask* createTreeTask(TreeTaskKind kind, TaggedIntervalTree* tree) {
+        TreeTask* task = (TreeTask*)calloc(1, sizeof(TreeTask));
+        if (!task) {
+            perror("Failed to allocate memory for TreeTask");
+            exit(EXIT_FAILURE);
+        }
+        task->kind = kind;
+        
+        if (tree) {
+            if (kind != TASK_PARSE_MARKUP) {
+                finishPendingOperation(tree);
+                touchTree(tree, NULL);
+            }
+            attachTreeTask(task, tree);
+        }
+        return task;
+    }
+    
+    // Make a task the one working on a tree. A task already there has been run by
+    // settleTreeTask until it stopped reading the tree, and now lets go of it.
+    void attachTreeTask(TreeTask* task, TaggedIntervalTree* tree) {
+        if (tree->task) {
+            detachTreeTask(tree->task);
+        }
+        task->tree = tree;
+        tree->task = task;
+    }
+    
+    // Let go of a task's tree
+    void detachTreeTask(TreeTask* task) {
+        if (task->tree && task->tree->task == task) {
+            task->tree->task = NULL;
+        }
+        task->tree = NULL;
+    }
+    
+    // Run the task working on a tree until it no longer reads the tree, before the
+    // tree is changed or read as a whole. The tree is in use again, so a hibernation
+    // is dropped. Compaction is left to the pending operation, and a tree being
+    // parsed is only seen by its task.
+    void settleTreeTask(TaggedIntervalTree* tree) {
+        TreeTask* task = tree->task;
+        if (!task || task->kind == TASK_COMPACT || task->kind == TASK_PARSE_MARKUP) return;
+        if (task->kind == TASK_HIBERNATE) {
+            cancelTreeTask(task);
+            return;
+        }
+        
+        WorkBudget unlimited = {0, 0};
+        stepTreeTask(task, unlimited);
+    }
+    
+    // Do a task's work on its tree within the budget. Returns true and detaches the
+    // task once it is through with the tree.
+    bool stepTreeTask(TreeTask* task, WorkBudget budget) {
+        TaggedIntervalTree* tree = task->tree;
+        uint64_t begin = budget.maxNanoseconds > 0 ? monotonicNanoseconds() : 0;
+        bool finished = false;
+        
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        switch (task->kind) {
+            case TASK_FORMAT_TEXT:
+                finished = stepFormatTask(task, budget, begin);
+                break;
+            case TASK_PARSE_MARKUP:
+                finished = stepParseTask(task, budget, begin);
+                break;
+            case TASK_HIBERNATE:
+                finished = stepHibernateTask(task, budget, begin);
+                break;
+            case TASK_COMPACT:
+                if (!task->continuation.tree) {
+                    task->continuation = compactTreeIncremental(tree, budget);
+                    finished = !isTreeOperationPending(task->continuation);
+                } else {
+                    finished = resumeTreeOperation(&task->continuation, budget);
+                }
+                break;
+        }
+        leaveTreeAccount(previousAccount);
+        
+        if (finished) {
+            detachTreeTask(task);
+        }
+        return finished;
+    }
+    
+    // Check whether a step has spent its budget after handling count nodes or tags.
+    // The clock is read every TASK_CLOCK_INTERVAL of them.
+    bool isTaskBudgetSpent(WorkBudget budget, size_t count, uint64_t begin) {
+        if (budget.maxNodes > 0 && count >= (size_t)budget.maxNodes) return true;
+        return budget.maxNanoseconds > 0 && count % TASK_CLOCK_INTERVAL == 0 && 
+               monotonicNanoseconds() - begin >= budget.maxNanoseconds;
+    }
+    
+    // Collect the markers of the next nodes, in the order getFormattedText always
+    // used, and hand them to the rendering once the walk is over
+    bool stepFormatTask(TreeTask* task, WorkBudget budget, uint64_t begin) {
+        size_t count = 0;
+        IntervalNode* node;
+        while ((node = advanceTreeWalk(&task->walk))) {
+            if (node->tag) {
+                // Markers come in pairs in pre-order, so the pair index orders the nodes
+                int order = task->markerCount / 2;
+                char* tag = copyTaskTag(task, node->tag);
+                addTaskMarker(task, node->interval[0], tag, true, order);
+                addTaskMarker(task, node->interval[1], tag, false, order);
+            }
+            if (isTaskBudgetSpent(budget, ++count, begin)) return false;
+        }
+        
+        beginChunkedFormatRender(&task->render, task->text, task->chunks, task->markerCount);
+        task->chunks = NULL;
+        task->lastChunk = NULL;
+        task->markerCount = 0;
+        return true;
+    }
+    
+    // Add a marker to a format task, starting a chunk once the last one is full
+    void addTaskMarker(TreeTask* task, TreePosition position, char* tag, bool isOpening, int order) {
+        MarkerChunk* chunk = task->lastChunk;
+        if (!chunk || chunk->count == FORMAT_MARKER_CHUNK) {
+            chunk = (MarkerChunk*)malloc(sizeof(MarkerChunk));
+            if (!chunk) {
+                perror("Failed to allocate memory for markers");
+                exit(EXIT_FAILURE);
+            }
+            chunk->next = NULL;
+            chunk->count = 0;
+            
+            if (task->lastChunk) {
+                task->lastChunk->next = chunk;
+            } else {
+                task->chunks = chunk;
+            }
+            task->lastChunk = chunk;
+        }
+        
+        TagMarker* marker = &chunk->markers[chunk->count++];
+        marker->position = position;
+        marker->tag = tag;
+        marker->isOpening = isOpening;
+        marker->order = order;
+        task->markerCount++;
+    }
+    
+    // Copy a tag into the blocks of a format task, or share the last copy if the
+    // tag is the same. The copies live until the markers are written, so markers
+    // free no tags one at a time.
+    char* copyTaskTag(TreeTask* task, const char* tag) {
+        if (task->lastTag && strcmp(task->lastTag, tag) == 0) return task->lastTag;
+        
+        size_t length = strlen(tag) + 1;
+        TagBlock* block = task->tagBlocks;
+        if (!block || block->used + length > block->size) {
+            size_t size = length > FORMAT_TAG_BLOCK ? length : FORMAT_TAG_BLOCK;
+            block = (TagBlock*)malloc(sizeof(TagBlock) + size);
+            if (!block) {
+                perror("Failed to allocate memory for marker tags");
+                exit(EXIT_FAILURE);
+            }
+            block->next = task->tagBlocks;
+            block->size = size;
+            block->used = 0;
+            task->tagBlocks = block;
+        }
+        
+        char* copy = block->bytes + block->used;
+        memcpy(copy, tag, length);
+        block->used += length;
+        task->lastTag = copy;
+        return copy;
+    }
+    
+    // Free the tag copies of a format task whose markers are written, a block at a
+    // time. A block counts as TASK_CLOCK_INTERVAL tags, so the clock is read after
+    // each. Returns true once they are all freed.
+    bool freeTaskTags(TreeTask* task, WorkBudget budget, uint64_t begin) {
+        size_t count = 0;
+        while (task->tagBlocks) {
+            TagBlock* next = task->tagBlocks->next;
+            free(task->tagBlocks);
+            task->tagBlocks = next;
+            count += TASK_CLOCK_INTERVAL;
+            if (task->tagBlocks && isTaskBudgetSpent(budget, count, begin)) return false;
+        }
+        task->lastTag = NULL;
+        return true;
+    }
+    
+    // Free the marker chunks a format task still holds and its tag copies
+    void freeTaskMarkers(TreeTask* task) {
+        while (task->chunks) {
+            MarkerChunk* next = task->chunks->next;
+            free(task->chunks);
+            task->chunks = next;
+        }
+        while (task->tagBlocks) {
+            TagBlock* next = task->tagBlocks->next;
+            free(task->tagBlocks);
+            task->tagBlocks = next;
+        }
+        task->lastChunk = NULL;
+        task->lastTag = NULL;
+        task->markerCount = 0;
+    }
+    
+    // Parse up to the next tags of the input, then close the tree and hand over the
+    // results once the input is consumed
+    bool stepParseTask(TreeTask* task, WorkBudget budget, uint64_t begin) {
+        const char* input = task->input;
+        size_t len = task->length;
+        size_t count = 0;
+        
+        while (task->pos < len) {
+            // Copy the text up to the next tag
+            size_t markup = findMarkupStart(input, task->pos, len);
+            memcpy(task->plain + task->plainLength, input + task->pos, markup - task->pos);
+            task->plainLength += markup - task->pos;
+            task->pos = markup;
+            if (markup == len) break;
+            
+            size_t nameStart = markup + 1;
+            bool closing = nameStart < len && input[nameStart] == '/';
+            if (closing) nameStart++;
+            
+            size_t nameEnd = nameStart;
+            while (nameEnd < len && nameEnd - nameStart < MAX_TAG_LENGTH && isTagNameChar(input[nameEnd])) {
+                nameEnd++;
+            }
+            
+            if (nameEnd == nameStart || nameEnd >= len || input[nameEnd] != '>' || 
+                nameEnd - nameStart >= MAX_TAG_LENGTH) {
+                task->plain[task->plainLength++] = '<';
+                task->pos = markup + 1;
+                continue;
+            }
+            
+            char tag[MAX_TAG_LENGTH];
+            memcpy(tag, input + nameStart, nameEnd - nameStart);
+            tag[nameEnd - nameStart] = '\0';
+            
+            if (closing) {
+                closeBuilderSpan(task->builder, tag, (TreePosition)task->plainLength);
+            } else {
+                openBuilderSpan(task->builder, tag, (TreePosition)task->plainLength);
+            }
+            task->pos = nameEnd + 1;
+            if (isTaskBudgetSpent(budget, ++count, begin)) return false;
+        }
+        
+        detachTreeTask(task);
+        task->plain[task->plainLength] = '\0';
+        *task->parsed = finishTreeBuilder(task->builder, (TreePosition)task->plainLength);
+        *task->plainText = task->plain;
+        task->builder = NULL;
+        task->plain = NULL;
+        return true;
+    }
+    
+    // Encode the next nodes as start delta from the previous sibling's end (or the
+    // parent's start), length, tag index and number of children. Once every node is
+    // encoded, the chunks are copied into the blob a chunk at a time, then the blob
+    // replaces the nodes and the next nodes are freed instead.
+    bool stepHibernateTask(TreeTask* task, WorkBudget budget, uint64_t begin) {
+        TreeWalk* walk = &task->walk;
+        size_t count = 0;
+        if (!task->blob.data && !task->detached.children) {
+            IntervalNode* node;
+            while ((node = advanceTreeWalk(walk))) {
+                IntervalNode* parent = walk->nodes[walk->depth - 2];
+                int index = walk->next[walk->depth - 2] - 1;
+                TreePosition origin = index > 0 ? parent->children[index - 1]->interval[1] : parent->interval[0];
+                
+                if (task->nodes.size + MAX_NODE_RECORD > task->nodes.capacity) {
+                    startBlobChunk(task);
+                }
+                writeSignedVarint(&task->nodes, node->interval[0] - origin);
+                writeSignedVarint(&task->nodes, node->interval[1] - node->interval[0]);
+                writeVarint(&task->nodes, node->tag ? internTag(&task->tags, node->tag) + 1 : 0);
+                writeVarint(&task->nodes, node->numChildren);
+                if (isTaskBudgetSpent(budget, ++count, begin)) return false;
+            }
+            
+            startTaskBlob(task);
+        }
+        
+        // A chunk counts as TASK_CLOCK_INTERVAL nodes, so the clock is read after
+        // each; freeing one gives its pages back to the system, which is slow
+        while (task->blobChunks) {
+            BlobChunk* chunk = task->blobChunks;
+            writeBlobBytes(&task->blob, chunk->bytes, chunk->size);
+            task->blobChunks = chunk->next;
+            free(chunk);
+            count += TASK_CLOCK_INTERVAL - count % TASK_CLOCK_INTERVAL;
+            if (task->blobChunks && isTaskBudgetSpent(budget, count, begin)) return false;
+        }
+        if (task->blob.data) {
+            finishHibernateTask(task);
+        }
+        
+        return freeHibernatedNodes(task, task->tree->root, budget, begin, count);
+    }
+    
+    // Start the next chunk of a hibernate task's encoded nodes. The writer never
+    // grows, as a chunk is started while a node may not fit.
+    void startBlobChunk(TreeTask* task) {
+        BlobChunk* chunk = (BlobChunk*)malloc(sizeof(BlobChunk));
+        if (!chunk) {
+            perror("Failed to allocate memory for blob");
+            exit(EXIT_FAILURE);
+        }
+        chunk->next = NULL;
+        chunk->size = 0;
+        
+        if (task->lastBlobChunk) {
+            task->lastBlobChunk->size = task->nodes.size;
+            task->encodedSize += task->nodes.size;
+            task->lastBlobChunk->next = chunk;
+        } else {
+            task->blobChunks = chunk;
+        }
+        task->lastBlobChunk = chunk;
+        task->nodes.data = chunk->bytes;
+        task->nodes.size = 0;
+        task->nodes.capacity = HIBERNATE_CHUNK;
+    }
+    
+    // Allocate the blob of a hibernate task once every node is encoded and write
+    // its tag table, NUL-terminated so tags are read in place. The chunks follow.
+    void startTaskBlob(TreeTask* task) {
+        task->lastBlobChunk->size = task->nodes.size;
+        task->encodedSize += task->nodes.size;
+        task->lastBlobChunk = NULL;
+        task->nodes.data = NULL;
+        
+        BlobWriter* blob = &task->blob;
+        writeVarint(blob, task->tags.count);
+        for (int i = 0; i < task->tags.count; i++) {
+            writeBlobBytes(blob, task->tags.tags[i], strlen(task->tags.tags[i]) + 1);
+        }
+        free(task->tags.tags);
+        task->tags.tags = NULL;
+        
+        // Size the blob once, so copying the chunks never moves it
+        blob->capacity = blob->size + task->encodedSize;
+        blob->data = (unsigned char*)realloc(blob->data, blob->capacity);
+        if (!blob->data) {
+            perror("Failed to allocate memory for blob");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Install the blob of a hibernate task and take the live nodes below the root
+    // off it; the walk starts over on them to free them. The root stays resident
+    // and the tracked positions resolve through the nodes until they move to the
+    // root as the nodes are freed. The next operation rehydrates the tree.
+    void finishHibernateTask(TreeTask* task) {
+        TaggedIntervalTree* tree = task->tree;
+        IntervalNode* root = tree->root;
+        BlobWriter blob = task->blob;
+        task->blob.data = NULL;
+        
+        task->detached.children = root->children;
+        task->detached.numChildren = root->numChildren;
+        task->detached.childrenCapacity = root->childrenCapacity;
+        root->children = NULL;
+        root->numChildren = 0;
+        root->childrenCapacity = 0;
+        
+        TreeWalk* walk = &task->walk;
+        walk->nodes[0] = &task->detached;
+        walk->next[0] = 0;
+        walk->depth = 1;
+        
+        tree->blob = blob.data;
+        tree->blobSize = blob.size;
+        chargeTreeMemory(tree->account, blob.size);
+        unlinkResidentTree(tree);
+    }
+    
+    // Free the next nodes a hibernate task took off the root, children first,
+    // sinking their tracked positions into root: the root alone while the tree is
+    // hibernated, the rehydrated nodes if it was read since. The encoding walk
+    // pushed every shift down, so positions are in the root's frame. count is the
+    // work the step has done already. Returns true once every node is freed.
+    bool freeHibernatedNodes(TreeTask* task, IntervalNode* root, WorkBudget budget, uint64_t begin, size_t count) {
+        IntervalNode* node;
+        while ((node = advanceTreeWalkPostOrder(&task->walk))) {
+            for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+                scatterPositions(node->positions[gravity], 0, root, sinkParkedPosition);
+                node->positions[gravity] = NULL;
+            }
+            freeIntervalNodeShell(node);
+            if (isTaskBudgetSpent(budget, ++count, begin)) return false;
+        }
+        
+        releaseChildArray(task->detached.children, task->detached.childrenCapacity);
+        task->detached.children = NULL;
+        task->detached.numChildren = 0;
+        task->detached.childrenCapacity = 0;
+        return true;
+    }
+    
+    // Free the chunks of a hibernate task cancelled before they were copied
+    void freeBlobChunks(TreeTask* task) {
+        while (task->blobChunks) {
+            BlobChunk* next = task->blobChunks->next;
+            free(task->blobChunks);
+            task->blobChunks = next;
+        }
+        task->lastBlobChunk = NULL;
+        task->nodes.data = NULL;
+    }
+    
+    // Start a walk at the root
+    void initTreeWalk(TreeWalk* walk, IntervalNode* root) {
+        walk->capacity = 16;
+        walk->nodes = (IntervalNode**)malloc(walk->capacity * sizeof(IntervalNode*));
+        walk->next = (int*)malloc(walk->capacity * sizeof(int));
+        if (!walk->nodes || !walk->next) {
+            perror("Failed to allocate memory for TreeWalk");
+            exit(EXIT_FAILURE);
+        }
+        
+        settleNode(root);
+        walk->nodes[0] = root;
+        walk->next[0] = 0;
+        walk->depth = 1;
+    }
+    
+    // Return the next node below the root in pre-order, with its shift pushed down
+    // so its children are in its parent's frame, or NULL at the end
+    IntervalNode* advanceTreeWalk(TreeWalk* walk) {
+        while (walk->depth > 0) {
+            IntervalNode* top = walk->nodes[walk->depth - 1];
+            if (walk->next[walk->depth - 1] == top->numChildren) {
+                walk->depth--;
+                continue;
+            }
+            
+            IntervalNode* child = top->children[walk->next[walk->depth - 1]++];
+            settleNode(child);
+            pushTreeWalk(walk, child);
+            return child;
+        }
+        return NULL;
+    }
+    
+    // Return the next node below the root in post-order, or NULL at the end. Nodes
+    // are not settled: the walk frees nodes a pre-order walk has settled already.
+    IntervalNode* advanceTreeWalkPostOrder(TreeWalk* walk) {
+        while (walk->depth > 0) {
+            IntervalNode* top = walk->nodes[walk->depth - 1];
+            if (walk->next[walk->depth - 1] < top->numChildren) {
+                pushTreeWalk(walk, top->children[walk->next[walk->depth - 1]++]);
+                continue;
+            }
+            
+            walk->depth--;
+            if (walk->depth > 0) return top;
+        }
+        return NULL;
+    }
+    
+    // Extend a walk's path by a node whose children are to be visited next
+    void pushTreeWalk(TreeWalk* walk, IntervalNode* node) {
+        if (walk->depth == walk->capacity) {
+            walk->capacity *= 2;
+            IntervalNode** newNodes = (IntervalNode**)realloc(walk->nodes, walk->capacity * sizeof(IntervalNode*));
+            int* newNext = (int*)realloc(walk->next, walk->capacity * sizeof(int));
+            if (!newNodes || !newNext) {
+                perror("Failed to allocate memory for TreeWalk");
+                exit(EXIT_FAILURE);
+            }
+            walk->nodes = newNodes;
+            walk->next = newNext;
+        }
+        
+        walk->nodes[walk->depth] = node;
+        walk->next[walk->depth] = 0;
+        walk->depth++;
+    }
+    
+    // Free a walk's path
+    void freeTreeWalk(TreeWalk* walk) {
+        free(walk->nodes);
+        free(walk->next);
+        walk->nodes = NULL;
+        walk->next = NULL;
+    }
+    
+    // Add a tag and return a handle to the span that stays valid across edits
+    SpanHandle* addTagWithHandle(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end) {
+        if (start >= end) return NULL; // Invalid interval
+        
+        if (addTag(tree, tag, start, end) != TREE_OK) return NULL;
+        
+        SpanHandle* handle = (SpanHandle*)malloc(sizeof(SpanHandle));
+        if (!handle) {
+            perror("Failed to allocate memory for SpanHandle");
+            exit(EXIT_FAILURE);
+        }
+        
+        handle->tag = strdup(tag);
+        if (!handle->tag) {
+            perror("Failed to allocate memory for tag");
+            exit(EXIT_FAILURE);
+        }
+        handle->start = trackPosition(tree, start, GRAVITY_RIGHT);
+        handle->end = trackPosition(tree, end, GRAVITY_LEFT);
+        
+        return handle;
+    }
+    
+    // Get the current interval of a span; false once the span is gone or empty
+    bool getSpanHandleInterval(SpanHandle* handle, TreePosition* start, TreePosition* end) {
+        if (!handle) return false;
+        
+        if (!resolveTrackedPosition(handle->start, start) || 
+            !resolveTrackedPosition(handle->end, end)) {
+            return false;
+        }
+        
+        return *start < *end;
+    }
+    
+    // Remove the span a handle refers to and release the handle. While the span is
+    // still the node that addTag made, the node is found by walking up from the
+    // handle's start, and its children take its place. Otherwise the range is
+    // removed as removeTag does.
+    bool removeTagByHandle(TaggedIntervalTree* tree, SpanHandle* handle) {
+        TreePosition start, end;
+        bool removed = false;
+        
+        if (handle) {
+            touchTree(tree, NULL);
+            finishPendingOperation(tree);
+        }
+        
+        if (getSpanHandleInterval(handle, &start, &end)) {
+            IntervalNode* node = findSpanNode(handle->start, handle->tag, start, end);
+            if (node) {
+                TREE_TRACE("Removing tag %s from interval [%" PRIpos ",%" PRIpos "]\n", handle->tag, start, end);
+                
+                TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+                IntervalNode* parent = node->parent;
+                liftChildren(parent, findInsertionPoint(parent->children, parent->numChildren, node->interval[0]));
+                leaveTreeAccount(previousAccount);
+                
+                emitChange(tree, CHANGE_TAG_REMOVED, handle->tag, start, end);
+                if (tree->log) {
+                    appendLogEntry(tree->log, LOG_REMOVE_TAG, handle->tag, start, end);
+                }
+                removed = true;
+            } else {
+                removed = removeTag(tree, handle->tag, start, end);
+            }
+        }
+        
+        releaseSpanHandle(handle);
+        return removed;
+    }
+    
+    // Release a span handle without touching the tree
+    void releaseSpanHandle(SpanHandle* handle) {
+        if (!handle) return;
+        
+        releaseTrackedPosition(handle->start);
+        releaseTrackedPosition(handle->end);
+        free(handle->tag);
+        free(handle);
+    }
+    
+    // Create an anchor at pos. Anchors live on the tree nodes like span endpoints,
+    // so an edit only touches the anchors on the nodes along its path.
+    Anchor* createAnchor(TaggedIntervalTree* tree, TreePosition pos, PositionGravity gravity, void* data) {
+        Anchor* anchor = trackPosition(tree, pos, gravity);
+        anchor->isAnchor = true;
+        anchor->data = data;
+        
+        return anchor;
+    }
+    
+    // Get the current position of an anchor in O(depth); false once its tree is freed
+    bool getAnchorPosition(Anchor* anchor, TreePosition* pos) {
+        if (!anchor) return false;
+        
+        return resolveTrackedPosition(anchor, pos);
+    }
+    
+    // Get the caller data of an anchor
+    void* getAnchorData(Anchor* anchor) {
+        return anchor ? anchor->data : NULL;
+    }
+    
+    // Move an anchor to a new position, e.g. when a cursor moves
+    void moveAnchor(TaggedIntervalTree* tree, Anchor* anchor, TreePosition pos) {
+        if (!anchor) return;
+        
+        detachTrackedPosition(anchor);
+        placeTrackedPosition(tree, anchor, pos);
+    }
+    
+    // Get the anchors in [start,end] sorted by position. The caller frees the array.
+    Anchor** getAnchorsInRange(TaggedIntervalTree* tree, TreePosition start, TreePosition end, int* count) {
+        Anchor** anchors = NULL;
+        int capacity = 0;
+        *count = 0;
+        
+        if (start > end) return NULL;
+        
+        touchTree(tree, NULL);
+        collectAnchorsDFS(tree->root, start, end, &anchors, count, &capacity);
+        
+        // Nodes on the search path were pushed down, so positions are absolute here
+        if (*count > 1) {
+            qsort(anchors, *count, sizeof(Anchor*), compareAnchors);
+        }
+        
+        return anchors;
+    }
+    
+    // Compare function for sorting anchors by position
+    int compareAnchors(const void* a, const void* b) {
+        const Anchor* anchorA = *(const Anchor* const*)a;
+        const Anchor* anchorB = *(const Anchor* const*)b;
+        
+        return (anchorA->position > anchorB->position) - (anchorA->position < anchorB->position);
+    }
+    
+    // DFS helper for collecting anchors; only visits nodes touching [start,end]
+    void collectAnchorsDFS(IntervalNode* node, TreePosition start, TreePosition end, Anchor*** anchors, 
+                           int* count, int* capacity) {
+        pushDownShift(node);
+        collectAnchorsInTreap(node->positions[GRAVITY_LEFT], start, end, anchors, count, capacity);
+        collectAnchorsInTreap(node->positions[GRAVITY_RIGHT], start, end, anchors, count, capacity);
+        
+        int i = findInsertionPoint(node->children, node->numChildren, start);
+        if (i > 0) i--;
+        
+        for (; i < node->numChildren && node->children[i]->interval[0] <= end; i++) {
+            if (node->children[i]->interval[1] >= start) {
+                collectAnchorsDFS(node->children[i], start, end, anchors, count, capacity);
+            }
+        }
+    }
+    
+    // Collect the anchors of a treap in [start,end], pushing its shifts down the paths
+    // visited so their positions are exact
+    void collectAnchorsInTreap(TrackedPosition* tp, TreePosition start, TreePosition end, Anchor*** anchors, 
+                               int* count, int* capacity) {
+        if (!tp) return;
+        
+        pushDownPositionShift(tp);
+        if (tp->position >= start) {
+            collectAnchorsInTreap(tp->left, start, end, anchors, count, capacity);
+        }
+        
+        if (tp->isAnchor && tp->position >= start && tp->position <= end) {
+            // Expand capacity if needed
+            if (*count >= *capacity) {
+                int newCapacity = *capacity == 0 ? 8 : *capacity * 2;
+                Anchor** newAnchors = (Anchor**)realloc(*anchors, newCapacity * sizeof(Anchor*));
+                if (!newAnchors) {
+                    perror("Failed to allocate memory for anchors");
+                    exit(EXIT_FAILURE);
+                }
+                
+                *anchors = newAnchors;
+                *capacity = newCapacity;
+            }
+            
+            (*anchors)[(*count)++] = tp;
+        }
+        
+        if (tp->position <= end) {
+            collectAnchorsInTreap(tp->right, start, end, anchors, count, capacity);
+        }
+    }
+    
+    // Stop tracking an anchor
+    void releaseAnchor(Anchor* anchor) {
+        releaseTrackedPosition(anchor);
+    }
+    
+    // Get the bytes held by a tree's nodes, tags and arrays. Trees split from one
+    // document share its account and report the total.
+    size_t getTreeMemoryUsage(TaggedIntervalTree* tree) {
+        return tree->account->bytesUsed;
+    }
+    
+    // Get the highest memory usage seen by a tree's account
+    size_t getTreePeakMemoryUsage(TaggedIntervalTree* tree) {
+        return tree->account->peakBytes;
+    }
+    
+    // Set the memory limit of a tree's account, 0 for none. The limit is checked when
+    // an operation starts, against the nodes the operation needs; an admitted
+    // operation always completes.
+    void setTreeMemoryLimit(TaggedIntervalTree* tree, size_t limit) {
+        tree->account->limit = limit;
+    }
+    
+    // Encode a tree into a compact blob and free its nodes. The root stays resident and
+    // holds the tracked positions meanwhile; the next operation rehydrates the tree.
+    void hibernateTree(TaggedIntervalTree* tree) {
+        WorkBudget unlimited = {0, 0};
+        TreeTask* task = startHibernateTask(tree);
+        runTreeTask(task, unlimited);
+        freeTreeTask(task);
+    }
+    
+    // Check whether a tree is hibernated
+    bool isTreeHibernated(TaggedIntervalTree* tree) {
+        return tree->blob != NULL;
+    }
+    
+    // Set the bytes all resident trees may hold before the least recently used ones
+    // are hibernated, 0 for no budget
+    void setResidentBudget(size_t bytes) {
+        residentBudget = bytes;
+        enforceResidentBudget(NULL, NULL);
+    }
+    
+    // Get the bytes held by the nodes of all resident trees
+    size_t getResidentBytes(void) {
+        return residentBytes;
+    }
+    
+    // Prepare trees for an operation: rehydrate them, mark them most recently used,
+    // and hibernate others if the budget is exceeded
+    void touchTree(TaggedIntervalTree* tree, TaggedIntervalTree* other) {
+        lockResidentTrees();
+        markTreeUsed(tree);
+        if (other) markTreeUsed(other);
+        
+        enforceResidentBudget(tree, other);
+        unlockResidentTrees();
+    }
+    
+    // Rehydrate a tree if needed and move it to the front of the LRU list
+    void markTreeUsed(TaggedIntervalTree* tree) {
+        if (tree->blob) {
+            rehydrateTree(tree);
+        } else if (lruHead == tree) {
+            tree->lruThread = pthread_self();
+            return;
+        } else {
+            unlinkResidentTree(tree);
+        }
+        
+        linkResidentTree(tree);
+    }
+    
+    // Insert a tree at the front of the LRU list
+    void linkResidentTree(TaggedIntervalTree* tree) {
+        lockResidentTrees();
+        tree->lruThread = pthread_self();
+        tree->lruPrev = NULL;
+        tree->lruNext = lruHead;
+        if (lruHead) {
+            lruHead->lruPrev = tree;
+        } else {
+            lruTail = tree;
+        }
+        lruHead = tree;
+        unlockResidentTrees();
+    }
+    
+    // Remove a tree from the LRU list
+    void unlinkResidentTree(TaggedIntervalTree* tree) {
+        lockResidentTrees();
+        if (tree->lruPrev) {
+            tree->lruPrev->lruNext = tree->lruNext;
+        } else {
+            lruHead = tree->lruNext;
+        }
+        if (tree->lruNext) {
+            tree->lruNext->lruPrev = tree->lruPrev;
+        } else {
+            lruTail = tree->lruPrev;
+        }
+        tree->lruPrev = NULL;
+        tree->lruNext = NULL;
+        unlockResidentTrees();
+    }
+    
+    // Hibernate the least recently used trees until the resident set fits the budget,
+    // sparing the trees of the running operation. Only trees this thread used last
+    // are hibernated, since another thread may be in the middle of using its own;
+    // those go once their thread touches a tree again. The lock is held throughout,
+    // so a tree being hibernated can't be picked up by another thread meanwhile.
+    void enforceResidentBudget(TaggedIntervalTree* keep, TaggedIntervalTree* other) {
+        if (residentBudget == 0) return;
+        
+        lockResidentTrees();
+        pthread_t self = pthread_self();
+        TaggedIntervalTree* tree = lruTail;
+        while (tree && residentBytes > residentBudget) {
+            TaggedIntervalTree* prev = tree->lruPrev;
+            if (tree != keep && tree != other && pthread_equal(tree->lruThread, self)) {
+                hibernateTree(tree);
+            }
+            tree = prev;
+        }
+        unlockResidentTrees();
+    }
+    
+    // Take the lock of the LRU list
+    void lockResidentTrees(void) {
+        pthread_once(&lruLockOnce, createLruLock);
+        pthread_mutex_lock(&lruLock);
+    }
+    
+    // Release the lock of the LRU list
+    void unlockResidentTrees(void) {
+        pthread_mutex_unlock(&lruLock);
+    }
+    
+    // Initialise the LRU lock as a recursive mutex
+    void createLruLock(void) {
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+        if (pthread_mutex_init(&lruLock, &attr) != 0) {
+            perror("Failed to create LRU lock");
+            exit(EXIT_FAILURE);
+        }
+        pthread_mutexattr_destroy(&attr);
+    }
+    
+    // Decode a hibernated tree's blob back into live nodes
+    void rehydrateTree(TaggedIntervalTree* tree) {
+        IntervalNode* root = tree->root;
+        BlobReader reader = {tree->blob, 0, tree->blobSize};
+        
+        // Tags are read in place from the blob's tag table
+        int tagCount = (int)readVarint(&reader);
+        const char** tags = (const char**)malloc((tagCount + 1) * sizeof(char*));
+        if (!tags) {
+            perror("Failed to allocate memory for tag table");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < tagCount; i++) {
+            tags[i] = (const char*)reader.data + reader.pos;
+            reader.pos += strlen(tags[i]) + 1;
+        }
+        
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        int numChildren = (int)readVarint(&reader);
+        TreePosition origin = root->interval[0];
+        for (int i = 0; i < numChildren; i++) {
+            IntervalNode* child = decodeNode(&reader, tags, root, origin);
+            origin = child->interval[1];
+        }
+        free(tags);
+        
+        tree->account->bytesUsed -= tree->blobSize;
+        free(tree->blob);
+        tree->blob = NULL;
+        tree->blobSize = 0;
+        
+        // Sink the parked positions back to their deepest owners
+        for (int gravity = GRAVITY_LEFT; gravity <= GRAVITY_RIGHT; gravity++) {
+            TrackedPosition* parked = root->positions[gravity];
+            root->positions[gravity] = NULL;
+            scatterPositions(parked, 0, root, sinkParkedPosition);
+        }
+        leaveTreeAccount(previousAccount);
+    }
+    
+    // Decode a node written by a hibernate task and add it to parent
+    IntervalNode* decodeNode(BlobReader* reader, const char** tags, IntervalNode* parent, TreePosition origin) {
+        TreePosition start = origin + (TreePosition)readSignedVarint(reader);
+        TreePosition end = start + (TreePosition)readSignedVarint(reader);
+        int tagIndex = (int)readVarint(reader);
+        int numChildren = (int)readVarint(reader);
+        
+        IntervalNode* node = createIntervalNode(start, end, tagIndex ? tags[tagIndex - 1] : NULL);
+        addChildToNode(parent, node);
+        
+        TreePosition childOrigin = start;
+        for (int i = 0; i < numChildren; i++) {
+            IntervalNode* child = decodeNode(reader, tags, node, childOrigin);
+            childOrigin = child->interval[1];
+        }
+        return node;
+    }
+    
+    // Get the index of a tag in the table, adding it if new. Documents use a handful
+    // of distinct tags, so a linear scan is enough.
+    int internTag(TagTable* tags, const char* tag) {
+        for (int i = 0; i < tags->count; i++) {
+            if (strcmp(tags->tags[i], tag) == 0) return i;
+        }
+        
+        // Expand capacity if needed
+        if (tags->count >= tags->capacity) {
+            int newCapacity = tags->capacity == 0 ? 8 : tags->capacity * 2;
+            const char** newTags = (const char**)realloc(tags->tags, newCapacity * sizeof(char*));
+            if (!newTags) {
+                perror("Failed to allocate memory for tag table");
+                exit(EXIT_FAILURE);
+            }
+            
+            tags->tags = newTags;
+            tags->capacity = newCapacity;
+        }
+        
+        tags->tags[tags->count] = tag;
+        return tags->count++;
+    }
+    
+    // Append a byte to a blob
+    void writeBlobByte(BlobWriter* writer, unsigned char byte) {
+        // Expand capacity if needed
+        if (writer->size >= writer->capacity) {
+            size_t newCapacity = writer->capacity == 0 ? 64 : writer->capacity * 2;
+            unsigned char* newData = (unsigned char*)realloc(writer->data, newCapacity);
+            if (!newData) {
+                perror("Failed to allocate memory for blob");
+                exit(EXIT_FAILURE);
+            }
+            
+            writer->data = newData;
+            writer->capacity = newCapacity;
+        }
+        
+        writer->data[writer->size++] = byte;
+    }
+    
+    // Append a run of bytes to a blob
+    void writeBlobBytes(BlobWriter* writer, const void* bytes, size_t length) {
+        // Expand capacity if needed
+        if (writer->size + length > writer->capacity) {
+            size_t newCapacity = writer->capacity == 0 ? 64 : writer->capacity * 2;
+            if (newCapacity < writer->size + length) newCapacity = writer->size + length;
+            unsigned char* newData = (unsigned char*)realloc(writer->data, newCapacity);
+            if (!newData) {
+                perror("Failed to allocate memory for blob");
+                exit(EXIT_FAILURE);
+            }
+            
+            writer->data = newData;
+            writer->capacity = newCapacity;
+        }
+        
+        memcpy(writer->data + writer->size, bytes, length);
+        writer->size += length;
+    }
+    
+    // Append an unsigned LEB128 varint
+    void writeVarint(BlobWriter* writer, uint64_t value) {
+        while (value >= 0x80) {
+            writeBlobByte(writer, (unsigned char)(value | 0x80));
+            value >>= 7;
+        }
+        writeBlobByte(writer, (unsigned char)value);
+    }
+    
+    // Append a zigzag encoded signed varint
+    void writeSignedVarint(BlobWriter* writer, int64_t value) {
+        writeVarint(writer, ((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+    }
+    
+    // Read an unsigned LEB128 varint
+    uint64_t readVarint(BlobReader* reader) {
+        uint64_t value = 0;
+        int shift = 0;
+        unsigned char byte;
+        
+        do {
+            if (reader->pos >= reader->size || shift >= 64) {
+                reader->pos = reader->size + 1;
+                return 0;
+            }
+            byte = reader->data[reader->pos++];
+            value |= (uint64_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        
+        return value;
+    }
+    
+    // Read a zigzag encoded signed varint
+    int64_t readSignedVarint(BlobReader* reader) {
+        uint64_t value = readVarint(reader);
+        return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+    }
+    
+    // Make a tree's account the one charged by allocations on this thread; returns
+    // the previous one so nested operations can restore it
+    TreeMemoryAccount* enterTreeAccount(TaggedIntervalTree* tree) {
+        TreeMemoryAccount* previous = currentAccount;
+        currentAccount = tree->account;
+        return previous;
+    }
+    
+    // Restore the account charged before enterTreeAccount
+    void leaveTreeAccount(TreeMemoryAccount* previous) {
+        currentAccount = previous;
+    }
+    
+    // Drop a tree's reference to its account
+    void releaseTreeAccount(TreeMemoryAccount* account) {
+        if (--account->refCount == 0) {
+            free(account);
+        }
+    }
+    
+    // Check whether an operation that may grow the tree by bytes fits in its limit,
+    // next to what incremental operations have reserved
+    bool admitTreeGrowth(TaggedIntervalTree* tree, size_t bytes) {
+        TreeMemoryAccount* account = tree->account;
+        return account->limit == 0 || account->bytesUsed + account->bytesReserved + bytes <= account->limit;
+    }
+    
+    // Check whether adding tag over [start,end) fits in the tree's limit. Each gap the
+    // tag fills takes a node, so the gaps are measured first, only as far as could
+    // fit. *growth, if given, is set to the bytes admitted.
+    bool admitTagGrowth(TaggedIntervalTree* tree, const char* tag, TreePosition start, TreePosition end, 
+                        size_t* growth) {
+        TreeMemoryAccount* account = tree->account;
+        if (growth) *growth = 0;
+        if (account->limit == 0) return true;
+        if (!admitTreeGrowth(tree, 0)) return false;
+        
+        size_t room = account->limit - account->bytesUsed - account->bytesReserved;
+        size_t bytes = measureTagGaps(tree->root, tag, start, end, 0, room);
+        if (bytes > room) return false;
+        
+        if (growth) *growth = bytes;
+        return true;
+    }
+    
+    // Charge bytes to an account
+    void chargeTreeMemory(TreeMemoryAccount* account, size_t bytes) {
+        account->bytesUsed += bytes;
+        if (account->bytesUsed > account->peakBytes) {
+            account->peakBytes = account->bytesUsed;
+        }
+    }
+    
+    // malloc charged to the current account
+    void* accountedMalloc(size_t size) {
+        void* ptr = malloc(size);
+        if (ptr && currentAccount) {
+            chargeTreeMemory(currentAccount, size);
+            atomic_fetch_add_explicit(&residentBytes, size, memory_order_relaxed);
+        }
+        return ptr;
+    }
+    
+    // Take nodes from an arena of aligned chunks from now on; flags combine
+    // NodeArenaFlags. Must be called before the first node is created, and
+    // returns false afterwards.
+    bool enableNodeArena(int flags) {
+        pthread_mutex_lock(&nodeArena.lock);
+        bool enabled = !atomic_load(&nodeMemoryUsed) && !nodeArena.enabled;
+        if (enabled) {
+            nodeArena.enabled = true;
+            nodeArena.flags = flags;
+        }
+        pthread_mutex_unlock(&nodeArena.lock);
+        return enabled;
+    }
+    
+    // Get the bytes the node arena has mapped
+    size_t getNodeArenaBytes(void) {
+        pthread_mutex_lock(&nodeArena.lock);
+        size_t bytes = nodeArena.bytesMapped;
+        pthread_mutex_unlock(&nodeArena.lock);
+        return bytes;
+    }
+    
+    // Get memory for a node, charged to the current account
+    IntervalNode* allocateNodeMemory(void) {
+        if (!atomic_load_explicit(&nodeMemoryUsed, memory_order_relaxed)) {
+            atomic_store(&nodeMemoryUsed, true);
+        }
+        
+        IntervalNode* node = (IntervalNode*)takeBlock(0);
+        if (currentAccount) {
+            chargeTreeMemory(currentAccount, sizeof(IntervalNode));
+            atomic_fetch_add_explicit(&residentBytes, sizeof(IntervalNode), memory_order_relaxed);
+        }
+        return node;
+    }
+    
+    // Give back the memory of a node, credited to the current account
+    void releaseNodeMemory(IntervalNode* node) {
+        giveBlock(0, node);
+        if (currentAccount) {
+            currentAccount->bytesUsed -= sizeof(IntervalNode);
+            atomic_fetch_sub_explicit(&residentBytes, sizeof(IntervalNode), memory_order_relaxed);
+        }
+    }
+    
+    // Get a children array with room for capacity children, charged to the current account
+    IntervalNode** allocateChildArray(int capacity) {
+        int blockClass = childArrayClass(capacity);
+        IntervalNode** children;
+        if (blockClass < 0) {
+            children = (IntervalNode**)accountedMalloc(capacity * sizeof(IntervalNode*));
+            if (!children) {
+                perror("Failed to allocate memory for children");
+                exit(EXIT_FAILURE);
+            }
+            return children;
+        }
+        
+        children = (IntervalNode**)takeBlock(blockClass);
+        if (currentAccount) {
+            chargeTreeMemory(currentAccount, capacity * sizeof(IntervalNode*));
+            atomic_fetch_add_explicit(&residentBytes, capacity * sizeof(IntervalNode*), memory_order_relaxed);
+        }
+        return children;
+    }
+    
+    // Give back a children array, credited to the current account
+    void releaseChildArray(IntervalNode** children, int capacity) {
+        if (!children) return;
+        
+        int blockClass = childArrayClass(capacity);
+        if (blockClass < 0) {
+            accountedFree(children, capacity * sizeof(IntervalNode*));
+            return;
+        }
+        
+        giveBlock(blockClass, children);
+        if (currentAccount) {
+            currentAccount->bytesUsed -= capacity * sizeof(IntervalNode*);
+            atomic_fetch_sub_explicit(&residentBytes, capacity * sizeof(IntervalNode*), memory_order_relaxed);
+        }
+    }
+    
+    // Get memory for a tag or a deferred tag list, charged to the current account at
+    // its size. Sizes that fit a children array class share its blocks, so the small
+    // allocations of a tree do not fill the heap with chunks malloc has to coalesce
+    // all at once later.
+    void* allocateBlockMemory(size_t size) {
+        int blockClass = smallBlockClass(size);
+        void* block;
+        if (blockClass < 0) {
+            block = accountedMalloc(size);
+            if (!block) {
+                perror("Failed to allocate memory for tree data");
+                exit(EXIT_FAILURE);
+            }
+            return block;
+        }
+        
+        block = takeBlock(blockClass);
+        if (currentAccount) {
+            chargeTreeMemory(currentAccount, size);
+            atomic_fetch_add_explicit(&residentBytes, size, memory_order_relaxed);
+        }
+        return block;
+    }
+    
+    // Give back memory from allocateBlockMemory, credited to the current account
+    void releaseBlockMemory(void* block, size_t size) {
+        int blockClass = smallBlockClass(size);
+        if (blockClass < 0) {
+            accountedFree(block, size);
+            return;
+        }
+        
+        giveBlock(blockClass, block);
+        if (currentAccount) {
+            currentAccount->bytesUsed -= size;
+            atomic_fetch_sub_explicit(&residentBytes, size, memory_order_relaxed);
+        }
+    }
+    
+    // Get the smallest children array class whose blocks hold size bytes, or -1
+    int smallBlockClass(size_t size) {
+        for (int blockClass = 1; blockClass < NUM_BLOCK_CLASSES; blockClass++) {
+            if (size <= blockClassSize(blockClass)) return blockClass;
+        }
+        return -1;
+    }
+    
+    // Get the block class of a children array, or -1 if arrays that large come from the heap
+    int childArrayClass(int capacity) {
+        if (capacity < 4 || capacity > 64 || (capacity & (capacity - 1))) return -1;
+        return __builtin_ctz(capacity) - 1;
+    }
+    
+    // Get the size of the blocks in a class
+    size_t blockClassSize(int blockClass) {
+        if (blockClass == 0) return sizeof(IntervalNode);
+        return ((size_t)2 << blockClass) * sizeof(IntervalNode*);
+    }
+    
+    // Take a block from this thread's cache, refilling it from the depot when empty
+    void* takeBlock(int blockClass) {
+        BlockList* list = &blockCache.lists[blockClass];
+        if (!list->first) refillBlockCache(blockClass);
+        
+        void* block = list->first;
+        list->first = *(void**)block;
+        list->count--;
+        return block;
+    }
+    
+    // Put a block in this thread's cache, moving a batch to the depot when it grows too long
+    void giveBlock(int blockClass, void* block) {
+        BlockList* list = &blockCache.lists[blockClass];
+        *(void**)block = list->first;
+        list->first = block;
+        if (++list->count >= 2 * NODE_CACHE_BATCH) {
+            flushBlockCache(blockClass, NODE_CACHE_BATCH);
+        }
+    }
+    
+    // Fill this thread's empty list with a batch from the depot, or with new blocks
+    void refillBlockCache(int blockClass) {
+        if (!blockCache.registered) {
+            // Hand the cache back to the depots when the thread exits
+            pthread_once(&blockCacheKeyOnce, createBlockCacheKey);
+            pthread_setspecific(blockCacheKey, &blockCache);
+            blockCache.registered = true;
+        }
+        
+        BlockDepot* depot = &blockDepots[currentDepot()];
+        BlockList batch = {NULL, 0};
+        pthread_mutex_lock(&depot->lock);
+        if (depot->numBatches[blockClass] > 0) {
+            batch = depot->batches[blockClass][--depot->numBatches[blockClass]];
+        }
+        pthread_mutex_unlock(&depot->lock);
+        
+        if (!batch.first) {
+            batch.first = carveBlocks(blockClass, NODE_CACHE_BATCH);
+            batch.count = NODE_CACHE_BATCH;
+        }
+        blockCache.lists[blockClass] = batch;
+    }
+    
+    // Move the first count blocks of this thread's list to the depot as one batch
+    void flushBlockCache(int blockClass, int count) {
+        BlockList* list = &blockCache.lists[blockClass];
+        BlockList batch = {list->first, count};
+        void* last = list->first;
+        for (int i = 1; i < count; i++) {
+            last = *(void**)last;
+        }
+        list->first = *(void**)last;
+        list->count -= count;
+        *(void**)last = NULL;
+        
+        BlockDepot* depot = &blockDepots[currentDepot()];
+        pthread_mutex_lock(&depot->lock);
+        if (depot->numBatches[blockClass] == depot->capacity[blockClass]) {
+            int newCapacity = depot->capacity[blockClass] == 0 ? 16 : depot->capacity[blockClass] * 2;
+            BlockList* newBatches = (BlockList*)realloc(depot->batches[blockClass], newCapacity * sizeof(BlockList));
+            if (!newBatches) {
+                perror("Failed to allocate memory for block depot");
+                exit(EXIT_FAILURE);
+            }
+            depot->batches[blockClass] = newBatches;
+            depot->capacity[blockClass] = newCapacity;
+        }
+        depot->batches[blockClass][depot->numBatches[blockClass]++] = batch;
+        pthread_mutex_unlock(&depot->lock);
+    }
+    
+    // Thread exit handler: move everything the thread's cache holds to the depot
+    void flushThreadBlockCache(void* cache) {
+        (void)cache;
+        for (int blockClass = 0; blockClass < NUM_BLOCK_CLASSES; blockClass++) {
+            if (blockCache.lists[blockClass].count > 0) {
+                flushBlockCache(blockClass, blockCache.lists[blockClass].count);
+            }
+        }
+        blockCache.registered = false;
+    }
+    
+    // Create the key whose destructor flushes a thread's block cache
+    void createBlockCacheKey(void) {
+        if (pthread_key_create(&blockCacheKey, flushThreadBlockCache) != 0) {
+            perror("Failed to create block cache key");
+            exit(EXIT_FAILURE);
+        }
+    }
+    
+    // Get the depot of this thread; NUMA local arenas keep one depot per node
+    int currentDepot(void) {
+        return nodeArena.enabled && (nodeArena.flags & ARENA_NUMA_LOCAL) ? currentNumaNode() : 0;
+    }
+    
+    // Make count new blocks of a class, linked into a list. Nodes come from the
+    // arena when it is enabled, and everything else from one heap slab per batch.
+    void* carveBlocks(int blockClass, int count) {
+        size_t size = blockClassSize(blockClass);
+        char* blocks;
+        if (blockClass == 0 && nodeArena.enabled) {
+            int numaNode = currentDepot();
+            pthread_mutex_lock(&nodeArena.lock);
+            if (!nodeArena.unused[numaNode] || 
+                (size_t)(nodeArena.unusedEnd[numaNode] - nodeArena.unused[numaNode]) < count * size) {
+                mapArenaChunk(numaNode);
+            }
+            blocks = nodeArena.unused[numaNode];
+            nodeArena.unused[numaNode] += count * size;
+            pthread_mutex_unlock(&nodeArena.lock);
+        } else {
+            blocks = (char*)malloc(count * size);
+            if (!blocks) {
+                perror("Failed to allocate memory for block cache");
+                exit(EXIT_FAILURE);
+            }
+        }
+        
+        for (int i = 0; i < count - 1; i++) {
+            *(void**)(blocks + i * size) = blocks + (i + 1) * size;
+        }
+        *(void**)(blocks + (count - 1) * size) = NULL;
+        return blocks;
+    }
+    
+    // Get the NUMA node of the CPU this thread first allocated on
+    int currentNumaNode(void) {
+        if (threadNumaNode < 0) {
+            unsigned int cpu = 0;
+            unsigned int numaNode = 0;
+    #ifdef SYS_getcpu
+            if (syscall(SYS_getcpu, &cpu, &numaNode, NULL) != 0) numaNode = 0;
+    #endif
+            threadNumaNode = numaNode < MAX_NUMA_NODES ? (int)numaNode : 0;
+        }
+        return threadNumaNode;
+    }
+    
+    // Map a new aligned chunk for a NUMA node's nodes; the arena lock is held
+    void mapArenaChunk(int numaNode) {
+        // Over-map so an aligned chunk fits, then trim the ends
+        size_t size = NODE_ARENA_CHUNK;
+        char* raw = (char*)mmap(NULL, 2 * size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            perror("Failed to map node arena chunk");
+            exit(EXIT_FAILURE);
+        }
+        char* chunk = (char*)(((uintptr_t)raw + size - 1) & ~(uintptr_t)(size - 1));
+        if (chunk > raw) munmap(raw, chunk - raw);
+        munmap(chunk + size, raw + size - chunk);
+        
+    #ifdef MADV_HUGEPAGE
+        if (nodeArena.flags & ARENA_HUGE_PAGES) {
+            madvise(chunk, size, MADV_HUGEPAGE);
+        }
+    #endif
+    #ifdef SYS_mbind
+        if (nodeArena.flags & ARENA_NUMA_LOCAL) {
+            // MPOL_BIND to the one node; the kernel reads maxnode - 1 bits of the mask
+            unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+            mask[numaNode / (8 * sizeof(unsigned long))] = 1UL << (numaNode % (8 * sizeof(unsigned long)));
+            syscall(SYS_mbind, chunk, size, 2, mask, MAX_NUMA_NODES + 1, 0);
+        }
+    #endif
+        
+        nodeArena.unused[numaNode] = chunk;
+        nodeArena.unusedEnd[numaNode] = chunk + size;
+        nodeArena.bytesMapped += size;
+    }
+    
+    // free credited to the current account
+    void accountedFree(void* ptr, size_t size) {
+        if (!ptr) return;
+        
+        free(ptr);
+        if (currentAccount) {
+            currentAccount->bytesUsed -= size;
+            atomic_fetch_sub_explicit(&residentBytes, size, memory_order_relaxed);
+        }
+    }
+    
+    // Copy a tag for a node or a deferred tag, charged to the current account
+    char* copyTag(const char* tag) {
+        size_t size = strlen(tag) + 1;
+        char* copy = (char*)allocateBlockMemory(size);
+        memcpy(copy, tag, size);
+        return copy;
+    }
+    
+    // Give back a tag copied by copyTag
+    void releaseTag(char* tag) {
+        releaseBlockMemory(tag, strlen(tag) + 1);
+    }
+    
+    // Count the bytes held by a subtree, matching what its allocations were charged
+    size_t measureSubtreeBytes(IntervalNode* node) {
+        size_t bytes = sizeof(IntervalNode);
+        if (node->tag) bytes += strlen(node->tag) + 1;
+        bytes += node->childrenCapacity * sizeof(IntervalNode*);
+        bytes += measureDeferredTags(node->deferred);
+        
+        for (int i = 0; i < node->numChildren; i++) {
+            bytes += measureSubtreeBytes(node->children[i]);
+        }
+        return bytes;
+    }
+    
+    // Estimate the growth of a tag operation: a couple of new nodes and a grown
+    // children array. Wide tags over fragmented text can take more.
+    size_t estimateTagGrowth(const char* tag) {
+        size_t tagBytes = tag ? strlen(tag) + 1 : MAX_TAG_LENGTH;
+        return 2 * (sizeof(IntervalNode) + tagBytes) + 8 * sizeof(IntervalNode*);
+    }
+    
+    // Subscribe to the changes of a tree. Subscribing and unsubscribing happen on the
+    // thread that edits the tree; the subscriber may be drained from any one thread.
+    ChangeSubscriber* subscribeChanges(TaggedIntervalTree* tree, int capacity) {
+        ChangeSubscriber* subscriber = (ChangeSubscriber*)malloc(sizeof(ChangeSubscriber));
+        if (!subscriber) {
+            perror("Failed to allocate memory for ChangeSubscriber");
+            exit(EXIT_FAILURE);
+        }
+        
+        // Round the capacity up to a power of two so positions wrap with a mask
+        size_t size = 16;
+        while (size < (size_t)capacity) size *= 2;
+        
+        subscriber->records = (ChangeRecord*)malloc(size * sizeof(ChangeRecord));
+        if (!subscriber->records) {
+            perror("Failed to allocate memory for change records");
+            free(subscriber);
+            exit(EXIT_FAILURE);
+        }
+        
+        subscriber->capacity = size;
+        atomic_init(&subscriber->head, 0);
+        atomic_init(&subscriber->tail, 0);
+        atomic_init(&subscriber->overflowed, false);
+        subscriber->next = tree->subscribers;
+        tree->subscribers = subscriber;
+        
+        return subscriber;
+    }
+    
+    // Stop a subscription and free the subscriber
+    void unsubscribeChanges(TaggedIntervalTree* tree, ChangeSubscriber* subscriber) {
+        ChangeSubscriber** link = &tree->subscribers;
+        while (*link && *link != subscriber) {
+            link = &(*link)->next;
+        }
+        if (!*link) return;
+        
+        *link = subscriber->next;
+        free(subscriber->records);
+        free(subscriber);
+    }
+    
+    // Free all subscribers of a tree
+    void freeChangeSubscribers(TaggedIntervalTree* tree) {
+        while (tree->subscribers) {
+            unsubscribeChanges(tree, tree->subscribers);
+        }
+    }
+    
+    // Append a change record to every subscriber's ring without blocking. A full
+    // ring drops the record and flags the overflow, so the consumer re-reads the tree.
+    void emitChange(TaggedIntervalTree* tree, ChangeKind kind, const char* tag, TreePosition start, TreePosition end) {
+        for (ChangeSubscriber* sub = tree->subscribers; sub; sub = sub->next) {
+            size_t tail = atomic_load_explicit(&sub->tail, memory_order_relaxed);
+            size_t head = atomic_load_explicit(&sub->head, memory_order_acquire);
+            
+            if (tail - head == sub->capacity) {
+                atomic_store_explicit(&sub->overflowed, true, memory_order_release);
+                continue;
+            }
+            
+            ChangeRecord* record = &sub->records[tail & (sub->capacity - 1)];
+            record->kind = kind;
+            record->start = start;
+            record->end = end;
+            if (tag) {
+                strncpy(record->tag, tag, MAX_TAG_LENGTH - 1);
+                record->tag[MAX_TAG_LENGTH - 1] = '\0';
+            } else {
+                record->tag[0] = '\0';
+            }
+            
+            atomic_store_explicit(&sub->tail, tail + 1, memory_order_release);
+        }
+    }
+    
+    // Report a merge of same-tag spans to the tree whose operation is running
+    void emitMergeChange(const char* tag, TreePosition start, TreePosition end) {
+        if (changeSource) {
+            emitChange(changeSource, CHANGE_TAGS_MERGED, tag, start, end);
+        }
+    }
+    
+    // Fold a record into the previous one when both describe one contiguous change
+    bool coalesceChange(ChangeRecord* last, const ChangeRecord* record) {
+        if (last->kind != record->kind || strcmp(last->tag, record->tag) != 0) return false;
+        
+        switch (record->kind) {
+            case CHANGE_TEXT_INSERTED:
+                // Typing on: the new text lands inside or right after the last insert
+                if (record->start < last->start || record->start > last->end) return false;
+                last->end += record->end - record->start;
+                return true;
+            case CHANGE_TEXT_DELETED:
+                // Backspace or forward delete next to the last deletion
+                if (last->start < record->start || last->start > record->end) return false;
+                last->end = record->end + (last->end - last->start);
+                last->start = record->start;
+                return true;
+            default:
+                // Tag changes coalesce when their ranges touch or overlap
+                if (record->start > last->end || record->end < last->start) return false;
+                last->start = last->start < record->start ? last->start : record->start;
+                last->end = last->end > record->end ? last->end : record->end;
+                return true;
+        }
+    }
+    
+    // Drain up to maxRecords change records in order, coalescing consecutive records
+    // of the same kind and tag whose ranges touch. Returns the number of records.
+    int drainChanges(ChangeSubscriber* subscriber, ChangeRecord* records, int maxRecords, 
+                     bool* overflowed) {
+        size_t head = atomic_load_explicit(&subscriber->head, memory_order_relaxed);
+        size_t tail = atomic_load_explicit(&subscriber->tail, memory_order_acquire);
+        int count = 0;
+        
+        while (head != tail) {
+            const ChangeRecord* record = &subscriber->records[head & (subscriber->capacity - 1)];
+            
+            if (count == 0 || !coalesceChange(&records[count - 1], record)) {
+                if (count == maxRecords) break;
+                records[count++] = *record;
+            }
+            head++;
+        }
+        
+        atomic_store_explicit(&subscriber->head, head, memory_order_release);
+        
+        if (overflowed) {
+            *overflowed = atomic_exchange_explicit(&subscriber->overflowed, false, 
+                                                   memory_order_acq_rel);
+        }
+        return count;
+    }
+    
+    // Helper functions for formatting and shared segments
+    int countSubtreeNodes(IntervalNode* node);
+    size_t countSubtreeTagBytes(IntervalNode* node);
+    const SharedNode* beginSharedRead(SharedTree* shared, int* index, uint32_t* sequence, 
+                                      uint32_t* numNodes);
+    bool endSharedRead(SharedTree* shared, int index, uint32_t sequence);
+    const char* sharedNodeTag(SharedTree* shared, int index, const SharedNode* node);
+    bool sharedChildrenValid(const SharedNode* nodes, uint32_t numNodes, uint32_t i);
+    int findSharedChild(const SharedNode* nodes, const SharedNode* parent, TreePosition start);
+    int checkSharedTagDFS(SharedTree* shared, int index, const SharedNode* nodes, uint32_t numNodes, 
+                          uint32_t i, const char* tag, TreePosition start, TreePosition end);
+    
+    // Compare function for sorting markers. At one position the closing tags go first,
+    // innermost first, then the opening tags, outermost first, so the markup nests
+    // as the nodes do.
+    int compareMarkers(const void* a, const void* b) {
+        const TagMarker* markerA = (const TagMarker*)a;
+        const TagMarker* markerB = (const TagMarker*)b;
+        
+        if (markerA->position != markerB->position) {
+            return (markerA->position > markerB->position) - (markerA->position < markerB->position);
+        }
+        if (markerA->isOpening != markerB->isOpening) {
+            return markerA->isOpening ? 1 : -1;
+        }
+        if (markerA->isOpening) {
+            return (markerA->order > markerB->order) - (markerA->order < markerB->order);
+        }
+        return (markerA->order < markerB->order) - (markerA->order > markerB->order);
+    }
+    
+// Get formatted text with tags - completely fixed version
+char* getFormattedText(TaggedIntervalTree* tree, const char* text) {
+    if (!tree || !text) return NULL;
+    LATENCY_SCOPE(LATENCY_FORMAT_TEXT);
+    
+    char* formatted = NULL;
+    WorkBudget unlimited = {0, 0};
+    TreeTask* task = startFormatTask(tree, text, &formatted);
+    runTreeTask(task, unlimited);
+    freeTreeTask(task);
+    return formatted;
+}
+
+// Insert tag markers into text; takes ownership of the markers and their tags
+char* renderFormattedText(const char* text, TagMarker* markers, int markerCount) {
+    FormatRender render;
+    WorkBudget unlimited = {0, 0};
+    beginFormatRender(&render, text, markers, markerCount);
+    stepFormatRender(&render, unlimited, 0);
+    return render.buffer.data;
+}
+
+// Start rendering markers into text; takes ownership of the markers and their tags
+void beginFormatRender(FormatRender* render, const char* text, TagMarker* markers, int markerCount) {
+    memset(render, 0, sizeof(FormatRender));
+    render->stage = RENDER_MEASURE_TEXT;
+    render->text = text;
+    render->markers = markers;
+    render->markerCount = markerCount;
+    render->ownsTags = true;
+}
+
+// Start rendering the markers of a format task; takes ownership of the chunks,
+// which are gathered into one array as the markers are placed, but not of the tags
+void beginChunkedFormatRender(FormatRender* render, const char* text, MarkerChunk* chunks, int markerCount) {
+    TagMarker* markers = (TagMarker*)malloc(((size_t)markerCount + 1) * sizeof(TagMarker));
+    if (!markers) {
+        perror("Failed to allocate memory for markers");
+        exit(EXIT_FAILURE);
+    }
+    
+    beginFormatRender(render, text, markers, markerCount);
+    render->chunks = chunks;
+    render->ownsTags = false;
+}
+
+// Render within the budget, a marker, a merged marker or a chunk of text at a
+// time. Returns true once the formatted text is in the render's buffer.
+bool stepFormatRender(FormatRender* render, WorkBudget budget, uint64_t begin) {
+    size_t count = 0;
+    while (render->stage != RENDER_DONE) {
+        if (render->stage == RENDER_MEASURE_TEXT) {
+            size_t length = strnlen(render->text + render->textLength, FORMAT_TEXT_CHUNK);
+            render->textLength += (TreePosition)length;
+            if (length < FORMAT_TEXT_CHUNK) {
+                render->stage = RENDER_PLACE_MARKERS;
+            }
+        } else if (render->stage == RENDER_PLACE_MARKERS) {
+            if (render->nextMarker == render->markerCount) {
+                // Start with room for the text and every tag once
+                render->buffer.capacity += (size_t)render->textLength + 1;
+                render->buffer.data = (char*)malloc(render->buffer.capacity);
+                render->tagStack = (TagMarker*)malloc((render->markerCount + 1) * sizeof(TagMarker));
+                render->sorted = (TagMarker*)malloc((render->markerCount + 1) * sizeof(TagMarker));
+                if (!render->buffer.data || !render->tagStack || !render->sorted) {
+                    perror("Failed to allocate memory for formatted text");
+                    exit(EXIT_FAILURE);
+                }
+                render->stage = RENDER_SORT_MARKERS;
+                render->width = 1;
+                render->right = render->markerCount < 1 ? render->markerCount : 1;
+                continue;
+            }
+            
+            TagMarker* marker = &render->markers[render->nextMarker++];
+            if (render->chunks) {
+                MarkerChunk* chunk = render->chunks;
+                *marker = chunk->markers[render->chunkMarker++];
+                if (render->chunkMarker == chunk->count) {
+                    render->chunks = chunk->next;
+                    render->chunkMarker = 0;
+                    releasePages(chunk->markers, chunk->markers + chunk->count);
+                    free(chunk);
+                }
+            }
+            
+            // Move markers inside a UTF-8 sequence to its first byte, so no tag
+            // splits a character
+            TreePosition pos = marker->position;
+            while (pos > 0 && pos < render->textLength && ((unsigned char)render->text[pos] & 0xC0) == 0x80) {
+                pos--;
+            }
+            marker->position = pos;
+            render->buffer.capacity += strlen(marker->tag) + 3;
+        } else if (render->stage == RENDER_SORT_MARKERS) {
+            // Merge pairs of sorted runs of width markers into the other array;
+            // sorted ends up in markers once the runs are as long as the array
+            int markerCount = render->markerCount;
+            if (render->width >= markerCount) {
+                render->stage = RENDER_WRITE_TEXT;
+                render->nextMarker = 0;
+                continue;
+            }
+            
+            int middle = render->mergeStart + render->width < markerCount ? 
+                         render->mergeStart + render->width : markerCount;
+            int end = middle + render->width < markerCount ? middle + render->width : markerCount;
+            if (render->out == end) {
+                render->mergeStart = end;
+                if (end == markerCount) {
+                    TagMarker* merged = render->sorted;
+                    render->sorted = render->markers;
+                    render->markers = merged;
+                    render->width *= 2;
+                    render->mergeStart = 0;
+                }
+                render->left = render->mergeStart;
+                render->right = render->mergeStart + render->width < markerCount ? 
+                                render->mergeStart + render->width : markerCount;
+                render->out = render->mergeStart;
+                continue;
+            }
+            
+            TagMarker* from = render->markers;
+            if (render->right == end || 
+                (render->left < middle && compareMarkers(&from[render->left], &from[render->right]) <= 0)) {
+                render->sorted[render->out++] = from[render->left++];
+            } else {
+                render->sorted[render->out++] = from[render->right++];
+            }
+        } else {
+            // Copy the text up to each run of markers at one position, then write the
+            // run. Markers at the end of the text or beyond are left to the final
+            // closing tags.
+            TagMarker* next = render->nextMarker < render->markerCount ? &render->markers[render->nextMarker] : NULL;
+            TreePosition target = next && next->position < render->textLength ? next->position : render->textLength;
+            if (render->textPosition < target) {
+                TreePosition length = target - render->textPosition < FORMAT_TEXT_CHUNK ? 
+                                      target - render->textPosition : FORMAT_TEXT_CHUNK;
+                appendFormatted(&render->buffer, render->text + render->textPosition, length);
+                render->textPosition += length;
+            } else if (next && next->position < render->textLength) {
+                writeMarkerRun(render);
+            } else if (next) {
+                freeMarkerTag(render, next->tag);
+                render->nextMarker++;
+            } else {
+                finishFormatRender(render);
+            }
+            if ((size_t)(render->nextMarker - render->released) * sizeof(TagMarker) >= FORMAT_RELEASE_BYTES) {
+                releaseWrittenMarkers(render);
+            }
+        }
+        if (isTaskBudgetSpent(budget, ++count, begin)) return render->stage == RENDER_DONE;
+    }
+    return true;
+}
+
+// Write the run of markers at the next marker's position, freeing their tags
+// unless they are still open; the stack takes those
+void writeMarkerRun(FormatRender* render) {
+    TagMarker* markers = render->markers;
+    TagMarker* tagStack = render->tagStack;
+    TreePosition position = markers[render->nextMarker].position;
+    int firstMarker = render->nextMarker;
+    int nextMarker = firstMarker;
+    while (nextMarker < render->markerCount && markers[nextMarker].position == position) {
+        nextMarker++;
+    }
+    
+    // First the closing tags. Tags opened after the one being closed are closed
+    // with it and opened again, so each stays on its whole range.
+    for (int i = firstMarker; i < nextMarker && !markers[i].isOpening; i++) {
+        int j = render->stackSize - 1;
+        while (j >= 0 && tagStack[j].order != markers[i].order) {
+            j--;
+        }
+        if (j < 0) continue;
+        
+        char* closed = tagStack[j].tag;
+        for (int k = render->stackSize - 1; k >= j; k--) {
+            appendFormattedTag(&render->buffer, tagStack[k].tag, false);
+        }
+        for (int k = j + 1; k < render->stackSize; k++) {
+            appendFormattedTag(&render->buffer, tagStack[k].tag, true);
+            tagStack[k - 1] = tagStack[k];
+        }
+        render->stackSize--;
+        freeMarkerTag(render, closed);
+    }
+    
+    // Then the opening tags, skipping spans that close where they open
+    for (int i = firstMarker; i < nextMarker; i++) {
+        if (!markers[i].isOpening) continue;
+        if (closesInRun(markers, firstMarker, nextMarker, markers[i].order)) {
+            freeMarkerTag(render, markers[i].tag);
+            continue;
+        }
+        
+        appendFormattedTag(&render->buffer, markers[i].tag, true);
+        tagStack[render->stackSize++] = markers[i];
+    }
+    
+    for (int i = firstMarker; i < nextMarker && !markers[i].isOpening; i++) {
+        freeMarkerTag(render, markers[i].tag);
+    }
+    render->nextMarker = nextMarker;
+}
+
+// Give back the pages of the markers written since the last call, and of the
+// array they were merged from, so the last step does not unmap them all at once
+void releaseWrittenMarkers(FormatRender* render) {
+    releasePages(render->markers + render->released, render->markers + render->nextMarker);
+    releasePages(render->sorted + render->released, render->sorted + render->nextMarker);
+    render->released = render->nextMarker;
+}
+
+// Give the whole pages between start and end back to the system. Memory freed
+// to the heap keeps its pages until the heap shrinks past it, which may be all
+// at once; memory released first costs nothing then.
+void releasePages(const void* start, const void* end) {
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t first = ((uintptr_t)start + page - 1) & ~(page - 1);
+    uintptr_t last = (uintptr_t)end & ~(page - 1);
+    if (last > first) {
+        madvise((void*)first, last - first, MADV_DONTNEED);
+    }
+}
+
+// Close the tags left open and terminate the formatted text
+void finishFormatRender(FormatRender* render) {
+    for (int i = render->stackSize - 1; i >= 0; i--) {
+        appendFormattedTag(&render->buffer, render->tagStack[i].tag, false);
+        freeMarkerTag(render, render->tagStack[i].tag);
+    }
+    appendFormatted(&render->buffer, "", 1);
+    
+    free(render->tagStack);
+    free(render->markers);
+    free(render->sorted);
+    render->tagStack = NULL;
+    render->markers = NULL;
+    render->sorted = NULL;
+    render->stackSize = 0;
+    render->markerCount = 0;
+    render->stage = RENDER_DONE;
+}
+
+// Free what a rendering holds, for a format task cancelled on the way. The
+// markers already written have freed their tags or handed them to the stack.
+void freeFormatRender(FormatRender* render) {
+    if (render->ownsTags) {
+        int first = render->stage == RENDER_WRITE_TEXT ? render->nextMarker : 0;
+        for (int i = first; i < render->markerCount; i++) {
+            free(render->markers[i].tag);
+        }
+        for (int i = 0; i < render->stackSize; i++) {
+            free(render->tagStack[i].tag);
+        }
+    }
+    while (render->chunks) {
+        MarkerChunk* next = render->chunks->next;
+        free(render->chunks);
+        render->chunks = next;
+    }
+    free(render->markers);
+    free(render->sorted);
+    free(render->tagStack);
+    free(render->buffer.data);
+    memset(render, 0, sizeof(FormatRender));
+}
+
+// Free a written tag, if the rendering owns its tags
+void freeMarkerTag(FormatRender* render, char* tag) {
+    if (render->ownsTags) {
+        free(tag);
+    }
+}
+
+// Append bytes to formatted text, growing it if needed
+void appendFormatted(FormattedBuffer* buffer, const char* bytes, size_t length) {
+    if (buffer->size + length > buffer->capacity) {
+        size_t newCapacity = buffer->capacity * 2;
+        while (newCapacity < buffer->size + length) {
+            newCapacity *= 2;
+        }
+        char* newData = (char*)realloc(buffer->data, newCapacity);
+        if (!newData) {
+            perror("Failed to allocate memory for formatted text");
+            exit(EXIT_FAILURE);
+        }
+        
+        buffer->data = newData;
+        buffer->capacity = newCapacity;
+    }
+    
+    memcpy(buffer->data + buffer->size, bytes, length);
+    buffer->size += length;
+}
+
+// Append <tag> or </tag> to formatted text
+void appendFormattedTag(FormattedBuffer* buffer, const char* tag, bool isOpening) {
+    appendFormatted(buffer, isOpening ? "<" : "</", isOpening ? 1 : 2);
+    appendFormatted(buffer, tag, strlen(tag));
+    appendFormatted(buffer, ">", 1);
+}
+
+// Check whether the node of an opening marker also closes in markers [first,last)
+bool closesInRun(const TagMarker* markers, int first, int last, int order) {
+    for (int i = first; i < last && !markers[i].isOpening; i++) {
+        if (markers[i].order == order) return true;
+    }
+    return false;
+}
+    
+    // Create a shared segment holding two snapshot buffers of bufferCapacity bytes.
+    // Only the creating process publishes to it.
+    SharedTree* createSharedTree(const char* name, size_t bufferCapacity) {
+        size_t headerSize = (sizeof(SharedTreeHeader) + 63) & ~(size_t)63;
+        bufferCapacity = (bufferCapacity + 63) & ~(size_t)63;
+        size_t size = headerSize + 2 * bufferCapacity;
+        
+        int fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0600);
+        if (fd < 0) {
+            perror("Failed to create shared segment");
+            return NULL;
+        }
+        if (ftruncate(fd, size) != 0) {
+            perror("Failed to size shared segment");
+            close(fd);
+            shm_unlink(name);
+            return NULL;
+        }
+        
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            perror("Failed to map shared segment");
+            shm_unlink(name);
+            return NULL;
+        }
+        
+        SharedTree* shared = (SharedTree*)malloc(sizeof(SharedTree));
+        if (!shared) {
+            perror("Failed to allocate memory for SharedTree");
+            exit(EXIT_FAILURE);
+        }
+        shared->header = (SharedTreeHeader*)mapping;
+        shared->mappedSize = size;
+        shared->writable = true;
+        
+        SharedTreeHeader* header = shared->header;
+        header->bufferCapacity = bufferCapacity;
+        for (int i = 0; i < 2; i++) {
+            atomic_init(&header->buffers[i].sequence, 0);
+            header->buffers[i].numNodes = 0;
+            header->buffers[i].offset = headerSize + i * bufferCapacity;
+            header->buffers[i].size = 0;
+        }
+        atomic_init(&header->activeBuffer, 0);
+        atomic_thread_fence(memory_order_release);
+        header->magic = SHARED_TREE_MAGIC;
+        
+        return shared;
+    }
+    
+    // Map an existing shared segment read-only
+    SharedTree* openSharedTree(const char* name) {
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) {
+            perror("Failed to open shared segment");
+            return NULL;
+        }
+        
+        struct stat info;
+        if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SharedTreeHeader)) {
+            close(fd);
+            return NULL;
+        }
+        
+        void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            perror("Failed to map shared segment");
+            return NULL;
+        }
+        
+        SharedTreeHeader* header = (SharedTreeHeader*)mapping;
+        if (header->magic != SHARED_TREE_MAGIC || 
+            header->buffers[1].offset + header->bufferCapacity > (uint64_t)info.st_size) {
+            munmap(mapping, info.st_size);
+            return NULL;
+        }
+        
+        SharedTree* shared = (SharedTree*)malloc(sizeof(SharedTree));
+        if (!shared) {
+            perror("Failed to allocate memory for SharedTree");
+            exit(EXIT_FAILURE);
+        }
+        shared->header = header;
+        shared->mappedSize = info.st_size;
+        shared->writable = false;
+        
+        return shared;
+    }
+    
+    // Unmap a shared segment
+    void closeSharedTree(SharedTree* shared) {
+        if (!shared) return;
+        
+        munmap(shared->header, shared->mappedSize);
+        free(shared);
+    }
+    
+    // Remove a shared segment's name; mappings stay valid until closed
+    void removeSharedTree(const char* name) {
+        shm_unlink(name);
+    }
+    
+    // Count the nodes of a subtree
+    int countSubtreeNodes(IntervalNode* node) {
+        int count = 1;
+        for (int i = 0; i < node->numChildren; i++) {
+            count += countSubtreeNodes(node->children[i]);
+        }
+        return count;
+    }
+    
+    // Count the bytes the tags of a subtree need at most, including terminators
+    size_t countSubtreeTagBytes(IntervalNode* node) {
+        size_t bytes = node->tag ? strlen(node->tag) + 1 : 0;
+        for (int i = 0; i < node->numChildren; i++) {
+            bytes += countSubtreeTagBytes(node->children[i]);
+        }
+        return bytes;
+    }
+    
+    // Publish a snapshot of a tree to the inactive buffer and make it the active one.
+    // Readers still on the previous snapshot finish undisturbed. Segments opened with
+    // openSharedTree are read-only and refuse.
+    TreeStatus publishSharedTree(SharedTree* shared, TaggedIntervalTree* tree) {
+        if (!shared->writable) return TREE_SHARED_SEGMENT_READ_ONLY;
+        touchTree(tree, NULL);
+        settleTree(tree);
+        
+        SharedTreeHeader* header = shared->header;
+        int numNodes = countSubtreeNodes(tree->root);
+        size_t nodesSize = numNodes * sizeof(SharedNode);
+        if (nodesSize + countSubtreeTagBytes(tree->root) > header->bufferCapacity) {
+            return TREE_SHARED_SEGMENT_FULL;
+        }
+        
+        IntervalNode** queue = (IntervalNode**)malloc(numNodes * sizeof(IntervalNode*));
+        if (!queue) {
+            perror("Failed to allocate memory for node queue");
+            exit(EXIT_FAILURE);
+        }
+        
+        int index = 1 - atomic_load_explicit(&header->activeBuffer, memory_order_relaxed);
+        SharedBuffer* buffer = &header->buffers[index];
+        unsigned char* base = (unsigned char*)header + buffer->offset;
+        SharedNode* nodes = (SharedNode*)base;
+        
+        // Mark the buffer as being rewritten
+        uint32_t sequence = atomic_load_explicit(&buffer->sequence, memory_order_relaxed);
+        atomic_store_explicit(&buffer->sequence, sequence + 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+        
+        // Lay the nodes out breadth first; tags are interned after the nodes
+        TagTable tags = {NULL, 0, 0};
+        uint32_t* tagOffsets = NULL;
+        size_t stringsEnd = nodesSize;
+        int tail = 1;
+        queue[0] = tree->root;
+        
+        for (int i = 0; i < numNodes; i++) {
+            IntervalNode* node = queue[i];
+            settleNode(node);
+            
+            nodes[i].start = node->interval[0];
+            nodes[i].end = node->interval[1];
+            nodes[i].tagOffset = 0;
+            nodes[i].firstChild = tail;
+            nodes[i].numChildren = node->numChildren;
+            
+            if (node->tag) {
+                int tagIndex = internTag(&tags, node->tag);
+                if (tagIndex == tags.count - 1) {
+                    uint32_t* newOffsets = (uint32_t*)realloc(tagOffsets, tags.capacity * sizeof(uint32_t));
+                    if (!newOffsets) {
+                        perror("Failed to allocate memory for tag offsets");
+                        exit(EXIT_FAILURE);
+                    }
+                    tagOffsets = newOffsets;
+                    
+                    size_t tagSize = strlen(node->tag) + 1;
+                    memcpy(base + stringsEnd, node->tag, tagSize);
+                    tagOffsets[tagIndex] = stringsEnd;
+                    stringsEnd += tagSize;
+                }
+                nodes[i].tagOffset = tagOffsets[tagIndex];
+            }
+            
+            for (int j = 0; j < node->numChildren; j++) {
+                queue[tail++] = node->children[j];
+            }
+        }
+        
+        buffer->numNodes = numNodes;
+        buffer->size = stringsEnd;
+        free(queue);
+        free(tags.tags);
+        free(tagOffsets);
+        
+        // Complete the buffer, then point readers at it
+        atomic_store_explicit(&buffer->sequence, sequence + 2, memory_order_release);
+        atomic_store_explicit(&header->activeBuffer, index, memory_order_release);
+        
+        return TREE_OK;
+    }
+    
+    // Start reading the active snapshot. Returns its nodes, or NULL for a
+    // snapshot that fails the sanity checks while being rewritten.
+    const SharedNode* beginSharedRead(SharedTree* shared, int* index, uint32_t* sequence, 
+                                      uint32_t* numNodes) {
+        SharedTreeHeader* header = shared->header;
+        SharedBuffer* buffer;
+        
+        // An odd sequence means the writer lapped this reader; take the new snapshot
+        do {
+            *index = atomic_load_explicit(&header->activeBuffer, memory_order_acquire) & 1;
+            buffer = &header->buffers[*index];
+            *sequence = atomic_load_explicit(&buffer->sequence, memory_order_acquire);
+        } while (*sequence & 1);
+        
+        *numNodes = buffer->numNodes;
+        if (buffer->size > header->bufferCapacity || 
+            (uint64_t)*numNodes * sizeof(SharedNode) > buffer->size) {
+            return NULL;
+        }
+        
+        return (const SharedNode*)((unsigned char*)header + buffer->offset);
+    }
+    
+    // Finish a read; false if the snapshot changed underneath and the read must be retried
+    bool endSharedRead(SharedTree* shared, int index, uint32_t sequence) {
+        atomic_thread_fence(memory_order_acquire);
+        return atomic_load_explicit(&shared->header->buffers[index].sequence, 
+                                    memory_order_relaxed) == sequence;
+    }
+    
+    // Get a node's tag from the snapshot, bounds checked against a torn read
+    const char* sharedNodeTag(SharedTree* shared, int index, const SharedNode* node) {
+        SharedBuffer* buffer = &shared->header->buffers[index];
+        if (node->tagOffset == 0 || node->tagOffset >= buffer->size) return NULL;
+        
+        const char* tag = (const char*)shared->header + buffer->offset + node->tagOffset;
+        if (!memchr(tag, '\0', buffer->size - node->tagOffset)) return NULL;
+        return tag;
+    }
+    
+    // Check that a node's children lie after it and inside the snapshot, which also
+    // keeps a torn read from looping
+    bool sharedChildrenValid(const SharedNode* nodes, uint32_t numNodes, uint32_t i) {
+        return nodes[i].firstChild > i && nodes[i].firstChild <= numNodes && 
+               nodes[i].numChildren <= numNodes - nodes[i].firstChild;
+    }
+    
+    // Binary search for the first child starting at or after start, as findInsertionPoint
+    int findSharedChild(const SharedNode* nodes, const SharedNode* parent, TreePosition start) {
+        int left = 0;
+        int right = (int)parent->numChildren - 1;
+        
+        while (left <= right) {
+            int mid = (left + right) / 2;
+            TreePosition midStart = nodes[parent->firstChild + mid].start;
+            if (midStart == start) {
+                return mid;
+            } else if (midStart < start) {
+                left = mid + 1;
+            } else {
+                right = mid - 1;
+            }
+        }
+        
+        return left;
+    }
+    
+    // DFS helper for sharedHasTag; returns 1 if found, 0 if not, -1 for a torn read
+    int checkSharedTagDFS(SharedTree* shared, int index, const SharedNode* nodes, uint32_t numNodes, 
+                          uint32_t i, const char* tag, TreePosition start, TreePosition end) {
+        const SharedNode* node = &nodes[i];
+        const char* nodeTag = sharedNodeTag(shared, index, node);
+        
+        if (nodeTag && strcmp(nodeTag, tag) == 0 && node->start <= start && node->end >= end) {
+            return 1;
+        }
+        if (!sharedChildrenValid(nodes, numNodes, i)) return -1;
+        
+        int c = findSharedChild(nodes, node, start);
+        if (c > 0 && nodes[node->firstChild + c - 1].end > start) {
+            c--;
+        }
+        
+        for (; c < (int)node->numChildren; c++) {
+            const SharedNode* child = &nodes[node->firstChild + c];
+            if (child->start >= end) break;
+            if (start >= child->end) continue;
+            
+            int found = checkSharedTagDFS(shared, index, nodes, numNodes, node->firstChild + c, 
+                                          tag, start, end);
+            if (found != 0) return found;
+        }
+        
+        return 0;
+    }
+    
+    // Check a tag against the active snapshot of a shared segment
+    bool sharedHasTag(SharedTree* shared, const char* tag, TreePosition start, TreePosition end) {
+        while (true) {
+            int index;
+            uint32_t sequence, numNodes;
+            const SharedNode* nodes = beginSharedRead(shared, &index, &sequence, &numNodes);
+            
+            int found = nodes && numNodes > 0 ? 
+                        checkSharedTagDFS(shared, index, nodes, numNodes, 0, tag, start, end) : 0;
+            
+            if (endSharedRead(shared, index, sequence) && (nodes || numNodes == 0) && found >= 0) {
+                return found == 1;
+            }
+        }
+    }
+    
+    // Get the tagged spans overlapping [start,end) from the active snapshot, in
+    // breadth-first order. Returns the number of spans, at most maxSpans.
+    int sharedTagsInRange(SharedTree* shared, TreePosition start, TreePosition end, SharedTagSpan* spans, int maxSpans) {
+        while (true) {
+            int index;
+            uint32_t sequence, numNodes;
+            const SharedNode* nodes = beginSharedRead(shared, &index, &sequence, &numNodes);
+            bool torn = !nodes;
+            int count = 0;
+            
+            // The nodes of a level overlapping the range are sorted by position, so
+            // they are one contiguous run of indices, and so are their children that
+            // overlap it. Each level is scanned from [first,last) only.
+            uint32_t first = 0;
+            uint32_t last = !torn && numNodes > 0 ? 1 : 0;
+            
+            while (first < last && !torn) {
+                uint32_t nextFirst = numNodes;
+                uint32_t nextLast = 0;
+                
+                for (uint32_t i = first; i < last; i++) {
+                    const SharedNode* node = &nodes[i];
+                    if (i > 0 && (node->start >= end || node->end <= start)) continue;
+                    
+                    const char* tag = sharedNodeTag(shared, index, node);
+                    if (tag && count < maxSpans) {
+                        strncpy(spans[count].tag, tag, MAX_TAG_LENGTH - 1);
+                        spans[count].tag[MAX_TAG_LENGTH - 1] = '\0';
+                        spans[count].start = node->start;
+                        spans[count].end = node->end;
+                        count++;
+                    }
+                    
+                    if (!sharedChildrenValid(nodes, numNodes, i)) {
+                        torn = true;
+                        break;
+                    }
+                    
+                    int c = findSharedChild(nodes, node, start);
+                    if (c > 0 && nodes[node->firstChild + c - 1].end > start) {
+                        c--;
+                    }
+                    for (; c < (int)node->numChildren; c++) {
+                        const SharedNode* child = &nodes[node->firstChild + c];
+                        if (child->start >= end) break;
+                        if (child->end <= start) continue;
+                        
+                        uint32_t childIndex = node->firstChild + c;
+                        if (childIndex < nextFirst) nextFirst = childIndex;
+                        nextLast = childIndex + 1;
+                    }
+                }
+                
+                first = nextFirst;
+                last = nextLast;
+            }
+            
+            if (endSharedRead(shared, index, sequence) && !torn) {
+                return count;
+            }
+        }
+    }
+    
+    // Format text with the tags of the active snapshot of a shared segment
+    char* sharedFormattedText(SharedTree* shared, const char* text) {
+        if (!text) return NULL;
+        
+        while (true) {
+            int index;
+            uint32_t sequence, numNodes;
+            const SharedNode* nodes = beginSharedRead(shared, &index, &sequence, &numNodes);
+            
+            TagMarker* markers = (TagMarker*)malloc((2 * (size_t)numNodes + 1) * sizeof(TagMarker));
+            if (!markers) {
+                perror("Failed to allocate memory for markers");
+                return NULL;
+            }
+            
+            // Copy the markers out, then render only once the snapshot proved stable
+            int markerCount = 0;
+            for (uint32_t i = 0; nodes && i < numNodes; i++) {
+                const char* tag = sharedNodeTag(shared, index, &nodes[i]);
+                if (!tag) continue;
+                
+                // Children come after their parent in the snapshot, so the index orders them
+                markers[markerCount].position = nodes[i].start;
+                markers[markerCount].tag = strdup(tag);
+                markers[markerCount].isOpening = true;
+                markers[markerCount].order = (int)i;
+                markerCount++;
+                
+                markers[markerCount].position = nodes[i].end;
+                markers[markerCount].tag = strdup(tag);
+                markers[markerCount].isOpening = false;
+                markers[markerCount].order = (int)i;
+                markerCount++;
+            }
+            
+            if (endSharedRead(shared, index, sequence) && (nodes || numNodes == 0)) {
+                return renderFormattedText(text, markers, markerCount);
+            }
+            
+            for (int i = 0; i < markerCount; i++) {
+                free(markers[i].tag);
+            }
+            free(markers);
+        }
+    }
+    
+    // Start logging a tree's mutations for followers; returns the tree's log if it has one.
+    // Only addTag, removeTag, insertText and deleteText are logged; splitting, concatenating
+    // and pasting are refused while the log is active.
+    ReplicationLog* startReplicationLog(TaggedIntervalTree* tree) {
+        if (tree->log) return tree->log;
+        
+        ReplicationLog* log = (ReplicationLog*)calloc(1, sizeof(ReplicationLog));
+        if (!log) {
+            perror("Failed to allocate memory for ReplicationLog");
+            exit(EXIT_FAILURE);
+        }
+        
+        log->leader = tree;
+        tree->log = log;
+        return log;
+    }
+    
+    // Stop logging a tree's mutations and free its log. Followers keep their trees
+    // but can no longer catch up.
+    void stopReplicationLog(TaggedIntervalTree* tree) {
+        ReplicationLog* log = tree->log;
+        if (!log) return;
+        
+        for (ReplicaFollower* follower = log->followers; follower; follower = follower->next) {
+            follower->knownSequence = getLogSequence(log);
+            follower->log = NULL;
+        }
+        
+        tree->log = NULL;
+        free(log->entries);
+        free(log);
+    }
+    
+    // Get the sequence the next logged mutation will have
+    uint64_t getLogSequence(ReplicationLog* log) {
+        return log->firstSequence + log->count;
+    }
+    
+    // Append a mutation to a log
+    void appendLogEntry(ReplicationLog* log, LogEntryKind kind, const char* tag, TreePosition start, TreePosition end) {
+        // Expand capacity if needed
+        if (log->count >= log->capacity) {
+            size_t newCapacity = log->capacity == 0 ? 64 : log->capacity * 2;
+            LogEntry* newEntries = (LogEntry*)realloc(log->entries, newCapacity * sizeof(LogEntry));
+            if (!newEntries) {
+                perror("Failed to allocate memory for log entries");
+                exit(EXIT_FAILURE);
+            }
+            
+            log->entries = newEntries;
+            log->capacity = newCapacity;
+        }
+        
+        LogEntry* entry = &log->entries[log->count++];
+        entry->kind = kind;
+        entry->start = start;
+        entry->end = end;
+        if (tag) {
+            strncpy(entry->tag, tag, MAX_TAG_LENGTH - 1);
+            entry->tag[MAX_TAG_LENGTH - 1] = '\0';
+        } else {
+            entry->tag[0] = '\0';
+        }
+    }
+    
+    // Drop the entries before sequence that every in-process follower has applied.
+    // Followers fed batches are the caller's to account for in sequence.
+    void trimReplicationLog(ReplicationLog* log, uint64_t sequence) {
+        for (ReplicaFollower* follower = log->followers; follower; follower = follower->next) {
+            if (follower->nextSequence < sequence) {
+                sequence = follower->nextSequence;
+            }
+        }
+        if (sequence <= log->firstSequence) return;
+        if (sequence > getLogSequence(log)) sequence = getLogSequence(log);
+        
+        size_t dropped = (size_t)(sequence - log->firstSequence);
+        memmove(log->entries, log->entries + dropped, (log->count - dropped) * sizeof(LogEntry));
+        log->count -= dropped;
+        log->firstSequence = sequence;
+    }
+    
+    // Create a follower of a log from a copy of the leader as it is now
+    ReplicaFollower* createFollower(ReplicationLog* log) {
+        TaggedIntervalTree* leader = log->leader;
+        touchTree(leader, NULL);
+        settleTree(leader);
+        IntervalNode* root = leader->root;
+        
+        ReplicaFollower* follower = createDetachedFollower(root->interval[0], root->interval[1], 
+                                                           getLogSequence(log));
+        TreeMemoryAccount* previousAccount = enterTreeAccount(follower->tree);
+        copyClippedChildren(follower->tree->root, root, root->interval[0], root->interval[1], 0);
+        leaveTreeAccount(previousAccount);
+        
+        follower->log = log;
+        follower->next = log->followers;
+        log->followers = follower;
+        return follower;
+    }
+    
+    // Create a follower fed encoded batches, starting from an empty tree over
+    // [start,end) that matches the leader at the given sequence
+    ReplicaFollower* createDetachedFollower(TreePosition start, TreePosition end, uint64_t sequence) {
+        ReplicaFollower* follower = (ReplicaFollower*)malloc(sizeof(ReplicaFollower));
+        if (!follower) {
+            perror("Failed to allocate memory for ReplicaFollower");
+            exit(EXIT_FAILURE);
+        }
+        
+        follower->tree = createTaggedIntervalTree(start, end);
+        follower->log = NULL;
+        follower->nextSequence = sequence;
+        follower->knownSequence = sequence;
+        follower->next = NULL;
+        return follower;
+    }
+    
+    // Free a follower and its tree
+    void freeFollower(ReplicaFollower* follower) {
+        if (!follower) return;
+        
+        if (follower->log) {
+            ReplicaFollower** link = &follower->log->followers;
+            while (*link != follower) {
+                link = &(*link)->next;
+            }
+            *link = follower->next;
+        }
+        
+        freeTaggedIntervalTree(follower->tree);
+        free(follower);
+    }
+    
+    // Replay a logged mutation on a follower's tree
+    void applyLogEntry(TaggedIntervalTree* tree, const LogEntry* entry) {
+        switch (entry->kind) {
+            case LOG_ADD_TAG:
+                addTag(tree, entry->tag, entry->start, entry->end);
+                break;
+            case LOG_REMOVE_TAG:
+                removeTag(tree, entry->tag, entry->start, entry->end);
+                break;
+            case LOG_INSERT_TEXT:
+                insertText(tree, entry->start, entry->end - entry->start);
+                break;
+            case LOG_DELETE_TEXT:
+                deleteText(tree, entry->start, entry->end - entry->start);
+                break;
+        }
+    }
+    
+    // Apply up to maxEntries pending entries of an in-process follower's log.
+    // Returns the number applied.
+    int applyLogBatch(ReplicaFollower* follower, int maxEntries) {
+        ReplicationLog* log = follower->log;
+        if (!log) return 0;
+        
+        int applied = 0;
+        while (applied < maxEntries && follower->nextSequence < getLogSequence(log)) {
+            applyLogEntry(follower->tree, &log->entries[follower->nextSequence - log->firstSequence]);
+            follower->nextSequence++;
+            applied++;
+        }
+        
+        follower->knownSequence = getLogSequence(log);
+        return applied;
+    }
+    
+    // Get how many logged mutations a follower is behind the leader, as far as it knows
+    uint64_t getFollowerLag(ReplicaFollower* follower) {
+        if (follower->log) {
+            follower->knownSequence = getLogSequence(follower->log);
+        }
+        return follower->knownSequence - follower->nextSequence;
+    }
+    
+    // Get a follower's tree for reading, at most maxLag mutations behind the leader.
+    // In-process followers catch up as needed; a follower fed batches returns NULL
+    // until it has been fed enough.
+    TaggedIntervalTree* readFollower(ReplicaFollower* follower, uint64_t maxLag) {
+        uint64_t lag = getFollowerLag(follower);
+        if (lag > maxLag && follower->log) {
+            applyLogBatch(follower, (int)(lag - maxLag));
+            lag = getFollowerLag(follower);
+        }
+        
+        return lag <= maxLag ? follower->tree : NULL;
+    }
+    
+    // Append a sequence as eight little-endian bytes
+    void writeSequence(BlobWriter* writer, uint64_t sequence) {
+        for (int i = 0; i < 8; i++) {
+            writeBlobByte(writer, (unsigned char)(sequence >> (8 * i)));
+        }
+    }
+    
+    // Read a sequence written by writeSequence
+    uint64_t readSequence(BlobReader* reader) {
+        if (reader->size - reader->pos < 8 || reader->pos > reader->size) {
+            reader->pos = reader->size + 1;
+            return 0;
+        }
+        
+        uint64_t sequence = 0;
+        for (int i = 0; i < 8; i++) {
+            sequence |= (uint64_t)reader->data[reader->pos++] << (8 * i);
+        }
+        return sequence;
+    }
+    
+    // Encode up to maxEntries log entries from fromSequence for a follower in another
+    // process. Returns a malloc'd batch, or NULL if fromSequence has been trimmed.
+    unsigned char* encodeLogBatch(ReplicationLog* log, uint64_t fromSequence, int maxEntries, 
+                                  size_t* size) {
+        *size = 0;
+        if (fromSequence < log->firstSequence) return NULL;
+        
+        uint64_t endSequence = getLogSequence(log);
+        if (fromSequence > endSequence) fromSequence = endSequence;
+        if (endSequence - fromSequence > (uint64_t)maxEntries) {
+            endSequence = fromSequence + maxEntries;
+        }
+        
+        // Header: first sequence, end of the leader's log, entry count
+        BlobWriter writer = {NULL, 0, 0};
+        writeSequence(&writer, fromSequence);
+        writeSequence(&writer, getLogSequence(log));
+        writeVarint(&writer, (unsigned int)(endSequence - fromSequence));
+        
+        for (uint64_t sequence = fromSequence; sequence < endSequence; sequence++) {
+            LogEntry* entry = &log->entries[sequence - log->firstSequence];
+            size_t tagLength = strlen(entry->tag);
+            
+            writeBlobByte(&writer, (unsigned char)entry->kind);
+            writeVarint(&writer, (unsigned int)tagLength);
+            writeBlobBytes(&writer, entry->tag, tagLength);
+            writeSignedVarint(&writer, entry->start);
+            writeVarint(&writer, (uint64_t)(entry->end - entry->start));
+        }
+        
+        *size = writer.size;
+        return writer.data;
+    }
+    
+    // Apply an encoded batch to a follower. Entries it already has are skipped. Returns
+    // the number applied, or -1 for a batch that leaves a gap or is malformed.
+    int applyEncodedBatch(ReplicaFollower* follower, const unsigned char* data, size_t size) {
+        BlobReader reader = {data, 0, size};
+        uint64_t sequence = readSequence(&reader);
+        uint64_t knownSequence = readSequence(&reader);
+        unsigned int count = (unsigned int)readVarint(&reader);
+        if (reader.pos > reader.size || sequence > follower->nextSequence) return -1;
+        
+        if (knownSequence > follower->knownSequence) {
+            follower->knownSequence = knownSequence;
+        }
+        
+        int applied = 0;
+        for (unsigned int i = 0; i < count; i++, sequence++) {
+            LogEntry entry;
+            unsigned int kind = reader.pos < reader.size ? reader.data[reader.pos++] : 0xFF;
+            unsigned int tagLength = (unsigned int)readVarint(&reader);
+            if (kind > LOG_DELETE_TEXT || tagLength >= MAX_TAG_LENGTH || 
+                reader.pos > reader.size || reader.size - reader.pos < tagLength) {
+                return -1;
+            }
+            
+            entry.kind = (LogEntryKind)kind;
+            memcpy(entry.tag, reader.data + reader.pos, tagLength);
+            entry.tag[tagLength] = '\0';
+            reader.pos += tagLength;
+            entry.start = (TreePosition)readSignedVarint(&reader);
+            entry.end = entry.start + (TreePosition)readVarint(&reader);
+            if (reader.pos > reader.size) return -1;
+            
+            if (sequence == follower->nextSequence) {
+                applyLogEntry(follower->tree, &entry);
+                follower->nextSequence++;
+                applied++;
+            }
+        }
+        
+        return applied;
+    }
+    
+    // Start building a tree whose root starts at start. Spans must be opened in
+    // document order and be well nested; closeBuilderSpan repairs misnesting.
+    TreeBuilder* beginTreeBuilder(TreePosition start) {
+        TreeBuilder* builder = (TreeBuilder*)malloc(sizeof(TreeBuilder));
+        if (!builder) {
+            perror("Failed to allocate memory for TreeBuilder");
+            exit(EXIT_FAILURE);
+        }
+        
+        builder->tree = createTaggedIntervalTree(start, start);
+        builder->capacity = 16;
+        builder->open = (BuilderSpan*)malloc(builder->capacity * sizeof(BuilderSpan));
+        if (!builder->open) {
+            perror("Failed to allocate memory for builder spans");
+            exit(EXIT_FAILURE);
+        }
+        
+        builder->open[0].tag[0] = '\0';
+        builder->open[0].node = builder->tree->root;
+        builder->open[0].transparent = false;
+        builder->depth = 1;
+        return builder;
+    }
+    
+    // Push an open span; a tag already open around it adds nothing, as in addTagDFS
+    void pushBuilderSpan(TreeBuilder* builder, const char* tag, TreePosition pos) {
+        // Expand capacity if needed
+        if (builder->depth >= builder->capacity) {
+            int newCapacity = builder->capacity * 2;
+            BuilderSpan* newOpen = (BuilderSpan*)realloc(builder->open, newCapacity * sizeof(BuilderSpan));
+            if (!newOpen) {
+                perror("Failed to allocate memory for builder spans");
+                exit(EXIT_FAILURE);
+            }
+            
+            builder->open = newOpen;
+            builder->capacity = newCapacity;
+        }
+        
+        BuilderSpan* span = &builder->open[builder->depth];
+        strncpy(span->tag, tag, MAX_TAG_LENGTH - 1);
+        span->tag[MAX_TAG_LENGTH - 1] = '\0';
+        
+        span->transparent = false;
+        for (int i = 1; i < builder->depth; i++) {
+            if (strcmp(builder->open[i].tag, span->tag) == 0) {
+                span->transparent = true;
+                break;
+            }
+        }
+        
+        span->node = span->transparent ? builder->open[builder->depth - 1].node : 
+                                         createIntervalNode(pos, pos, span->tag);
+        builder->depth++;
+    }
+    
+    // Close the innermost open span at pos and attach it after its parent's last
+    // child, merging it with a touching span of the same tag
+    void popBuilderSpan(TreeBuilder* builder, TreePosition pos) {
+        BuilderSpan* span = &builder->open[--builder->depth];
+        if (span->transparent) return;
+        
+        IntervalNode* node = span->node;
+        IntervalNode* parent = builder->open[builder->depth - 1].node;
+        if (pos <= node->interval[0]) {
+            freeIntervalNode(node);
+            return;
+        }
+        
+        node->interval[1] = pos;
+        addChildToNode(parent, node);
+        mergeSeamAt(parent, parent->numChildren - 1);
+    }
+    
+    // Open a span with the given tag at pos
+    void openBuilderSpan(TreeBuilder* builder, const char* tag, TreePosition pos) {
+        touchTree(builder->tree, NULL);
+        TreeMemoryAccount* previousAccount = enterTreeAccount(builder->tree);
+        pushBuilderSpan(builder, tag, pos);
+        builder->tree->root->interval[1] = pos;
+        leaveTreeAccount(previousAccount);
+    }
+    
+    // Close the innermost open span with the given tag at pos. Spans opened inside
+    // it are closed with it and reopened, so misnested markup still covers the same
+    // text. A tag that is not open is ignored.
+    void closeBuilderSpan(TreeBuilder* builder, const char* tag, TreePosition pos) {
+        int match = builder->depth - 1;
+        while (match > 0 && strncmp(builder->open[match].tag, tag, MAX_TAG_LENGTH - 1) != 0) {
+            match--;
+        }
+        if (match == 0) return;
+        
+        touchTree(builder->tree, NULL);
+        TreeMemoryAccount* previousAccount = enterTreeAccount(builder->tree);
+        
+        // Keep the tags of the spans above the match to reopen them
+        int numReopened = builder->depth - 1 - match;
+        char (*reopened)[MAX_TAG_LENGTH] = NULL;
+        if (numReopened > 0) {
+            reopened = malloc(numReopened * sizeof(*reopened));
+            if (!reopened) {
+                perror("Failed to allocate memory for reopened spans");
+                exit(EXIT_FAILURE);
+            }
+            for (int i = 0; i < numReopened; i++) {
+                memcpy(reopened[i], builder->open[match + 1 + i].tag, MAX_TAG_LENGTH);
+            }
+        }
+        
+        while (builder->depth > match) {
+            popBuilderSpan(builder, pos);
+        }
+        for (int i = 0; i < numReopened; i++) {
+            pushBuilderSpan(builder, reopened[i], pos);
+        }
+        
+        builder->tree->root->interval[1] = pos;
+        leaveTreeAccount(previousAccount);
+        free(reopened);
+    }
+    
+    // Close the spans still open at end and return the built tree over [start,end)
+    TaggedIntervalTree* finishTreeBuilder(TreeBuilder* builder, TreePosition end) {
+        TaggedIntervalTree* tree = builder->tree;
+        touchTree(tree, NULL);
+        
+        TreeMemoryAccount* previousAccount = enterTreeAccount(tree);
+        while (builder->depth > 1) {
+            popBuilderSpan(builder, end);
+        }
+        leaveTreeAccount(previousAccount);
+        
+        tree->root->interval[1] = end;
+        free(builder->open);
+        free(builder);
+        return tree;
+    }
+    
+    // Find the next '<' at or after pos, or len if there is none
+    size_t findMarkupStart(const char* input, size_t pos, size_t len) {
+    #ifdef __SSE2__
+        // Compare sixteen bytes at a time
+        __m128i open = _mm_set1_epi8('<');
+        for (; pos + 16 <= len; pos += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(input + pos));
+            int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, open));
+            if (mask) return pos + __builtin_ctz(mask);
+        }
+    #endif
+        const char* found = (const char*)memchr(input + pos, '<', len - pos);
+        return found ? (size_t)(found - input) : len;
+    }
+    
+    // Check whether a character can be part of a tag name
+    bool isTagNameChar(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || 
+               c == '_' || c == '-' || c == '.' || c == ':';
+    }
+    
+    // Parse <tag>...</tag> markup into a tree and the plain text in one pass. A '<'
+    // that does not start a tag is kept as text. Returns the plain text length;
+    // the plain text is malloc'd and null terminated.
+    TreePosition parseTaggedText(const char* input, size_t len, TaggedIntervalTree** tree, char** plainText) {
+        WorkBudget unlimited = {0, 0};
+        TreeTask* task = startParseTask(input, len, tree, plainText);
+        runTreeTask(task, unlimited);
+        TreePosition plainLength = (TreePosition)task->plainLength;
+        freeTreeTask(task);
+        return plainLength;
+    }
+    
+    // Count the UTF-16 units and code points of text[start,end). A code point starts
+    // at every byte that is not a continuation byte; four-byte sequences take two
+    // UTF-16 units.
+    void countTextUnits(const char* text, TreePosition start, TreePosition end, TreePosition* utf16, TreePosition* codePoints) {
+        TreePosition continuations = 0;
+        TreePosition fourByteLeads = 0;
+        TreePosition pos = start;
+        
+    #ifdef __SSE2__
+        // Continuation bytes are 0x80-0xBF, below -64 as signed bytes; four-byte
+        // leads are 0xF0-0xFF, -16 to -1
+        __m128i continuationLimit = _mm_set1_epi8(-64);
+        __m128i leadLimit = _mm_set1_epi8(-17);
+        __m128i zero = _mm_setzero_si128();
+        for (; pos + 16 <= end; pos += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(text + pos));
+            __m128i isContinuation = _mm_cmplt_epi8(chunk, continuationLimit);
+            __m128i isFourByteLead = _mm_and_si128(_mm_cmpgt_epi8(chunk, leadLimit), 
+                                                   _mm_cmplt_epi8(chunk, zero));
+            continuations += __builtin_popcount(_mm_movemask_epi8(isContinuation));
+            fourByteLeads += __builtin_popcount(_mm_movemask_epi8(isFourByteLead));
+        }
+    #endif
+        for (; pos < end; pos++) {
+            unsigned char byte = (unsigned char)text[pos];
+            continuations += (byte & 0xC0) == 0x80;
+            fourByteLeads += byte >= 0xF0;
+        }
+        
+        *codePoints = (end - start) - continuations;
+        *utf16 = *codePoints + fourByteLeads;
+    }
+    
+    // Build a position index over a UTF-8 text. The text must outlive the index and
+    // the index must be rebuilt when the text changes.
+    TextIndex* buildTextIndex(const char* text, TreePosition length) {
+        TextIndex* index = (TextIndex*)malloc(sizeof(TextIndex));
+        if (!index) {
+            perror("Failed to allocate memory for TextIndex");
+            exit(EXIT_FAILURE);
+        }
+        
+        int maxCheckpoints = (int)(length / TEXT_INDEX_CHUNK) + 2;
+        index->checkpoints = (TextCheckpoint*)malloc(maxCheckpoints * sizeof(TextCheckpoint));
+        if (!index->checkpoints) {
+            perror("Failed to allocate memory for text checkpoints");
+            free(index);
+            exit(EXIT_FAILURE);
+        }
+        
+        index->text = text;
+        index->length = length;
+        index->checkpoints[0] = (TextCheckpoint){0, 0, 0};
+        index->numCheckpoints = 1;
+        
+        for (TreePosition chunk = TEXT_INDEX_CHUNK; ; chunk += TEXT_INDEX_CHUNK) {
+            TextCheckpoint* last = &index->checkpoints[index->numCheckpoints - 1];
+            
+            // Back up to a character boundary, or run to the end
+            TreePosition byte = chunk < length ? chunk : length;
+            while (byte > last->byte + 1 && byte < length && ((unsigned char)text[byte] & 0xC0) == 0x80) {
+                byte--;
+            }
+            
+            TreePosition utf16, codePoints;
+            countTextUnits(text, last->byte, byte, &utf16, &codePoints);
+            index->checkpoints[index->numCheckpoints++] = (TextCheckpoint){
+                byte, last->utf16 + utf16, last->codePoint + codePoints
+            };
+            
+            if (byte == length) break;
+        }
+        
+        return index;
+    }
+    
+    // Free a text index
+    void freeTextIndex(TextIndex* index) {
+        if (!index) return;
+        
+        free(index->checkpoints);
+        free(index);
+    }
+    
+    // Get a checkpoint's offset in a unit
+    TreePosition checkpointOffset(const TextCheckpoint* checkpoint, PositionUnit unit) {
+        switch (unit) {
+            case UNIT_UTF16: return checkpoint->utf16;
+            case UNIT_CODE_POINT: return checkpoint->codePoint;
+            default: return checkpoint->byte;
+        }
+    }
+    
+    // Translate a position between units: binary search for the checkpoint, then a
+    // walk of at most one chunk. A position inside a character, such as between the
+    // halves of a surrogate pair, maps to the character's start.
+    TreePosition translatePosition(TextIndex* index, TreePosition pos, PositionUnit from, PositionUnit to) {
+        TextCheckpoint* end = &index->checkpoints[index->numCheckpoints - 1];
+        if (pos <= 0) return 0;
+        if (pos >= checkpointOffset(end, from)) return checkpointOffset(end, to);
+        
+        // Find the last checkpoint at or before pos
+        int left = 0;
+        int right = index->numCheckpoints - 1;
+        while (left < right) {
+            int mid = (left + right + 1) / 2;
+            if (checkpointOffset(&index->checkpoints[mid], from) <= pos) {
+                left = mid;
+            } else {
+                right = mid - 1;
+            }
+        }
+        
+        // Walk character by character until the next one would pass pos
+        TextCheckpoint at = index->checkpoints[left];
+        const unsigned char* text = (const unsigned char*)index->text;
+        while (at.byte < index->length) {
+            int bytes = 1;
+            while (at.byte + bytes < index->length && (text[at.byte + bytes] & 0xC0) == 0x80) {
+                bytes++;
+            }
+            
+            TextCheckpoint next = at;
+            next.byte += bytes;
+            next.codePoint += (text[at.byte] & 0xC0) != 0x80;
+            next.utf16 += (text[at.byte] & 0xC0) == 0x80 ? 0 : text[at.byte] >= 0xF0 ? 2 : 1;
+            if (checkpointOffset(&next, from) > pos) break;
+            
+            at = next;
+        }
+        
+        return checkpointOffset(&at, to);
+    }
+    
+    // Add a tag to an interval given in a unit of the indexed text
+    TreeStatus addTagInUnit(TaggedIntervalTree* tree, TextIndex* index, const char* tag, TreePosition start, 
+                            TreePosition end, PositionUnit unit) {
+        return addTag(tree, tag, translatePosition(index, start, unit, UNIT_BYTE), 
+                      translatePosition(index, end, unit, UNIT_BYTE));
+    }
+    
+    // Remove a tag from an interval given in a unit of the indexed text
+    bool removeTagInUnit(TaggedIntervalTree* tree, TextIndex* index, const char* tag, TreePosition start, 
+                         TreePosition end, PositionUnit unit) {
+        return removeTag(tree, tag, translatePosition(index, start, unit, UNIT_BYTE), 
+                         translatePosition(index, end, unit, UNIT_BYTE));
+    }
+    
+    // Check a tag on an interval given in a unit of the indexed text
+    bool hasTagInUnit(TaggedIntervalTree* tree, TextIndex* index, const char* tag, TreePosition start, 
+                      TreePosition end, PositionUnit unit) {
+        return hasTag(tree, tag, translatePosition(index, start, unit, UNIT_BYTE), 
+                      translatePosition(index, end, unit, UNIT_BYTE));
+    }
+    
+    // Index the lines of a tree's text, which starts at the root's start. Edits that
+    // may add or remove newlines must go through insertLineText and deleteLineText.
+    LineIndex* createLineIndex(TaggedIntervalTree* tree, const char* text, TreePosition length) {
+        LineIndex* index = (LineIndex*)malloc(sizeof(LineIndex));
+        if (!index) {
+            perror("Failed to allocate memory for LineIndex");
+            exit(EXIT_FAILURE);
+        }
+        
+        index->tree = tree;
+        index->lineStarts = NULL;
+        index->numLines = 1;
+        index->capacity = 0;
+        
+        touchTree(tree, NULL);
+        addLineStarts(index, 0, tree->root->interval[0], text, length);
+        return index;
+    }
+    
+    // Free a line index and stop tracking its line starts
+    void freeLineIndex(LineIndex* index) {
+        if (!index) return;
+        
+        for (int i = 0; i < index->numLines - 1; i++) {
+            releaseTrackedPosition(index->lineStarts[i]);
+        }
+        free(index->lineStarts);
+        free(index);
+    }
+    
+    // Add a line start after every newline of text, which is at pos in line
+    void addLineStarts(LineIndex* index, int line, TreePosition pos, const char* text, TreePosition length) {
+        int newLines = 0;
+        for (const char* nl = memchr(text, '\n', length); nl; 
+             nl = memchr(nl + 1, '\n', length - (nl + 1 - text))) {
+            newLines++;
+        }
+        if (newLines == 0) return;
+        
+        // Expand capacity if needed
+        if (index->numLines - 1 + newLines > index->capacity) {
+            int newCapacity = index->capacity == 0 ? 16 : index->capacity;
+            while (newCapacity < index->numLines - 1 + newLines) newCapacity *= 2;
+            
+            TrackedPosition** newStarts = (TrackedPosition**)realloc(index->lineStarts, 
+                                          newCapacity * sizeof(TrackedPosition*));
+            if (!newStarts) {
+                perror("Failed to allocate memory for line starts");
+                exit(EXIT_FAILURE);
+            }
+            
+            index->lineStarts = newStarts;
+            index->capacity = newCapacity;
+        }
+        
+        // The new lines follow line; lineStarts[i] is the start of line i + 1
+        memmove(index->lineStarts + line + newLines, index->lineStarts + line, 
+                (index->numLines - 1 - line) * sizeof(TrackedPosition*));
+        
+        // Text typed at the start of a line belongs to that line, so starts stay put
+        int slot = line;
+        for (const char* nl = memchr(text, '\n', length); nl; 
+             nl = memchr(nl + 1, '\n', length - (nl + 1 - text))) {
+            index->lineStarts[slot++] = trackPosition(index->tree, pos + (int)(nl - text) + 1, 
+                                                      GRAVITY_LEFT);
+        }
+        index->numLines += newLines;
+    }
+    
+    // Insert text at pos: shifts the tree like insertText and adds its line breaks
+    void insertLineText(LineIndex* index, TreePosition pos, const char* text, TreePosition length) {
+        IntervalNode* root = index->tree->root;
+        if (length <= 0 || pos < root->interval[0] || pos > root->interval[1]) return;
+        
+        int line = getLineOfPosition(index, pos);
+        insertText(index->tree, pos, length);
+        addLineStarts(index, line, pos, text, length);
+    }
+    
+    // Delete length positions at pos like deleteText, joining the lines whose
+    // newlines are deleted
+    void deleteLineText(LineIndex* index, TreePosition pos, TreePosition length) {
+        IntervalNode* root = index->tree->root;
+        TreePosition start = pos > root->interval[0] ? pos : root->interval[0];
+        TreePosition end = pos + length < root->interval[1] ? pos + length : root->interval[1];
+        if (start >= end) return;
+        
+        // Lines starting in (start,end] lost the newline before them
+        int first = getLineOfPosition(index, start) + 1;
+        int last = first;
+        while (last < index->numLines && getLineStart(index, last) <= end) {
+            releaseTrackedPosition(index->lineStarts[last - 1]);
+            last++;
+        }
+        
+        memmove(index->lineStarts + first - 1, index->lineStarts + last - 1, 
+                (index->numLines - last) * sizeof(TrackedPosition*));
+        index->numLines -= last - first;
+        
+        deleteText(index->tree, start, end - start);
+    }
+    
+    // Get the number of lines
+    int getLineCount(LineIndex* index) {
+        return index->numLines;
+    }
+    
+    // Get the position a line starts at in O(depth), or -1 for no such line
+    TreePosition getLineStart(LineIndex* index, int line) {
+        if (line < 0 || line >= index->numLines) return -1;
+        if (line == 0) return index->tree->root->interval[0];
+        
+        TreePosition pos = -1;
+        resolveTrackedPosition(index->lineStarts[line - 1], &pos);
+        return pos;
+    }
+    
+    // Get the position a line ends at, before its newline
+    TreePosition getLineEnd(LineIndex* index, int line) {
+        if (line + 1 < index->numLines) {
+            return getLineStart(index, line + 1) - 1;
+        }
+        return index->tree->root->interval[1];
+    }
+    
+    // Get the line containing pos by binary search over the line starts
+    int getLineOfPosition(LineIndex* index, TreePosition pos) {
+        int left = 0;
+        int right = index->numLines - 1;
+        
+        while (left < right) {
+            int mid = (left + right + 1) / 2;
+            if (getLineStart(index, mid) <= pos) {
+                left = mid;
+            } else {
+                right = mid - 1;
+            }
+        }
+        
+        return left;
+    }
+    
+    // Report the tagged spans of lines firstLine to lastLine, line by line, with
+    // enclosing spans before the spans inside them. Line starts are resolved once,
+    // then one DFS clips every span to the lines it covers. Deferred tags over the
+    // lines are applied to a copy of the nodes there, as hasTag does, rather than
+    // to the tree. Returns the number of spans reported; the callback must not edit
+    // the tree.
+    int queryLines(LineIndex* index, int firstLine, int lastLine, LineSpanCallback callback, 
+                   void* context) {
+        if (firstLine < 0) firstLine = 0;
+        if (lastLine >= index->numLines) lastLine = index->numLines - 1;
+        if (firstLine > lastLine) return 0;
+        
+        touchTree(index->tree, NULL);
+        finishPendingOperation(index->tree);
+        
+        // starts[k] is the start of line firstLine + k; starts[numLines] is one past
+        // the end of the last line, as if it were followed by a newline
+        int numLines = lastLine - firstLine + 1;
+        TreePosition* starts = (TreePosition*)malloc((numLines + 1) * sizeof(TreePosition));
+        if (!starts) {
+            perror("Failed to allocate memory for line starts");
+            exit(EXIT_FAILURE);
+        }
+        for (int k = 0; k < numLines; k++) {
+            starts[k] = getLineStart(index, firstLine + k);
+        }
+        starts[numLines] = getLineEnd(index, lastLine) + 1;
+        
+        LineSpan* spans = NULL;
+        int count = 0;
+        int capacity = 0;
+        // Deferred tags over the lines are applied to a copy, which holds the tags
+        // reported until the callbacks are done
+        TreeMemoryAccount scratch = {0, 0, 0, 0, 1};
+        TreeMemoryAccount* previousAccount = currentAccount;
+        IntervalNode* root = index->tree->root;
+        if (index->tree->hasDeferredTags) {
+            currentAccount = &scratch;
+            root = copySettledRange(root, NULL, starts[0], starts[numLines]);
+            currentAccount = previousAccount;
+        }
+        collectLineSpansDFS(root, starts, firstLine, numLines, &spans, &count, &capacity);
+        
+        if (count > 1) {
+            qsort(spans, count, sizeof(LineSpan), compareLineSpans);
+        }
+        for (int i = 0; i < count; i++) {
+            callback(spans[i].line, spans[i].tag, spans[i].start, spans[i].end, context);
+        }
+        
+        if (root != index->tree->root) {
+            currentAccount = &scratch;
+            freeIntervalNode(root);
+            currentAccount = previousAccount;
+        }
+        free(spans);
+        free(starts);
+        return count;
+    }
+    
+    // DFS helper for queryLines; clips each tagged node to the queried lines it covers
+    void collectLineSpansDFS(IntervalNode* node, const TreePosition* starts, int firstLine, int numLines, 
+                             LineSpan** spans, int* count, int* capacity) {
+        TreePosition rangeStart = starts[0];
+        TreePosition rangeEnd = starts[numLines] - 1;
+        
+        if (node->tag) {
+            // Find the first queried line ending after the node starts
+            int k = 0;
+            int right = numLines - 1;
+            while (k < right) {
+                int mid = (k + right) / 2;
+                if (starts[mid + 1] - 1 > node->interval[0]) {
+                    right = mid;
+                } else {
+                    k = mid + 1;
+                }
+            }
+            
+            for (; k < numLines && starts[k] < node->interval[1]; k++) {
+                TreePosition lineEnd = starts[k + 1] - 1;
+                TreePosition start = node->interval[0] > starts[k] ? node->interval[0] : starts[k];
+                TreePosition end = node->interval[1] < lineEnd ? node->interval[1] : lineEnd;
+                if (start >= end) continue;
+                
+                // Expand capacity if needed
+                if (*count >= *capacity) {
+                    int newCapacity = *capacity == 0 ? 16 : *capacity * 2;
+                    LineSpan* newSpans = (LineSpan*)realloc(*spans, newCapacity * sizeof(LineSpan));
+                    if (!newSpans) {
+                        perror("Failed to allocate memory for line spans");
+                        exit(EXIT_FAILURE);
+                    }
+                    
+                    *spans = newSpans;
+                    *capacity = newCapacity;
+                }
+                
+                (*spans)[*count] = (LineSpan){
+                    firstLine + k, *count, node->tag, start - starts[k], end - starts[k]
+                };
+                (*count)++;
+            }
+        }
+        
+        pushDownShift(node);
+        int i = findInsertionPoint(node->children, node->numChildren, rangeStart);
+        if (i > 0 && node->children[i - 1]->interval[1] > rangeStart) {
+            i--;
+        }
+        
+        for (; i < node->numChildren && node->children[i]->interval[0] < rangeEnd; i++) {
+            if (node->children[i]->interval[1] > rangeStart) {
+                collectLineSpansDFS(node->children[i], starts, firstLine, numLines, spans, count, 
+                                    capacity);
+            }
+        }
+    }
+    
+    // Compare function for sorting line spans by line, then in DFS order
+    int compareLineSpans(const void* a, const void* b) {
+        const LineSpan* spanA = (const LineSpan*)a;
+        const LineSpan* spanB = (const LineSpan*)b;
+        
+        if (spanA->line != spanB->line) return spanA->line - spanB->line;
+        return spanA->order - spanB->order;
+    }
+    
+    // Example of usage; define TAG_TREE_NO_MAIN to include this file in another program
+    #ifndef TAG_TREE_NO_MAIN
+    // Print a span reported by queryLines
+    void printLineSpan(int line, const char* tag, TreePosition startColumn, TreePosition endColumn, void* context) {
+        (void)context;
+        printf("Line %d: %s [%" PRIpos ",%" PRIpos "]\n", line, tag, startColumn, endColumn);
+    }
     
-    // Example of usage
     int main() {
         // Create a new tree with text range [0, 20]
         TaggedIntervalTree* tree = createTaggedIntervalTree(0, 30);
@@ -1340,8 +7842,191 @@ char* getFormattedText(TaggedIntervalTree* tree, const char* text) {
         printf("Formatted text: %s\n", formattedText);
         free(formattedText);
         
+        // Copy a styled slice and paste it further on
+        TaggedIntervalTree* slice = extractSlice(tree, 8, 14);
+        treeStr = treeToString(slice);
+        printf("Slice of [8,14]:\n%s\n", treeStr);
+        free(treeStr);
+        
+        pasteSlice(tree, 20, slice);
+        pasteSlice(tree, 9, slice);
+        freeTaggedIntervalTree(slice);
+        
+        treeStr = treeToString(tree);
+        printf("Tree after pasting the slice at 20 and 9:\n%s\n", treeStr);
+        free(treeStr);
+        
+        // Split into two documents and join them back
+        TreeSplitResult halves = splitTree(tree, 13);
+        treeStr = treeToString(halves.right);
+        printf("Right half after splitting at 13:\n%s\n", treeStr);
+        free(treeStr);
+        
+        concatTrees(halves.left, halves.right);
+        treeStr = treeToString(tree);
+        printf("Tree after concatenating the halves:\n%s\n", treeStr);
+        free(treeStr);
+        
+        // Keep a handle on a span while the text around it is edited
+        SpanHandle* comment = addTagWithHandle(tree, "c", 17, 24);
+        insertText(tree, 2, 4);
+        deleteText(tree, 12, 3);
+        insertText(tree, 25, 2);
+        
+        TreePosition spanStart, spanEnd;
+        if (getSpanHandleInterval(comment, &spanStart, &spanEnd)) {
+            printf("Comment span moved to [%" PRIpos ",%" PRIpos "]\n", spanStart, spanEnd);
+        }
+        removeTagByHandle(tree, comment);
+        
+        treeStr = treeToString(tree);
+        printf("Tree after editing and removing the comment:\n%s\n", treeStr);
+        free(treeStr);
+        
+        // Keep cursors and bookmarks in place while the text is edited
+        Anchor* cursors[3];
+        cursors[0] = createAnchor(tree, 4, GRAVITY_RIGHT, "alice");
+        cursors[1] = createAnchor(tree, 15, GRAVITY_LEFT, "bob");
+        cursors[2] = createAnchor(tree, 30, GRAVITY_RIGHT, "bookmark");
+        insertText(tree, 4, 3);
+        deleteText(tree, 10, 4);
+        moveAnchor(tree, cursors[0], 1);
+        
+        int anchorCount;
+        Anchor** visible = getAnchorsInRange(tree, 0, 20, &anchorCount);
+        for (int i = 0; i < anchorCount; i++) {
+            TreePosition anchorPos;
+            if (getAnchorPosition(visible[i], &anchorPos)) {
+                printf("Anchor %s at %" PRIpos "\n", (char*)getAnchorData(visible[i]), anchorPos);
+            }
+        }
+        free(visible);
+        
+        for (int i = 0; i < 3; i++) {
+            releaseAnchor(cursors[i]);
+        }
+        
+        // Let a renderer follow the changes instead of re-querying the tree
+        ChangeSubscriber* renderer = subscribeChanges(tree, 64);
+        insertText(tree, 5, 1);
+        insertText(tree, 6, 1);
+        insertText(tree, 7, 1);
+        addTag(tree, "b", 5, 7);
+        addTag(tree, "b", 7, 9);
+        deleteText(tree, 8, 1);
+        deleteText(tree, 7, 1);
+        
+        ChangeRecord changes[16];
+        bool overflowed;
+        int changeCount = drainChanges(renderer, changes, 16, &overflowed);
+        const char* changeNames[] = {"tag added", "tag removed", "tags merged", 
+                                     "text inserted", "text deleted"};
+        for (int i = 0; i < changeCount; i++) {
+            printf("Change: %s %s [%" PRIpos ",%" PRIpos "]\n", changeNames[changes[i].kind], changes[i].tag, 
+                   changes[i].start, changes[i].end);
+        }
+        unsubscribeChanges(tree, renderer);
+        
+        // Cap the memory of a document and let it refuse new tags past the limit
+        printf("Tree uses %zu bytes (peak %zu)\n", getTreeMemoryUsage(tree), 
+               getTreePeakMemoryUsage(tree));
+        setTreeMemoryLimit(tree, getTreeMemoryUsage(tree) + 256);
+        for (int i = 0; i < 8; i++) {
+            if (addTag(tree, i % 2 ? "b" : "i", 2 * i, 2 * i + 1) == TREE_MEMORY_LIMIT_EXCEEDED) {
+                printf("Tag %d refused, tree uses %zu bytes\n", i, getTreeMemoryUsage(tree));
+                break;
+            }
+        }
+        setTreeMemoryLimit(tree, 0);
+        
+        // Hibernate the idle document; the next query wakes it up transparently
+        size_t residentBefore = getResidentBytes();
+        hibernateTree(tree);
+        printf("Hibernated tree into %zu bytes, resident bytes %zu -> %zu\n", tree->blobSize, 
+               residentBefore, getResidentBytes());
+        printf("Interval [3,6] has b tag: %s\n", hasTag(tree, "b", 3, 6) ? "true" : "false");
+        printf("Tree is %s again\n", isTreeHibernated(tree) ? "hibernated" : "resident");
+        
+        // Publish the tree to shared memory and read it back through a reader mapping
+        SharedTree* published = createSharedTree("/tagTreeDemo", 4096);
+        SharedTree* reader = openSharedTree("/tagTreeDemo");
+        if (published && reader) {
+            publishSharedTree(published, tree);
+            
+            SharedTagSpan spans[8];
+            int spanCount = sharedTagsInRange(reader, 0, 12, spans, 8);
+            for (int i = 0; i < spanCount; i++) {
+                printf("Shared span %s [%" PRIpos ",%" PRIpos "]\n", spans[i].tag, spans[i].start, spans[i].end);
+            }
+            printf("Shared [8,9] has u tag: %s\n", sharedHasTag(reader, "u", 8, 9) ? "true" : "false");
+            
+            char* sharedText = sharedFormattedText(reader, text);
+            printf("Shared formatted text: %s\n", sharedText);
+            free(sharedText);
+        }
+        closeSharedTree(reader);
+        closeSharedTree(published);
+        removeSharedTree("/tagTreeDemo");
+        
+        // Replicate the tree to a follower, reading it first at most one mutation behind
+        startReplicationLog(tree);
+        ReplicaFollower* follower = createFollower(tree->log);
+        addTag(tree, "i", 0, 4);
+        insertText(tree, 0, 2);
+        removeTag(tree, "b", 20, 24);
+        printf("Follower lag: %llu\n", (unsigned long long)getFollowerLag(follower));
+        
+        TaggedIntervalTree* replica = readFollower(follower, 1);
+        printf("Follower lag after bounded read: %llu\n", (unsigned long long)getFollowerLag(follower));
+        replica = readFollower(follower, 0);
+        char* leaderText = getFormattedText(tree, text);
+        char* replicaText = getFormattedText(replica, text);
+        printf("Follower matches leader: %s\n", strcmp(leaderText, replicaText) == 0 ? "true" : "false");
+        free(leaderText);
+        free(replicaText);
+        freeFollower(follower);
+        
+        // Parse markup back into a tree and its plain text
+        const char* markup = "Det <b>var en <i>gang</i></b> et tre";
+        TaggedIntervalTree* parsed;
+        char* plainText;
+        TreePosition plainLength = parseTaggedText(markup, strlen(markup), &parsed, &plainText);
+        char* reformatted = getFormattedText(parsed, plainText);
+        printf("Parsed %" PRIpos " characters: %s\n", plainLength, plainText);
+        printf("Parsed [11,15] has i tag: %s\n", hasTag(parsed, "i", 11, 15) ? "true" : "false");
+        printf("Reformatted text: %s\n", reformatted);
+        free(reformatted);
+        free(plainText);
+        freeTaggedIntervalTree(parsed);
+        
+        // Tag UTF-8 text using UTF-16 positions from a front-end
+        const char* utf8 = "Bl\xC3\xA5" "b\xC3\xA6r \xF0\x9F\x98\x80 syltet\xC3\xB8y";
+        TextIndex* index = buildTextIndex(utf8, strlen(utf8));
+        TaggedIntervalTree* unicodeTree = createTaggedIntervalTree(0, strlen(utf8));
+        addTagInUnit(unicodeTree, index, "b", 7, 9, UNIT_UTF16);
+        addTagInUnit(unicodeTree, index, "i", 2, 5, UNIT_CODE_POINT);
+        printf("UTF-16 position 11 is byte %" PRIpos "\n", translatePosition(index, 11, UNIT_UTF16, UNIT_BYTE));
+        char* unicodeText = getFormattedText(unicodeTree, utf8);
+        printf("Unicode formatted text: %s\n", unicodeText);
+        free(unicodeText);
+        freeTaggedIntervalTree(unicodeTree);
+        freeTextIndex(index);
+        
+        // Index the lines of a small source file and query them line by line
+        const char* source = "int x;\nint y = x;\nreturn y;";
+        TaggedIntervalTree* sourceTree = createTaggedIntervalTree(0, strlen(source));
+        LineIndex* lines = createLineIndex(sourceTree, source, strlen(source));
+        addTag(sourceTree, "keyword", 0, 3);
+        addTag(sourceTree, "error", 4, 12);
+        insertLineText(lines, 0, "// demo\n", 8);
+        printf("Lines: %d, line 2 starts at %" PRIpos "\n", getLineCount(lines), getLineStart(lines, 2));
+        queryLines(lines, 0, getLineCount(lines) - 1, printLineSpan, NULL);
+        freeLineIndex(lines);
+        freeTaggedIntervalTree(sourceTree);
+        
         // Free tree
         freeTaggedIntervalTree(tree);
         
         return 0;
     }
+    #endif